@@ -3,6 +3,18 @@
 
 #include "../include/message.h"
 
+/* The two UTF8String fields of an ACC_LOGIN, ACC_CREATE or ACC_EDIT payload, pointing into req_buf */
+typedef struct
+{
+    const char *username;    // cppcheck-suppress unusedStructMember
+    const char *password;    // cppcheck-suppress unusedStructMember
+    uint8_t     user_len;    // cppcheck-suppress unusedStructMember
+    uint8_t     pass_len;    // cppcheck-suppress unusedStructMember
+} credentials_t;
+
 ssize_t account_handler(message_t *message);
 
+/* Splits an account payload into username and password without copying. */
+void account_credentials(const message_t *message, credentials_t *cred);
+
 #endif    // ACCOUNT_H
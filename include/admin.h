@@ -0,0 +1,24 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include "../include/timer.h"
+#include <poll.h>
+
+#define ADMIN_MAX_CLIENTS (4)
+#define ADMIN_FDS (1 + ADMIN_MAX_CLIENTS)    // Listener plus scrapers
+#define ADMIN_TIMEOUT (5000)
+#define ADMIN_REQ_MAX (1024)
+#define ADMIN_BUF_SIZE (32768)
+
+/* Takes over fds[0 .. ADMIN_FDS): the listener (listen_fd, or -1 when the endpoint is
+   disabled) and one slot per scraper. The slots must be part of the caller's poll set. */
+void admin_init(struct pollfd *fds, int listen_fd, timer_wheel_t *wheel);
+
+/* Accepts scrapers, reads their requests and writes the metrics page.
+   Call after every poll(); never blocks. */
+void admin_handle(void);
+
+/* Closes every scraper connection. */
+void admin_shutdown(void);
+
+#endif    // ADMIN_H
@@ -0,0 +1,54 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bump-pointer arena for memory that lives as long as one request. Handlers
+ * take scratch memory from it and never free it; whoever owns the arena
+ * resets it once the request is answered. When a request needs more than the
+ * arena holds, the rest comes from the heap and the arena grows on the next
+ * reset, so a steady workload settles into no heap traffic at all.
+ *
+ * Functions taking an arena_t * accept NULL and use malloc() instead; the
+ * caller then frees the result with arena_release() or free().
+ */
+
+/* One overflow allocation, freed on reset */
+typedef struct arena_chunk
+{
+    struct arena_chunk *next;    // cppcheck-suppress unusedStructMember
+} arena_chunk_t;
+
+typedef struct
+{
+    uint8_t       *base;        // Allocated on first use
+    size_t         cap;         // cppcheck-suppress unusedStructMember
+    size_t         used;        // cppcheck-suppress unusedStructMember
+    size_t         spilled;     // Bytes in overflow chunks since the last reset
+    arena_chunk_t *overflow;    // cppcheck-suppress unusedStructMember
+} arena_t;
+
+/* Sets up an empty arena that will start out holding cap bytes. Allocates nothing yet. */
+void arena_init(arena_t *arena, size_t cap);
+
+/* size bytes aligned for any type, or NULL if memory ran out. */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/* arena_alloc() with the memory zeroed. */
+void *arena_zalloc(arena_t *arena, size_t size);
+
+/* A NUL-terminated copy of the first len bytes of str. */
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+
+/* Frees ptr if it came from malloc() because arena was NULL; arena memory waits for the reset. */
+void arena_release(const arena_t *arena, void *ptr);
+
+/* Takes back everything allocated since the last reset. */
+void arena_reset(arena_t *arena);
+
+/* Frees the arena's memory. It can be used again after arena_init(). */
+void arena_destroy(arena_t *arena);
+
+#endif    // ARENA_H
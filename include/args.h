@@ -2,19 +2,48 @@
 #define ARGS_H
 
 #include <arpa/inet.h>
+#include <stddef.h>
 
 #define IP_ADDRESS "0.0.0.0"
 #define SERVER_MANAGER_IP "192.168.1.86"
 #define PORT "8080"
 #define SERVER_MANAGER_PORT "9000"
+#define LOG_LEVEL "info"
+#define DIAG_VERSION (1)
+#define ADMIN_ADDRESS "127.0.0.1"
+#define DIAG_VERSION_MAX (2)
+#define IO_BACKEND_POLL (0)
+#define IO_BACKEND_URING (1)
+#define WORKERS_MAX (64)
+#define THREADS_MAX (64)
+#define CLIENTS_DEFAULT (1024)
+#define CLIENTS_MAX (1 << 20)
+#define CONN_MEM_DEFAULT_KB (1024)    // Receive buffer and send queue of one connection
+#define CONN_MEM_MIN_KB (128)         // Room for the largest frame plus some send queue
+#define CONN_MEM_MAX_KB (1 << 20)
+#define MEM_DEFAULT_MB (1024)    // Everything the connections hold together; 0 for no cap
+#define MEM_MAX_MB (1 << 20)
 
 // struct to hold the arguments
 typedef struct Arguments
 {
-    const char *ip;         // cppcheck-suppress unusedStructMember
-    in_port_t   port;       // cppcheck-suppress unusedStructMember
-    const char *sm_ip;      // cppcheck-suppress unusedStructMember
-    in_port_t   sm_port;    // cppcheck-suppress unusedStructMember
+    const char *ip;              // cppcheck-suppress unusedStructMember
+    in_port_t   port;            // cppcheck-suppress unusedStructMember
+    const char *sm_ip;           // cppcheck-suppress unusedStructMember
+    in_port_t   sm_port;         // cppcheck-suppress unusedStructMember
+    int         log_level;       // cppcheck-suppress unusedStructMember
+    int         diag_version;    // cppcheck-suppress unusedStructMember
+    const char *admin_ip;        // cppcheck-suppress unusedStructMember
+    in_port_t   admin_port;      // cppcheck-suppress unusedStructMember
+    const char *capture_path;    // cppcheck-suppress unusedStructMember
+    int         io_backend;      // cppcheck-suppress unusedStructMember
+    const char *handoff_path;    // cppcheck-suppress unusedStructMember
+    int         workers;         // cppcheck-suppress unusedStructMember
+    int         router;          // cppcheck-suppress unusedStructMember
+    int         threads;         // cppcheck-suppress unusedStructMember
+    int         max_clients;     // cppcheck-suppress unusedStructMember
+    size_t      conn_mem_max;    // cppcheck-suppress unusedStructMember
+    size_t      mem_max;         // cppcheck-suppress unusedStructMember
 } Arguments;
 
 extern Arguments global_args;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
@@ -0,0 +1,49 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Capture file layout: CAPTURE_MAGIC, then one record per event.
+ * Every record has a 16-byte header in network byte order:
+ *   ts_us (8)  microseconds since the capture started
+ *   conn  (4)  connection sequence number, unique for the server's lifetime
+ *   kind  (1)  CAPTURE_OPEN, CAPTURE_FRAME or CAPTURE_CLOSE
+ *   len   (3)  bytes of data that follow (the raw frame for CAPTURE_FRAME)
+ */
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_MAGIC_LEN (8)
+#define CAPTURE_RECORD_HEADER (16)
+#define CAPTURE_LEN_MAX (0xFFFFFF)
+
+#define CAPTURE_OPEN (1)
+#define CAPTURE_FRAME (2)
+#define CAPTURE_CLOSE (3)
+
+/* One decoded record; data points into the buffer it was decoded from */
+typedef struct
+{
+    uint64_t       ts_us;    // cppcheck-suppress unusedStructMember
+    uint32_t       conn;     // cppcheck-suppress unusedStructMember
+    uint8_t        kind;     // cppcheck-suppress unusedStructMember
+    uint32_t       len;      // cppcheck-suppress unusedStructMember
+    const uint8_t *data;     // cppcheck-suppress unusedStructMember
+} capture_record_t;
+
+/* Creates (truncates) path and starts capturing. Returns 0 on success, -1 on failure. */
+int capture_open(const char *path);
+
+/* Buffers one record. Does nothing when capture is off; turns itself off on a write error. */
+void capture_event(uint32_t conn, uint8_t kind, const void *data, size_t len);
+
+/* Writes out whatever is buffered. */
+void capture_flush(void);
+
+/* Flushes and closes the capture file. */
+void capture_close(void);
+
+/* Decodes the record at the front of buf. Returns its total length, or 0 if buf holds less than a record. */
+size_t capture_decode(const uint8_t *buf, size_t len, capture_record_t *rec);
+
+#endif    // CAPTURE_H
@@ -0,0 +1,60 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include "../include/message.h"
+#include <poll.h>
+#include <stdint.h>
+
+#define CONN_NO_USER (-1)    // user_id of a connection that has not logged in
+#define CONN_GEN_SHIFT (32)
+
+/*
+ * The loop's connections, one slot each, kept as a structure of arrays. The
+ * fields every pass over the connections reads (descriptor and interest
+ * mask, user id, generation) sit in dense arrays of their own; the per
+ * connection buffers, timers and send queues are in state[], which is only
+ * touched for the connections a pass acts on. pfd[] is the poll set itself:
+ * slots below base hold the loop's own descriptors and are never handed out.
+ *
+ * Every array is allocated for the full capacity up front, so pointers into
+ * them stay valid, but a slot is set up only the first time it is claimed
+ * and pages nobody reached are never touched. Free slots are reused lowest
+ * first, which keeps the live slots packed under high.
+ */
+typedef struct
+{
+    struct pollfd  *pfd;           // Hot: descriptor (-1 when free) and interest mask
+    int            *user_id;       // Hot: CONN_NO_USER until the client logs in
+    uint32_t       *gen;           // Hot: bumped each time the slot is freed
+    client_state_t *state;         // Cold: buffers, timers and send queues
+    uint32_t       *free_heap;     // Freed slots, a min-heap
+    uint32_t        free_count;    // cppcheck-suppress unusedStructMember
+    uint32_t        base;          // First connection slot
+    uint32_t        cap;           // Slots, base included
+    uint32_t        touched;       // Slots below this have been set up
+    uint32_t        high;          // One past the highest slot in use; passes and poll() stop here
+    uint32_t        count;         // Open connections
+} conn_table_t;
+
+/* Names a connection: its slot and the slot's generation, so a handle to a closed connection never finds the
+   one that reused its slot. 0 is never a handle. */
+typedef uint64_t conn_handle_t;
+
+/* Allocates room for clients connections after base reserved slots. Returns 0, or -1 if memory ran out. */
+int conn_table_init(conn_table_t *table, uint32_t base, uint32_t clients);
+
+void conn_table_destroy(conn_table_t *table);
+
+/* Takes the lowest free slot for a connection on fd. *fresh is set when the slot has never been used, so the
+   caller sets up its part of the slot's state. Returns the slot, or -1 when the table is full. */
+int conn_table_claim(conn_table_t *table, int fd, int *fresh);
+
+/* Frees a slot; handles to its connection go stale. The caller has closed the descriptor. */
+void conn_table_release(conn_table_t *table, uint32_t slot);
+
+conn_handle_t conn_table_handle(const conn_table_t *table, uint32_t slot) __attribute__((pure));
+
+/* The slot a handle names, or -1 if that connection has closed. */
+int conn_table_lookup(const conn_table_t *table, conn_handle_t handle) __attribute__((pure));
+
+#endif    // CONN_TABLE_H
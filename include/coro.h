@@ -0,0 +1,39 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+
+#define CORO_STACK_SIZE (64 * 1024)    // Handler stacks; storage work runs on the storage thread's own stack
+#define CORO_POOL_MAX (32)             // Finished coroutines kept for reuse
+
+/*
+ * Stackful coroutines for request handlers. A handler that runs as a
+ * coroutine can call coro_yield() anywhere in its call chain and be resumed
+ * later exactly where it stopped, so code that waits on storage reads as
+ * straight-line code while the event loop goes on serving other sockets.
+ * Coroutines belong to the thread that created them, and are resumed only
+ * there.
+ */
+typedef struct coro coro_t;
+
+typedef void (*coro_fn_t)(void *arg);
+
+/* Prepares fn(arg) to run on its own stack. Nothing runs until coro_resume(). Returns NULL on failure. */
+coro_t *coro_create(coro_fn_t fn, void *arg);
+
+/* Runs co until it yields or fn returns. Returns 1 once fn has returned, 0 while it is suspended. */
+int coro_resume(coro_t *co);
+
+/* Suspends the calling coroutine; the matching coro_resume() returns 0. */
+void coro_yield(void);
+
+/* The coroutine running on this thread, or NULL outside any. */
+coro_t *coro_current(void) __attribute__((pure));
+
+/* The arg given to coro_create(). */
+void *coro_arg(const coro_t *co) __attribute__((pure));
+
+/* Frees a coroutine whose function has returned, keeping its stack for the next coro_create(). */
+void coro_destroy(coro_t *co);
+
+#endif    // CORO_H
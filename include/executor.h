@@ -0,0 +1,73 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define EXECUTOR_THREADS_MAX (64)
+
+/*
+ * Work-stealing pool for request handlers. Each worker owns a deque of
+ * runnable strands: it takes work from the front of its own and, once that
+ * is empty, steals from the back of another worker's. A strand is a serial
+ * queue of tasks, one per connection: its tasks run one at a time and in
+ * submission order, on whichever worker picks the strand up, while separate
+ * strands run in parallel. Workers hand results back to the event loop by
+ * posting tasks that the loop runs when executor_loop_fd() is readable.
+ */
+
+struct exec_task;
+
+/* Runs a task. The task belongs to the function from then on, which may free it or post it on. */
+typedef void (*exec_fn_t)(struct exec_task *task);
+
+/* Embedded at the start of the caller's own task structure */
+typedef struct exec_task
+{
+    struct exec_task *next;    // cppcheck-suppress unusedStructMember
+    exec_fn_t         run;     // cppcheck-suppress unusedStructMember
+} exec_task_t;
+
+typedef struct exec_strand
+{
+    pthread_mutex_t     lock;       // cppcheck-suppress unusedStructMember
+    exec_task_t        *head;       // cppcheck-suppress unusedStructMember
+    exec_task_t        *tail;       // cppcheck-suppress unusedStructMember
+    atomic_size_t       pending;    // Submitted and not yet finished; the strand is runnable while non-zero
+    size_t              home;       // Worker whose deque it joins when it becomes runnable
+    struct exec_strand *prev;       // Links in a worker's deque, owned by the executor
+    struct exec_strand *next;       // cppcheck-suppress unusedStructMember
+} exec_strand_t;
+
+/* Starts threads workers. Returns 0 on success, -1 on failure. */
+int executor_start(size_t threads);
+
+/* Lets the workers finish every submitted task, joins them, then runs what they posted to the loop. */
+void executor_stop(void);
+
+/* 1 while the workers run. */
+int executor_active(void) __attribute__((pure));
+
+/* 1 when called on a worker thread. */
+int executor_on_worker(void) __attribute__((pure));
+
+/* Prepares a strand. Strands are spread over the workers' deques as they are initialised. */
+void executor_strand_init(exec_strand_t *strand);
+
+/* Frees a strand that has nothing pending. */
+void executor_strand_destroy(exec_strand_t *strand);
+
+/* Queues task on strand, after every task submitted to it before. */
+void executor_submit(exec_strand_t *strand, exec_task_t *task);
+
+/* The descriptor the event loop polls (POLLIN) for posted tasks. */
+int executor_loop_fd(void) __attribute__((pure));
+
+/* Queues task to run on the event loop. Tasks from one thread run in the order they were posted. */
+void executor_post(exec_task_t *task);
+
+/* Runs everything posted so far. Call from the event loop when executor_loop_fd() is readable. */
+void executor_loop_run(void);
+
+#endif    // EXECUTOR_H
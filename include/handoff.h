@@ -0,0 +1,68 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hot upgrade: a running server listens on a Unix socket (--handoff <path>).
+ * A new server started with the same path connects to it and receives the
+ * listening socket and every live client socket over SCM_RIGHTS. Once the
+ * new server confirms it holds them all, the old one lets go of its clients,
+ * drains and exits; until then they are still its own. Each SOCK_SEQPACKET
+ * message carries at most one descriptor behind a 10-byte header in network
+ * byte order:
+ *   version   (1)  HANDOFF_VERSION
+ *   kind      (1)  HANDOFF_LISTENER, HANDOFF_CLIENT, HANDOFF_DATA, HANDOFF_END or HANDOFF_ACK
+ *   client_id (4)  the client's user binding (HANDOFF_CLIENT only)
+ *   rx_len    (4)  HANDOFF_CLIENT: bytes the old server had received but not yet handled. Up to
+ *                  HANDOFF_RX_MAX of them follow the header, the rest in HANDOFF_DATA messages.
+ *                  HANDOFF_DATA: the bytes that follow its header.
+ */
+#define HANDOFF_VERSION (2)
+#define HANDOFF_HEADER (10)
+#define HANDOFF_RX_MAX (6 + UINT16_MAX)    // Buffered bytes per message: one frame, header plus the largest payload
+#define HANDOFF_TIMEOUT (10000)            // ms either side waits on the other
+
+#define HANDOFF_LISTENER (1)
+#define HANDOFF_CLIENT (2)
+#define HANDOFF_END (3)     // No descriptor; the new server answers with HANDOFF_ACK
+#define HANDOFF_DATA (4)    // More of the previous client's buffered bytes; no descriptor
+#define HANDOFF_ACK (5)     // New to old: everything arrived, the clients are ours now
+
+/* One client socket and the connection state that moves with it */
+typedef struct
+{
+    int      fd;           // cppcheck-suppress unusedStructMember
+    int      client_id;    // cppcheck-suppress unusedStructMember
+    uint32_t rx_len;       // cppcheck-suppress unusedStructMember
+    uint8_t *rx;           // cppcheck-suppress unusedStructMember
+} handoff_client_t;
+
+/* Handoff state shared between main() and the event loop */
+typedef struct handoff
+{
+    int               listen_fd;       // cppcheck-suppress unusedStructMember
+    int               successor_fd;    // cppcheck-suppress unusedStructMember
+    handoff_client_t *clients;         // cppcheck-suppress unusedStructMember
+    size_t            count;           // cppcheck-suppress unusedStructMember
+} handoff_t;
+
+/* Binds and listens on the Unix socket at path, replacing a stale one. Returns the listening fd or -1. */
+int handoff_listen(const char *path);
+
+/* Connects to a server listening at path. Returns the connection, or -1 when no server is there. */
+int handoff_connect(const char *path);
+
+/* Sends the listener and every client over conn_fd, then waits for the successor to confirm it has them.
+   Returns 0 once it has, -1 on failure, in which case the clients are still the caller's. */
+int handoff_send(int conn_fd, int listen_fd, const handoff_client_t *clients, size_t count);
+
+/* Receives the listener and clients into handoff, confirms them, then waits for the old server to exit.
+   Returns the listening socket, or -1 on failure, in which case the old server keeps its clients. */
+int handoff_receive(int conn_fd, handoff_t *handoff);
+
+/* Frees the received clients' buffers (not their sockets). */
+void handoff_release(handoff_t *handoff);
+
+#endif    // HANDOFF_H
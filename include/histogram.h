@@ -0,0 +1,42 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Log-linear buckets: every power of two is split into HIST_SUB_BUCKETS linear
+   sub-buckets, so a recorded value is reported within ~6% of its true value. */
+#define HIST_SUB_BITS (4)
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB_BUCKETS)
+
+/* Recorded into and read from any thread without locking. */
+typedef struct
+{
+    atomic_uint_fast64_t counts[HIST_BUCKETS];    // cppcheck-suppress unusedStructMember
+    atomic_uint_fast64_t total;                   // cppcheck-suppress unusedStructMember
+    atomic_uint_fast64_t sum;                     // cppcheck-suppress unusedStructMember
+    atomic_uint_fast64_t max;                     // cppcheck-suppress unusedStructMember
+} histogram_t;
+
+/* A plain copy of a histogram, used to diff and merge histograms off the hot path. */
+typedef struct
+{
+    uint64_t counts[HIST_BUCKETS];    // cppcheck-suppress unusedStructMember
+    uint64_t total;                   // cppcheck-suppress unusedStructMember
+    uint64_t sum;                     // cppcheck-suppress unusedStructMember
+    uint64_t max;                     // cppcheck-suppress unusedStructMember
+} hist_snapshot_t;
+
+void hist_record(histogram_t *hist, uint64_t value);
+
+/* Adds the current contents of hist to snap. */
+void hist_accumulate(hist_snapshot_t *snap, const histogram_t *hist);
+
+/* Subtracts base from snap, leaving only what was recorded since base was taken. */
+void hist_subtract(hist_snapshot_t *snap, const hist_snapshot_t *base);
+
+/* Highest value equivalent to the given percentile (0-100), or 0 if empty. */
+uint64_t hist_percentile(const hist_snapshot_t *snap, double percentile) __attribute__((pure));
+
+#endif    // HISTOGRAM_H
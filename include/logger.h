@@ -0,0 +1,56 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdatomic.h>
+
+typedef enum
+{
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO  = 1,
+    LOG_LEVEL_WARN  = 2,
+    LOG_LEVEL_ERROR = 3,
+    LOG_LEVEL_OFF   = 4,
+} log_level_t;
+
+/* Levels below LOG_COMPILE_LEVEL are removed at compile time, e.g. -DLOG_COMPILE_LEVEL=1 drops LOG_DEBUG. */
+#ifndef LOG_COMPILE_LEVEL
+    #define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern atomic_int log_level;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+/* Starts the background writer thread. Records below level are skipped by the producer.
+   Before log_init() (and after log_shutdown()) records are written synchronously. */
+int log_init(log_level_t level, int fd);
+
+/* Drains every ring, writes the remaining records and joins the writer thread. The rings stay allocated. */
+void log_shutdown(void);
+
+/* Parses "debug", "info", "warn", "error" or "off". Returns -1 if unknown. */
+int log_parse_level(const char *name) __attribute__((pure));
+
+/* Packs fmt and its arguments into a record in the calling thread's ring; the writer thread formats it later,
+   so fmt must be a string literal. Use the LOG_* macros instead. */
+void log_write(log_level_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Number of records dropped because a ring was full. */
+unsigned long log_dropped(void);
+
+/* Number of records waiting in all rings. */
+unsigned long log_backlog(void);
+
+#define LOG_AT(level, ...)                                                                                         \
+    do                                                                                                             \
+    {                                                                                                              \
+        if((level) >= LOG_COMPILE_LEVEL && (int)(level) >= atomic_load_explicit(&log_level, memory_order_relaxed)) \
+        {                                                                                                          \
+            log_write((level), __VA_ARGS__);                                                                       \
+        }                                                                                                          \
+    } while(0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif    // LOGGER_H
@@ -1,6 +1,7 @@
 #ifndef message_h
 #define message_h
 
+#include "../include/timer.h"
 #include "../include/user_db.h"
 #include <poll.h>
 #include <stddef.h>
@@ -10,9 +11,22 @@
 #define SYSID (0)
 #define VERSION_NUM (3)    // Updated to Protocol Version 3
 
-#define MAX_FDS (5)
-#define MAX_MSG (100)
 #define TIMEOUT (5000)
+#define HOUSEKEEPING_INTERVAL TIMEOUT
+#define DIAGNOSTIC_INTERVAL (1000)
+#define CLIENT_IDLE_TIMEOUT (300000)
+#define FRAME_TIMEOUT (10000)
+#define RX_BUF_INIT (512)
+#define SCRATCH_SIZE (1024)    // Starting size of the request arenas; they grow to the largest request seen
+// Overload: above any of these the loop turns away logins, account creation and new connections.
+// It recovers once every signal is below half its threshold.
+#define OVERLOAD_LAG_US (20000)      // Average time a loop pass keeps new events waiting
+#define OVERLOAD_REQUESTS (4096)     // Frames handed to the workers and not yet answered
+#define OVERLOAD_STORAGE (512)       // Calls queued for the storage thread and handlers waiting to make one
+// io_uring backend: submission slots, and the provided receive buffers shared by all connections
+#define URING_ENTRIES (1024)
+#define URING_BUFFERS (256)
+#define URING_BUFFER_SIZE (4096)
 
 #define HEADERLEN (6)
 #define SM_HEADERLEN 4
@@ -24,6 +38,9 @@
 // The diagnostic message (sent to the server manager) consists of the 6-byte header plus 10 bytes payload.
 #define DIAGNOSTIC_MSG_LEN (SM_HEADERLEN + DIAGNOSTIC_PAYLOAD_LEN)
 #define SM_RESPONSE_BUFFER_SIZE 32
+// Extended diagnostics (--diag-version 2): a version byte followed by fixed-width BER integers.
+#define DIAG_VERSION_EXTENDED (2)
+#define DIAG_EXT_MSG_MAX (128)
 
 #define ACCOUNT_ERROR (-1)
 #define ACCOUNT_LOGIN_ERROR (-2)
@@ -31,6 +48,7 @@
 #define ACCOUNT_EDIT_ERROR (-4)
 #define CHAT_ERROR (-5)
 #define END (-6)
+#define DISCONNECT (-7)
 
 #define UNKNOWNTYPE "Unknown Type"
 
@@ -39,9 +57,9 @@
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 extern uint16_t user_count;    // Global user count
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-extern uint32_t msg_count;    // Global message count
+extern _Atomic(uint32_t) msg_count;    // Global message count, bumped by handlers on any thread
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-extern int user_index;    // Global user index
+extern _Atomic(int) user_index;    // Global user index, moved by handlers on any thread
 
 typedef enum
 {
@@ -101,6 +119,59 @@ typedef enum
     EC_REQ_TIMEOUT = 0x20
 } error_code_t;
 
+/* Per-connection state, the cold half of a connection table slot */
+typedef struct client_state
+{
+    /* cppcheck-suppress unusedStructMember */
+    uint8_t *rx_buf;    // Bytes received but not yet handled
+
+    /* cppcheck-suppress unusedStructMember */
+    size_t rx_len;    // Bytes buffered
+
+    /* cppcheck-suppress unusedStructMember */
+    size_t rx_cap;    // Allocated size of rx_buf
+
+    /* cppcheck-suppress unusedStructMember */
+    uint64_t frame_start_us;    // When the first byte of the frame at the front of rx_buf arrived
+
+    /* cppcheck-suppress unusedStructMember */
+    uint64_t last_read_us;    // When the most recent read returned data
+
+    /* cppcheck-suppress unusedStructMember */
+    uint32_t conn_seq;    // Connection sequence number, names the connection in traffic captures
+    /* cppcheck-suppress unusedStructMember */
+    tw_timer_t idle_timer;    // Closes connections that stay silent
+
+    /* cppcheck-suppress unusedStructMember */
+    tw_timer_t frame_timer;    // Closes connections that stall mid-frame
+
+    /* cppcheck-suppress unusedStructMember */
+    struct pollfd *pfd;    // Slot in the poll set
+
+    /* cppcheck-suppress unusedStructMember */
+    int *client_id;    // Slot in the client id table
+    /* cppcheck-suppress unusedStructMember */
+    struct tx_op *tx_head;    // Queued sends; the first is in flight, or part written in poll mode
+    /* cppcheck-suppress unusedStructMember */
+    struct tx_op *tx_tail;    // Last queued send
+    /* cppcheck-suppress unusedStructMember */
+    struct tx_op *tx_urgent;    // Last queued send that went ahead of chat
+    /* cppcheck-suppress unusedStructMember */
+    size_t tx_queued;    // Bytes of the queued sends, counted against the connection's memory cap
+    /* cppcheck-suppress unusedStructMember */
+    int shed;    // Over its memory cap; closed at the end of the loop pass
+    /* cppcheck-suppress unusedStructMember */
+    int ready;    // Used up its turn with work left: 1 + the class of the ready queue it waits in, else 0
+    /* cppcheck-suppress unusedStructMember */
+    uint32_t ready_next;    // Next slot in the ready queue
+    /* cppcheck-suppress unusedStructMember */
+    uint32_t ready_prev;    // Previous slot in the ready queue
+    /* cppcheck-suppress unusedStructMember */
+    int rx_armed;    // io_uring only: a multishot receive is outstanding
+    /* cppcheck-suppress unusedStructMember */
+    struct coro_request *request;    // A handler waiting on storage; later frames wait behind it
+} client_state_t;
+
 /* Message structure for protocol packets */
 typedef struct message_t
 {
@@ -122,6 +193,9 @@ typedef struct message_t
     /* cppcheck-suppress unusedStructMember */
     void *res_buf;    // Response buffer
 
+    /* cppcheck-suppress unusedStructMember */
+    arena_t *arena;    // Scratch memory for the handlers, reset once the frame is answered
+
     /* cppcheck-suppress unusedStructMember */
     uint16_t response_len;    // Response length
 
@@ -135,7 +209,7 @@ typedef struct message_t
     int *client_id;    // Client ID
 
     /* cppcheck-suppress unusedStructMember */
-    struct pollfd *fds;    // Poll file descriptors
+    client_state_t *state;    // Receive state of the client
 } message_t;
 
 typedef struct
@@ -160,6 +234,51 @@ typedef enum
     SVR_STOP  = 0x15,
 } sm_type_t;
 
-void handle_connections(int server_fd);
+/* Scheduling classes, most urgent first. Leftover work of each class waits in its own queue and the
+   loop gives each class a quota of turns per pass; in send queues, anything but chat goes ahead of chat. */
+typedef enum
+{
+    SCHED_CONTROL,    // Logout, presence and the replies that acknowledge requests
+    SCHED_ACCOUNT,    // Login, account creation and edits
+    SCHED_CHAT,       // Chat and its fanout
+    SCHED_CLASSES
+} sched_class_t;
+
+/* Why the loop is shedding load */
+typedef enum
+{
+    OVERLOAD_LAG,
+    OVERLOAD_QUEUE,
+    OVERLOAD_STORAGE_BACKLOG,
+    OVERLOAD_REASONS
+} overload_reason_t;
+
+struct handoff;
+
+/* Runs the event loop. admin_fd is the metrics listener, or -1 when disabled. handoff carries the clients
+   taken over from an old server and the socket a successor connects to (listen_fd -1 when disabled). */
+void handle_connections(int server_fd, int admin_fd, struct handoff *handoff);
+
+/* Decodes the 6-byte header at req_buf into message. nread is the number of bytes available. */
+ssize_t handle_header(message_t *message, ssize_t nread);
+
+/* Writes the pre-encoded SYS_ERROR reply for message->type and message->code to the client. */
+ssize_t send_error_response(message_t *message);
+
+/* Writes a frame to a client, counting it in the outbound byte metrics. With io_uring the frame is copied and
+   queued; it goes out with the next submission. With poll() it is written at once if nothing is queued and
+   the socket takes it, otherwise what is left is copied and queued until the socket is writable. Either way
+   a frame that is not chat goes ahead of queued chat.
+   Called by a handler on a worker thread, it goes to the loop for the connection whose request is running. */
+ssize_t send_client(client_state_t *state, const void *buf, size_t len);
+
+/* Sends one frame to every connected client. Every recipient that has to queue it shares a single copy. */
+void send_broadcast(const void *buf, size_t len);
+
+/* The scheduling class of a frame of the given packet type. */
+sched_class_t packet_class(uint8_t type) __attribute__((const));
+
+/* Short name of an overload reason for logs and metrics, e.g. "loop_lag". */
+const char *overload_name(overload_reason_t reason) __attribute__((const));
 
 #endif
@@ -0,0 +1,75 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "../include/histogram.h"
+#include "../include/response.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* One end-to-end latency histogram per packet type; the last slot collects unknown types. */
+#define METRIC_FRAME_TYPES (PACKET_TYPE_MAX + 1)
+#define METRIC_MAX_THREADS (64)
+
+/* Process-wide counters. Updated with relaxed atomics so any thread can bump them. */
+typedef struct
+{
+    atomic_uint_fast64_t msgs_in;                    // cppcheck-suppress unusedStructMember
+    atomic_uint_fast64_t bytes_in;                   // cppcheck-suppress unusedStructMember
+    atomic_uint_fast64_t bytes_out;                  // cppcheck-suppress unusedStructMember
+    atomic_int_fast64_t  connections;                // cppcheck-suppress unusedStructMember
+    atomic_int_fast64_t  rx_queued;                  // cppcheck-suppress unusedStructMember
+    atomic_int_fast64_t  rx_allocated;               // cppcheck-suppress unusedStructMember
+    atomic_int_fast64_t  loop_lag_us;                // Moving average of the loop pass duration
+    atomic_int_fast64_t  tx_allocated;               // Send buffers, queue entries and broadcasts not yet written out
+    atomic_uint_fast64_t mem_refused;                // Connections turned away over the memory cap
+    atomic_uint_fast64_t mem_shed;                   // Connections closed for holding too much memory
+    atomic_uint_fast64_t shed[OVERLOAD_REASONS];     // Logins and creates turned away while overloaded, by reason
+    atomic_uint_fast64_t errors[ERROR_CODE_MAX];     // cppcheck-suppress unusedStructMember
+    histogram_t          handler_latency;            // cppcheck-suppress unusedStructMember
+    histogram_t          db_latency;                 // cppcheck-suppress unusedStructMember
+} metrics_t;
+
+/* One reading of the counters; rates and percentiles cover the time since the previous reading. */
+typedef struct
+{
+    uint64_t msgs_in;         // cppcheck-suppress unusedStructMember
+    uint64_t bytes_in;        // cppcheck-suppress unusedStructMember
+    uint64_t bytes_out;       // cppcheck-suppress unusedStructMember
+    int64_t  connections;     // cppcheck-suppress unusedStructMember
+    int64_t  rx_queued;       // cppcheck-suppress unusedStructMember
+    int64_t  mem_held;        // Receive buffers and send queues of every connection
+    uint64_t log_backlog;     // cppcheck-suppress unusedStructMember
+    uint32_t msgs_per_sec;    // cppcheck-suppress unusedStructMember
+    uint64_t p50_us;          // cppcheck-suppress unusedStructMember
+    uint64_t p99_us;          // cppcheck-suppress unusedStructMember
+} metrics_report_t;
+
+extern metrics_t metrics;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+#define METRIC_ADD(field, n) atomic_fetch_add_explicit(&metrics.field, (n), memory_order_relaxed)
+#define METRIC_SUB(field, n) atomic_fetch_sub_explicit(&metrics.field, (n), memory_order_relaxed)
+#define METRIC_STORE(field, n) atomic_store_explicit(&metrics.field, (n), memory_order_relaxed)
+
+/* Bytes the connections hold in receive buffers and send queues, the figure the memory caps apply to. */
+int64_t metrics_mem_held(void);
+
+/* Monotonic clock in microseconds, for latency measurements. */
+uint64_t metrics_now_us(void);
+
+/* Fills report. Meant for a single periodic caller: each call starts a new interval. */
+void metrics_report(metrics_report_t *report);
+
+/* Records the time from a frame's first received byte to its last response byte.
+   Goes to the calling thread's own table, so threads never contend. */
+void metrics_record_frame(uint8_t type, uint64_t latency_us);
+
+/* Merges every thread's histogram for one packet type into snap. */
+void metrics_frame_latency(hist_snapshot_t *snap, uint8_t type);
+
+/* Name of a packet type for reports, e.g. "ACC_LOGIN". */
+const char *metrics_type_name(uint8_t type) __attribute__((const));
+
+/* Logs count and p50/p90/p99/p99.9/max of every packet type seen so far. */
+void metrics_dump_latency(void);
+
+#endif    // METRICS_H
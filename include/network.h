@@ -5,12 +5,19 @@
 #include "../include/message.h"
 #include "../include/user_db.h"
 
+// A server started by server_starter finds its link to the supervisor on this descriptor
+#define SM_WORKER_FD (0)
+
 extern int sm_fd;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
 
 int server_tcp(const Arguments *args);
+int admin_tcp(const Arguments *args);
 int server_manager_tcp(const Arguments *args);
 
 int       socket_accept(int server_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len);
 in_port_t convert_port(const char *binary_name, const char *str);
 
+/* Non-zero if err says a non-blocking socket had nothing to give or no room to take. */
+int would_block(int err) __attribute__((const));
+
 #endif    // NETWORK_H
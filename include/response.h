@@ -0,0 +1,32 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include "../include/message.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define PACKET_TYPE_MAX (GRP_CREATE + 1)
+#define ERROR_CODE_MAX (EC_REQ_TIMEOUT + 1)
+#define RESPONSE_FRAME_MAX (40)
+#define LOGIN_SUCCESS_LEN (HEADERLEN + 4)
+
+/* A fully encoded reply frame, ready to be written to a client as-is. */
+typedef struct
+{
+    uint8_t  buf[RESPONSE_FRAME_MAX];    // cppcheck-suppress unusedStructMember
+    uint16_t len;                        // cppcheck-suppress unusedStructMember
+} response_frame_t;
+
+/* Encodes every fixed-shape reply once. Must be called before handle_connections(). */
+void response_init(void);
+
+/* Returns the pre-encoded reply for a request of the given type that finished with code.
+   The returned frame has len == 0 when no reply must be sent (e.g. ACC_LOGOUT), or when the reply carries
+   per-request data (a successful ACC_LOGIN, see response_login_success()). */
+const response_frame_t *response_lookup(uint8_t type, error_code_t code) __attribute__((pure));
+
+/* Copies the ACC_LOGIN_SUCCESS template into dst and patches in the user id.
+   dst must hold at least LOGIN_SUCCESS_LEN bytes. Returns the frame length. */
+uint16_t response_login_success(void *dst, uint16_t user_id);
+
+#endif    // RESPONSE_H
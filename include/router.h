@@ -0,0 +1,77 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROUTER_IO_MAX (16)              // I/O threads the router can deliver to
+#define ROUTER_QUEUE_SIZE (4096)        // Ingress entries shared by every I/O thread, a power of two
+#define ROUTER_DELIVERY_SIZE (1024)     // Deliveries waiting per I/O thread, a power of two
+
+/*
+ * Chat routing stage. I/O threads publish chat frames, and the joins and
+ * leaves of their connections, into one bounded lock-free MPSC queue. The
+ * router thread keeps every I/O thread's membership, resolves a frame's
+ * recipients and posts one delivery per I/O thread that has any, sharing a
+ * single refcounted copy of the frame and of the membership, then wakes the
+ * thread through its router_wake_fd(). A connection is named by an opaque
+ * 64-bit handle chosen by its I/O thread, which must check that the handle
+ * is still live when the delivery arrives, and is filed under the small slot
+ * number the I/O thread gives it.
+ */
+
+/* One copy of a routed frame, shared by every delivery that carries it */
+typedef struct
+{
+    atomic_uint refs;      // cppcheck-suppress unusedStructMember
+    uint32_t    len;       // cppcheck-suppress unusedStructMember
+    uint8_t     data[];    // cppcheck-suppress unusedStructMember
+} route_frame_t;
+
+/* An I/O thread's connections as of a join or leave. The router changes it in place only while no delivery
+   holds it, and copies it otherwise, so a chat frame costs a reference rather than a copy of the list. */
+typedef struct
+{
+    atomic_uint refs;         // cppcheck-suppress unusedStructMember
+    uint32_t    count;        // cppcheck-suppress unusedStructMember
+    uint64_t    handles[];    // cppcheck-suppress unusedStructMember
+} route_members_t;
+
+/* A frame and the connections on one I/O thread that should get it */
+typedef struct
+{
+    route_frame_t   *frame;      // cppcheck-suppress unusedStructMember
+    route_members_t *members;    // cppcheck-suppress unusedStructMember
+} route_delivery_t;
+
+/* Starts the router thread for io_threads I/O threads. Returns 0 on success, -1 on failure. */
+int router_start(size_t io_threads);
+
+/* Stops the router thread and frees everything still queued. */
+void router_stop(void);
+
+/* 1 while the router thread runs. */
+int router_active(void) __attribute__((pure));
+
+/* The descriptor I/O thread io polls (POLLIN) for deliveries. */
+int router_wake_fd(size_t io) __attribute__((pure));
+
+/* Adds and removes a connection of I/O thread io. slot must be unique among that thread's live connections
+   and small, as the router keeps an array indexed by it. They wait for room in the queue rather than fail,
+   so the router's membership never drifts from the I/O thread's. */
+void router_join(size_t io, uint32_t slot, uint64_t handle);
+void router_leave(size_t io, uint32_t slot);
+
+/* Queues a frame for every connection on every I/O thread. Returns 0, or -1 if the queue is full
+   and the caller must deliver it itself. */
+int router_publish(const void *frame, size_t len);
+
+/* Takes up to max deliveries for I/O thread io. Call when router_wake_fd(io) is readable and
+   repeat until it returns 0; pass each delivery to router_done() once its frame is sent. */
+size_t router_take(size_t io, route_delivery_t *out, size_t max);
+
+/* Releases a delivery taken with router_take(). */
+void router_done(route_delivery_t *delivery);
+
+#endif    // ROUTER_H
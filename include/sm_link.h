@@ -0,0 +1,73 @@
+#ifndef SM_LINK_H
+#define SM_LINK_H
+
+#include "../include/args.h"
+#include "../include/message.h"
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SM_LINK_RX_MAX (SM_HEADERLEN + UINT16_MAX)    // One frame: header plus the largest payload
+#define SM_LINK_TX_MAX (64 * 1024)                    // Queued while the manager is slow or away; oldest frames go first
+#define SM_LINK_BACKOFF_MIN (100)                     // ms before the first reconnect
+#define SM_LINK_BACKOFF_MAX (30000)
+
+/*
+ * A non-blocking connection to the server manager that lives in an event loop.
+ * Frames are the manager's 4-byte header (type, version, payload length) and
+ * their payload. Incoming bytes are reassembled into whole frames; outgoing
+ * frames are queued and written one at a time, so the link also works over a
+ * SOCK_SEQPACKET pair. A link opened with sm_link_open() reconnects with
+ * exponential backoff; one taken over with sm_link_adopt() ends when it breaks.
+ */
+typedef struct
+{
+    int             fd;                         // cppcheck-suppress unusedStructMember
+    int             connecting;                 // cppcheck-suppress unusedStructMember
+    const Arguments *args;                      // cppcheck-suppress unusedStructMember
+    uint64_t        retry_at_ms;                // cppcheck-suppress unusedStructMember
+    unsigned        backoff_ms;                 // cppcheck-suppress unusedStructMember
+    size_t          rx_len;                     // cppcheck-suppress unusedStructMember
+    size_t          tx_len;                     // cppcheck-suppress unusedStructMember
+    size_t          tx_sent;                    // cppcheck-suppress unusedStructMember
+    uint8_t         rx[SM_LINK_RX_MAX];         // cppcheck-suppress unusedStructMember
+    uint8_t         tx[SM_LINK_TX_MAX];         // cppcheck-suppress unusedStructMember
+} sm_link_t;
+
+/* Starts connecting to the manager at args->sm_ip:sm_port. Never blocks; failures are retried. */
+void sm_link_open(sm_link_t *link, const Arguments *args);
+
+/* Takes over an already connected socket. Returns 0, or -1 if fd is not a socket. */
+int sm_link_adopt(sm_link_t *link, int fd);
+
+/* Closes the link and discards anything queued. */
+void sm_link_close(sm_link_t *link);
+
+/* 1 if the link is connected, or (for sm_link_open()) will be again. Frames sent meanwhile are queued. */
+int sm_link_enabled(const sm_link_t *link) __attribute__((pure));
+
+/* 1 once the connection is established. */
+int sm_link_up(const sm_link_t *link) __attribute__((pure));
+
+/* Fills in pfd for the next poll(): fd -1 while there is no connection. */
+void sm_link_poll(const sm_link_t *link, struct pollfd *pfd);
+
+/* Completes the connect, reads and writes as revents allow, and reconnects when the backoff is up.
+   Call after every poll(), with 0 when the link's descriptor had no events. Returns 1 when the link
+   has just come up. */
+int sm_link_handle(sm_link_t *link, short revents);
+
+/* Milliseconds until sm_link_handle() needs to run to reconnect, or -1. Suitable as a poll() timeout. */
+int sm_link_timeout(const sm_link_t *link);
+
+/* Moves the next complete frame into buf. Returns its length, 0 if none is complete, or -1 if it does not fit. */
+ssize_t sm_link_recv(sm_link_t *link, uint8_t *buf, size_t cap);
+
+/* Queues one frame and starts writing it. Returns 0, or -1 if it was dropped. */
+int sm_link_send(sm_link_t *link, const void *frame, size_t len);
+
+/* Waits up to timeout_ms for the queue to go out, e.g. before exiting. */
+void sm_link_flush(sm_link_t *link, int timeout_ms);
+
+#endif    // SM_LINK_H
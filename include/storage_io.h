@@ -0,0 +1,48 @@
+#ifndef STORAGE_IO_H
+#define STORAGE_IO_H
+
+#include "../include/coro.h"
+#include <stddef.h>
+
+/*
+ * Storage I/O thread. A handler running as a coroutine passes each blocking
+ * storage call to storage_await(), which queues it for the storage thread
+ * and suspends the handler. When the call returns the event loop sees
+ * storage_io_fd() become readable and resumes the handler from
+ * storage_io_run(). Called anywhere else, storage_await() just makes the
+ * call, so the same storage code serves every caller. Work nobody has to
+ * wait for goes through storage_submit() instead, and its completion runs
+ * on the loop the same way.
+ */
+
+/* Runs one blocking storage call; arg carries its inputs and results. */
+typedef void (*storage_fn_t)(void *arg);
+
+/* Starts the storage thread. Returns 0 on success, -1 on failure. */
+int storage_io_start(void);
+
+/* Finishes the queued calls, joins the storage thread and runs the completions of submitted calls. Handlers
+   waiting on theirs are passed to resume, as by storage_io_run(), and make any further calls directly. */
+void storage_io_stop(void (*resume)(coro_t *co));
+
+/* 1 while the storage thread runs. */
+int storage_io_active(void) __attribute__((pure));
+
+/* The descriptor the event loop polls (POLLIN) for finished calls. */
+int storage_io_fd(void) __attribute__((pure));
+
+/* Calls queued for the storage thread or running on it; the loop's measure of how far storage is behind. */
+size_t storage_io_backlog(void);
+
+/* Passes every coroutine whose call has finished to resume, and runs the completions of finished submitted
+   calls, in the order the calls were made. Call from the loop when storage_io_fd() is readable. */
+void storage_io_run(void (*resume)(coro_t *co));
+
+/* Makes fn(arg) on the storage thread from inside a coroutine, suspending it meanwhile, and directly otherwise. */
+void storage_await(storage_fn_t fn, void *arg);
+
+/* Queues fn(arg) for the storage thread and returns at once; complete(arg) runs from storage_io_run() afterwards.
+   Without the storage thread both run before it returns. Returns 0, or -1 if the call cannot be queued. */
+int storage_submit(storage_fn_t fn, storage_fn_t complete, void *arg);
+
+#endif    // STORAGE_IO_H
@@ -0,0 +1,57 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS (10)
+#define TIMER_LEVEL_BITS (6)
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS (4)
+
+typedef void (*timer_cb)(void *arg);
+
+/* A timer is embedded in its owner; scheduling and cancelling never allocate. */
+typedef struct tw_timer
+{
+    struct tw_timer *next;       // cppcheck-suppress unusedStructMember
+    struct tw_timer *prev;       // cppcheck-suppress unusedStructMember
+    uint64_t         expires;    // cppcheck-suppress unusedStructMember
+    timer_cb         cb;         // cppcheck-suppress unusedStructMember
+    void            *arg;        // cppcheck-suppress unusedStructMember
+} tw_timer_t;
+
+/* Hierarchical timing wheel: TIMER_LEVELS wheels of TIMER_SLOTS slots, each level
+   TIMER_SLOTS times coarser than the one below. */
+typedef struct
+{
+    uint64_t   now;                                  // cppcheck-suppress unusedStructMember
+    uint64_t   start_ms;                             // cppcheck-suppress unusedStructMember
+    size_t     count;                                // cppcheck-suppress unusedStructMember
+    tw_timer_t slots[TIMER_LEVELS][TIMER_SLOTS];    // cppcheck-suppress unusedStructMember
+} timer_wheel_t;
+
+/* Monotonic clock in milliseconds. */
+uint64_t timer_now_ms(void);
+
+void timer_wheel_init(timer_wheel_t *wheel);
+
+/* Prepares a timer; must be called once before the first timer_schedule(). */
+void timer_init(tw_timer_t *timer, timer_cb cb, void *arg);
+
+/* Arms (or re-arms) timer to fire after delay_ms. O(1). */
+void timer_schedule(timer_wheel_t *wheel, tw_timer_t *timer, uint32_t delay_ms);
+
+/* Disarms timer if it is pending. O(1). */
+void timer_cancel(timer_wheel_t *wheel, tw_timer_t *timer);
+
+int timer_pending(const tw_timer_t *timer) __attribute__((pure));
+
+/* Runs every timer that expired up to the current time. Returns the number fired. */
+size_t timer_advance(timer_wheel_t *wheel);
+
+/* Milliseconds until the wheel next needs timer_advance(), or -1 if no timer is pending.
+   Suitable as a poll() timeout. */
+int timer_next_timeout(const timer_wheel_t *wheel);
+
+#endif    // TIMER_H
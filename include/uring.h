@@ -0,0 +1,85 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A minimal io_uring wrapper on the raw system calls, covering what the event
+ * loop needs: multishot accept, multishot receive into a ring of provided
+ * buffers, and plain sends. Outside Linux, and on kernels without these
+ * features, uring_init() fails and the caller keeps using poll().
+ */
+
+#define URING_NO_BUFFER (-1)
+
+typedef struct
+{
+    int       fd;             // cppcheck-suppress unusedStructMember
+    unsigned  sq_entries;     // cppcheck-suppress unusedStructMember
+    unsigned  sq_pending;     // cppcheck-suppress unusedStructMember
+    unsigned *sq_head;        // cppcheck-suppress unusedStructMember
+    unsigned *sq_tail;        // cppcheck-suppress unusedStructMember
+    unsigned *sq_mask;        // cppcheck-suppress unusedStructMember
+    unsigned *sq_array;       // cppcheck-suppress unusedStructMember
+    void     *sqes;           // cppcheck-suppress unusedStructMember
+    unsigned *cq_head;        // cppcheck-suppress unusedStructMember
+    unsigned *cq_tail;        // cppcheck-suppress unusedStructMember
+    unsigned *cq_mask;        // cppcheck-suppress unusedStructMember
+    void     *cqes;           // cppcheck-suppress unusedStructMember
+    void     *sq_ring;        // cppcheck-suppress unusedStructMember
+    size_t    sq_ring_size;   // cppcheck-suppress unusedStructMember
+    void     *cq_ring;        // cppcheck-suppress unusedStructMember
+    size_t    cq_ring_size;   // cppcheck-suppress unusedStructMember
+    size_t    sqes_size;      // cppcheck-suppress unusedStructMember
+    void     *buf_ring;       // cppcheck-suppress unusedStructMember
+    uint8_t  *buf_base;       // cppcheck-suppress unusedStructMember
+    size_t    buf_ring_size;  // cppcheck-suppress unusedStructMember
+    unsigned  buf_count;      // cppcheck-suppress unusedStructMember
+    unsigned  buf_size;       // cppcheck-suppress unusedStructMember
+    uint16_t  buf_tail;       // cppcheck-suppress unusedStructMember
+} uring_t;
+
+/* One completion, copied out of the completion queue */
+typedef struct
+{
+    uint64_t user_data;    // cppcheck-suppress unusedStructMember
+    int32_t  res;          // cppcheck-suppress unusedStructMember
+    bool     more;         // cppcheck-suppress unusedStructMember
+    int      buffer;       // cppcheck-suppress unusedStructMember
+} uring_event_t;
+
+/* Sets up a ring with entries submission slots and buf_count provided receive buffers of buf_size bytes
+   (buf_count must be a power of two). Returns 0 on success, -1 when the kernel cannot support the loop. */
+int uring_init(uring_t *ring, unsigned entries, unsigned buf_count, unsigned buf_size);
+
+/* Unmaps everything and closes the ring. */
+void uring_destroy(uring_t *ring);
+
+/* Queues a multishot accept on listen_fd. */
+int uring_accept_multishot(uring_t *ring, int listen_fd, uint64_t user_data);
+
+/* Queues a multishot receive on fd that picks its buffers from the provided ring. */
+int uring_recv_multishot(uring_t *ring, int fd, uint64_t user_data);
+
+/* Queues a send of len bytes at buf; buf must stay valid until the completion arrives. */
+int uring_send(uring_t *ring, int fd, const void *buf, size_t len, uint64_t user_data);
+
+/* Queues a cancellation of the request submitted with target as its user_data. A cancelled multishot request
+   still posts a final completion without more set. */
+int uring_cancel(uring_t *ring, uint64_t target, uint64_t user_data);
+
+/* Hands everything queued to the kernel without waiting. Returns the number submitted or -1. */
+int uring_submit(uring_t *ring);
+
+/* Takes the next completion. Returns false when the completion queue is empty. */
+bool uring_next(uring_t *ring, uring_event_t *event);
+
+/* The data of a provided buffer named by a completion. */
+const uint8_t *uring_buffer(const uring_t *ring, int buffer) __attribute__((pure));
+
+/* Gives a provided buffer back to the kernel once its data has been consumed. */
+void uring_buffer_recycle(uring_t *ring, int buffer);
+
+#endif    // URING_H
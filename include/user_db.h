@@ -1,5 +1,6 @@
 #ifndef USER_DB_H
 #define USER_DB_H
+#include "../include/arena.h"
 #include <inttypes.h>
 #include <string.h>    // for strlen
 
@@ -16,6 +17,7 @@ typedef int datum_size;
 #endif
 
 #define TO_SIZE_T(x) ((size_t)(x))
+#define STORAGE_LOCK_FILE "storage.lock"
 
 typedef struct
 {
@@ -28,6 +30,9 @@ typedef struct
 #define MAKE_CONST_DATUM(str) ((const_datum){(str), (datum_size)strlen(str) + 1})
 #define MAKE_CONST_DATUM_BYTE(str, size) ((const_datum){(str), (datum_size)(size)})
 
+/* Completion of a queued write: result is what dbm_store() returned, ctx what was passed with the write */
+typedef void (*store_done_t)(int result, void *ctx);
+
 typedef struct DBO
 {
     char *name;    // cppcheck-suppress unusedStructMember
@@ -38,6 +43,9 @@ typedef struct DBO
    Returns 0 on success, -1 on failure. */
 ssize_t database_open(DBO *dbo);
 
+/* Closes a database opened with database_open(). */
+void database_close(DBO *dbo);
+
 /* Stores the string value under the key into the given DBM.
    Returns 0 on success, -1 on failure. */
 int store_string(DBM *db, const char *key, const char *value);
@@ -50,20 +58,46 @@ int store_int(DBM *db, const char *key, int value);
    Returns 0 on success, -1 on failure. */
 int store_byte(DBM *db, const void *key, size_t k_size, const void *value, size_t v_size);
 
+/* Queues a write of raw bytes for the storage thread and returns without waiting for it. Key and value are
+   copied. Queued writes are applied in batches under the storage lock, a later write to a key still queued
+   replaces the earlier one, and done (which may be NULL) runs on the event loop once the write is made.
+   The caller must not close db before then. Returns 0, or -1 if the write cannot be queued. */
+int store_byte_async(DBM *db, const void *key, size_t k_size, const void *value, size_t v_size, store_done_t done, void *ctx);
+
+/* store_byte_async() for an integer under a string key, as store_int() writes it. */
+int store_int_async(DBM *db, const char *key, int value, store_done_t done, void *ctx);
+
 /* Retrieves the stored string value associated with key from the given DBM.
-   On success, returns a pointer to a newly allocated copy of the value (which must be freed by the caller);
+   On success, returns a copy of the value taken from arena (with a NULL arena, a malloc'd copy the caller frees);
    returns NULL if the key is not found or on error. */
-char *retrieve_string(DBM *db, const char *key);
+char *retrieve_string(DBM *db, const char *key, arena_t *arena);
 
 /* Retrieves an integer from the DBM.
    Returns 0 on success, -1 on failure. */
 int retrieve_int(DBM *db, const char *key, int *result);
 
-/* Retrieves raw bytes from the DBM.
+/* Retrieves raw bytes from the DBM, copied into arena as retrieve_string() does.
    Returns pointer on success, or NULL if not found. */
-void *retrieve_byte(DBM *db, const void *key, size_t size);
+void *retrieve_byte(DBM *db, const void *key, size_t size, arena_t *arena);
 
 /* Initializes the primary key in the database. Returns 0 on success, -1 on failure. */
 ssize_t init_pk(DBO *dbo, const char *pk_name);
 
+/* Marks the databases as shared with other server processes. From then on storage_lock() takes an
+   flock() on STORAGE_LOCK_FILE; otherwise it does nothing. Returns 0 on success, -1 on failure. */
+int storage_share(void);
+
+/* Non-zero once storage_share() has succeeded. */
+int storage_shared(void) __attribute__((pure));
+
+/* Serialise database access between processes, and between the threads of this one. Every
+   open/read/write/close of a shared database, or from a handler thread, must happen between the two calls.
+   From a handler coroutine the lock is taken and released on the storage thread. */
+void storage_lock(void);
+void storage_unlock(void);
+
+/* Increments pk_name in the database db_name on a fresh handle and returns the new value, or -1 on failure.
+   The caller holds the storage lock. */
+int pk_next(char *db_name, const char *pk_name);
+
 #endif    // USER_DB_H
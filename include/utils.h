@@ -3,7 +3,8 @@
 
 #include <signal.h>
 
-extern volatile sig_atomic_t server_running;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+extern volatile sig_atomic_t server_running;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+extern volatile sig_atomic_t stats_requested;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
 
 void sfree(void **ptr);
 
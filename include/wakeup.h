@@ -0,0 +1,23 @@
+#ifndef WAKEUP_H
+#define WAKEUP_H
+
+/*
+ * Cross-thread wakeups for threads that sleep in poll(). fds[0] is the end
+ * to poll for POLLIN, fds[1] the end to signal. It is an eventfd where there
+ * is one (both ends are then the same descriptor) and a non-blocking pipe
+ * elsewhere. Signals coalesce: any number of them wake the sleeper once.
+ */
+
+/* Opens a wakeup into fds. Returns 0, or -1 with errno set. */
+int wakeup_open(int *fds);
+
+/* Closes both ends, if open, and marks them -1. */
+void wakeup_close(int *fds);
+
+/* Wakes whoever polls fds[0]. name says whose wakeup failed in the error log; NULL keeps a failure quiet. */
+void wakeup_signal(const int *fds, const char *name);
+
+/* Consumes every pending signal, so the next poll() sleeps until a new one. */
+void wakeup_clear(const int *fds);
+
+#endif    // WAKEUP_H
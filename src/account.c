@@ -1,7 +1,10 @@
 #include "../include/account.h"
+#include "../include/conn_table.h"
+#include "../include/logger.h"
+#include "../include/response.h"
 #include "../include/user_db.h"
-#include "../include/utils.h"    // For sfree
-#include <arpa/inet.h>           // For htons/ntohs/htonl
+#include <arpa/inet.h>    // For htons/ntohs/htonl
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,27 +22,44 @@ ssize_t account_handler(message_t *message)
     result = ACCOUNT_ERROR;
     if(message->type == ACC_CREATE)
     {
-        printf("account create\n");
+        LOG_DEBUG("account create");
         result = account_create(message);
     }
     else if(message->type == ACC_LOGIN)
     {
-        printf("account login\n");
+        LOG_DEBUG("account login");
         result = account_login(message);
     }
     else if(message->type == ACC_EDIT)
     {
-        printf("account edit\n");
+        LOG_DEBUG("account edit");
         result = account_edit(message);
     }
     else if(message->type == ACC_LOGOUT)
     {
-        printf("account logout\n");
+        LOG_DEBUG("account logout");
         result = account_logout(message);
     }
     return result;
 }
 
+void account_credentials(const message_t *message, credentials_t *cred)
+{
+    const char *ptr;
+
+    // Username: tag, length, bytes
+    ptr = (const char *)message->req_buf + HEADERLEN + 1;
+    memcpy(&cred->user_len, ptr, sizeof(cred->user_len));
+    ptr += sizeof(cred->user_len);
+    cred->username = ptr;
+
+    // Password: tag, length, bytes
+    ptr += cred->user_len + 1;
+    memcpy(&cred->pass_len, ptr, sizeof(cred->pass_len));
+    ptr += sizeof(cred->pass_len);
+    cred->password = ptr;
+}
+
 static ssize_t account_create(message_t *message)
 {
     char db_name[]    = "user_db";
@@ -47,16 +67,15 @@ static ssize_t account_create(message_t *message)
     DBO  userDB;
     DBO  index_userDB;
 
-    const char *username;
-    const char *password;
-    uint8_t     user_len;
-    uint8_t     pass_len;
+    credentials_t cred;
+    const char   *username;
+    const char   *password;
+    uint8_t       user_len;
+    uint8_t       pass_len;
 
     int   user_id;
-    char *key = NULL;
-    char *ptr;
-
-    uint16_t sender_id = SYSID;
+    char *existing = NULL;
+    char *key      = NULL;
 
     userDB.name       = db_name;
     userDB.db         = NULL;
@@ -65,57 +84,66 @@ static ssize_t account_create(message_t *message)
 
     if(database_open(&userDB) < 0)
     {
-        perror("Failed to open user_db");
+        LOG_ERROR("Failed to open user_db: %s", strerror(errno));
         message->code = EC_SERVER;
         goto error;
     }
 
     if(database_open(&index_userDB) < 0)
     {
-        perror("Failed to open index_userDB");
+        LOG_ERROR("Failed to open index_userDB: %s", strerror(errno));
         message->code = EC_SERVER;
         goto error;
     }
 
-    // Extract username from request buffer.
-    ptr = (char *)message->req_buf + HEADERLEN + 1;
-    memcpy(&user_len, ptr, sizeof(user_len));
-    ptr += sizeof(user_len);
-    username = ptr;
+    account_credentials(message, &cred);
+    username = cred.username;
+    user_len = cred.user_len;
+    password = cred.password;
+    pass_len = cred.pass_len;
 
-    // Extract password.
-    ptr += user_len + 1;
-    memcpy(&pass_len, ptr, sizeof(pass_len));
-    ptr += sizeof(pass_len);
-    password = ptr;
-
-    // Print extracted values using %.*s.
-    printf("Username: %.*s\n", (int)user_len, username);
-    printf("Username length: %d\n", (int)user_len);
-    printf("Password: %.*s\n", (int)pass_len, password);
-    printf("Password length: %d\n", (int)pass_len);
+    // Never log the password itself.
+    LOG_DEBUG("Username: %.*s (password length %d)", (int)user_len, username, (int)pass_len);
 
     // Check if user exists.
-    if(retrieve_byte(userDB.db, username, user_len))
+    existing = (char *)retrieve_byte(userDB.db, username, user_len, message->arena);
+    if(existing != NULL)
     {
         message->code = EC_USER_EXISTS;
         goto error;
     }
 
-    user_index++;
+    // Workers sharing the databases take ids from the stored counter, not from their own copy.
+    if(storage_shared())
+    {
+        char meta_name[] = "meta_db";
+        int  id          = pk_next(meta_name, "USER_PK");
+
+        if(id < 0)
+        {
+            LOG_ERROR("Failed to allocate a user id");
+            message->code = EC_SERVER;
+            goto error;
+        }
+        user_index = id;
+    }
+    else
+    {
+        user_index++;
+    }
     *message->client_id = user_index;
 
     // Store user.
     if(store_byte(userDB.db, username, user_len, password, pass_len) != 0)
     {
-        perror("Failed to store username and password");
+        LOG_ERROR("Failed to store username and password: %s", strerror(errno));
         message->code = EC_SERVER;
         goto error;
     }
-    key = strndup(username, user_len);
+    key = arena_strndup(message->arena, username, user_len);
     if(key == NULL)
     {
-        perror("Failed to allocate memory");
+        LOG_ERROR("Failed to allocate memory: %s", strerror(errno));
         message->code = EC_SERVER;
         goto error;
     }
@@ -123,7 +151,7 @@ static ssize_t account_create(message_t *message)
     // Store user index.
     if(store_int(index_userDB.db, key, *message->client_id) < 0)
     {
-        perror("Failed to store user index");
+        LOG_ERROR("Failed to store user index: %s", strerror(errno));
         message->code = EC_SERVER;
         goto error;
     }
@@ -131,35 +159,26 @@ static ssize_t account_create(message_t *message)
     // Retrieve user id.
     if(retrieve_int(index_userDB.db, key, &user_id) < 0)
     {
-        printf("Failed to retrieve user info\n");
+        LOG_ERROR("Failed to retrieve user info");
         message->code = EC_SERVER;
         goto error;
     }
-    printf("User %.*d created\n", (int)sizeof(*message->client_id), user_id);
-
-    ptr = (char *)message->res_buf;
-    // Build response.
-    *ptr++    = SYS_SUCCESS;
-    *ptr++    = VERSION_NUM;
-    sender_id = htons(sender_id);    // Removed redundant cast
-    memcpy(ptr, &sender_id, sizeof(sender_id));
-    ptr += sizeof(sender_id);
-    message->response_len = htons(message->response_len);
-    memcpy(ptr, &message->response_len, sizeof(message->response_len));
-    ptr += sizeof(message->response_len);
-    *ptr++ = BER_ENUM;
-    *ptr++ = sizeof(uint8_t);
-    *ptr++ = ACC_CREATE;
-
-    dbm_close(userDB.db);
-    dbm_close(index_userDB.db);
-    sfree((void **)&key);
+    LOG_INFO("User %d created", user_id);
+
+    // The SYS_SUCCESS reply is the pre-encoded ACC_CREATE template.
+    message->response_len = 0;
+
+    database_close(&userDB);
+    database_close(&index_userDB);
+    arena_release(message->arena, key);
+    arena_release(message->arena, existing);
     return 0;
 
 error:
-    dbm_close(userDB.db);
-    dbm_close(index_userDB.db);
-    sfree((void **)&key);
+    database_close(&userDB);
+    database_close(&index_userDB);
+    arena_release(message->arena, key);
+    arena_release(message->arena, existing);
     return ACCOUNT_CREATE_ERROR;
 }
 
@@ -170,18 +189,16 @@ static ssize_t account_login(message_t *message)
     DBO  userDB;
     DBO  index_userDB;
 
-    const char *username;
-    const char *password;
-    uint8_t     user_len;
-    uint8_t     pass_len;
+    credentials_t cred;
+    const char   *username;
+    const char   *password;
+    uint8_t       user_len;
+    uint8_t       pass_len;
 
     int   user_id;
     datum output;
     char *existing = NULL;
     char *key      = NULL;
-    char *ptr;
-
-    uint16_t sender_id = SYSID;
 
     userDB.name       = db_name;
     userDB.db         = NULL;
@@ -192,39 +209,32 @@ static ssize_t account_login(message_t *message)
 
     if(database_open(&userDB) < 0)
     {
-        perror("Failed to open user_db");
+        LOG_ERROR("Failed to open user_db: %s", strerror(errno));
         message->code = EC_SERVER;
         goto error;
     }
 
     if(database_open(&index_userDB) < 0)
     {
-        perror("Failed to open index_userDB");
+        LOG_ERROR("Failed to open index_userDB: %s", strerror(errno));
         message->code = EC_SERVER;
         goto error;
     }
 
     // Extract username and password.
-    ptr = (char *)message->req_buf + HEADERLEN + 1;
-    memcpy(&user_len, ptr, sizeof(user_len));
-    ptr += sizeof(user_len);
-    username = ptr;
-
-    ptr += user_len + 1;
-    memcpy(&pass_len, ptr, sizeof(pass_len));
-    ptr += sizeof(pass_len);
-    password = ptr;
+    account_credentials(message, &cred);
+    username = cred.username;
+    user_len = cred.user_len;
+    password = cred.password;
+    pass_len = cred.pass_len;
 
-    printf("Username: %.*s\n", (int)user_len, username);
-    printf("Username length: %d\n", (int)user_len);
-    printf("Password: %.*s\n", (int)pass_len, password);
-    printf("Password length: %d\n", (int)pass_len);
+    LOG_DEBUG("Username: %.*s (password length %d)", (int)user_len, username, (int)pass_len);
 
     // Retrieve existing user.
-    existing = retrieve_byte(userDB.db, username, user_len);
+    existing = (char *)retrieve_byte(userDB.db, username, user_len, message->arena);
     if(!existing)
     {
-        perror("Failed to find user");
+        LOG_DEBUG("Failed to find user");
         message->code = EC_INV_USER_ID;
         goto error;
     }
@@ -232,59 +242,41 @@ static ssize_t account_login(message_t *message)
     // Validate password.
     if(memcmp(existing, password, pass_len) != 0)
     {
-        sfree((void **)&existing);
-        perror("Failed to provide correct password");
+        LOG_DEBUG("Failed to provide correct password");
         message->code = EC_INV_AUTH_INFO;
         goto error;
     }
 
-    key = strndup(username, user_len);
+    key = arena_strndup(message->arena, username, user_len);
     if(key == NULL)
     {
-        perror("Failed to allocate memory");
+        LOG_ERROR("Failed to allocate memory: %s", strerror(errno));
         message->code = EC_SERVER;
         goto error;
     }
 
     if(retrieve_int(index_userDB.db, key, &user_id) < 0)
     {
-        perror("Failed to retrieve user index");
+        LOG_ERROR("Failed to retrieve user index");
         message->code = EC_SERVER;
         goto error;
     }
-    printf("User %.*d logged in\n", (int)sizeof(*message->client_id), user_id);
-
-    ptr       = (char *)message->res_buf;
-    *ptr++    = ACC_LOGIN_SUCCESS;
-    *ptr++    = SYSID;
-    sender_id = htons(sender_id);    // Removed redundant cast
-    memcpy(ptr, &sender_id, sizeof(sender_id));
-    ptr += sizeof(sender_id);
-    message->response_len = 4;
-    message->response_len = htons(message->response_len);
-    memcpy(ptr, &message->response_len, sizeof(message->response_len));
-    ptr += sizeof(message->response_len);
-    *ptr++ = BER_INT;
-    *ptr++ = sizeof(uint16_t);
-    {
-        uint16_t uid = (uint16_t)user_id;
-        uid          = htons(uid);
-        memcpy(ptr, &uid, sizeof(uid));
-        // Convert back and assign to client_id.
-        *message->client_id = (int)ntohs(uid);
-    }
+    LOG_INFO("User %d logged in", user_id);
+
+    message->response_len = response_login_success(message->res_buf, (uint16_t)user_id);
+    *message->client_id   = (uint16_t)user_id;
 
-    dbm_close(userDB.db);
-    dbm_close(index_userDB.db);
-    sfree((void **)&key);
-    sfree((void **)&existing);
+    database_close(&userDB);
+    database_close(&index_userDB);
+    arena_release(message->arena, key);
+    arena_release(message->arena, existing);
     return 0;
 
 error:
-    dbm_close(userDB.db);
-    dbm_close(index_userDB.db);
-    sfree((void **)&key);
-    sfree((void **)&existing);
+    database_close(&userDB);
+    database_close(&index_userDB);
+    arena_release(message->arena, key);
+    arena_release(message->arena, existing);
     return ACCOUNT_LOGIN_ERROR;
 }
 
@@ -293,82 +285,68 @@ static ssize_t account_edit(message_t *message)
     char db_name[] = "user_db";
     DBO  userDB;
 
-    const char *username;
-    const char *new_password;
-    uint8_t     user_len;
-    uint8_t     pass_len;
+    credentials_t cred;
+    const char   *username;
+    const char   *new_password;
+    uint8_t       user_len;
+    uint8_t       pass_len;
 
     char *existing = NULL;
-    char *ptr;
 
     userDB.name = db_name;
     userDB.db   = NULL;
 
     if(database_open(&userDB) < 0)
     {
-        perror("Failed to open user_db");
+        LOG_ERROR("Failed to open user_db: %s", strerror(errno));
         message->code = EC_SERVER;
         goto error;
     }
 
-    ptr = (char *)message->req_buf + HEADERLEN + 1;
-    memcpy(&user_len, ptr, sizeof(user_len));
-    ptr += sizeof(user_len);
-    username = ptr;
-
-    ptr += user_len + 1;
-    memcpy(&pass_len, ptr, sizeof(pass_len));
-    ptr += sizeof(pass_len);
-    new_password = ptr;
+    account_credentials(message, &cred);
+    username     = cred.username;
+    user_len     = cred.user_len;
+    new_password = cred.password;
+    pass_len     = cred.pass_len;
 
-    printf("Username: %.*s\n", (int)user_len, username);
-    printf("Username length: %d\n", (int)user_len);
-    printf("New Password: %.*s\n", (int)pass_len, new_password);
-    printf("New Password length: %d\n", (int)pass_len);
+    LOG_DEBUG("Username: %.*s (new password length %d)", (int)user_len, username, (int)pass_len);
 
-    existing = retrieve_byte(userDB.db, username, user_len);
+    existing = (char *)retrieve_byte(userDB.db, username, user_len, message->arena);
     if(!existing)
     {
-        perror("Failed to find user");
+        LOG_DEBUG("Failed to find user");
         message->code = EC_INV_USER_ID;
         goto error;
     }
 
     if(store_byte(userDB.db, username, user_len, new_password, pass_len) != 0)
     {
-        perror("Failed to update password");
+        LOG_ERROR("Failed to update password: %s", strerror(errno));
         message->code = EC_SERVER;
         goto error;
     }
 
-    printf("User %.*s password updated\n", (int)user_len, username);
+    LOG_INFO("User %.*s password updated", (int)user_len, username);
 
-    ptr    = (char *)message->res_buf;
-    *ptr++ = SYS_SUCCESS;
-    *ptr++ = VERSION_NUM;
-    {
-        uint16_t sender_id = SYSID;
-        sender_id          = htons(sender_id);    // Removed redundant cast
-        memcpy(ptr, &sender_id, sizeof(sender_id));
-        ptr += sizeof(sender_id);
-    }
+    // The empty SYS_SUCCESS reply is the pre-encoded ACC_EDIT template.
     message->response_len = 0;
-    message->response_len = htons(message->response_len);
-    memcpy(ptr, &message->response_len, sizeof(message->response_len));
 
-    dbm_close(userDB.db);
-    sfree((void **)&existing);
+    database_close(&userDB);
+    arena_release(message->arena, existing);
     return 0;
 
 error:
-    dbm_close(userDB.db);
-    sfree((void **)&existing);
+    database_close(&userDB);
+    arena_release(message->arena, existing);
     return ACCOUNT_EDIT_ERROR;
 }
 
 static ssize_t account_logout(message_t *message)
 {
-    printf("User %d logged out\n", *message->client_id);
+    LOG_INFO("User %d logged out", *message->client_id);
+    // The connection stays open, but no longer counts as a logged-in user. On a worker this is the
+    // worker's copy, which request_done() writes back to the connection.
+    *message->client_id   = CONN_NO_USER;
     message->response_len = 0;
     return END;
 }
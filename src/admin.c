@@ -0,0 +1,379 @@
+/*******************************************************************************
+ * Admin / metrics endpoint
+ *
+ * An optional listener that serves the server's counters, gauges and latency
+ * summaries in the Prometheus text exposition format. Scrapers share the
+ * event loop with chat clients: every socket is non-blocking, the page is
+ * rendered in one go once a request has arrived, and it is flushed with
+ * POLLOUT, so a slow scraper never holds up client traffic. Any request line
+ * gets the page; the connection is closed once it has been sent.
+ ******************************************************************************/
+
+#include "../include/admin.h"
+#include "../include/args.h"
+#include "../include/logger.h"
+#include "../include/message.h"
+#include "../include/metrics.h"
+#include "../include/network.h"
+#include "../include/utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define ADMIN_LABEL_MAX (64)
+#define PERCENT (100.0)
+
+typedef struct
+{
+    struct pollfd *pfd;                  // cppcheck-suppress unusedStructMember
+    char          *page;                 // cppcheck-suppress unusedStructMember
+    size_t         page_len;             // cppcheck-suppress unusedStructMember
+    size_t         sent;                 // cppcheck-suppress unusedStructMember
+    size_t         req_len;              // cppcheck-suppress unusedStructMember
+    char           req[ADMIN_REQ_MAX];    // cppcheck-suppress unusedStructMember
+    tw_timer_t     timer;                // cppcheck-suppress unusedStructMember
+} admin_conn_t;
+
+typedef struct
+{
+    error_code_t code;    // cppcheck-suppress unusedStructMember
+    const char  *name;    // cppcheck-suppress unusedStructMember
+} error_label_t;
+
+static const error_label_t error_labels[] = {
+    {EC_INV_USER_ID,   "EC_INV_USER_ID"  },
+    {EC_INV_AUTH_INFO, "EC_INV_AUTH_INFO"},
+    {EC_USER_EXISTS,   "EC_USER_EXISTS"  },
+    {EC_SERVER,        "EC_SERVER"       },
+    {EC_INV_REQ,       "EC_INV_REQ"      },
+    {EC_REQ_TIMEOUT,   "EC_REQ_TIMEOUT"  }
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static const char header[] = "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Connection: close\r\n"
+                             "\r\n";
+
+static struct pollfd *listener;                        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static admin_conn_t   conns[ADMIN_MAX_CLIENTS];        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static timer_wheel_t *admin_wheel;                     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static void   admin_accept(void);
+static void   admin_read(admin_conn_t *conn);
+static void   admin_write(admin_conn_t *conn);
+static void   admin_close(admin_conn_t *conn);
+static void   admin_timeout(void *arg);
+static size_t render_page(char *buf, size_t cap);
+static void   render_summary(char *buf, size_t cap, size_t *len, const char *name, const char *labels, const hist_snapshot_t *snap);
+static void   appendf(char *buf, size_t cap, size_t *len, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+void admin_init(struct pollfd *fds, int listen_fd, timer_wheel_t *wheel)
+{
+    admin_wheel      = wheel;
+    listener         = &fds[0];
+    listener->fd     = listen_fd;
+    listener->events = POLLIN;
+    for(int i = 0; i < ADMIN_MAX_CLIENTS; i++)
+    {
+        memset(&conns[i], 0, sizeof(conns[i]));
+        conns[i].pfd         = &fds[i + 1];
+        conns[i].pfd->fd     = -1;
+        conns[i].pfd->events = 0;
+        timer_init(&conns[i].timer, admin_timeout, &conns[i]);
+    }
+}
+
+void admin_handle(void)
+{
+    if(listener == NULL || listener->fd < 0)
+    {
+        return;
+    }
+    if(listener->revents & POLLIN)
+    {
+        admin_accept();
+    }
+    for(int i = 0; i < ADMIN_MAX_CLIENTS; i++)
+    {
+        admin_conn_t *conn = &conns[i];
+
+        if(conn->pfd->fd < 0 || conn->pfd->revents == 0)
+        {
+            continue;
+        }
+        if(conn->pfd->revents & (POLLHUP | POLLERR))
+        {
+            admin_close(conn);
+        }
+        else if(conn->pfd->revents & POLLIN)
+        {
+            admin_read(conn);
+        }
+        else if(conn->pfd->revents & POLLOUT)
+        {
+            admin_write(conn);
+        }
+    }
+}
+
+void admin_shutdown(void)
+{
+    for(int i = 0; i < ADMIN_MAX_CLIENTS; i++)
+    {
+        if(conns[i].pfd != NULL && conns[i].pfd->fd >= 0)
+        {
+            admin_close(&conns[i]);
+        }
+    }
+    if(listener != NULL && listener->fd >= 0)
+    {
+        close(listener->fd);
+        listener->fd = -1;
+    }
+}
+
+static void admin_accept(void)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len = sizeof(addr);
+    int                     fd;
+    int                     flags;
+
+    fd = socket_accept(listener->fd, &addr, &addr_len);
+    if(fd < 0)
+    {
+        LOG_WARN("admin accept error: %s", strerror(errno));
+        return;
+    }
+    flags = fcntl(fd, F_GETFL, 0);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        LOG_WARN("admin fcntl error: %s", strerror(errno));
+        close(fd);
+        return;
+    }
+
+    for(int i = 0; i < ADMIN_MAX_CLIENTS; i++)
+    {
+        admin_conn_t *conn = &conns[i];
+
+        if(conn->pfd->fd < 0)
+        {
+            conn->pfd->fd     = fd;
+            conn->pfd->events = POLLIN;
+            conn->req_len     = 0;
+            timer_schedule(admin_wheel, &conn->timer, ADMIN_TIMEOUT);
+            return;
+        }
+    }
+    LOG_WARN("Too many admin connections. Rejecting connection.");
+    close(fd);
+}
+
+static void admin_read(admin_conn_t *conn)
+{
+    ssize_t nread;
+
+    nread = read(conn->pfd->fd, conn->req + conn->req_len, sizeof(conn->req) - conn->req_len - 1);
+    if(nread < 0 && (would_block(errno) || errno == EINTR))
+    {
+        return;
+    }
+    if(nread <= 0)
+    {
+        admin_close(conn);
+        return;
+    }
+    conn->req_len += (size_t)nread;
+    conn->req[conn->req_len] = '\0';
+
+    // Wait for the end of the request headers unless the buffer is already full.
+    if(strstr(conn->req, "\r\n\r\n") == NULL && strstr(conn->req, "\n\n") == NULL && conn->req_len < sizeof(conn->req) - 1)
+    {
+        return;
+    }
+
+    conn->page = (char *)malloc(ADMIN_BUF_SIZE);
+    if(conn->page == NULL)
+    {
+        LOG_ERROR("Failed to allocate admin page: %s", strerror(errno));
+        admin_close(conn);
+        return;
+    }
+    conn->page_len    = render_page(conn->page, ADMIN_BUF_SIZE);
+    conn->sent        = 0;
+    conn->pfd->events = POLLOUT;
+    admin_write(conn);
+}
+
+static void admin_write(admin_conn_t *conn)
+{
+    while(conn->sent < conn->page_len)
+    {
+        ssize_t nwritten = write(conn->pfd->fd, conn->page + conn->sent, conn->page_len - conn->sent);
+        if(nwritten < 0)
+        {
+            if(would_block(errno) || errno == EINTR)
+            {
+                return;    // POLLOUT brings us back
+            }
+            break;
+        }
+        conn->sent += (size_t)nwritten;
+    }
+    admin_close(conn);
+}
+
+static void admin_close(admin_conn_t *conn)
+{
+    timer_cancel(admin_wheel, &conn->timer);
+    sfree((void **)&conn->page);
+    close(conn->pfd->fd);
+    conn->pfd->fd     = -1;
+    conn->pfd->events = 0;
+}
+
+static void admin_timeout(void *arg)
+{
+    admin_conn_t *conn = (admin_conn_t *)arg;
+
+    LOG_INFO("admin connection timed out, closing.");
+    admin_close(conn);
+}
+
+static size_t render_page(char *buf, size_t cap)
+{
+    hist_snapshot_t snap;
+    size_t          len = 0;
+
+    appendf(buf, cap, &len, "%s", header);
+
+    appendf(buf, cap, &len, "# HELP chat_connections Open client connections.\n# TYPE chat_connections gauge\n");
+    appendf(buf, cap, &len, "chat_connections %ld\n", (long)atomic_load_explicit(&metrics.connections, memory_order_relaxed));
+
+    appendf(buf, cap, &len, "# HELP chat_messages_total Client frames handled.\n# TYPE chat_messages_total counter\n");
+    appendf(buf, cap, &len, "chat_messages_total %lu\n", (unsigned long)atomic_load_explicit(&metrics.msgs_in, memory_order_relaxed));
+    appendf(buf, cap, &len, "# HELP chat_relayed_total Chat messages relayed.\n# TYPE chat_relayed_total counter\n");
+    appendf(buf, cap, &len, "chat_relayed_total %lu\n", (unsigned long)msg_count);
+    appendf(buf, cap, &len, "# HELP chat_received_bytes_total Bytes read from clients.\n# TYPE chat_received_bytes_total counter\n");
+    appendf(buf, cap, &len, "chat_received_bytes_total %lu\n", (unsigned long)atomic_load_explicit(&metrics.bytes_in, memory_order_relaxed));
+    appendf(buf, cap, &len, "# HELP chat_sent_bytes_total Bytes written to clients.\n# TYPE chat_sent_bytes_total counter\n");
+    appendf(buf, cap, &len, "chat_sent_bytes_total %lu\n", (unsigned long)atomic_load_explicit(&metrics.bytes_out, memory_order_relaxed));
+
+    appendf(buf, cap, &len, "# HELP chat_frames_total Client frames by packet type.\n# TYPE chat_frames_total counter\n");
+    for(int type = 0; type < METRIC_FRAME_TYPES; type++)
+    {
+        memset(&snap, 0, sizeof(snap));
+        metrics_frame_latency(&snap, (uint8_t)type);
+        if(snap.total > 0)
+        {
+            appendf(buf, cap, &len, "chat_frames_total{type=\"%s\"} %lu\n", metrics_type_name((uint8_t)type), (unsigned long)snap.total);
+        }
+    }
+
+    appendf(buf, cap, &len, "# HELP chat_errors_total Error responses by error code.\n# TYPE chat_errors_total counter\n");
+    for(size_t i = 0; i < sizeof(error_labels) / sizeof(error_labels[0]); i++)
+    {
+        appendf(buf, cap, &len, "chat_errors_total{code=\"%s\"} %lu\n", error_labels[i].name, (unsigned long)atomic_load_explicit(&metrics.errors[error_labels[i].code], memory_order_relaxed));
+    }
+
+    appendf(buf, cap, &len, "# HELP chat_frame_latency_us First byte received to last byte sent, by packet type.\n# TYPE chat_frame_latency_us summary\n");
+    for(int type = 0; type < METRIC_FRAME_TYPES; type++)
+    {
+        char labels[ADMIN_LABEL_MAX];
+
+        memset(&snap, 0, sizeof(snap));
+        metrics_frame_latency(&snap, (uint8_t)type);
+        if(snap.total > 0)
+        {
+            snprintf(labels, sizeof(labels), "type=\"%s\"", metrics_type_name((uint8_t)type));
+            render_summary(buf, cap, &len, "chat_frame_latency_us", labels, &snap);
+        }
+    }
+
+    appendf(buf, cap, &len, "# HELP chat_handler_latency_us Time spent decoding and handling a frame.\n# TYPE chat_handler_latency_us summary\n");
+    memset(&snap, 0, sizeof(snap));
+    hist_accumulate(&snap, &metrics.handler_latency);
+    render_summary(buf, cap, &len, "chat_handler_latency_us", NULL, &snap);
+
+    appendf(buf, cap, &len, "# HELP chat_db_op_latency_us Duration of DBM open, store and fetch calls.\n# TYPE chat_db_op_latency_us summary\n");
+    memset(&snap, 0, sizeof(snap));
+    hist_accumulate(&snap, &metrics.db_latency);
+    render_summary(buf, cap, &len, "chat_db_op_latency_us", NULL, &snap);
+
+    appendf(buf, cap, &len, "# HELP chat_rx_buffer_bytes Receive buffer memory.\n# TYPE chat_rx_buffer_bytes gauge\n");
+    appendf(buf, cap, &len, "chat_rx_buffer_bytes{state=\"allocated\"} %ld\n", (long)atomic_load_explicit(&metrics.rx_allocated, memory_order_relaxed));
+    appendf(buf, cap, &len, "chat_rx_buffer_bytes{state=\"queued\"} %ld\n", (long)atomic_load_explicit(&metrics.rx_queued, memory_order_relaxed));
+
+    appendf(buf, cap, &len, "# HELP chat_tx_buffer_bytes Send buffer memory: queued sends and broadcasts not yet written out.\n# TYPE chat_tx_buffer_bytes gauge\n");
+    appendf(buf, cap, &len, "chat_tx_buffer_bytes{state=\"allocated\"} %ld\n", (long)atomic_load_explicit(&metrics.tx_allocated, memory_order_relaxed));
+    appendf(buf, cap, &len, "# HELP chat_memory_limit_bytes Cap on allocated receive and send buffer memory together, 0 if none.\n# TYPE chat_memory_limit_bytes gauge\n");
+    appendf(buf, cap, &len, "chat_memory_limit_bytes %lu\n", (unsigned long)global_args.mem_max);
+    appendf(buf, cap, &len, "# HELP chat_memory_refused_total Connections refused while over the memory cap.\n# TYPE chat_memory_refused_total counter\n");
+    appendf(buf, cap, &len, "chat_memory_refused_total %lu\n", (unsigned long)atomic_load_explicit(&metrics.mem_refused, memory_order_relaxed));
+    appendf(buf, cap, &len, "# HELP chat_memory_shed_total Connections closed for holding too much memory.\n# TYPE chat_memory_shed_total counter\n");
+    appendf(buf, cap, &len, "chat_memory_shed_total %lu\n", (unsigned long)atomic_load_explicit(&metrics.mem_shed, memory_order_relaxed));
+
+    appendf(buf, cap, &len, "# HELP chat_loop_lag_us Moving average of how long an event loop pass takes.\n# TYPE chat_loop_lag_us gauge\n");
+    appendf(buf, cap, &len, "chat_loop_lag_us %ld\n", (long)atomic_load_explicit(&metrics.loop_lag_us, memory_order_relaxed));
+    appendf(buf, cap, &len, "# HELP chat_shed_total Logins and creates answered EC_SERVER while overloaded, by reason.\n# TYPE chat_shed_total counter\n");
+    for(int reason = 0; reason < OVERLOAD_REASONS; reason++)
+    {
+        appendf(buf, cap, &len, "chat_shed_total{reason=\"%s\"} %lu\n", overload_name((overload_reason_t)reason), (unsigned long)atomic_load_explicit(&metrics.shed[reason], memory_order_relaxed));
+    }
+
+    appendf(buf, cap, &len, "# HELP chat_log_queue_records Log records waiting for the writer thread.\n# TYPE chat_log_queue_records gauge\n");
+    appendf(buf, cap, &len, "chat_log_queue_records %lu\n", log_backlog());
+    appendf(buf, cap, &len, "# HELP chat_log_dropped_total Log records dropped because a ring was full.\n# TYPE chat_log_dropped_total counter\n");
+    appendf(buf, cap, &len, "chat_log_dropped_total %lu\n", log_dropped());
+
+    return len;
+}
+
+static void render_summary(char *buf, size_t cap, size_t *len, const char *name, const char *labels, const hist_snapshot_t *snap)
+{
+    const char *sep    = labels != NULL ? "," : "";
+    const char *lbrace = labels != NULL ? "{" : "";
+    const char *rbrace = labels != NULL ? "}" : "";
+
+    if(labels == NULL)
+    {
+        labels = "";
+    }
+    for(size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    {
+        appendf(buf, cap, len, "%s{%s%squantile=\"%g\"} %lu\n", name, labels, sep, quantiles[i], (unsigned long)hist_percentile(snap, quantiles[i] * PERCENT));
+    }
+    appendf(buf, cap, len, "%s_sum%s%s%s %lu\n", name, lbrace, labels, rbrace, (unsigned long)snap->sum);
+    appendf(buf, cap, len, "%s_count%s%s%s %lu\n", name, lbrace, labels, rbrace, (unsigned long)snap->total);
+}
+
+/* Appends to buf, silently truncating once it is full. */
+static void appendf(char *buf, size_t cap, size_t *len, const char *fmt, ...)
+{
+    va_list args;
+    int     n;
+
+    if(*len >= cap)
+    {
+        return;
+    }
+    va_start(args, fmt);
+    n = vsnprintf(buf + *len, cap - *len, fmt, args);
+    va_end(args);
+    if(n > 0)
+    {
+        *len += (size_t)n;
+        if(*len >= cap)
+        {
+            *len = cap - 1;
+        }
+    }
+}
@@ -0,0 +1,125 @@
+/*******************************************************************************
+ * Request arenas
+ *
+ * An allocation is a pointer bump in one block. An allocation that does not
+ * fit gets its own heap chunk, linked so the reset can free it, and the
+ * reset then swaps the block for one large enough to have held everything.
+ * Blocks only grow, so the heap is touched once per new high-water mark.
+ ******************************************************************************/
+
+#include "../include/arena.h"
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN (alignof(max_align_t))
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+static void *arena_spill(arena_t *arena, size_t size);
+
+void arena_init(arena_t *arena, size_t cap)
+{
+    arena->base     = NULL;
+    arena->cap      = ARENA_ROUND(cap);
+    arena->used     = 0;
+    arena->spilled  = 0;
+    arena->overflow = NULL;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    void *ptr;
+
+    if(arena == NULL)
+    {
+        return malloc(size);
+    }
+    size = ARENA_ROUND(size == 0 ? 1 : size);
+    if(arena->base == NULL && arena->cap > 0)
+    {
+        arena->base = (uint8_t *)malloc(arena->cap);
+    }
+    if(arena->base == NULL || arena->cap - arena->used < size)
+    {
+        return arena_spill(arena, size);
+    }
+    ptr = arena->base + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+void *arena_zalloc(arena_t *arena, size_t size)
+{
+    void *ptr = arena_alloc(arena, size);
+
+    if(ptr != NULL)
+    {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len)
+{
+    char *copy = (char *)arena_alloc(arena, len + 1);
+
+    if(copy != NULL)
+    {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+void arena_release(const arena_t *arena, void *ptr)
+{
+    if(arena == NULL)
+    {
+        free(ptr);
+    }
+}
+
+void arena_reset(arena_t *arena)
+{
+    size_t need = arena->used + arena->spilled;
+
+    while(arena->overflow != NULL)
+    {
+        arena_chunk_t *next = arena->overflow->next;
+
+        free(arena->overflow);
+        arena->overflow = next;
+    }
+    // Next time the whole request fits in one block.
+    if(need > arena->cap)
+    {
+        free(arena->base);
+        arena->base = NULL;
+        arena->cap  = ARENA_ROUND(need);
+    }
+    arena->used    = 0;
+    arena->spilled = 0;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    arena_reset(arena);
+    free(arena->base);
+    arena->base = NULL;
+}
+
+/* An allocation the block has no room for, in a heap chunk of its own until the reset */
+static void *arena_spill(arena_t *arena, size_t size)
+{
+    size_t         header = ARENA_ROUND(sizeof(arena_chunk_t));
+    arena_chunk_t *chunk  = (arena_chunk_t *)malloc(header + size);
+
+    if(chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->next     = arena->overflow;
+    arena->overflow = chunk;
+    arena->spilled += size;
+    return (uint8_t *)chunk + header;
+}
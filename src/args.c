@@ -1,10 +1,15 @@
 #include "../include/args.h"
+#include "../include/logger.h"
 #include "../include/network.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define OPTION_MESSAGE_LEN 50
+#define BASE_TEN 10
+#define KIB ((size_t)1024)
+#define MIB (KIB * KIB)
 
 Arguments global_args;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
 
@@ -23,6 +28,18 @@ _Noreturn void usage(const char *app_name, int exit_code, const char *message)
     fputs("  -p <port>,    --port <port>        PORT number of the server.\n", stderr);
     fputs("  -A <address>, --address <address>  IP Address of the server manager.\n", stderr);
     fputs("  -P <port>,    --port <port>        PORT number of the server manager.\n", stderr);
+    fputs("  -l <level>,   --log-level <level>  debug, info, warn, error or off (default info).\n", stderr);
+    fputs("  -d <n>,       --diag-version <n>   Diagnostic payload: 1 (legacy, default) or 2 (extended).\n", stderr);
+    fputs("  -M <port>,    --admin-port <port>  Serve metrics on 127.0.0.1:<port> (disabled by default).\n", stderr);
+    fputs("  -C <file>,    --capture <file>     Record client traffic to <file> for test/replay.\n", stderr);
+    fputs("  -I <backend>, --io <backend>       Client I/O: poll (default) or uring (falls back to poll).\n", stderr);
+    fputs("  -H <path>,    --handoff <path>     Take over from the server at <path> if one runs, then accept upgrades there.\n", stderr);
+    fputs("  -w <n>,       --workers <n>        server_starter: run n worker processes on one SO_REUSEPORT port (default 1).\n", stderr);
+    fputs("  -R,           --router             Resolve chat recipients on a dedicated router thread.\n", stderr);
+    fputs("  -t <n>,       --threads <n>        Run request handlers on n work-stealing threads (default 0: inline).\n", stderr);
+    fputs("  -c <n>,       --max-clients <n>    Accept up to n client connections at once (default 1024).\n", stderr);
+    fputs("  -b <KiB>,     --conn-mem <KiB>     Disconnect a client holding more than this in buffers (default 1024).\n", stderr);
+    fputs("  -m <MiB>,     --mem-max <MiB>      Cap on buffers across all clients, 0 for none (default 1024).\n", stderr);
     exit(exit_code);
 }
 
@@ -35,18 +52,38 @@ _Noreturn void usage(const char *app_name, int exit_code, const char *message)
  */
 void parse_args(int argc, char *argv[])
 {
-    int opt;
+    int  opt;
+    long value;
 
     static struct option long_options[] = {
         {"address",                required_argument, NULL, 'a'},
         {"port",                   required_argument, NULL, 'p'},
         {"server manager address", required_argument, NULL, 'A'},
         {"server manager port",    required_argument, NULL, 'P'},
+        {"log-level",              required_argument, NULL, 'l'},
+        {"diag-version",           required_argument, NULL, 'd'},
+        {"admin-port",             required_argument, NULL, 'M'},
+        {"capture",                required_argument, NULL, 'C'},
+        {"io",                     required_argument, NULL, 'I'},
+        {"handoff",                required_argument, NULL, 'H'},
+        {"workers",                required_argument, NULL, 'w'},
+        {"router",                 no_argument,       NULL, 'R'},
+        {"threads",                required_argument, NULL, 't'},
+        {"max-clients",            required_argument, NULL, 'c'},
+        {"conn-mem",               required_argument, NULL, 'b'},
+        {"mem-max",                required_argument, NULL, 'm'},
         {"help",                   no_argument,       NULL, 'h'},
         {NULL,                     0,                 NULL, 0  }
     };
 
-    while((opt = getopt_long(argc, argv, "ha:p:A:P:", long_options, NULL)) != -1)
+    global_args.log_level    = log_parse_level(LOG_LEVEL);
+    global_args.diag_version = DIAG_VERSION;
+    global_args.workers      = 1;
+    global_args.max_clients  = CLIENTS_DEFAULT;
+    global_args.conn_mem_max = (size_t)CONN_MEM_DEFAULT_KB * KIB;
+    global_args.mem_max      = (size_t)MEM_DEFAULT_MB * MIB;
+
+    while((opt = getopt_long(argc, argv, "ha:p:A:P:l:d:M:C:I:H:w:Rt:c:b:m:", long_options, NULL)) != -1)
     {
         switch(opt)
         {
@@ -62,10 +99,87 @@ void parse_args(int argc, char *argv[])
             case 'P':
                 global_args.sm_port = convert_port(argv[0], optarg);
                 break;
+            case 'l':
+                global_args.log_level = log_parse_level(optarg);
+                if(global_args.log_level < 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Unknown log level.");
+                }
+                break;
+            case 'd':
+                global_args.diag_version = (int)strtol(optarg, NULL, BASE_TEN);
+                if(global_args.diag_version < DIAG_VERSION || global_args.diag_version > DIAG_VERSION_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Unknown diagnostic version.");
+                }
+                break;
+            case 'M':
+                global_args.admin_port = convert_port(argv[0], optarg);
+                break;
+            case 'C':
+                global_args.capture_path = optarg;
+                break;
+            case 'I':
+                if(strcmp(optarg, "poll") == 0)
+                {
+                    global_args.io_backend = IO_BACKEND_POLL;
+                }
+                else if(strcmp(optarg, "uring") == 0)
+                {
+                    global_args.io_backend = IO_BACKEND_URING;
+                }
+                else
+                {
+                    usage(argv[0], EXIT_FAILURE, "Unknown I/O backend.");
+                }
+                break;
+            case 'H':
+                global_args.handoff_path = optarg;
+                break;
+            case 'w':
+                global_args.workers = (int)strtol(optarg, NULL, BASE_TEN);
+                if(global_args.workers < 1 || global_args.workers > WORKERS_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Worker count out of range.");
+                }
+                break;
+            case 'R':
+                global_args.router = 1;
+                break;
+            case 't':
+                global_args.threads = (int)strtol(optarg, NULL, BASE_TEN);
+                if(global_args.threads < 0 || global_args.threads > THREADS_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Thread count out of range.");
+                }
+                break;
+            case 'c':
+                global_args.max_clients = (int)strtol(optarg, NULL, BASE_TEN);
+                if(global_args.max_clients < 1 || global_args.max_clients > CLIENTS_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Client limit out of range.");
+                }
+                break;
+            case 'b':
+                value = strtol(optarg, NULL, BASE_TEN);
+                if(value < CONN_MEM_MIN_KB || value > CONN_MEM_MAX_KB)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Connection memory cap out of range.");
+                }
+                global_args.conn_mem_max = (size_t)value * KIB;
+                break;
+            case 'm':
+                value = strtol(optarg, NULL, BASE_TEN);
+                if(value < 0 || value > MEM_MAX_MB)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Memory cap out of range.");
+                }
+                global_args.mem_max = (size_t)value * MIB;
+                break;
             case 'h':
                 usage(argv[0], EXIT_SUCCESS, NULL);
             case '?':
-                if(optopt != 'a' && optopt != 'p' && optopt != 'A' && optopt != 'P')
+                if(optopt != 'a' && optopt != 'p' && optopt != 'A' && optopt != 'P' && optopt != 'l' && optopt != 'd' && optopt != 'M' && optopt != 'C' && optopt != 'I' && optopt != 'H' && optopt != 'w' && optopt != 't' && optopt != 'c' && optopt != 'b' && optopt != 'm')
                 {
                     char message[OPTION_MESSAGE_LEN];
                     snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
@@ -94,4 +208,8 @@ void parse_args(int argc, char *argv[])
     {
         global_args.sm_port = convert_port(argv[0], SERVER_MANAGER_PORT);
     }
+    if(global_args.admin_ip == NULL)
+    {
+        global_args.admin_ip = ADMIN_ADDRESS;    // Metrics stay local unless proxied
+    }
 }
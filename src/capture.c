@@ -0,0 +1,195 @@
+/*******************************************************************************
+ * Traffic capture
+ *
+ * Records every client frame, plus connection opens and closes, with a
+ * timestamp so test/replay can re-drive the same load shape. Only the event
+ * loop calls in here, so the buffer needs no locking. Records pile up in
+ * memory and go to disk when the buffer fills, from housekeeping, and at
+ * shutdown. A write error turns capture off rather than disturbing clients.
+ * Capture files hold credentials as sent, so they are created 0600.
+ ******************************************************************************/
+
+#include "../include/capture.h"
+#include "../include/logger.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_BUF_SIZE (256 * 1024)
+#define US_PER_SEC (1000000)
+#define NS_PER_US (1000)
+#define BYTE_BITS (8)
+#define BYTE_MASK (0xFF)
+#define LEN_BYTES (3)
+
+static int      capture_fd = -1;                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static uint64_t capture_start;                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static uint8_t  capture_buf[CAPTURE_BUF_SIZE];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static size_t   capture_len;                     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static uint64_t now_us(void);
+static int      write_all(const void *buf, size_t len);
+
+int capture_open(const char *path)
+{
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(capture_fd < 0)
+    {
+        LOG_ERROR("Failed to open capture file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    capture_start = now_us();
+    memcpy(capture_buf, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    capture_len = CAPTURE_MAGIC_LEN;
+    LOG_INFO("Capturing client traffic to %s", path);
+    return 0;
+}
+
+void capture_event(uint32_t conn, uint8_t kind, const void *data, size_t len)
+{
+    uint8_t *ptr;
+    uint64_t ts;
+    uint32_t net32;
+
+    if(capture_fd < 0)
+    {
+        return;
+    }
+    if(len > CAPTURE_LEN_MAX)
+    {
+        len = CAPTURE_LEN_MAX;
+    }
+    if(capture_len + CAPTURE_RECORD_HEADER + len > sizeof(capture_buf))
+    {
+        capture_flush();
+        if(capture_fd < 0)
+        {
+            return;
+        }
+    }
+
+    ts    = now_us() - capture_start;
+    ptr   = capture_buf + capture_len;
+    net32 = htonl((uint32_t)(ts >> (sizeof(uint32_t) * BYTE_BITS)));
+    memcpy(ptr, &net32, sizeof(net32));
+    net32 = htonl((uint32_t)ts);
+    memcpy(ptr + sizeof(net32), &net32, sizeof(net32));
+    ptr += sizeof(ts);
+    net32 = htonl(conn);
+    memcpy(ptr, &net32, sizeof(net32));
+    ptr += sizeof(net32);
+    *ptr++ = kind;
+    for(int shift = (LEN_BYTES - 1) * BYTE_BITS; shift >= 0; shift -= BYTE_BITS)
+    {
+        *ptr++ = (uint8_t)((len >> shift) & BYTE_MASK);
+    }
+    capture_len += CAPTURE_RECORD_HEADER;
+
+    // Frames never exceed the buffer, but write an oversized one straight through rather than lose it.
+    if(capture_len + len > sizeof(capture_buf))
+    {
+        capture_flush();
+        if(capture_fd >= 0 && write_all(data, len) < 0)
+        {
+            capture_close();
+        }
+        return;
+    }
+    if(len > 0)
+    {
+        memcpy(capture_buf + capture_len, data, len);
+        capture_len += len;
+    }
+}
+
+void capture_flush(void)
+{
+    if(capture_fd < 0 || capture_len == 0)
+    {
+        return;
+    }
+    if(write_all(capture_buf, capture_len) < 0)
+    {
+        LOG_ERROR("Capture write failed, capture stopped: %s", strerror(errno));
+        close(capture_fd);
+        capture_fd = -1;
+    }
+    capture_len = 0;
+}
+
+void capture_close(void)
+{
+    if(capture_fd < 0)
+    {
+        return;
+    }
+    capture_flush();
+    if(capture_fd >= 0)
+    {
+        close(capture_fd);
+        capture_fd = -1;
+    }
+}
+
+size_t capture_decode(const uint8_t *buf, size_t len, capture_record_t *rec)
+{
+    uint32_t high;
+    uint32_t low;
+    uint32_t conn;
+
+    if(len < CAPTURE_RECORD_HEADER)
+    {
+        return 0;
+    }
+    memcpy(&high, buf, sizeof(high));
+    memcpy(&low, buf + sizeof(high), sizeof(low));
+    memcpy(&conn, buf + sizeof(uint64_t), sizeof(conn));
+    rec->ts_us = ((uint64_t)ntohl(high) << (sizeof(uint32_t) * BYTE_BITS)) | ntohl(low);
+    rec->conn  = ntohl(conn);
+    rec->kind  = buf[sizeof(uint64_t) + sizeof(uint32_t)];
+    rec->len   = 0;
+    for(size_t i = CAPTURE_RECORD_HEADER - LEN_BYTES; i < CAPTURE_RECORD_HEADER; i++)
+    {
+        rec->len = (rec->len << BYTE_BITS) | buf[i];
+    }
+    if(len - CAPTURE_RECORD_HEADER < rec->len)
+    {
+        return 0;
+    }
+    rec->data = buf + CAPTURE_RECORD_HEADER;
+    return CAPTURE_RECORD_HEADER + rec->len;
+}
+
+static int write_all(const void *buf, size_t len)
+{
+    const uint8_t *ptr = (const uint8_t *)buf;
+
+    while(len > 0)
+    {
+        ssize_t nwritten = write(capture_fd, ptr, len);
+
+        if(nwritten < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        ptr += nwritten;
+        len -= (size_t)nwritten;
+    }
+    return 0;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * US_PER_SEC) + ((uint64_t)ts.tv_nsec / NS_PER_US);
+}
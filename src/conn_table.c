@@ -0,0 +1,156 @@
+/*******************************************************************************
+ * Connection table
+ *
+ * Slots are handed out from a min-heap of freed slots, then from the slots
+ * never used. Taking the lowest free slot means the table only spreads as
+ * far as the most connections open at once, and high sinks back as the
+ * connections at the top close.
+ ******************************************************************************/
+
+#include "../include/conn_table.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void     heap_push(conn_table_t *table, uint32_t slot);
+static uint32_t heap_pop(conn_table_t *table);
+
+int conn_table_init(conn_table_t *table, uint32_t base, uint32_t clients)
+{
+    memset(table, 0, sizeof(*table));
+    table->base    = base;
+    table->cap     = base + clients;
+    table->touched = base;
+    table->high    = base;
+    // calloc() leaves large arrays to the kernel's zero pages until a slot is written.
+    table->pfd       = (struct pollfd *)calloc(table->cap, sizeof(struct pollfd));
+    table->user_id   = (int *)calloc(table->cap, sizeof(int));
+    table->gen       = (uint32_t *)calloc(table->cap, sizeof(uint32_t));
+    table->state     = (client_state_t *)calloc(table->cap, sizeof(client_state_t));
+    table->free_heap = (uint32_t *)malloc((clients > 0 ? clients : 1) * sizeof(uint32_t));
+    if(table->pfd == NULL || table->user_id == NULL || table->gen == NULL || table->state == NULL || table->free_heap == NULL)
+    {
+        conn_table_destroy(table);
+        return -1;
+    }
+    for(uint32_t i = 0; i < base; i++)
+    {
+        table->pfd[i].fd = -1;
+    }
+    return 0;
+}
+
+void conn_table_destroy(conn_table_t *table)
+{
+    free(table->pfd);
+    free(table->user_id);
+    free(table->gen);
+    free(table->state);
+    free(table->free_heap);
+    memset(table, 0, sizeof(*table));
+}
+
+int conn_table_claim(conn_table_t *table, int fd, int *fresh)
+{
+    uint32_t slot;
+
+    *fresh = 0;
+    if(table->free_count > 0)
+    {
+        slot = heap_pop(table);
+    }
+    else if(table->touched < table->cap)
+    {
+        slot   = table->touched++;
+        *fresh = 1;
+        table->state[slot].pfd       = &table->pfd[slot];
+        table->state[slot].client_id = &table->user_id[slot];
+    }
+    else
+    {
+        return -1;
+    }
+    table->pfd[slot].fd      = fd;
+    table->pfd[slot].events  = 0;
+    table->pfd[slot].revents = 0;
+    table->user_id[slot]     = CONN_NO_USER;
+    table->count++;
+    if(slot >= table->high)
+    {
+        table->high = slot + 1;
+    }
+    return (int)slot;
+}
+
+void conn_table_release(conn_table_t *table, uint32_t slot)
+{
+    table->pfd[slot].fd      = -1;
+    table->pfd[slot].events  = 0;
+    table->pfd[slot].revents = 0;
+    table->user_id[slot]     = CONN_NO_USER;
+    table->gen[slot]++;
+    table->count--;
+    heap_push(table, slot);
+    while(table->high > table->base && table->pfd[table->high - 1].fd == -1)
+    {
+        table->high--;
+    }
+}
+
+conn_handle_t conn_table_handle(const conn_table_t *table, uint32_t slot)
+{
+    return ((conn_handle_t)slot << CONN_GEN_SHIFT) | table->gen[slot];
+}
+
+int conn_table_lookup(const conn_table_t *table, conn_handle_t handle)
+{
+    uint64_t slot = handle >> CONN_GEN_SHIFT;
+
+    if(slot < table->base || slot >= table->high || table->pfd[slot].fd == -1 || table->gen[slot] != (uint32_t)handle)
+    {
+        return -1;
+    }
+    return (int)slot;
+}
+
+static void heap_push(conn_table_t *table, uint32_t slot)
+{
+    uint32_t *heap = table->free_heap;
+    uint32_t  i    = table->free_count++;
+
+    while(i > 0 && heap[(i - 1) / 2] > slot)
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i       = (i - 1) / 2;
+    }
+    heap[i] = slot;
+}
+
+static uint32_t heap_pop(conn_table_t *table)
+{
+    uint32_t *heap = table->free_heap;
+    uint32_t  top  = heap[0];
+    uint32_t  last = heap[--table->free_count];
+    uint32_t  i    = 0;
+
+    for(;;)
+    {
+        uint32_t child = (2 * i) + 1;
+
+        if(child >= table->free_count)
+        {
+            break;
+        }
+        if(child + 1 < table->free_count && heap[child + 1] < heap[child])
+        {
+            child++;
+        }
+        if(heap[child] >= last)
+        {
+            break;
+        }
+        heap[i] = heap[child];
+        i       = child;
+    }
+    heap[i] = last;
+    return top;
+}
@@ -0,0 +1,147 @@
+/*******************************************************************************
+ * Coroutines
+ *
+ * Built on ucontext: each coroutine has its own mmap'd stack with an
+ * unmapped guard page below it, so an overflow faults instead of writing
+ * over the heap. Returning from the coroutine function switches back to
+ * whoever resumed it last through uc_link. Stacks are expensive to map, so
+ * finished coroutines go to a small per-thread pool.
+ ******************************************************************************/
+
+#include "../include/coro.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#ifndef MAP_STACK
+    #define MAP_STACK (0)
+#endif
+
+struct coro
+{
+    ucontext_t ctx;       // Where the coroutine continues
+    ucontext_t caller;    // Where coro_resume() continues
+    coro_fn_t  fn;        // cppcheck-suppress unusedStructMember
+    void      *arg;       // cppcheck-suppress unusedStructMember
+    int        done;      // cppcheck-suppress unusedStructMember
+    uint8_t   *map;       // Guard page followed by the stack
+    size_t     map_len;   // cppcheck-suppress unusedStructMember
+    coro_t    *next;      // Pool link
+};
+
+static _Thread_local coro_t *current;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static _Thread_local coro_t *pool;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static _Thread_local size_t  pool_len;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static coro_t *coro_alloc(void);
+static void    trampoline(void);
+
+coro_t *coro_create(coro_fn_t fn, void *arg)
+{
+    coro_t *volatile co = coro_alloc();    // getcontext() returns twice as far as the compiler knows
+    size_t           page;
+
+    if(co == NULL)
+    {
+        return NULL;
+    }
+    if(getcontext(&co->ctx) < 0)
+    {
+        coro_destroy(co);
+        return NULL;
+    }
+    page                     = (size_t)sysconf(_SC_PAGESIZE);
+    co->fn                   = fn;
+    co->arg                  = arg;
+    co->done                 = 0;
+    co->ctx.uc_stack.ss_sp   = co->map + page;
+    co->ctx.uc_stack.ss_size = co->map_len - page;
+    co->ctx.uc_link          = &co->caller;
+    makecontext(&co->ctx, trampoline, 0);
+    return co;
+}
+
+int coro_resume(coro_t *co)
+{
+    coro_t *prev = current;
+
+    current = co;
+    swapcontext(&co->caller, &co->ctx);
+    current = prev;
+    return co->done;
+}
+
+void coro_yield(void)
+{
+    coro_t *co = current;
+
+    swapcontext(&co->ctx, &co->caller);
+}
+
+coro_t *coro_current(void)
+{
+    return current;
+}
+
+void *coro_arg(const coro_t *co)
+{
+    return co->arg;
+}
+
+void coro_destroy(coro_t *co)
+{
+    if(pool_len < CORO_POOL_MAX)
+    {
+        co->next = pool;
+        pool     = co;
+        pool_len++;
+        return;
+    }
+    munmap(co->map, co->map_len);
+    free(co);
+}
+
+/* A pooled coroutine, or a new one with a fresh stack */
+static coro_t *coro_alloc(void)
+{
+    coro_t *co = pool;
+    size_t  page;
+
+    if(co != NULL)
+    {
+        pool = co->next;
+        pool_len--;
+        return co;
+    }
+    co = (coro_t *)calloc(1, sizeof(coro_t));
+    if(co == NULL)
+    {
+        return NULL;
+    }
+    page        = (size_t)sysconf(_SC_PAGESIZE);
+    co->map_len = page + CORO_STACK_SIZE;
+    co->map     = (uint8_t *)mmap(NULL, co->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if(co->map == MAP_FAILED)
+    {
+        free(co);
+        return NULL;
+    }
+    if(mprotect(co->map, page, PROT_NONE) < 0)
+    {
+        munmap(co->map, co->map_len);
+        free(co);
+        return NULL;
+    }
+    return co;
+}
+
+/* First frame on every coroutine stack; returning resumes uc_link, the last caller of coro_resume(). */
+static void trampoline(void)
+{
+    coro_t *co = current;
+
+    co->fn(co->arg);
+    co->done = 1;
+}
@@ -0,0 +1,429 @@
+/*******************************************************************************
+ * Work-stealing executor
+ *
+ * What gets scheduled is strands, not tasks: a strand is on some worker's
+ * deque, or being run, exactly while it has tasks pending, so a connection's
+ * requests never run on two workers at once. A worker takes strands from the
+ * front of its own deque, runs one task and puts the strand back at the end
+ * if more are waiting, which round-robins the connections it holds. A worker
+ * whose deque is empty steals from the end of someone else's, so one worker
+ * stuck with several busy connections is relieved by the idle ones. The
+ * deques link the strands themselves, so scheduling never allocates.
+ *
+ * Idle workers sleep on a condition variable. They count themselves idle
+ * before their last look at the deques, and producers check the count after
+ * pushing, so a wakeup is only paid for when someone is asleep and cannot be
+ * missed.
+ ******************************************************************************/
+
+#include "../include/executor.h"
+#include "../include/logger.h"
+#include "../include/wakeup.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define EXEC_CACHE_LINE (64)
+
+typedef struct
+{
+    _Alignas(EXEC_CACHE_LINE) pthread_mutex_t lock;    // Guards the deque
+    exec_strand_t *first;                              // cppcheck-suppress unusedStructMember
+    exec_strand_t *last;                               // cppcheck-suppress unusedStructMember
+    atomic_size_t  count;                              // Read without the lock to skip empty deques
+    size_t         victim;                             // Where this worker's next steal starts
+    pthread_t      thread;                             // cppcheck-suppress unusedStructMember
+} exec_worker_t;
+
+static exec_worker_t              *workers;                                        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static size_t                      worker_count;                                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static size_t                      next_home;                                      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int                         running;                                        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_bool                 stopping;                                       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_size_t               idle_count;                                     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static pthread_mutex_t             idle_lock  = PTHREAD_MUTEX_INITIALIZER;         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static pthread_cond_t              idle_cond  = PTHREAD_COND_INITIALIZER;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static pthread_mutex_t             inbox_lock = PTHREAD_MUTEX_INITIALIZER;         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static exec_task_t                *inbox_head;                                     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static exec_task_t                *inbox_tail;                                     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int                         inbox_wake[2] = {-1, -1};                       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static _Thread_local exec_worker_t *worker_self;                                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static void          *worker_loop(void *arg);
+static void           strand_run(exec_strand_t *strand, exec_worker_t *self);
+static exec_strand_t *steal(exec_worker_t *self);
+static void           idle_wait(void);
+static void           idle_wake(void);
+static int            work_visible(void);
+static void           deque_push(exec_worker_t *worker, exec_strand_t *strand);
+static exec_strand_t *deque_pop_first(exec_worker_t *worker);
+static exec_strand_t *deque_pop_last(exec_worker_t *worker);
+
+int executor_start(size_t threads)
+{
+    size_t started;
+
+    if(threads == 0 || threads > EXECUTOR_THREADS_MAX)
+    {
+        return -1;
+    }
+    workers = (exec_worker_t *)calloc(threads, sizeof(exec_worker_t));
+    if(workers == NULL)
+    {
+        return -1;
+    }
+    worker_count = threads;
+    next_home    = 0;
+    atomic_store(&stopping, false);
+    atomic_store(&idle_count, 0);
+    if(wakeup_open(inbox_wake) < 0)
+    {
+        goto fail;
+    }
+    for(size_t i = 0; i < worker_count; i++)
+    {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        atomic_init(&workers[i].count, 0);
+        workers[i].victim = (i + 1) % worker_count;
+    }
+    for(started = 0; started < worker_count; started++)
+    {
+        if(pthread_create(&workers[started].thread, NULL, worker_loop, &workers[started]) != 0)
+        {
+            break;
+        }
+    }
+    if(started < worker_count)
+    {
+        atomic_store(&stopping, true);
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+        for(size_t i = 0; i < started; i++)
+        {
+            pthread_join(workers[i].thread, NULL);
+        }
+        goto fail;
+    }
+    running = 1;
+    LOG_INFO("Request handlers run on %zu worker thread(s)", worker_count);
+    return 0;
+
+fail:
+    LOG_ERROR("executor: %s", strerror(errno));
+    wakeup_close(inbox_wake);
+    free(workers);
+    workers      = NULL;
+    worker_count = 0;
+    return -1;
+}
+
+void executor_stop(void)
+{
+    if(!running)
+    {
+        return;
+    }
+    atomic_store(&stopping, true);
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+    for(size_t i = 0; i < worker_count; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+    running = 0;
+
+    executor_loop_run();
+    wakeup_close(inbox_wake);
+    free(workers);
+    workers      = NULL;
+    worker_count = 0;
+}
+
+int executor_active(void)
+{
+    return running;
+}
+
+int executor_on_worker(void)
+{
+    return worker_self != NULL;
+}
+
+void executor_strand_init(exec_strand_t *strand)
+{
+    pthread_mutex_init(&strand->lock, NULL);
+    strand->head = NULL;
+    strand->tail = NULL;
+    atomic_init(&strand->pending, 0);
+    strand->home = worker_count > 0 ? next_home++ % worker_count : 0;
+    strand->prev = NULL;
+    strand->next = NULL;
+}
+
+void executor_strand_destroy(exec_strand_t *strand)
+{
+    pthread_mutex_destroy(&strand->lock);
+}
+
+void executor_submit(exec_strand_t *strand, exec_task_t *task)
+{
+    task->next = NULL;
+    pthread_mutex_lock(&strand->lock);
+    if(strand->tail != NULL)
+    {
+        strand->tail->next = task;
+    }
+    else
+    {
+        strand->head = task;
+    }
+    strand->tail = task;
+    pthread_mutex_unlock(&strand->lock);
+
+    // The first pending task makes the strand runnable; later ones ride along with it.
+    if(atomic_fetch_add(&strand->pending, 1) == 0)
+    {
+        deque_push(&workers[strand->home], strand);
+        idle_wake();
+    }
+}
+
+int executor_loop_fd(void)
+{
+    return inbox_wake[0];
+}
+
+void executor_post(exec_task_t *task)
+{
+    bool was_empty;
+
+    task->next = NULL;
+    pthread_mutex_lock(&inbox_lock);
+    was_empty = inbox_head == NULL;
+    if(inbox_tail != NULL)
+    {
+        inbox_tail->next = task;
+    }
+    else
+    {
+        inbox_head = task;
+    }
+    inbox_tail = task;
+    pthread_mutex_unlock(&inbox_lock);
+
+    // The loop takes the whole list at once, so only the first post since then needs to wake it.
+    if(was_empty)
+    {
+        wakeup_signal(inbox_wake, "executor");
+    }
+}
+
+void executor_loop_run(void)
+{
+    exec_task_t *task;
+
+    wakeup_clear(inbox_wake);
+    pthread_mutex_lock(&inbox_lock);
+    task       = inbox_head;
+    inbox_head = NULL;
+    inbox_tail = NULL;
+    pthread_mutex_unlock(&inbox_lock);
+
+    while(task != NULL)
+    {
+        exec_task_t *next = task->next;
+
+        task->run(task);
+        task = next;
+    }
+}
+
+static void *worker_loop(void *arg)
+{
+    exec_worker_t *self = (exec_worker_t *)arg;
+
+    worker_self = self;
+    for(;;)
+    {
+        exec_strand_t *strand = deque_pop_first(self);
+
+        if(strand == NULL)
+        {
+            strand = steal(self);
+        }
+        if(strand != NULL)
+        {
+            strand_run(strand, self);
+            continue;
+        }
+        // Every deque looked empty. Strands still running are requeued by the worker running them.
+        if(atomic_load(&stopping))
+        {
+            break;
+        }
+        idle_wait();
+    }
+    return NULL;
+}
+
+/* Runs the strand's oldest task, then puts the strand back on this worker if more are pending. */
+static void strand_run(exec_strand_t *strand, exec_worker_t *self)
+{
+    exec_task_t *task;
+
+    pthread_mutex_lock(&strand->lock);
+    task         = strand->head;
+    strand->head = task->next;
+    if(strand->head == NULL)
+    {
+        strand->tail = NULL;
+    }
+    pthread_mutex_unlock(&strand->lock);
+
+    task->run(task);
+
+    if(atomic_fetch_sub(&strand->pending, 1) > 1)
+    {
+        deque_push(self, strand);
+        // This worker can only run one strand at a time; anyone idle may take the rest.
+        if(atomic_load(&self->count) > 1)
+        {
+            idle_wake();
+        }
+    }
+}
+
+/* Takes the newest strand from the first other worker that has any. */
+static exec_strand_t *steal(exec_worker_t *self)
+{
+    for(size_t n = 1; n < worker_count; n++)
+    {
+        exec_worker_t *victim = &workers[self->victim];
+        exec_strand_t *strand = NULL;
+
+        self->victim = (self->victim + 1) % worker_count;
+        if(victim == self)
+        {
+            victim       = &workers[self->victim];
+            self->victim = (self->victim + 1) % worker_count;
+        }
+        if(atomic_load(&victim->count) > 0)
+        {
+            strand = deque_pop_last(victim);
+        }
+        if(strand != NULL)
+        {
+            return strand;
+        }
+    }
+    return NULL;
+}
+
+static void idle_wait(void)
+{
+    pthread_mutex_lock(&idle_lock);
+    atomic_fetch_add(&idle_count, 1);
+    if(!work_visible() && !atomic_load(&stopping))
+    {
+        pthread_cond_wait(&idle_cond, &idle_lock);
+    }
+    atomic_fetch_sub(&idle_count, 1);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+/* Called after a push: a sleeper either saw the push or counted itself idle before we looked. */
+static void idle_wake(void)
+{
+    if(atomic_load(&idle_count) > 0)
+    {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static int work_visible(void)
+{
+    for(size_t i = 0; i < worker_count; i++)
+    {
+        if(atomic_load(&workers[i].count) > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void deque_push(exec_worker_t *worker, exec_strand_t *strand)
+{
+    pthread_mutex_lock(&worker->lock);
+    strand->prev = worker->last;
+    strand->next = NULL;
+    if(worker->last != NULL)
+    {
+        worker->last->next = strand;
+    }
+    else
+    {
+        worker->first = strand;
+    }
+    worker->last = strand;
+    atomic_fetch_add(&worker->count, 1);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static exec_strand_t *deque_pop_first(exec_worker_t *worker)
+{
+    exec_strand_t *strand;
+
+    if(atomic_load(&worker->count) == 0)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&worker->lock);
+    strand = worker->first;
+    if(strand != NULL)
+    {
+        worker->first = strand->next;
+        if(worker->first != NULL)
+        {
+            worker->first->prev = NULL;
+        }
+        else
+        {
+            worker->last = NULL;
+        }
+        atomic_fetch_sub(&worker->count, 1);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return strand;
+}
+
+static exec_strand_t *deque_pop_last(exec_worker_t *worker)
+{
+    exec_strand_t *strand;
+
+    pthread_mutex_lock(&worker->lock);
+    strand = worker->last;
+    if(strand != NULL)
+    {
+        worker->last = strand->prev;
+        if(worker->last != NULL)
+        {
+            worker->last->next = NULL;
+        }
+        else
+        {
+            worker->first = NULL;
+        }
+        atomic_fetch_sub(&worker->count, 1);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return strand;
+}
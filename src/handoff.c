@@ -0,0 +1,409 @@
+/*******************************************************************************
+ * Listening-socket handoff
+ *
+ * Moves the listener and live client sockets from a running server to its
+ * replacement, so a deploy costs clients a pause instead of a reconnect and
+ * a fresh login. SOCK_SEQPACKET keeps one descriptor per message, so the
+ * receiver never has to split ancillary data out of a byte stream. The
+ * sender keeps its clients until the receiver acknowledges the lot, so a
+ * handoff that fails part way leaves them where they were. The receiver
+ * then holds off until the old server has closed the connection, which it
+ * does only on exit, after its databases are closed.
+ ******************************************************************************/
+
+#include "../include/handoff.h"
+#include "../include/logger.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define HANDOFF_BACKLOG (1)
+#define MS_PER_SEC (1000)
+#define US_PER_MS (1000)
+#define OFF_KIND (1)
+#define OFF_CLIENT_ID (2)
+#define OFF_RX_LEN (6)
+
+static int     set_address(struct sockaddr_un *addr, const char *path);
+static void    set_timeouts(int fd);
+static int     send_client(int conn_fd, const handoff_client_t *client);
+static int     send_one(int conn_fd, uint8_t kind, int fd, int client_id, uint32_t rx_len, uint8_t *data, size_t len);
+static ssize_t recv_one(int conn_fd, uint8_t *buf, size_t cap, int *fd);
+static int     recv_ack(int conn_fd);
+
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int                fd;
+
+    if(set_address(&addr, path) < 0)
+    {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        LOG_ERROR("handoff socket: %s", strerror(errno));
+        return -1;
+    }
+    // Only reached once any previous server is gone, so whatever is at path is stale.
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, HANDOFF_BACKLOG) < 0)
+    {
+        LOG_ERROR("handoff listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    LOG_INFO("Accepting hot upgrades on %s", path);
+    return fd;
+}
+
+int handoff_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int                fd;
+
+    if(set_address(&addr, path) < 0)
+    {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        // ENOENT or ECONNREFUSED: nobody to take over from.
+        close(fd);
+        return -1;
+    }
+    set_timeouts(fd);
+    return fd;
+}
+
+int handoff_send(int conn_fd, int listen_fd, const handoff_client_t *clients, size_t count)
+{
+    set_timeouts(conn_fd);
+    if(send_one(conn_fd, HANDOFF_LISTENER, listen_fd, -1, 0, NULL, 0) < 0)
+    {
+        return -1;
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        if(send_client(conn_fd, &clients[i]) < 0)
+        {
+            return -1;
+        }
+    }
+    if(send_one(conn_fd, HANDOFF_END, -1, -1, 0, NULL, 0) < 0)
+    {
+        return -1;
+    }
+    return recv_ack(conn_fd);
+}
+
+int handoff_receive(int conn_fd, handoff_t *handoff)
+{
+    uint8_t *buf       = (uint8_t *)malloc(HANDOFF_HEADER + HANDOFF_RX_MAX);
+    int      listen_fd = -1;
+    size_t   filled    = 0;    // Bytes of the last client's buffer received so far
+
+    if(buf == NULL)
+    {
+        return -1;
+    }
+
+    for(;;)
+    {
+        int              fd = -1;
+        ssize_t          len;
+        uint32_t         net32;
+        size_t           chunk;
+        handoff_client_t client;
+        void            *grown;
+
+        len = recv_one(conn_fd, buf, HANDOFF_HEADER + HANDOFF_RX_MAX, &fd);
+        if(len < HANDOFF_HEADER || buf[0] != HANDOFF_VERSION)
+        {
+            if(fd >= 0)
+            {
+                close(fd);
+            }
+            LOG_ERROR("handoff: malformed message from the old server");
+            goto fail;
+        }
+        memcpy(&net32, buf + OFF_RX_LEN, sizeof(net32));
+        chunk = (size_t)len - HANDOFF_HEADER;
+        if(handoff->count > 0 && filled < handoff->clients[handoff->count - 1].rx_len)
+        {
+            handoff_client_t *last = &handoff->clients[handoff->count - 1];
+
+            // Only the rest of the last client's buffer may come before anything else.
+            if(buf[OFF_KIND] != HANDOFF_DATA || fd >= 0 || chunk != ntohl(net32) || chunk > last->rx_len - filled)
+            {
+                if(fd >= 0)
+                {
+                    close(fd);
+                }
+                LOG_ERROR("handoff: client buffer cut short");
+                goto fail;
+            }
+            memcpy(last->rx + filled, buf + HANDOFF_HEADER, chunk);
+            filled += chunk;
+            continue;
+        }
+        if(buf[OFF_KIND] == HANDOFF_END)
+        {
+            break;
+        }
+        if(fd < 0)
+        {
+            LOG_ERROR("handoff: message without a socket");
+            goto fail;
+        }
+        if(buf[OFF_KIND] == HANDOFF_LISTENER)
+        {
+            listen_fd = fd;
+            continue;
+        }
+
+        client.rx_len = ntohl(net32);
+        memcpy(&net32, buf + OFF_CLIENT_ID, sizeof(net32));
+        client.client_id = (int)(int32_t)ntohl(net32);
+        client.fd        = fd;
+        client.rx        = NULL;
+        if(buf[OFF_KIND] != HANDOFF_CLIENT || chunk != (client.rx_len < HANDOFF_RX_MAX ? client.rx_len : HANDOFF_RX_MAX))
+        {
+            close(fd);
+            LOG_ERROR("handoff: client record length mismatch");
+            goto fail;
+        }
+        if(client.rx_len > 0)
+        {
+            client.rx = (uint8_t *)malloc(client.rx_len);
+            if(client.rx == NULL)
+            {
+                close(fd);
+                goto fail;
+            }
+            memcpy(client.rx, buf + HANDOFF_HEADER, chunk);
+        }
+        filled = chunk;
+        grown = realloc(handoff->clients, (handoff->count + 1) * sizeof(*handoff->clients));
+        if(grown == NULL)
+        {
+            free(client.rx);
+            close(fd);
+            goto fail;
+        }
+        handoff->clients                   = (handoff_client_t *)grown;
+        handoff->clients[handoff->count++] = client;
+    }
+
+    if(listen_fd < 0)
+    {
+        LOG_ERROR("handoff: the old server sent no listener");
+        goto fail;
+    }
+    // From here the old server lets go of the clients. EOF means it has exited and let go of its databases.
+    if(send_one(conn_fd, HANDOFF_ACK, -1, -1, 0, NULL, 0) < 0)
+    {
+        goto fail;
+    }
+    if(recv(conn_fd, buf, 1, 0) != 0)
+    {
+        LOG_WARN("handoff: old server has not exited, continuing anyway");
+    }
+    free(buf);
+    LOG_INFO("Took over the listener and %zu client(s)", handoff->count);
+    return listen_fd;
+
+fail:
+    free(buf);
+    if(listen_fd >= 0)
+    {
+        close(listen_fd);
+    }
+    for(size_t i = 0; i < handoff->count; i++)
+    {
+        close(handoff->clients[i].fd);
+    }
+    handoff_release(handoff);
+    return -1;
+}
+
+void handoff_release(handoff_t *handoff)
+{
+    for(size_t i = 0; i < handoff->count; i++)
+    {
+        free(handoff->clients[i].rx);
+    }
+    free(handoff->clients);
+    handoff->clients = NULL;
+    handoff->count   = 0;
+}
+
+static int set_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path))
+    {
+        LOG_ERROR("handoff path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);    // NOLINT(clang-analyzer-security.insecureAPI.strcpy)
+    return 0;
+}
+
+/* Neither side may hang the other for longer than HANDOFF_TIMEOUT. */
+static void set_timeouts(int fd)
+{
+    struct timeval tv;
+
+    tv.tv_sec  = HANDOFF_TIMEOUT / MS_PER_SEC;
+    tv.tv_usec = (HANDOFF_TIMEOUT % MS_PER_SEC) * US_PER_MS;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* Sends a client's socket with as much of its buffer as one message holds, then the rest in HANDOFF_DATA messages. */
+static int send_client(int conn_fd, const handoff_client_t *client)
+{
+    size_t chunk = client->rx_len < HANDOFF_RX_MAX ? client->rx_len : HANDOFF_RX_MAX;
+
+    if(send_one(conn_fd, HANDOFF_CLIENT, client->fd, client->client_id, client->rx_len, client->rx, chunk) < 0)
+    {
+        return -1;
+    }
+    for(size_t off = chunk; off < client->rx_len; off += chunk)
+    {
+        chunk = client->rx_len - off < HANDOFF_RX_MAX ? client->rx_len - off : HANDOFF_RX_MAX;
+        if(send_one(conn_fd, HANDOFF_DATA, -1, -1, (uint32_t)chunk, client->rx + off, chunk) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Sends one message: the header, len bytes of data after it, and fd if it is not -1. */
+static int send_one(int conn_fd, uint8_t kind, int fd, int client_id, uint32_t rx_len, uint8_t *data, size_t len)
+{
+    uint8_t        header[HANDOFF_HEADER];
+    struct iovec   iov[2];
+    struct msghdr  msg;
+    uint32_t       net32;
+    union
+    {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    header[0]        = HANDOFF_VERSION;
+    header[OFF_KIND] = kind;
+    net32            = htonl((uint32_t)client_id);
+    memcpy(header + OFF_CLIENT_ID, &net32, sizeof(net32));
+    net32 = htonl(rx_len);
+    memcpy(header + OFF_RX_LEN, &net32, sizeof(net32));
+
+    iov[0].iov_base = header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = data;
+    iov[1].iov_len  = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = len > 0 ? 2 : 1;
+    if(fd >= 0)
+    {
+        struct cmsghdr *cmsg;
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg               = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level   = SOL_SOCKET;
+        cmsg->cmsg_type    = SCM_RIGHTS;
+        cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if(sendmsg(conn_fd, &msg, MSG_NOSIGNAL) < 0)
+    {
+        LOG_ERROR("handoff send: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Receives one message into buf and the descriptor riding on it, if any, into *fd. */
+static ssize_t recv_one(int conn_fd, uint8_t *buf, size_t cap, int *fd)
+{
+    struct iovec   iov;
+    struct msghdr  msg;
+    ssize_t        len;
+    struct cmsghdr *cmsg;
+    union
+    {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    iov.iov_base = buf;
+    iov.iov_len  = cap;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    len = recvmsg(conn_fd, &msg, MSG_CMSG_CLOEXEC);
+    if(len < 0)
+    {
+        LOG_ERROR("handoff receive: %s", strerror(errno));
+        return -1;
+    }
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+    {
+        if(*fd >= 0)
+        {
+            close(*fd);
+            *fd = -1;
+        }
+        return -1;
+    }
+    return len;
+}
+
+/* Waits for the successor to confirm it has every client. Returns 0 once it has. */
+static int recv_ack(int conn_fd)
+{
+    uint8_t buf[HANDOFF_HEADER];
+    int     fd  = -1;
+    ssize_t len = recv_one(conn_fd, buf, sizeof(buf), &fd);
+
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+    if(len < HANDOFF_HEADER || buf[0] != HANDOFF_VERSION || buf[OFF_KIND] != HANDOFF_ACK)
+    {
+        LOG_ERROR("handoff: the successor did not take the clients");
+        return -1;
+    }
+    return 0;
+}
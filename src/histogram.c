@@ -0,0 +1,119 @@
+/*******************************************************************************
+ * Log-linear latency histograms
+ *
+ * Values below 2 * HIST_SUB_BUCKETS get one bucket each; above that every
+ * power of two is divided into HIST_SUB_BUCKETS equal buckets. Recording is a
+ * couple of relaxed atomic adds, so recorders never block readers or each
+ * other.
+ ******************************************************************************/
+
+#include "../include/histogram.h"
+
+#define HIST_LINEAR_LIMIT (2 * HIST_SUB_BUCKETS)
+#define PERCENT (100.0)
+
+static int      bucket_index(uint64_t value);
+static uint64_t bucket_highest(int index);
+
+void hist_record(histogram_t *hist, uint64_t value)
+{
+    uint_fast64_t max;
+
+    atomic_fetch_add_explicit(&hist->counts[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+    // Another thread may be raising max at the same time; retry until ours is stored or no longer the largest.
+    max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    while(value > max && !atomic_compare_exchange_weak_explicit(&hist->max, &max, value, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+void hist_accumulate(hist_snapshot_t *snap, const histogram_t *hist)
+{
+    uint64_t max;
+    int      i;
+
+    for(i = 0; i < HIST_BUCKETS; i++)
+    {
+        snap->counts[i] += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+    }
+    snap->total += atomic_load_explicit(&hist->total, memory_order_relaxed);
+    snap->sum += atomic_load_explicit(&hist->sum, memory_order_relaxed);
+    max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    if(max > snap->max)
+    {
+        snap->max = max;
+    }
+}
+
+void hist_subtract(hist_snapshot_t *snap, const hist_snapshot_t *base)
+{
+    int i;
+
+    for(i = 0; i < HIST_BUCKETS; i++)
+    {
+        snap->counts[i] -= base->counts[i];
+    }
+    snap->total -= base->total;
+    snap->sum -= base->sum;
+}
+
+uint64_t hist_percentile(const hist_snapshot_t *snap, double percentile)
+{
+    uint64_t target;
+    uint64_t seen = 0;
+    int      i;
+
+    if(snap->total == 0)
+    {
+        return 0;
+    }
+
+    target = (uint64_t)((percentile / PERCENT) * (double)snap->total);
+    if(target == 0)
+    {
+        target = 1;
+    }
+    for(i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += snap->counts[i];
+        if(seen >= target)
+        {
+            uint64_t value = bucket_highest(i);
+            return value < snap->max ? value : snap->max;
+        }
+    }
+    return snap->max;
+}
+
+static int bucket_index(uint64_t value)
+{
+    int msb;
+    int shift;
+    int index;
+
+    if(value < HIST_LINEAR_LIMIT)
+    {
+        return (int)value;
+    }
+    msb   = 63 - __builtin_clzll(value);    // NOLINT(readability-magic-numbers)
+    shift = msb - HIST_SUB_BITS;
+    index = (shift * HIST_SUB_BUCKETS) + (int)(value >> shift);
+    // Values from 2^63 up would land past the table; they share its last bucket.
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+static uint64_t bucket_highest(int index)
+{
+    int      shift;
+    uint64_t mantissa;
+
+    if(index < HIST_LINEAR_LIMIT)
+    {
+        return (uint64_t)index;
+    }
+    shift    = (index / HIST_SUB_BUCKETS) - 1;
+    mantissa = (uint64_t)(index - (shift * HIST_SUB_BUCKETS));
+    return ((mantissa + 1) << shift) - 1;
+}
@@ -0,0 +1,810 @@
+/*******************************************************************************
+ * Asynchronous logger
+ *
+ * Every producing thread owns a single-producer/single-consumer ring of
+ * fixed-size binary records. A producer only copies its format pointer and
+ * the raw argument values into its own ring slot; a background thread drains
+ * all rings, formats the records into lines and writes them in large batches,
+ * so the event loop neither formats text nor blocks on stdout. The writer
+ * sleeps on a wakeup while every ring is empty, and the first record that
+ * finds it asleep wakes it.
+ ******************************************************************************/
+
+#include "../include/logger.h"
+#include "../include/wakeup.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE (1024)    // Records per thread, must be a power of two
+#define LOG_TEXT_LEN (200)
+#define LOG_ARGS_LEN (200)    // Packed argument bytes per record; longer strings are cut short
+#define LOG_SPEC_LEN (64)     // One conversion rebuilt for snprintf()
+#define LOG_MAX_RINGS (64)
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_LINE_LEN (LOG_TEXT_LEN + 64)
+#define LOG_CACHE_LINE (64)
+#define NSEC_PER_USEC (1000)
+
+/* A record holds the caller's format string, which is a literal and outlives it, and the values its
+   conversions consumed, packed in order: the * width and precision as ints, integers widened to 64 bits,
+   floating point as double, pointers as they are and strings copied in with their terminator. */
+typedef struct
+{
+    struct timespec ts;                      // cppcheck-suppress unusedStructMember
+    const char     *fmt;                     // cppcheck-suppress unusedStructMember
+    int             level;                   // cppcheck-suppress unusedStructMember
+    uint16_t        args_len;                // cppcheck-suppress unusedStructMember
+    unsigned char   args[LOG_ARGS_LEN];      // cppcheck-suppress unusedStructMember
+} log_record_t;
+
+/* How a conversion's value is passed and packed */
+typedef enum
+{
+    ARG_NONE,        // %%
+    ARG_SIGNED,      // d i
+    ARG_UNSIGNED,    // u o x X
+    ARG_DOUBLE,      // f F e E g G a A
+    ARG_CHAR,        // c
+    ARG_STRING,      // s
+    ARG_POINTER,     // p
+    ARG_UNKNOWN      // Anything else; the record stops here
+} arg_kind_t;
+
+/* One conversion of a format string, as the producer and the writer both read it */
+typedef struct
+{
+    const char *start;         // Flags, width and precision as written, after the %
+    size_t      span;          // cppcheck-suppress unusedStructMember
+    int         width_star;    // cppcheck-suppress unusedStructMember
+    int         prec_star;     // cppcheck-suppress unusedStructMember
+    int         prec;          // Written precision, -1 if none or *
+    char        length[3];     // cppcheck-suppress unusedStructMember
+    char        conv;          // cppcheck-suppress unusedStructMember
+} log_spec_t;
+
+typedef struct
+{
+    _Alignas(LOG_CACHE_LINE) atomic_size_t head;    // Next slot the producer fills
+    _Alignas(LOG_CACHE_LINE) atomic_size_t tail;    // Next slot the writer drains
+    log_record_t records[LOG_RING_SIZE];            // cppcheck-suppress unusedStructMember
+} log_ring_t;
+
+atomic_int log_level = LOG_LEVEL_INFO;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static _Atomic(log_ring_t *) rings[LOG_MAX_RINGS];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_int            ring_count;              // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_bool           writer_running;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_bool           writer_stop;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_bool           writer_sleeping;         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int                   wake[2] = {-1, -1};      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static char                  batch[LOG_BATCH_SIZE];   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_ulong          dropped;                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static pthread_t             writer;                  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int                   log_fd = STDOUT_FILENO;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static _Thread_local log_ring_t *local_ring;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static const char *const level_names[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+static log_ring_t *ring_acquire(void);
+static void       *writer_loop(void *arg);
+static void        writer_wake(void);
+static size_t      drain_rings(size_t *used);
+static size_t      pack_args(unsigned char *dst, const char *fmt, va_list *ap);
+static int         format_record(char *text, size_t size, const log_record_t *rec);
+static const char *spec_parse(const char *p, log_spec_t *spec);
+static arg_kind_t  spec_kind(char conv);
+static size_t      spec_build(char *dst, const log_spec_t *spec, const int *stars, arg_kind_t kind);
+static size_t      format_line(char *dst, size_t size, const struct timespec *ts, int level, const char *text, int len);
+static void        write_all(const char *buf, size_t len);
+
+int log_init(log_level_t level, int fd)
+{
+    atomic_store(&log_level, (int)level);
+    log_fd = fd;
+    atomic_store(&writer_stop, false);
+    atomic_store(&writer_sleeping, false);
+
+    if(wakeup_open(wake) < 0)
+    {
+        perror("Failed to start log writer");
+        return -1;
+    }
+    if(pthread_create(&writer, NULL, writer_loop, NULL) != 0)
+    {
+        perror("Failed to start log writer");
+        wakeup_close(wake);
+        return -1;
+    }
+    atomic_store_explicit(&writer_running, true, memory_order_release);
+    return 0;
+}
+
+void log_shutdown(void)
+{
+    size_t used = 0;
+
+    if(!atomic_exchange(&writer_running, false))
+    {
+        return;
+    }
+    atomic_store(&writer_stop, true);
+    writer_wake();
+    pthread_join(writer, NULL);
+    wakeup_close(wake);
+
+    // A record that got in after the writer's last drain is still written. The rings stay registered, since
+    // other threads keep pointers to theirs; a later log_init() goes on with them.
+    while(drain_rings(&used) > 0)
+    {
+    }
+    write_all(batch, used);
+}
+
+int log_parse_level(const char *name)
+{
+    static const char *const names[] = {"debug", "info", "warn", "error", "off"};
+    int                      i;
+
+    for(i = 0; i <= LOG_LEVEL_OFF; i++)
+    {
+        if(strcmp(name, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void log_write(log_level_t level, const char *fmt, ...)
+{
+    va_list       args;
+    log_ring_t   *ring;
+    log_record_t *rec;
+    size_t        head;
+    int           len;
+
+    if(!atomic_load_explicit(&writer_running, memory_order_acquire))
+    {
+        /* No writer yet: fall back to a synchronous write of the formatted line */
+        char            text[LOG_TEXT_LEN];
+        char            line[LOG_LINE_LEN];
+        struct timespec ts;
+
+        va_start(args, fmt);
+        len = vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        write_all(line, format_line(line, sizeof(line), &ts, (int)level, text, len));
+        return;
+    }
+
+    ring = ring_acquire();
+    if(ring == NULL)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    rec        = &ring->records[head & (LOG_RING_SIZE - 1)];
+    rec->level = (int)level;
+    rec->fmt   = fmt;
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    va_start(args, fmt);
+    rec->args_len = (uint16_t)pack_args(rec->args, fmt, &args);
+    va_end(args);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    writer_wake();
+}
+
+unsigned long log_dropped(void)
+{
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+unsigned long log_backlog(void)
+{
+    unsigned long total = 0;
+    int           i;
+
+    for(i = 0; i < atomic_load(&ring_count); i++)
+    {
+        const log_ring_t *ring = atomic_load(&rings[i]);
+        if(ring != NULL)
+        {
+            total += atomic_load_explicit(&ring->head, memory_order_relaxed) - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+    return total;
+}
+
+/* Returns the calling thread's ring, registering a new one on first use. */
+static log_ring_t *ring_acquire(void)
+{
+    log_ring_t *ring;
+    int         slot;
+
+    if(local_ring != NULL)
+    {
+        return local_ring;
+    }
+
+    slot = atomic_fetch_add(&ring_count, 1);
+    if(slot >= LOG_MAX_RINGS)
+    {
+        atomic_fetch_sub(&ring_count, 1);
+        return NULL;
+    }
+
+    ring = (log_ring_t *)calloc(1, sizeof(log_ring_t));
+    if(ring == NULL)
+    {
+        return NULL;
+    }
+    atomic_store_explicit(&rings[slot], ring, memory_order_release);
+    local_ring = ring;
+    return ring;
+}
+
+static void *writer_loop(void *arg)
+{
+    size_t used = 0;
+
+    (void)arg;
+    while(!atomic_load(&writer_stop))
+    {
+        struct pollfd pfd;
+
+        if(drain_rings(&used) > 0)
+        {
+            continue;
+        }
+        write_all(batch, used);
+        used = 0;
+
+        atomic_store(&writer_sleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if(log_backlog() > 0 || atomic_load(&writer_stop))
+        {
+            atomic_store(&writer_sleeping, false);
+            continue;
+        }
+        pfd.fd      = wake[0];
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, -1) > 0)
+        {
+            wakeup_clear(wake);
+        }
+        atomic_store(&writer_sleeping, false);
+    }
+
+    /* Final drain so nothing logged before shutdown is lost */
+    while(drain_rings(&used) > 0)
+    {
+    }
+    write_all(batch, used);
+    return NULL;
+}
+
+/* Wakes the writer if it is asleep. */
+static void writer_wake(void)
+{
+    // Pairs with the fence in writer_loop(): either it sees the new record or the stop, or we see it asleep.
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&writer_sleeping, memory_order_relaxed) && atomic_exchange(&writer_sleeping, false))
+    {
+        // Silent on failure: logging it would land back here.
+        wakeup_signal(wake, NULL);
+    }
+}
+
+/* Moves every pending record into the batch buffer, flushing it when full.
+   Returns the number of records consumed. */
+static size_t drain_rings(size_t *used)
+{
+    size_t consumed = 0;
+    int    count;
+    int    i;
+
+    count = atomic_load_explicit(&ring_count, memory_order_acquire);
+    for(i = 0; i < count && i < LOG_MAX_RINGS; i++)
+    {
+        log_ring_t *ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+        size_t      tail;
+        size_t      head;
+
+        if(ring == NULL)
+        {
+            continue;
+        }
+
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while(tail != head)
+        {
+            const log_record_t *rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+            char                text[LOG_TEXT_LEN];
+            int                 len = format_record(text, sizeof(text), rec);
+
+            if(LOG_BATCH_SIZE - *used < LOG_LINE_LEN)
+            {
+                write_all(batch, *used);
+                *used = 0;
+            }
+            *used += format_line(batch + *used, LOG_BATCH_SIZE - *used, &rec->ts, rec->level, text, len);
+            tail++;
+            consumed++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return consumed;
+}
+
+/* Appends len bytes from src to the packed arguments if they fit. */
+static bool pack(unsigned char *dst, size_t *used, const void *src, size_t len)
+{
+    if(LOG_ARGS_LEN - *used < len)
+    {
+        return false;
+    }
+    memcpy(dst + *used, src, len);
+    *used += len;
+    return true;
+}
+
+/* Takes the next value of a d or i conversion off ap as the length modifier says it was passed. */
+static int64_t signed_arg(const char *length, va_list *ap)
+{
+    switch(length[0])
+    {
+        case 'h':
+            return length[1] == 'h' ? (signed char)va_arg(*ap, int) : (short)va_arg(*ap, int);
+        case 'l':
+            return length[1] == 'l' ? (int64_t)va_arg(*ap, long long) : (int64_t)va_arg(*ap, long);
+        case 'j':
+            return (int64_t)va_arg(*ap, intmax_t);
+        case 'z':
+            return (int64_t)va_arg(*ap, ssize_t);
+        case 't':
+            return (int64_t)va_arg(*ap, ptrdiff_t);
+        default:
+            return va_arg(*ap, int);
+    }
+}
+
+/* Takes the next value of a u, o, x or X conversion off ap as the length modifier says it was passed. */
+static uint64_t unsigned_arg(const char *length, va_list *ap)
+{
+    switch(length[0])
+    {
+        case 'h':
+            return length[1] == 'h' ? (unsigned char)va_arg(*ap, unsigned int) : (unsigned short)va_arg(*ap, unsigned int);
+        case 'l':
+            return length[1] == 'l' ? (uint64_t)va_arg(*ap, unsigned long long) : (uint64_t)va_arg(*ap, unsigned long);
+        case 'j':
+            return (uint64_t)va_arg(*ap, uintmax_t);
+        case 'z':
+            return (uint64_t)va_arg(*ap, size_t);
+        case 't':
+            return (uint64_t)va_arg(*ap, ptrdiff_t);
+        default:
+            return va_arg(*ap, unsigned int);
+    }
+}
+
+/* Packs the values fmt's conversions take from ap into dst. A value that does not fit ends the record there,
+   except a string, which is cut to the room left. Returns the bytes used. */
+static size_t pack_args(unsigned char *dst, const char *fmt, va_list *ap)
+{
+    size_t used = 0;
+
+    for(const char *p = fmt; *p != '\0'; p++)
+    {
+        log_spec_t spec;
+        arg_kind_t kind;
+        int        stars[2];
+        int        nstars = 0;
+        int        prec;
+        bool       fits   = true;
+
+        if(*p != '%')
+        {
+            continue;
+        }
+        p    = spec_parse(p + 1, &spec);
+        kind = spec_kind(spec.conv);
+        if(kind == ARG_NONE)
+        {
+            continue;
+        }
+        if(kind == ARG_UNKNOWN)
+        {
+            break;
+        }
+        if(spec.width_star)
+        {
+            stars[nstars++] = va_arg(*ap, int);
+        }
+        if(spec.prec_star)
+        {
+            stars[nstars++] = va_arg(*ap, int);
+        }
+        prec = spec.prec_star ? stars[nstars - 1] : spec.prec;
+        if(!pack(dst, &used, stars, (size_t)nstars * sizeof(int)))
+        {
+            break;
+        }
+        switch(kind)
+        {
+            case ARG_SIGNED:
+            {
+                int64_t value = signed_arg(spec.length, ap);
+
+                fits = pack(dst, &used, &value, sizeof(value));
+                break;
+            }
+            case ARG_UNSIGNED:
+            {
+                uint64_t value = unsigned_arg(spec.length, ap);
+
+                fits = pack(dst, &used, &value, sizeof(value));
+                break;
+            }
+            case ARG_CHAR:
+            {
+                int64_t value = va_arg(*ap, int);
+
+                fits = pack(dst, &used, &value, sizeof(value));
+                break;
+            }
+            case ARG_DOUBLE:
+            {
+                double value = spec.length[0] == 'L' ? (double)va_arg(*ap, long double) : va_arg(*ap, double);
+
+                fits = pack(dst, &used, &value, sizeof(value));
+                break;
+            }
+            case ARG_POINTER:
+            {
+                const void *value = va_arg(*ap, const void *);
+
+                fits = pack(dst, &used, (const void *)&value, sizeof(value));
+                break;
+            }
+            case ARG_STRING:
+            {
+                const char *str = va_arg(*ap, const char *);
+                size_t      len;
+
+                if(str == NULL)
+                {
+                    str = "(null)";
+                }
+                len = prec >= 0 ? strnlen(str, (size_t)prec) : strlen(str);
+                if(used == LOG_ARGS_LEN)
+                {
+                    fits = false;
+                    break;
+                }
+                if(len > LOG_ARGS_LEN - used - 1)
+                {
+                    len = LOG_ARGS_LEN - used - 1;
+                }
+                memcpy(dst + used, str, len);
+                dst[used + len] = '\0';
+                used += len + 1;
+                break;
+            }
+            case ARG_NONE:       // Both are dealt with before the switch
+            case ARG_UNKNOWN:
+            default:
+                break;
+        }
+        if(!fits)
+        {
+            break;
+        }
+    }
+    return used;
+}
+
+/* Copies len packed bytes into dst if the record has them. */
+static bool unpack(const log_record_t *rec, size_t *used, void *dst, size_t len)
+{
+    if(rec->args_len - *used < len)
+    {
+        return false;
+    }
+    memcpy(dst, rec->args + *used, len);
+    *used += len;
+    return true;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+/* Formats a record's text the way vsnprintf() would have formatted its call. Output stops at the first
+   conversion whose value did not fit in the record. Returns the text length. */
+static int format_record(char *text, size_t size, const log_record_t *rec)
+{
+    size_t out  = 0;
+    size_t used = 0;
+
+    for(const char *p = rec->fmt; *p != '\0' && out < size - 1; p++)
+    {
+        log_spec_t spec;
+        arg_kind_t kind;
+        char       conv[LOG_SPEC_LEN];
+        int        stars[2] = {0, 0};
+        int        n        = 0;
+
+        if(*p != '%')
+        {
+            text[out++] = *p;
+            continue;
+        }
+        p    = spec_parse(p + 1, &spec);
+        kind = spec_kind(spec.conv);
+        if(kind == ARG_NONE)
+        {
+            text[out++] = '%';
+            continue;
+        }
+        if(kind == ARG_UNKNOWN || spec.span > LOG_SPEC_LEN / 2 ||
+           !unpack(rec, &used, stars, (size_t)(spec.width_star + spec.prec_star) * sizeof(int)))
+        {
+            break;
+        }
+        spec_build(conv, &spec, stars, kind);
+        switch(kind)
+        {
+            case ARG_SIGNED:
+            case ARG_CHAR:
+            {
+                int64_t value;
+
+                if(!unpack(rec, &used, &value, sizeof(value)))
+                {
+                    goto done;
+                }
+                n = kind == ARG_CHAR ? snprintf(text + out, size - out, conv, (int)value) : snprintf(text + out, size - out, conv, (long long)value);
+                break;
+            }
+            case ARG_UNSIGNED:
+            {
+                uint64_t value;
+
+                if(!unpack(rec, &used, &value, sizeof(value)))
+                {
+                    goto done;
+                }
+                n = snprintf(text + out, size - out, conv, (unsigned long long)value);
+                break;
+            }
+            case ARG_DOUBLE:
+            {
+                double value;
+
+                if(!unpack(rec, &used, &value, sizeof(value)))
+                {
+                    goto done;
+                }
+                n = snprintf(text + out, size - out, conv, value);
+                break;
+            }
+            case ARG_POINTER:
+            {
+                const void *value;
+
+                if(!unpack(rec, &used, (void *)&value, sizeof(value)))
+                {
+                    goto done;
+                }
+                n = snprintf(text + out, size - out, conv, value);
+                break;
+            }
+            case ARG_STRING:
+            {
+                const char *str = (const char *)rec->args + used;
+                size_t      len = strnlen(str, rec->args_len - used);
+
+                if(len == rec->args_len - used)
+                {
+                    goto done;
+                }
+                used += len + 1;
+                n = snprintf(text + out, size - out, conv, str);
+                break;
+            }
+            case ARG_NONE:       // Both are dealt with before the switch
+            case ARG_UNKNOWN:
+            default:
+                break;
+        }
+        if(n < 0)
+        {
+            break;
+        }
+        out += (size_t)n < size - out ? (size_t)n : size - out - 1;
+    }
+done:
+    text[out] = '\0';
+    return (int)out;
+}
+#pragma GCC diagnostic pop
+
+/* Reads the conversion after a %. Returns a pointer to its conversion character. */
+static const char *spec_parse(const char *p, log_spec_t *spec)
+{
+    size_t n = 0;
+
+    memset(spec, 0, sizeof(*spec));
+    spec->prec  = -1;
+    spec->start = p;
+    while(*p != '\0' && strchr("-+ #0'", *p) != NULL)
+    {
+        p++;
+    }
+    if(*p == '*')
+    {
+        spec->width_star = 1;
+        p++;
+    }
+    while(*p >= '0' && *p <= '9')
+    {
+        p++;
+    }
+    if(*p == '.')
+    {
+        p++;
+        if(*p == '*')
+        {
+            spec->prec_star = 1;
+            p++;
+        }
+        else
+        {
+            spec->prec = 0;
+            while(*p >= '0' && *p <= '9')
+            {
+                spec->prec = (spec->prec * 10) + (*p++ - '0');    // NOLINT(readability-magic-numbers)
+            }
+        }
+    }
+    spec->span = (size_t)(p - spec->start);
+    while(*p != '\0' && n < 2 && strchr("hljztL", *p) != NULL)
+    {
+        spec->length[n++] = *p++;
+    }
+    spec->conv = *p;
+    return *p != '\0' ? p : p - 1;
+}
+
+static arg_kind_t spec_kind(char conv)
+{
+    switch(conv)
+    {
+        case '%':
+            return ARG_NONE;
+        case 'd':
+        case 'i':
+            return ARG_SIGNED;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            return ARG_UNSIGNED;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            return ARG_DOUBLE;
+        case 'c':
+            return ARG_CHAR;
+        case 's':
+            return ARG_STRING;
+        case 'p':
+            return ARG_POINTER;
+        default:
+            return ARG_UNKNOWN;
+    }
+}
+
+/* Writes the conversion back out as a format for the packed value: * replaced by the width or precision it
+   stood for, and integers at the width they were packed at. */
+static size_t spec_build(char *dst, const log_spec_t *spec, const int *stars, arg_kind_t kind)
+{
+    size_t n    = 0;
+    int    star = 0;
+
+    dst[n++] = '%';
+    for(size_t i = 0; i < spec->span; i++)
+    {
+        char c = spec->start[i];
+
+        // A negative precision through * means none was given.
+        if(c == '.' && spec->prec_star && stars[spec->width_star] < 0)
+        {
+            break;
+        }
+        if(c == '*')
+        {
+            n += (size_t)snprintf(dst + n, LOG_SPEC_LEN - n, "%d", stars[star++]);
+            continue;
+        }
+        dst[n++] = c;
+    }
+    if(kind == ARG_SIGNED || kind == ARG_UNSIGNED)
+    {
+        dst[n++] = 'l';
+        dst[n++] = 'l';
+    }
+    dst[n++] = spec->conv;
+    dst[n]   = '\0';
+    return n;
+}
+
+static size_t format_line(char *dst, size_t size, const struct timespec *ts, int level, const char *text, int len)
+{
+    struct tm tm;
+    size_t    n;
+
+    if(len < 0)
+    {
+        len = 0;
+    }
+    if(len >= LOG_TEXT_LEN)
+    {
+        len = LOG_TEXT_LEN - 1;
+    }
+    /* The line break is ours to add */
+    while(len > 0 && text[len - 1] == '\n')
+    {
+        len--;
+    }
+
+    gmtime_r(&ts->tv_sec, &tm);
+    n = strftime(dst, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    n += (size_t)snprintf(dst + n, size - n, ".%06ldZ %s %.*s\n", ts->tv_nsec / NSEC_PER_USEC, level_names[level], len, text);
+    return n < size ? n : size - 1;
+}
+
+static void write_all(const char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(log_fd, buf, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
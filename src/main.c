@@ -1,5 +1,9 @@
 #include "../include/args.h"
+#include "../include/capture.h"
+#include "../include/handoff.h"
+#include "../include/logger.h"
 #include "../include/network.h"
+#include "../include/response.h"
 #include "../include/user_db.h"
 #include "../include/utils.h"    // Declares setup_signal_handler() and server_running
 #include <stdio.h>
@@ -9,28 +13,107 @@
 
 int main(int argc, char *argv[])
 {
-    int sockfd;
+    int       sockfd   = -1;
+    int       admin_fd = -1;
+    handoff_t handoff;
 
     memset(&global_args, 0, sizeof(Arguments));
     global_args.ip   = NULL;
     global_args.port = 0;
+    memset(&handoff, 0, sizeof(handoff));
+    handoff.listen_fd    = -1;
+    handoff.successor_fd = -1;
 
     parse_args(argc, argv);
 
     printf("Listening on %s:%d\n", global_args.ip, global_args.port);
 
+    // Workers started by server_starter share the databases
+    if(global_args.workers > 1 && storage_share() < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
     // Set up signal handler
     setup_signal_handler();
 
-    sockfd = server_tcp(&global_args);
+    // Move logging off the event loop
+    if(log_init((log_level_t)global_args.log_level, STDOUT_FILENO) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Encode the fixed-shape replies once
+    response_init();
+
+    // A server already running at the handoff path passes us its listener and clients, then exits.
+    if(global_args.handoff_path != NULL)
+    {
+        int predecessor = handoff_connect(global_args.handoff_path);
+
+        if(predecessor >= 0)
+        {
+            sockfd = handoff_receive(predecessor, &handoff);
+            close(predecessor);
+            if(sockfd < 0)
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if(sockfd < 0)
+    {
+        sockfd = server_tcp(&global_args);
+    }
     if(sockfd < 0)
     {
         perror("Failed to create server network.");
         exit(EXIT_FAILURE);
     }
 
+    if(global_args.admin_port != 0)
+    {
+        admin_fd = admin_tcp(&global_args);
+        if(admin_fd < 0)
+        {
+            perror("Failed to create admin listener.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(global_args.handoff_path != NULL)
+    {
+        handoff.listen_fd = handoff_listen(global_args.handoff_path);
+        if(handoff.listen_fd < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(global_args.capture_path != NULL && capture_open(global_args.capture_path) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
     // Start handling client connections (and optionally sending diagnostics to the server manager)
-    handle_connections(sockfd);
+    handle_connections(sockfd, admin_fd, &handoff);
+    handoff_release(&handoff);
 
+    capture_close();
+    log_shutdown();
+    if(handoff.listen_fd >= 0)
+    {
+        close(handoff.listen_fd);
+    }
+    // Closing this tells a successor we are gone; it rebinds the handoff path itself.
+    if(handoff.successor_fd >= 0)
+    {
+        close(handoff.successor_fd);
+    }
+    else if(global_args.handoff_path != NULL)
+    {
+        unlink(global_args.handoff_path);
+    }
     return EXIT_SUCCESS;
 }
@@ -1,76 +1,360 @@
 #include "../include/message.h"
 #include "../include/account.h"
+#include "../include/admin.h"
+#include "../include/args.h"
+#include "../include/capture.h"
 #include "../include/chat.h"
+#include "../include/conn_table.h"
+#include "../include/coro.h"
+#include "../include/executor.h"
+#include "../include/handoff.h"
+#include "../include/logger.h"
+#include "../include/metrics.h"
 #include "../include/network.h"
+#include "../include/response.h"
+#include "../include/router.h"
+#include "../include/sm_link.h"
+#include "../include/storage_io.h"
+#include "../include/uring.h"
 #include "../include/user_db.h"
 #include "../include/utils.h"
 #include <errno.h>
+#include <arpa/inet.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-uint16_t user_count = 0;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
-uint32_t msg_count  = MAX_MSG;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
-int      user_index = 0;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+uint16_t user_count = 0;            // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+_Atomic(uint32_t) msg_count = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+_Atomic(int) user_index = 0;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+/* Periodic work that must run whether or not clients are active */
+typedef struct
+{
+    tw_timer_t timer;      // cppcheck-suppress unusedStructMember
+    DBO       *meta_db;    // cppcheck-suppress unusedStructMember
+} housekeeping_t;
+
+/* Diagnostics go to the server manager every DIAGNOSTIC_INTERVAL, however busy the loop is */
+typedef struct
+{
+    tw_timer_t timer;     // cppcheck-suppress unusedStructMember
+    char      *sm_msg;    // cppcheck-suppress unusedStructMember
+} diagnostics_t;
+
+/* One copy of an outgoing frame, shared by every send that carries it */
+typedef struct
+{
+    uint32_t refs;      // cppcheck-suppress unusedStructMember
+    uint32_t len;       // cppcheck-suppress unusedStructMember
+    uint8_t  data[];    // cppcheck-suppress unusedStructMember
+} tx_buf_t;
+
+/* A send queued on one connection. Only the head of a connection's queue is in flight, which keeps frames in order. */
+typedef struct tx_op
+{
+    struct tx_op   *next;     // cppcheck-suppress unusedStructMember
+    tx_buf_t       *buf;      // cppcheck-suppress unusedStructMember
+    client_state_t *state;    // cppcheck-suppress unusedStructMember
+    uint32_t        sent;     // cppcheck-suppress unusedStructMember
+} tx_op_t;
+
+/* A slot's requests on the worker threads. Only the task running on the strand touches the rest. */
+typedef struct
+{
+    exec_strand_t strand;       // cppcheck-suppress unusedStructMember
+    arena_t       scratch;      // The running request's arena
+    uint32_t      gen;          // Generation of the connection the fields below belong to
+    int           client_id;    // The handlers' client id; the loop's copy follows it as requests finish
+} conn_exec_t;
+
+/* One frame handed to a worker. It comes back to the loop once handled to settle the client id. */
+typedef struct
+{
+    exec_task_t task;              // cppcheck-suppress unusedStructMember
+    uint64_t    handle;            // cppcheck-suppress unusedStructMember
+    int         client_id;         // cppcheck-suppress unusedStructMember
+    uint64_t    frame_start_us;    // cppcheck-suppress unusedStructMember
+    uint32_t    len;               // cppcheck-suppress unusedStructMember
+    int         shed;              // Answer EC_SERVER without handling it
+    uint8_t     frame[];           // cppcheck-suppress unusedStructMember
+} request_task_t;
+
+typedef enum
+{
+    REPLY_SEND,
+    REPLY_BROADCAST,
+} reply_kind_t;
+
+/* An account request running as a coroutine. It owns a copy of its frame, since rx_buf keeps filling while it waits. */
+typedef struct coro_request
+{
+    struct coro_request *next;              // Next request waiting for storage
+    message_t            message;           // cppcheck-suppress unusedStructMember
+    client_state_t      *state;             // NULL once the connection has closed
+    coro_t              *co;                // cppcheck-suppress unusedStructMember
+    int                  orphan_id;         // Where message.client_id points once the connection has closed
+    uint64_t             start_us;          // cppcheck-suppress unusedStructMember
+    uint64_t             frame_start_us;    // cppcheck-suppress unusedStructMember
+    size_t               len;               // cppcheck-suppress unusedStructMember
+    uint8_t              frame[];           // cppcheck-suppress unusedStructMember
+} coro_request_t;
+
+/* A broadcast the loop is still writing out */
+typedef struct fanout
+{
+    struct fanout *next;         // cppcheck-suppress unusedStructMember
+    tx_buf_t      *tx;           // The frame, shared with the sends queued so far
+    uint32_t       next_slot;    // Where the next pass carries on
+    uint32_t       seq_limit;    // conn_seq of the newest connection that gets it
+} fanout_t;
+
+/* The loop's view of its own load */
+typedef struct
+{
+    uint64_t          lag_us;                      // Moving average of how long a pass keeps new events waiting
+    int               active;                      // Shedding logins, creates and accepts
+    overload_reason_t reason;                      // The signal that tripped it
+    uint64_t          logged[OVERLOAD_REASONS];    // Shed counts at the last log line
+} overload_t;
+
+/* A frame a handler sent from a worker, written out by the loop */
+typedef struct
+{
+    exec_task_t  task;      // cppcheck-suppress unusedStructMember
+    reply_kind_t kind;      // cppcheck-suppress unusedStructMember
+    uint64_t     handle;    // cppcheck-suppress unusedStructMember
+    uint32_t     len;       // cppcheck-suppress unusedStructMember
+    uint8_t      data[];    // cppcheck-suppress unusedStructMember
+} reply_task_t;
+
+/* io_uring user_data: sends carry their tx_op pointer (8-byte aligned, so the low bits are 0);
+   other completions carry a kind in the low bits and, for receives, the slot and connection number */
+#define UD_ACCEPT (1U)
+#define UD_RECV (2U)
+#define UD_CANCEL (3U)
+#define UD_KIND_MASK (7U)
+#define UD_SEQ_SHIFT (3)
+#define UD_SLOT_SHIFT (35)
+
+// The loop's own descriptors open the poll set: the listener (or the ring), the admin endpoint, the hot-upgrade
+// listener, the server manager link and the wakeups. Connections follow from CONN_BASE.
+#define LISTEN_SLOT (0)
+#define ADMIN_SLOT (1)
+#define HANDOFF_SLOT (ADMIN_SLOT + ADMIN_FDS)
+#define SM_SLOT (HANDOFF_SLOT + 1)
+#define ROUTER_SLOT (SM_SLOT + 1)
+#define EXEC_SLOT (ROUTER_SLOT + 1)
+#define STORAGE_SLOT (EXEC_SLOT + 1)
+#define CONN_BASE (STORAGE_SLOT + 1)
+#define FD_SPARE (64)    // Descriptors kept for everything besides the connections
+#define ROUTER_IO (0)          // This loop is the router's only I/O thread
+#define ROUTER_TAKE_MAX (64)
+#define DRAIN_POLL_MS (50)
+#define SM_FLUSH_MS (500)    // How long queued diagnostics may hold up shutdown
+#define US_PER_MS (1000)
+#define OVERLOAD_LAG_WEIGHT (8)
+#define SERVE_BUDGET (16)    // Frames (or reads, each at most one frame) a connection gets per turn
+// Turns each class gets from the ready queues per pass, and broadcast recipients written per pass
+#define SCHED_QUOTA_CONTROL (256)
+#define SCHED_QUOTA_ACCOUNT (128)
+#define SCHED_QUOTA_CHAT (32)
+#define FANOUT_QUOTA (1024)
+#define FANOUT_BACKLOG_MAX (256)    // Broadcasts waiting on the loop before the oldest is written out at once
+
+static uint32_t      conn_seq;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static timer_wheel_t wheel;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static conn_table_t  conns;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static message_t    *loop_message;   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static uring_t       ring;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int           ring_active;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int           draining;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int           accept_armed;   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static sm_link_t     sm_link;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static conn_exec_t  *conn_exec;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static size_t        requests_inflight;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static _Thread_local request_task_t *running_request;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static coro_request_t *storage_holder;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static coro_request_t *storage_waiting;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static size_t          storage_waiters;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static uint32_t        ready_head[SCHED_CLASSES];     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static uint32_t        ready_tail[SCHED_CLASSES];     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static uint32_t        ready_count[SCHED_CLASSES];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static uint32_t        ready_total;                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static fanout_t       *fanout_head;                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static fanout_t      **fanout_tail = &fanout_head;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static uint32_t        fanout_pending;                // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int             route_pending;                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static overload_t      overload;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int             accept_paused;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int             shed_pending;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static arena_t         loop_scratch;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static arena_t         holder_scratch;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static struct pollfd   detached_pfd;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static client_state_t  detached_state;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
 
 static void handle_sm_diagnostic(char *msg);
 /* Declaration for static functions */
 static ssize_t handle_message(message_t *message);
-static ssize_t handle_package(message_t *message);
-static ssize_t handle_header(message_t *message, ssize_t nread);
+static ssize_t handle_package(message_t *message, size_t len);
 static ssize_t handle_payload(message_t *message, ssize_t nread);
 static ssize_t handle_response(message_t *message);
 // static ssize_t     send_response(message_t *message);
-static void        send_sm_response(char *msg);
-static ssize_t     send_error_response(message_t *message);
-static const char *error_code_to_string(const error_code_t *code);
-static void        count_user(const int *client_id);
-
-/* Error code map */
-static const error_code_map code_map[] = {
-    {EC_GOOD,          ""                      },
-    {EC_INV_USER_ID,   "Invalid User ID"       },
-    {EC_INV_AUTH_INFO, "Invalid Authentication"},
-    {EC_USER_EXISTS,   "User Already Exist"    },
-    {EC_SERVER,        "Server Error"          },
-    {EC_INV_REQ,       "Invalid message"       },
-    {EC_REQ_TIMEOUT,   "message Timeout"       }
-};
-
-void handle_connections(int server_fd)
+static void    send_sm_response(char *msg);
+static void    count_user(void);
+static ssize_t read_client(client_state_t *state);
+static int     rx_reserve(client_state_t *state, size_t need);
+static void    rx_commit(client_state_t *state, size_t nread);
+static int     admit_client(int client_fd);
+static void    serve_client(int i);
+static void    ready_push(int i);
+static void    ready_remove(uint32_t slot);
+static void    ready_run(void);
+static void    fanout_run(void);
+static uint32_t fanout_step(fanout_t *job, uint32_t budget);
+static void    fanout_pop(void);
+static void    fanout_flush(void);
+static int     loop_backlog(void);
+static size_t  frame_length(const client_state_t *state);
+static void    consume_frame(client_state_t *state, size_t len);
+static void    slot_init(int slot);
+static void    open_client(client_state_t *state, int client_fd);
+static void    raise_fd_limit(rlim_t need);
+static size_t  conn_mem(const client_state_t *state);
+static int     mem_over(void);
+static void    mem_enforce(void);
+static void    overload_update(int server_fd, uint64_t pass_start);
+static void    overload_log(void);
+static void    accept_pause(int server_fd, int paused);
+static int     sheds_when_busy(uint8_t type);
+static void    shed_reply(client_state_t *state, uint8_t type);
+static void    close_client(client_state_t *state);
+static void    release_client(client_state_t *state);
+static void    handoff_adopt(const handoff_t *handoff);
+static void    handoff_serve(int server_fd, handoff_t *handoff);
+static void    idle_timeout(void *arg);
+static void    frame_timeout(void *arg);
+static void    housekeeping(void *arg);
+static void    user_index_synced(int result, void *ctx);
+static void    diagnostics(void *arg);
+static size_t  handle_sm_diagnostic_ext(uint8_t *msg);
+static uint8_t *put_ber_uint(uint8_t *ptr, uint64_t value, uint8_t width);
+static int      ring_start(int server_fd);
+static void     ring_reap(int server_fd);
+static void     ring_recv(const uring_event_t *event);
+static uint64_t recv_user_data(int slot);
+static int      ring_drain(int server_fd);
+static void     ring_resume(int server_fd);
+static tx_buf_t *tx_alloc(const void *buf, size_t len, uint32_t refs);
+static tx_op_t  *tx_push(client_state_t *state, tx_buf_t *buf, int urgent);
+static void     tx_share(client_state_t *state, tx_buf_t *buf);
+static ssize_t  tx_write_now(client_state_t *state, const void *buf, size_t len);
+static int      tx_flush(client_state_t *state);
+static int      tx_drain(void);
+static int      tx_start(tx_op_t *op);
+static void     tx_complete(tx_op_t *op, int32_t res);
+static void     tx_pop(client_state_t *state);
+static void     tx_free(tx_op_t *op);
+static void     tx_unref(tx_buf_t *buf);
+static void     tx_drop(client_state_t *state, const tx_op_t *keep);
+static uint64_t route_handle(const client_state_t *state);
+static client_state_t *route_target(uint64_t handle);
+static void     route_deliver(void);
+static ssize_t  request_submit(client_state_t *state, size_t len, int shed);
+static void     request_run(exec_task_t *task);
+static void     request_done(exec_task_t *task);
+static ssize_t  reply_post(reply_kind_t kind, const void *buf, size_t len);
+static void     reply_run(exec_task_t *task);
+static int      requests_settle(int timeout_ms);
+static int      uses_storage(uint8_t type);
+static int      request_spawn(const message_t *message, size_t len);
+static void     request_begin(coro_request_t *req);
+static void     request_body(void *arg);
+static void     request_resume(coro_t *co);
+static client_state_t *request_finish(coro_request_t *req);
+static void     request_detach(coro_request_t *req);
+
+void handle_connections(int server_fd, int admin_fd, handoff_t *handoff)
 {
     /* Use the global server_running variable declared in utils.h */
-    struct pollfd fds[MAX_FDS];
-    int           client_id[MAX_FDS];
-    char          db_name[] = "meta_db";
-    DBO           meta_db;
-    int           poll_count;
-    message_t     message;
-    char          sm_msg[MESSAGE_NUM];
-    int           i;
-    ssize_t       retval;
-
-    // Initialize fds
-    fds[0].fd     = server_fd;
-    fds[0].events = POLLIN;
-    for(i = 1; i < MAX_FDS; i++)
-    {
-        fds[i].fd    = -1;
-        client_id[i] = -1;
-    }
-
-    // Initialize meta database
+    struct pollfd *fds;
+    housekeeping_t hk;
+    diagnostics_t  diag;
+    char           db_name[] = "meta_db";
+    DBO            meta_db;
+    int            poll_count;
+    message_t      message;
+    char           sm_msg[MESSAGE_NUM];
+    uint64_t       pass_start;
+    int            i;
+
+    // The poll set is the connection table's: the loop's own descriptors, then every connection.
+    if(conn_table_init(&conns, CONN_BASE, (uint32_t)global_args.max_clients) < 0)
+    {
+        LOG_ERROR("Cannot allocate room for %d clients", global_args.max_clients);
+        return;
+    }
+    raise_fd_limit((rlim_t)global_args.max_clients + FD_SPARE);
+    fds          = conns.pfd;
+    loop_message = &message;
+    timer_wheel_init(&wheel);
+    admin_init(&fds[ADMIN_SLOT], admin_fd, &wheel);
+    fds[HANDOFF_SLOT].fd     = handoff->listen_fd;
+    fds[HANDOFF_SLOT].events = POLLIN;
+    // Under server_starter the supervisor's socket waits on SM_WORKER_FD; run by hand there is no manager.
+    sm_link_adopt(&sm_link, sm_fd);
+
+    // With io_uring the listener belongs to the ring and LISTEN_SLOT watches for completions instead.
+    ring_active             = global_args.io_backend == IO_BACKEND_URING && ring_start(server_fd) == 0;
+    fds[LISTEN_SLOT].fd     = ring_active ? ring.fd : server_fd;
+    fds[LISTEN_SLOT].events = POLLIN;
+    // Chat fanout moves to the router thread; it learns about connections as they open.
+    fds[ROUTER_SLOT].fd     = global_args.router && router_start(1) == 0 ? router_wake_fd(ROUTER_IO) : -1;
+    fds[ROUTER_SLOT].events = POLLIN;
+    // Queued database writes are flushed on the storage thread. Without workers, account handlers also run
+    // as coroutines that wait for storage there.
+    fds[STORAGE_SLOT].fd     = storage_io_start() == 0 ? storage_io_fd() : -1;
+    fds[STORAGE_SLOT].events = POLLIN;
+    // Handlers run on the worker pool, one strand per slot; what they send comes back through EXEC_SLOT.
+    // A slot's strand is set up the first time the slot is used.
+    if(global_args.threads > 0)
+    {
+        conn_exec = (conn_exec_t *)calloc(conns.cap, sizeof(conn_exec_t));
+    }
+    fds[EXEC_SLOT].fd     = conn_exec != NULL && executor_start((size_t)global_args.threads) == 0 ? executor_loop_fd() : -1;
+    fds[EXEC_SLOT].events = POLLIN;
+    if(!executor_active())
+    {
+        sfree((void **)&conn_exec);
+    }
+    // Frames handled on the loop and the handler holding storage each reuse one arena, reset per frame.
+    arena_init(&loop_scratch, SCRATCH_SIZE);
+    arena_init(&holder_scratch, SCRATCH_SIZE);
+    detached_pfd.fd          = -1;
+    detached_state.pfd       = &detached_pfd;
+    handoff_adopt(handoff);
+
+    // Initialize meta database. Workers sharing storage allocate ids through pk_next() and keep no handle open.
     meta_db.name = db_name;
+    storage_lock();
     if(init_pk(&meta_db, "USER_PK") < 0)
     {
+        storage_unlock();
+        meta_db.db = NULL;
         perror("Failed to initialize meta_db\n");
         goto exit;
     }
-    if(database_open(&meta_db) < 0)
+    storage_unlock();
+    meta_db.db = NULL;    // init_pk() closed it
+    if(!storage_shared() && database_open(&meta_db) < 0)
     {
         perror("Failed to open meta_db");
         goto exit;
@@ -78,48 +362,116 @@ void handle_connections(int server_fd)
 
     handle_sm_diagnostic(sm_msg);
 
+    // Housekeeping and diagnostics run on their own cadence instead of only when poll() times out.
+    hk.meta_db = &meta_db;
+    timer_init(&hk.timer, housekeeping, &hk);
+    timer_schedule(&wheel, &hk.timer, HOUSEKEEPING_INTERVAL);
+
+    diag.sm_msg = sm_msg;
+    timer_init(&diag.timer, diagnostics, &diag);
+    timer_schedule(&wheel, &diag.timer, DIAGNOSTIC_INTERVAL);
+
     /* Global server_running will be used here */
     while(server_running)
     {
+        // SIGUSR1 asks for the latency histograms.
+        if(stats_requested)
+        {
+            stats_requested = 0;
+            metrics_dump_latency();
+        }
+
+        // Everything queued since the last pass (replies, fanout, re-armed receives) goes in one call.
+        if(ring_active)
+        {
+            uring_submit(&ring);
+        }
+
+        sm_link_poll(&sm_link, &fds[SM_SLOT]);
         errno      = 0;
-        poll_count = poll(fds, MAX_FDS, TIMEOUT);
+        // Connections with work left over from their last turn must not wait for a timer.
+        poll_count = poll(fds, conns.high, loop_backlog() ? 0 : timer_next_timeout(&wheel));
 
         // Poll for events on the file descriptors
         if(poll_count < 0)
         {
             if(errno == EINTR)
             {
-                goto exit;
+                // SIGINT clears server_running; any other signal just wakes us up.
+                continue;
             }
-            perror("poll error");
+            LOG_ERROR("poll error: %s", strerror(errno));
             goto exit;
         }
-        // On poll timeout, update user count and send diagnostics if connected to server manager.
-        if(poll_count == 0)
+        pass_start = metrics_now_us();
+        // Nothing ready: only timers are due.
+        if(poll_count == 0 && !loop_backlog())
+        {
+            // poll() waited out its timeout, so nothing is queued behind the loop.
+            overload.lag_us = 0;
+            overload_update(server_fd, pass_start);
+            timer_advance(&wheel);
+            continue;
+        }
+        // A new server wants our sockets: hand them over and stop.
+        if(fds[HANDOFF_SLOT].revents & POLLIN)
+        {
+            handoff_serve(server_fd, handoff);
+            if(!server_running)
+            {
+                break;
+            }
+        }
+        // Diagnostics queued behind a slow supervisor go out as it drains; it sends us nothing we act on.
+        if(fds[SM_SLOT].revents)
         {
-            printf("poll timeout\n");
-            if(store_int(meta_db.db, "USER_PK", user_index) != 0)
+            uint8_t frame[SM_HEADERLEN];
+
+            sm_link_handle(&sm_link, fds[SM_SLOT].revents);
+            while(sm_link_recv(&sm_link, frame, sizeof(frame)) != 0)
             {
-                perror("update user_index");
-                goto exit;
+                LOG_DEBUG("Ignoring a server manager frame");
             }
-            count_user(client_id);
-            if(sm_fd >= 0)    // Only send diagnostic update if connected to the server manager.
+        }
+        // Chat the router has resolved to our connections, a quota per pass.
+        if((fds[ROUTER_SLOT].revents & POLLIN) || route_pending)
+        {
+            route_deliver();
+        }
+        // Replies and fanout from requests the workers have handled.
+        if(fds[EXEC_SLOT].revents & POLLIN)
+        {
+            executor_loop_run();
+        }
+        // Handlers whose storage calls have finished.
+        if(fds[STORAGE_SLOT].revents & POLLIN)
+        {
+            storage_io_run(request_resume);
+        }
+        // Connections that used up their last turn go again before anyone gets a second one, then broadcasts
+        // go out to another slice of their recipients.
+        ready_run();
+        fanout_run();
+        // Accepts, receives and send completions all arrive through the ring.
+        if(ring_active)
+        {
+            if(fds[LISTEN_SLOT].revents & POLLIN)
             {
-                send_sm_response(sm_msg);
+                ring_reap(server_fd);
             }
+            mem_enforce();
+            overload_update(server_fd, pass_start);
+            admin_handle();
+            timer_advance(&wheel);
             continue;
         }
+
         // Check for new client connections
-        if(fds[0].revents & POLLIN)
+        if(fds[LISTEN_SLOT].revents & POLLIN)
         {
-            int                     client_added;
             int                     client_fd;
             struct sockaddr_storage client_addr;
             socklen_t               client_addr_len = sizeof(client_addr);
-            int                     flags;
-
-            client_added = 0;
 
             client_fd = socket_accept(server_fd, &client_addr, &client_addr_len);
             if(client_fd < 0)
@@ -129,440 +481,2180 @@ void handle_connections(int server_fd)
                     server_running = 0;
                     goto exit;
                 }
-                perror("accept error");
-                continue;
-            }
-
-            flags = fcntl(client_fd, F_GETFL, 0);
-            if(flags == -1)
-            {
-                perror("fcntl (get flags) error");
-                close(client_fd);
-                continue;
-            }
-            if(fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1)
-            {
-                perror("fcntl (set non-blocking) error");
-                close(client_fd);
+                LOG_ERROR("accept error: %s", strerror(errno));
                 continue;
             }
-
-            for(i = 1; i < MAX_FDS; i++)
-            {
-                if(fds[i].fd == -1)
-                {
-                    fds[i].fd     = client_fd;
-                    fds[i].events = POLLIN;
-                    client_id[i]  = client_fd;    // Use the accepted socket fd as the temporary client ID
-                    client_added  = 1;
-                    break;
-                }
-            }
-
-            if(!client_added)
+            if(admit_client(client_fd) < 0)
             {
-                printf("Too many clients connected. Rejecting connection.\n");
-                close(client_fd);
                 continue;
             }
         }
 
-        // Handle incoming data on existing client connections.
-        for(i = 1; i < MAX_FDS; i++)
+        // Handle incoming data on existing client connections. Only the dense pfd[] is read for idle ones.
+        for(i = (int)conns.base; i < (int)conns.high; i++)
         {
-            if(fds[i].fd != -1)
+            if(fds[i].fd != -1 && fds[i].revents != 0)
             {
+                // Queued sends go out first, so a client catching up on them frees its memory before reading more.
+                if((fds[i].revents & POLLOUT) && tx_flush(&conns.state[i]) < 0)
+                {
+                    LOG_INFO("client#%d disconnected.", conns.user_id[i]);
+                    close_client(&conns.state[i]);
+                    continue;
+                }
                 if(fds[i].revents & POLLIN)
                 {
-                    printf("polling client#%d\n", client_id[i]);
-                    message.fds          = fds;
-                    message.client       = &fds[i];
-                    message.client_id    = &client_id[i];
-                    message.payload_len  = HEADERLEN;
-                    message.response_len = 3;
-                    message.code         = EC_GOOD;
-
-                    retval = 0;    // reset retval for each connection
-                    while(retval != END)
-                    {
-                        printf("handling message");
-                        retval = handle_message(&message);
-                    }
-                    /* Do not exit the poll loop—continue to process other connections */
+                    LOG_DEBUG("polling client#%d", conns.user_id[i]);
+                    serve_client(i);
                 }
-                if(fds[i].revents & (POLLHUP | POLLERR))
+                if(fds[i].fd != -1 && (fds[i].revents & (POLLHUP | POLLERR)))
                 {
-                    printf("client#%d disconnected.\n", client_id[i]);
-                    close(fds[i].fd);
-                    fds[i].fd     = -1;
-                    fds[i].events = 0;
-                    client_id[i]  = -1;
+                    LOG_INFO("client#%d disconnected.", conns.user_id[i]);
+                    close_client(&conns.state[i]);
                     continue;
                 }
             }
         }
-    }
 
-    // Sync the user database
-    if(store_int(meta_db.db, "USER_PK", user_index) != 0)
-    {
-        perror("Failed to sync user database");
-        goto exit;
+        mem_enforce();
+        overload_update(server_fd, pass_start);
+        admin_handle();
+        timer_advance(&wheel);
     }
 
 exit:
-    store_int(meta_db.db, "USER_PK", user_index);
-    dbm_close(meta_db.db);
-}
-
-static ssize_t handle_message(message_t *message)
-{
-    ssize_t retval;
-
-    /* Allocate the message buffer */
-    message->req_buf = malloc(HEADERLEN);
-    if(!message->req_buf)
+    // Requests already handed to the workers, or waiting on storage, are answered before the clients are closed.
+    if(storage_holder != NULL && requests_settle(HANDOFF_TIMEOUT) < 0)
     {
-        perror("Failed to allocate message message buffer");
-        retval = -1;
-        goto exit;
+        LOG_WARN("Requests still waiting on storage after %d ms", HANDOFF_TIMEOUT);
     }
-
-    /* Allocate the response buffer */
-    message->res_buf = malloc(RESPONSELEN);
-    if(!message->res_buf)
+    if(executor_active())
     {
-        perror("Failed to allocate message response buffer");
-        retval = -2;
-        goto exit;
+        executor_stop();
+        for(i = (int)conns.base; i < (int)conns.touched; i++)
+        {
+            executor_strand_destroy(&conn_exec[i].strand);
+            arena_destroy(&conn_exec[i].scratch);
+        }
+        sfree((void **)&conn_exec);
     }
-    memset(message->res_buf, 0, RESPONSELEN);
-
-    retval = handle_package(message);
-
-exit:
-    sfree(&message->req_buf);
-    sfree(&message->res_buf);
-    return retval;
-}
-
-/* BER Decoder function */
-static ssize_t handle_package(message_t *message)
-{
-    ssize_t retval;
-    ssize_t nread;
-    void   *tmp;
-
-    nread = read(message->client->fd, (char *)message->req_buf, message->payload_len);
-    if(nread < 0)
+    // Queued writes are flushed before the last sync below goes to the same handle. Requests still waiting
+    // on storage finish on the way, and the ones queued behind them after.
+    storage_io_stop(request_resume);
+    arena_destroy(&loop_scratch);
+    arena_destroy(&holder_scratch);
+    fanout_flush();
+    // Replies queued behind a full socket get a bounded chance to go out before it closes.
+    if(!ring_active && tx_drain() < 0)
+    {
+        LOG_WARN("Sends did not drain in %d ms, closing anyway", HANDOFF_TIMEOUT);
+    }
+    for(i = (int)conns.base; i < (int)conns.high; i++)
     {
-        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        if(fds[i].fd != -1)
         {
-            // No data yet; not a real error for non-blocking sockets
-            return 0;    // Return NO_DATA or just 0 to skip this round
+            close_client(&conns.state[i]);
         }
-        perror("Fail to read header");
-        message->code = EC_SERVER;
-        return -1;
     }
-
-    printf("handling header\n");
-    if(handle_header(message, nread) < 0)
+    admin_shutdown();
+    router_stop();
+    sm_link_flush(&sm_link, SM_FLUSH_MS);
+    sm_link_close(&sm_link);
+    if(ring_active)
     {
-        perror("Failed to decode header");
-        return -2;
+        uring_destroy(&ring);
+        ring_active = 0;
     }
-
-    // Reallocate buffer to fit the payload
-    tmp = realloc(message->req_buf, (size_t)(message->payload_len + HEADERLEN));
-    if(!tmp)
+    // Sync the user database
+    if(meta_db.db != NULL)
     {
-        perror("Failed to reallocate message body\n");
-        free(message->req_buf);
-        message->code = EC_SERVER;
-        return -3;
+        if(store_int(meta_db.db, "USER_PK", user_index) != 0)
+        {
+            perror("Failed to sync user database");
+        }
+        dbm_close(meta_db.db);
     }
-    message->req_buf = tmp;
+    conn_table_destroy(&conns);
+}
 
-    // Read payload_length into buffer
-    nread = read(message->client->fd, ((char *)message->req_buf) + HEADERLEN, message->payload_len);
-    if(nread < 0)
+/* Sets up a newly accepted socket in a free slot. Returns the slot, or -1 if the connection was refused. */
+static int admit_client(int client_fd)
+{
+    int flags;
+    int slot;
+    int fresh;
+
+    flags = fcntl(client_fd, F_GETFL, 0);
+    if(flags == -1)
     {
-        perror("Failed to read message body\n");
-        message->code = EC_SERVER;
-        return -4;
+        LOG_ERROR("fcntl (get flags) error: %s", strerror(errno));
+        close(client_fd);
+        return -1;
+    }
+    if(fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        LOG_ERROR("fcntl (set non-blocking) error: %s", strerror(errno));
+        close(client_fd);
+        return -1;
     }
+    // A request is answered with back-to-back small frames (ack, then the relay); Nagle would hold the second.
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
 
-    printf("handling payload\n");
-    retval = handle_payload(message, nread);
-    if(retval == ACCOUNT_ERROR)
+    if(mem_over())
     {
-        perror("Failed to identify account package\n");
-        return ACCOUNT_ERROR;
+        LOG_WARN("Connection buffers are over the %zu byte cap. Rejecting connection.", global_args.mem_max);
+        METRIC_ADD(mem_refused, 1);
+        close(client_fd);
+        return -1;
     }
-    if(retval == ACCOUNT_LOGIN_ERROR)
+    slot = conn_table_claim(&conns, client_fd, &fresh);
+    if(slot < 0)
     {
-        perror("Failed to login\n");
-        return ACCOUNT_LOGIN_ERROR;
+        LOG_WARN("Too many clients connected. Rejecting connection.");
+        close(client_fd);
+        return -1;
     }
-    if(retval == ACCOUNT_CREATE_ERROR)
+    if(fresh)
     {
-        perror("Failed to create account\n");
-        return ACCOUNT_CREATE_ERROR;
+        slot_init(slot);
     }
-    if(retval == ACCOUNT_EDIT_ERROR)
+    open_client(&conns.state[slot], client_fd);
+    return slot;
+}
+
+/* Sets up the loop's part of a slot the first time it is used; the table has done its own. */
+static void slot_init(int slot)
+{
+    client_state_t *state = &conns.state[slot];
+
+    timer_init(&state->idle_timer, idle_timeout, state);
+    timer_init(&state->frame_timer, frame_timeout, state);
+    if(conn_exec != NULL)
     {
-        perror("Failed to edit account\n");
-        return ACCOUNT_EDIT_ERROR;
+        executor_strand_init(&conn_exec[slot].strand);
+        arena_init(&conn_exec[slot].scratch, SCRATCH_SIZE);
+        conn_exec[slot].gen = UINT32_MAX;    // Matches no handle, so the first request brings the client id
     }
-    if(retval == CHAT_ERROR)
+}
+
+/* Lets the process hold a descriptor per client. Past the hard limit, accept() fails and is logged as usual. */
+static void raise_fd_limit(rlim_t need)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur >= need)
     {
-        perror("Chat error\n");
-        return CHAT_ERROR;
+        return;
     }
-    if(retval == END)
+    limit.rlim_cur = limit.rlim_max != RLIM_INFINITY && limit.rlim_max < need ? limit.rlim_max : need;
+    if(setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < need)
     {
-        perror("End, closing client fd.\n");
-        return END;
+        LOG_WARN("Descriptor limit %lu is below the %lu needed for every client", (unsigned long)limit.rlim_cur, (unsigned long)need);
     }
+}
 
-    return 0;
+/* Bytes a connection holds: its receive buffer and its queued sends. */
+static size_t conn_mem(const client_state_t *state)
+{
+    return state->rx_cap + state->tx_queued;
 }
 
-static ssize_t handle_header(message_t *message, ssize_t nread)
+/* Whether the connections together hold more than the global cap. */
+static int mem_over(void)
 {
-    char *buf;
+    return global_args.mem_max > 0 && metrics_mem_held() > (int64_t)global_args.mem_max;
+}
 
-    buf = (char *)message->req_buf;
-    if(nread < (ssize_t)sizeof(message->payload_len))
+/* Runs between loop passes, where no handler holds a connection: closes the connections marked as over
+   their own cap, then, while the total is over the global cap, whichever connection holds the most. */
+static void mem_enforce(void)
+{
+    if(shed_pending)
     {
-        perror("Payload length mismatch\n");
-        message->code = EC_INV_REQ;
-        return -1;
+        shed_pending = 0;
+        for(uint32_t i = conns.base; i < conns.high; i++)
+        {
+            if(conns.pfd[i].fd != -1 && conns.state[i].shed)
+            {
+                METRIC_ADD(mem_shed, 1);
+                close_client(&conns.state[i]);
+            }
+        }
     }
+    while(mem_over())
+    {
+        client_state_t *worst = NULL;
 
-    memcpy(&message->type, buf, sizeof(message->type));
-    buf += sizeof(message->type);
+        for(uint32_t i = conns.base; i < conns.high; i++)
+        {
+            if(conns.pfd[i].fd != -1 && (worst == NULL || conn_mem(&conns.state[i]) > conn_mem(worst)))
+            {
+                worst = &conns.state[i];
+            }
+        }
+        if(worst == NULL || conn_mem(worst) == 0)
+        {
+            return;
+        }
+        LOG_WARN("Connection buffers are over the %zu byte cap; closing client#%d, which holds %zu", global_args.mem_max, *worst->client_id, conn_mem(worst));
+        METRIC_ADD(mem_shed, 1);
+        close_client(worst);
+    }
+}
 
-    memcpy(&message->version, buf, sizeof(message->version));
-    buf += sizeof(message->version);
+/* Runs at the end of every loop pass. Enters overload when a signal goes over its threshold and leaves it
+   once every signal is below half of its own, so the state does not flap at the boundary. */
+static void overload_update(int server_fd, uint64_t pass_start)
+{
+    static const uint64_t limit[OVERLOAD_REASONS] = {OVERLOAD_LAG_US, OVERLOAD_REQUESTS, OVERLOAD_STORAGE};
+    uint64_t              level[OVERLOAD_REASONS];
+    uint64_t              pass = metrics_now_us() - pass_start;
+    int                   over = 0;
 
-    memcpy(&message->sender_id, buf, sizeof(message->sender_id));
-    buf += sizeof(message->sender_id);
-    message->sender_id = ntohs(message->sender_id);
+    // An eighth of each new pass, so one slow pass does not trip it but a run of them does.
+    overload.lag_us = overload.lag_us - (overload.lag_us / OVERLOAD_LAG_WEIGHT) + (pass / OVERLOAD_LAG_WEIGHT);
+    METRIC_STORE(loop_lag_us, (int_fast64_t)overload.lag_us);
+    level[OVERLOAD_LAG]             = overload.lag_us;
+    level[OVERLOAD_QUEUE]           = requests_inflight;
+    level[OVERLOAD_STORAGE_BACKLOG] = storage_io_backlog() + storage_waiters;
 
-    memcpy(&message->payload_len, buf, sizeof(message->payload_len));
-    message->payload_len = ntohs(message->payload_len);
+    for(int r = 0; r < OVERLOAD_REASONS; r++)
+    {
+        if(!overload.active && level[r] > limit[r])
+        {
+            overload.active = 1;
+            overload.reason = (overload_reason_t)r;
+            LOG_WARN("Overloaded (%s at %lu): refusing logins and new connections", overload_name(overload.reason), (unsigned long)level[r]);
+            accept_pause(server_fd, 1);
+            return;
+        }
+        over |= level[r] > limit[r] / 2;
+    }
+    if(overload.active && !over)
+    {
+        overload.active = 0;
+        LOG_INFO("Load is back to normal: accepting again");
+        accept_pause(server_fd, 0);
+    }
+}
 
-    // DEBUG
-    printf("Header type: %d\n", (int)message->type);
-    printf("Header version: %d\n", (int)message->version);
-    printf("Header sender_id: %d\n", (int)message->sender_id);
-    printf("Header payload_len: %d\n", (int)message->payload_len);
+/* Logs how many requests each overload reason has turned away since the last call. */
+static void overload_log(void)
+{
+    for(int r = 0; r < OVERLOAD_REASONS; r++)
+    {
+        uint64_t count = atomic_load_explicit(&metrics.shed[r], memory_order_relaxed);
 
-    return 0;
+        if(count != overload.logged[r])
+        {
+            LOG_WARN("Shed %lu logins and creates for %s", (unsigned long)(count - overload.logged[r]), overload_name((overload_reason_t)r));
+            overload.logged[r] = count;
+        }
+    }
 }
 
-static ssize_t handle_payload(message_t *message, ssize_t nread)
+const char *overload_name(overload_reason_t reason)
 {
-    ssize_t retval;
+    static const char *const names[OVERLOAD_REASONS] = {"loop_lag", "queue", "storage"};
 
-    if(nread < (ssize_t)message->payload_len)
+    return (unsigned)reason < OVERLOAD_REASONS ? names[reason] : "unknown";
+}
+
+/* Stops taking connections off the listener while overloaded; they wait in the kernel's backlog. */
+static void accept_pause(int server_fd, int paused)
+{
+    accept_paused = paused;
+    if(!ring_active)
     {
-        printf("Payload length mismatch");
-        message->code = EC_INV_REQ;
-        return ACCOUNT_ERROR;
+        conns.pfd[LISTEN_SLOT].events = paused ? 0 : POLLIN;
+        return;
     }
-
-    printf("handle payload\n");
-    switch(message->type)
+    // LISTEN_SLOT is the ring's own descriptor here: the accept is a request on the ring.
+    if(paused && accept_armed)
     {
-        case ACC_LOGIN:
-        case ACC_CREATE:
-        case ACC_EDIT:
-        case ACC_LOGOUT:
-            retval = account_handler(message);
-            if(retval < 0)
-            {
-                send_error_response(message);
-                return retval;
-            }
-            break;
-
-        case CHT_SEND:
-            retval = chat_handler(message);
-            if(retval < 0)
-            {
-                send_error_response(message);
-                return retval;
-            }
-            break;
-
-        default:
-            message->code = EC_INV_REQ;
-            send_error_response(message);
-            return ACCOUNT_ERROR;
+        uring_cancel(&ring, UD_ACCEPT, UD_CANCEL);
+    }
+    else if(!paused && !accept_armed && !draining)
+    {
+        accept_armed = uring_accept_multishot(&ring, server_fd, UD_ACCEPT) == 0;
     }
+}
 
-    // If no error, return 0 always
-    return handle_response(message);
+/* Requests that start a session. Turning these away sheds new work without touching anyone already chatting. */
+static int sheds_when_busy(uint8_t type)
+{
+    return type == ACC_LOGIN || type == ACC_CREATE;
 }
 
-static ssize_t handle_response(message_t *message)
+/* Answers a frame of the given type with the pre-encoded EC_SERVER error instead of handling it. */
+static void shed_reply(client_state_t *state, uint8_t type)
 {
-    if(message->type != CHT_SEND)
+    const response_frame_t *frame = response_lookup(type, EC_SERVER);
+
+    if(frame->len > 0)
     {
-        message->response_len = (uint16_t)(HEADERLEN + ntohs(message->response_len));
-        printf("response_len: %d\n", (message->response_len));
-        write(message->client->fd, message->res_buf, message->response_len);
+        send_client(state, frame->buf, frame->len);
     }
-
-    sfree(&message->req_buf);
-    return 0;
 }
 
-static void count_user(const int *client_id)
+/* Handles the frames buffered for slot i (reading first in poll mode), up to SERVE_BUDGET of them. A connection
+   with more to do goes to the back of the ready queue instead of keeping the loop to itself. */
+static void serve_client(int i)
 {
-    user_count = 0;
-    for(int i = 1; i < MAX_FDS; i++)
+    message_t      *message = loop_message;
+    client_state_t *state   = &conns.state[i];
+    ssize_t         retval  = 0;
+    int             budget  = SERVE_BUDGET;
+
+    // Already queued: its next turn comes from ready_run().
+    if(state->ready)
+    {
+        return;
+    }
+    message->client       = &conns.pfd[i];
+    message->client_id    = &conns.user_id[i];
+    message->state        = state;
+    message->response_len = 0;
+    message->code         = EC_GOOD;
+
+    while(retval != END && retval != DISCONNECT)
     {
-        printf("user id: %d\n", client_id[i]);
-        if(client_id[i] != -1)
+        if(budget-- == 0)
         {
-            user_count++;
+            ready_push(i);
+            break;
         }
+        retval = handle_message(message);
+    }
+    if(retval == DISCONNECT)
+    {
+        LOG_INFO("client#%d disconnected.", conns.user_id[i]);
+        close_client(state);
+        return;
+    }
+
+    // A partially received frame must complete within FRAME_TIMEOUT. Frames queued behind a waiting handler are complete.
+    if(state->rx_len > 0 && state->request == NULL && !timer_pending(&state->frame_timer))
+    {
+        timer_schedule(&wheel, &state->frame_timer, FRAME_TIMEOUT);
     }
-    printf("Current number of users: %d\n", user_count);
 }
 
-static void handle_sm_diagnostic(char *msg)
+/* Puts slot i at the back of the ready queue of the class of its next frame. The links live in the slot, so
+   queueing never allocates; a slot that closes while queued is unlinked by release_client(). */
+static void ready_push(int i)
 {
-    char    *ptr = msg;
-    uint16_t temp;
+    client_state_t *state = &conns.state[i];
+    sched_class_t   cls   = state->rx_len > 0 ? packet_class(state->rx_buf[0]) : SCHED_CHAT;
 
-    /* Build the 4-byte header for server management */
-    *ptr++ = SVR_DIAGNOSTIC;                /* Packet type, from your sm_type_t enum (0x0A) */
-    *ptr++ = VERSION_NUM;                   /* Protocol version */
-    temp   = htons(DIAGNOSTIC_PAYLOAD_LEN); /* 10 bytes payload */
+    state->ready      = (int)cls + 1;
+    state->ready_next = 0;
+    state->ready_prev = ready_tail[cls];
+    if(ready_count[cls]++ == 0)
+    {
+        ready_head[cls] = (uint32_t)i;
+    }
+    else
+    {
+        conns.state[ready_tail[cls]].ready_next = (uint32_t)i;
+    }
+    ready_tail[cls] = (uint32_t)i;
+    ready_total++;
+}
+
+/* Takes slot out of the ready queue it waits in, if any. */
+static void ready_remove(uint32_t slot)
+{
+    client_state_t *state = &conns.state[slot];
+    int             cls   = state->ready - 1;
+
+    if(state->ready == 0)
+    {
+        return;
+    }
+    if(ready_head[cls] == slot)
+    {
+        ready_head[cls] = state->ready_next;
+    }
+    else
+    {
+        conns.state[state->ready_prev].ready_next = state->ready_next;
+    }
+    if(ready_tail[cls] == slot)
+    {
+        ready_tail[cls] = state->ready_prev;
+    }
+    else
+    {
+        conns.state[state->ready_next].ready_prev = state->ready_prev;
+    }
+    ready_count[cls]--;
+    ready_total--;
+    state->ready = 0;
+}
+
+/* Gives connections queued before this pass one more turn, most urgent class first and each class no more
+   than its quota. Those that need yet another go to the back, so a busy client never gets two turns in a row. */
+static void ready_run(void)
+{
+    static const uint32_t quota[SCHED_CLASSES] = {SCHED_QUOTA_CONTROL, SCHED_QUOTA_ACCOUNT, SCHED_QUOTA_CHAT};
+
+    for(int cls = 0; cls < SCHED_CLASSES; cls++)
+    {
+        uint32_t n = ready_count[cls] < quota[cls] ? ready_count[cls] : quota[cls];
+
+        // Serving one connection can close others, taking them out of the queue.
+        for(; n > 0 && ready_count[cls] > 0; n--)
+        {
+            uint32_t slot = ready_head[cls];
+
+            ready_remove(slot);
+            serve_client((int)slot);
+        }
+    }
+}
+
+/* Whether work is left over for the next pass, which then must not wait in poll(). */
+static int loop_backlog(void)
+{
+    return ready_total > 0 || fanout_head != NULL || route_pending;
+}
+
+sched_class_t packet_class(uint8_t type)
+{
+    switch(type)
+    {
+        case ACC_LOGIN:
+        case ACC_CREATE:
+        case ACC_EDIT:
+            return SCHED_ACCOUNT;
+        case CHT_SEND:
+        case GRP_JOIN:
+        case GRP_EXIT:
+        case GRP_CREATE:
+            return SCHED_CHAT;
+        default:
+            // Logout, user lists and every reply that only acknowledges a request
+            return SCHED_CONTROL;
+    }
+}
+
+/* Handles one buffered frame, reading more from the socket when no complete frame is buffered.
+   Returns END once the socket has no more data and DISCONNECT when the client has gone away. */
+static ssize_t handle_message(message_t *message)
+{
+    client_state_t *state = message->state;
+    size_t          len;
+    ssize_t         retval;
+    uint64_t        start;
+    int             shed;
+
+    // Frames wait behind a handler that is waiting on storage, so they are handled in order.
+    if(state->request != NULL)
+    {
+        return END;
+    }
+    len = frame_length(state);
+    if(len == 0)
+    {
+        // io_uring has already delivered everything that arrived.
+        return ring_active ? END : read_client(state);
+    }
+    // Every frame received is captured, shed or not and on either path, so a replay sees what the clients sent.
+    capture_event(state->conn_seq, CAPTURE_FRAME, state->rx_buf, len);
+    // Overloaded, sessions that have not started yet are turned away at once, so the ones running keep chatting.
+    shed = overload.active && sheds_when_busy(state->rx_buf[0]);
+    if(shed)
+    {
+        METRIC_ADD(errors[EC_SERVER], 1);
+        METRIC_ADD(shed[overload.reason], 1);
+    }
+    // With worker threads the frame is copied out and handled there, behind the connection's earlier frames.
+    // A shed frame goes the same way, so its error does not overtake the replies to those.
+    if(executor_active())
+    {
+        retval = request_submit(state, len, shed);
+        consume_frame(state, len);
+        return retval;
+    }
+    if(shed)
+    {
+        shed_reply(state, state->rx_buf[0]);
+        consume_frame(state, len);
+        return 0;
+    }
+    // Account handlers go through storage: as coroutines they leave the loop free while they wait.
+    if(storage_io_active() && uses_storage(state->rx_buf[0]))
+    {
+        if(request_spawn(message, len) == 0)
+        {
+            consume_frame(state, len);
+            return 0;
+        }
+        // Inline, the handler would wait for the storage lock the holder keeps until the loop resumes it.
+        if(storage_holder != NULL)
+        {
+            LOG_ERROR("Failed to start account handler while storage is held");
+            consume_frame(state, len);
+            return -2;
+        }
+    }
+
+    /* The frame is decoded in place from the receive buffer */
+    message->req_buf = state->rx_buf;
+
+    /* The response buffer and the handlers' scratch come from the loop's arena */
+    message->arena   = &loop_scratch;
+    message->res_buf = arena_zalloc(&loop_scratch, RESPONSELEN);
+    if(!message->res_buf)
+    {
+        LOG_ERROR("Failed to allocate message response buffer: %s", strerror(errno));
+        retval = -2;
+        goto exit;
+    }
+
+    message->response_len = 0;
+    message->code         = EC_GOOD;
+    start                 = metrics_now_us();
+    retval                = handle_package(message, len);
+    hist_record(&metrics.handler_latency, metrics_now_us() - start);
+    METRIC_ADD(msgs_in, 1);
+    // The response has been written by now, or queued behind what the socket would not take yet.
+    metrics_record_frame(message->type, metrics_now_us() - state->frame_start_us);
+
+    /* A logout ends the session, not the connection: keep serving buffered frames */
+    if(retval == END)
+    {
+        retval = 0;
+    }
+
+exit:
+    message->req_buf = NULL;
+    message->res_buf = NULL;
+    message->arena   = NULL;
+    arena_reset(&loop_scratch);
+    consume_frame(state, len);
+    return retval;
+}
+
+/* BER Decoder function */
+static ssize_t handle_package(message_t *message, size_t len)
+{
+    ssize_t retval;
+
+    if(handle_header(message, (ssize_t)len) < 0)
+    {
+        LOG_DEBUG("Failed to decode header");
+        return -2;
+    }
+
+    retval = handle_payload(message, (ssize_t)(len - HEADERLEN));
+    if(retval == ACCOUNT_ERROR)
+    {
+        LOG_DEBUG("Failed to identify account package");
+        return ACCOUNT_ERROR;
+    }
+    if(retval == ACCOUNT_LOGIN_ERROR)
+    {
+        LOG_DEBUG("Failed to login");
+        return ACCOUNT_LOGIN_ERROR;
+    }
+    if(retval == ACCOUNT_CREATE_ERROR)
+    {
+        LOG_DEBUG("Failed to create account");
+        return ACCOUNT_CREATE_ERROR;
+    }
+    if(retval == ACCOUNT_EDIT_ERROR)
+    {
+        LOG_DEBUG("Failed to edit account");
+        return ACCOUNT_EDIT_ERROR;
+    }
+    if(retval == CHAT_ERROR)
+    {
+        LOG_DEBUG("Chat error");
+        return CHAT_ERROR;
+    }
+    if(retval == END)
+    {
+        LOG_DEBUG("End, closing client fd.");
+        return END;
+    }
+
+    return 0;
+}
+
+/* Reads whatever the socket holds into the receive buffer, growing it to fit the current frame. */
+static ssize_t read_client(client_state_t *state)
+{
+    size_t  need;
+    ssize_t nread;
+
+    need = HEADERLEN;
+    if(state->rx_len >= HEADERLEN)
+    {
+        uint16_t payload_len;
+
+        memcpy(&payload_len, state->rx_buf + HEADERLEN - sizeof(payload_len), sizeof(payload_len));
+        need = HEADERLEN + (size_t)ntohs(payload_len);
+    }
+    if(rx_reserve(state, need) < 0)
+    {
+        return DISCONNECT;
+    }
+
+    nread = read(state->pfd->fd, state->rx_buf + state->rx_len, state->rx_cap - state->rx_len);
+    if(nread < 0)
+    {
+        if(would_block(errno))
+        {
+            // Socket drained; the rest of the frame arrives with a later POLLIN
+            return END;
+        }
+        if(errno == EINTR)
+        {
+            return 0;
+        }
+        LOG_ERROR("Fail to read from client: %s", strerror(errno));
+        return DISCONNECT;
+    }
+    if(nread == 0)
+    {
+        return DISCONNECT;
+    }
+
+    rx_commit(state, (size_t)nread);
+    return 0;
+}
+
+/* Grows the receive buffer to hold at least need bytes. Returns -1 if memory ran out or the connection
+   would go over its memory cap. */
+static int rx_reserve(client_state_t *state, size_t need)
+{
+    if(need < RX_BUF_INIT)
+    {
+        need = RX_BUF_INIT;
+    }
+    if(state->rx_cap < need)
+    {
+        uint8_t *tmp;
+
+        if(conn_mem(state) + (need - state->rx_cap) > global_args.conn_mem_max)
+        {
+            LOG_WARN("client#%d would hold more than %zu bytes", *state->client_id, global_args.conn_mem_max);
+            METRIC_ADD(mem_shed, 1);
+            return -1;
+        }
+        tmp = (uint8_t *)realloc(state->rx_buf, need);
+        if(!tmp)
+        {
+            LOG_ERROR("Failed to grow receive buffer: %s", strerror(errno));
+            return -1;
+        }
+        METRIC_ADD(rx_allocated, (int_fast64_t)(need - state->rx_cap));
+        state->rx_buf = tmp;
+        state->rx_cap = need;
+    }
+    return 0;
+}
+
+/* Accounts for nread bytes just placed after rx_len. */
+static void rx_commit(client_state_t *state, size_t nread)
+{
+    state->last_read_us = metrics_now_us();
+    if(state->rx_len == 0)
+    {
+        state->frame_start_us = state->last_read_us;
+    }
+    state->rx_len += nread;
+    METRIC_ADD(bytes_in, (uint_fast64_t)nread);
+    METRIC_ADD(rx_queued, (int_fast64_t)nread);
+    timer_schedule(&wheel, &state->idle_timer, CLIENT_IDLE_TIMEOUT);
+}
+
+/* Length of the complete frame at the front of the receive buffer, or 0 if it is still partial. */
+static size_t frame_length(const client_state_t *state)
+{
+    uint16_t payload_len;
+    size_t   len;
+
+    if(state->rx_len < HEADERLEN)
+    {
+        return 0;
+    }
+    memcpy(&payload_len, state->rx_buf + HEADERLEN - sizeof(payload_len), sizeof(payload_len));
+    len = HEADERLEN + (size_t)ntohs(payload_len);
+    return state->rx_len >= len ? len : 0;
+}
+
+static void consume_frame(client_state_t *state, size_t len)
+{
+    state->rx_len -= len;
+    METRIC_SUB(rx_queued, (int_fast64_t)len);
+    if(state->rx_len > 0)
+    {
+        memmove(state->rx_buf, state->rx_buf + len, state->rx_len);
+        // The next frame's first byte came in with the latest read.
+        state->frame_start_us = state->last_read_us;
+    }
+    // The frame timer covers only the frame that is currently incomplete.
+    timer_cancel(&wheel, &state->frame_timer);
+}
+
+/* The table has put client_fd in the slot; its user id stays CONN_NO_USER until a login. */
+static void open_client(client_state_t *state, int client_fd)
+{
+    state->pfd->events = ring_active ? 0 : POLLIN;    // The ring does the reading
+    state->rx_len      = 0;
+    state->shed        = 0;
+    state->ready       = 0;
+    state->conn_seq = ++conn_seq;
+    METRIC_ADD(connections, 1);
+    capture_event(state->conn_seq, CAPTURE_OPEN, NULL, 0);
+    if(router_active())
+    {
+        router_join(ROUTER_IO, (uint32_t)(state - conns.state), route_handle(state));
+    }
+    timer_schedule(&wheel, &state->idle_timer, CLIENT_IDLE_TIMEOUT);
+    if(ring_active && !draining)
+    {
+        state->rx_armed = uring_recv_multishot(&ring, client_fd, recv_user_data((int)(state - conns.state))) == 0;
+    }
+}
+
+static void close_client(client_state_t *state)
+{
+    capture_event(state->conn_seq, CAPTURE_CLOSE, NULL, 0);
+    if(ring_active)
+    {
+        // Queued SQEs name this fd by number: submit them before the number can be reused.
+        // shutdown() then ends the multishot receive, whose last completion is ignored.
+        uring_submit(&ring);
+        shutdown(state->pfd->fd, SHUT_RDWR);
+    }
+    release_client(state);
+}
+
+/* Frees the slot and drops this process's reference to the socket, leaving the connection itself alone. */
+static void release_client(client_state_t *state)
+{
+    // A reused slot must not inherit this connection's place in a ready queue.
+    ready_remove((uint32_t)(state - conns.state));
+    timer_cancel(&wheel, &state->idle_timer);
+    timer_cancel(&wheel, &state->frame_timer);
+    sfree((void **)&state->rx_buf);
+    METRIC_SUB(rx_queued, (int_fast64_t)state->rx_len);
+    METRIC_SUB(rx_allocated, (int_fast64_t)state->rx_cap);
+    METRIC_SUB(connections, 1);
+    if(router_active())
+    {
+        router_leave(ROUTER_IO, (uint32_t)(state - conns.state));
+    }
+    if(state->request != NULL)
+    {
+        request_detach(state->request);
+        state->request = NULL;
+    }
+    state->rx_len   = 0;
+    state->rx_cap   = 0;
+    state->rx_armed = 0;
+
+    // An io_uring send in flight still belongs to the kernel; its completion frees it.
+    tx_drop(state, ring_active ? state->tx_head : NULL);
+    close(state->pfd->fd);
+    conn_table_release(&conns, (uint32_t)(state - conns.state));
+}
+
+/* Puts the clients taken over from the old server into slots, along with any frame they had half sent. */
+static void handoff_adopt(const handoff_t *handoff)
+{
+    for(size_t i = 0; i < handoff->count; i++)
+    {
+        const handoff_client_t *client = &handoff->clients[i];
+        int                     slot   = admit_client(client->fd);
+        client_state_t         *state;
+
+        if(slot < 0)
+        {
+            continue;
+        }
+        state               = &conns.state[slot];
+        conns.user_id[slot] = client->client_id;
+        if(client->rx_len == 0)
+        {
+            continue;
+        }
+        if(rx_reserve(state, client->rx_len) < 0)
+        {
+            close_client(state);
+            continue;
+        }
+        memcpy(state->rx_buf, client->rx, client->rx_len);
+        rx_commit(state, client->rx_len);
+        serve_client(slot);
+    }
+}
+
+/* A successor has connected: stop reading, pass it the listener and every client, and let the loop end.
+   If the handoff fails the server carries on as before. */
+static void handoff_serve(int server_fd, handoff_t *handoff)
+{
+    handoff_client_t *clients;
+    size_t            count = 0;
+    int               conn_fd;
+
+    conn_fd = accept(handoff->listen_fd, NULL, NULL);
+    if(conn_fd < 0)
+    {
+        LOG_ERROR("handoff accept: %s", strerror(errno));
+        return;
+    }
+    LOG_INFO("Successor connected, handing over connections");
+
+    // Requests still on the workers or waiting on storage are answered first; their replies join the send queues.
+    if(requests_settle(HANDOFF_TIMEOUT) < 0)
+    {
+        LOG_WARN("Requests still running after %d ms, handing over anyway", HANDOFF_TIMEOUT);
+    }
+    fanout_flush();
+    // With io_uring, reads and queued sends must finish before another process touches the sockets.
+    if(ring_active && ring_drain(server_fd) < 0)
+    {
+        LOG_WARN("io_uring did not drain in %d ms, handing over anyway", HANDOFF_TIMEOUT);
+    }
+    // With poll(), the queued sends must.
+    if(!ring_active && tx_drain() < 0)
+    {
+        LOG_WARN("Sends did not drain in %d ms, handing over anyway", HANDOFF_TIMEOUT);
+    }
+
+    clients = (handoff_client_t *)malloc((conns.count > 0 ? conns.count : 1) * sizeof(handoff_client_t));
+    for(uint32_t i = conns.base; clients != NULL && i < conns.high; i++)
+    {
+        if(conns.pfd[i].fd != -1)
+        {
+            clients[count].fd        = conns.pfd[i].fd;
+            clients[count].client_id = conns.user_id[i];
+            clients[count].rx_len    = (uint32_t)conns.state[i].rx_len;
+            clients[count].rx        = conns.state[i].rx_buf;
+            count++;
+        }
+    }
+
+    if(clients == NULL || handoff_send(conn_fd, server_fd, clients, count) < 0)
+    {
+        free(clients);
+        LOG_ERROR("Handoff failed, keeping connections");
+        close(conn_fd);
+        if(ring_active)
+        {
+            ring_resume(server_fd);
+        }
+        for(uint32_t i = conns.base; !ring_active && i < conns.high; i++)
+        {
+            if(conns.pfd[i].fd != -1 && conns.state[i].request == NULL)
+            {
+                conns.pfd[i].events |= POLLIN;
+            }
+        }
+        return;
+    }
+
+    free(clients);
+    // The successor has confirmed it holds every client, so ours can go.
+    for(uint32_t i = conns.base; i < conns.high; i++)
+    {
+        if(conns.pfd[i].fd != -1)
+        {
+            release_client(&conns.state[i]);
+        }
+    }
+    // Held open until exit: the successor waits for it to close before opening the databases.
+    handoff->successor_fd = conn_fd;
+    server_running        = 0;
+    LOG_INFO("Handed over %zu client(s), exiting", count);
+}
+
+static void idle_timeout(void *arg)
+{
+    client_state_t         *state = (client_state_t *)arg;
+    const response_frame_t *frame = response_lookup(SYS_ERROR, EC_REQ_TIMEOUT);
+
+    LOG_INFO("client#%d idle for %d ms, closing.", *state->client_id, CLIENT_IDLE_TIMEOUT);
+    METRIC_ADD(errors[EC_REQ_TIMEOUT], 1);
+    send_client(state, frame->buf, frame->len);
+    close_client(state);
+}
+
+static void frame_timeout(void *arg)
+{
+    client_state_t         *state = (client_state_t *)arg;
+    const response_frame_t *frame = response_lookup(SYS_ERROR, EC_REQ_TIMEOUT);
+
+    LOG_INFO("client#%d sent a partial frame (%zu bytes) and stalled, closing.", *state->client_id, state->rx_len);
+    METRIC_ADD(errors[EC_REQ_TIMEOUT], 1);
+    send_client(state, frame->buf, frame->len);
+    close_client(state);
+}
+
+static void housekeeping(void *arg)
+{
+    housekeeping_t *hk = (housekeeping_t *)arg;
+
+    // The write is queued for the storage thread, so a slow disk never holds up the loop. A sync still
+    // queued from last time just takes the newer value.
+    if(hk->meta_db->db != NULL && store_int_async(hk->meta_db->db, "USER_PK", user_index, user_index_synced, NULL) < 0)
+    {
+        LOG_ERROR("update user_index: %s", strerror(errno));
+    }
+    capture_flush();
+    timer_schedule(&wheel, &hk->timer, HOUSEKEEPING_INTERVAL);
+}
+
+static void user_index_synced(int result, void *ctx)
+{
+    (void)ctx;
+    if(result != 0)
+    {
+        LOG_ERROR("update user_index: write failed");
+    }
+}
+
+static void diagnostics(void *arg)
+{
+    diagnostics_t *diag = (diagnostics_t *)arg;
+
+    count_user();
+    overload_log();
+    if(sm_link_enabled(&sm_link))    // Only send diagnostic update if connected to the server manager.
+    {
+        if(global_args.diag_version == DIAG_VERSION_EXTENDED)
+        {
+            uint8_t ext_msg[DIAG_EXT_MSG_MAX];
+            size_t  len = handle_sm_diagnostic_ext(ext_msg);
+
+            if(sm_link_send(&sm_link, ext_msg, len) < 0)
+            {
+                LOG_ERROR("Failed to queue diagnostics");
+            }
+        }
+        else
+        {
+            send_sm_response(diag->sm_msg);
+        }
+    }
+    timer_schedule(&wheel, &diag->timer, DIAGNOSTIC_INTERVAL);
+}
+
+ssize_t handle_header(message_t *message, ssize_t nread)
+{
+    char *buf;
+
+    buf = (char *)message->req_buf;
+    if(nread < HEADERLEN)
+    {
+        LOG_DEBUG("Payload length mismatch");
+        message->code = EC_INV_REQ;
+        return -1;
+    }
+
+    memcpy(&message->type, buf, sizeof(message->type));
+    buf += sizeof(message->type);
+
+    memcpy(&message->version, buf, sizeof(message->version));
+    buf += sizeof(message->version);
+
+    memcpy(&message->sender_id, buf, sizeof(message->sender_id));
+    buf += sizeof(message->sender_id);
+    message->sender_id = ntohs(message->sender_id);
+
+    memcpy(&message->payload_len, buf, sizeof(message->payload_len));
+    message->payload_len = ntohs(message->payload_len);
+
+    LOG_DEBUG("Header type: %d version: %d sender_id: %d payload_len: %d", (int)message->type, (int)message->version, (int)message->sender_id, (int)message->payload_len);
+
+    return 0;
+}
+
+static ssize_t handle_payload(message_t *message, ssize_t nread)
+{
+    ssize_t retval;
+
+    if(nread < (ssize_t)message->payload_len)
+    {
+        LOG_DEBUG("Payload length mismatch");
+        message->code = EC_INV_REQ;
+        return ACCOUNT_ERROR;
+    }
+
+    switch(message->type)
+    {
+        case ACC_LOGIN:
+        case ACC_CREATE:
+        case ACC_EDIT:
+        case ACC_LOGOUT:
+            storage_lock();
+            retval = account_handler(message);
+            storage_unlock();
+            if(retval < 0)
+            {
+                send_error_response(message);
+                return retval;
+            }
+            break;
+
+        case CHT_SEND:
+            retval = chat_handler(message);
+            if(retval < 0)
+            {
+                send_error_response(message);
+                return retval;
+            }
+            break;
+
+        default:
+            message->code = EC_INV_REQ;
+            send_error_response(message);
+            return ACCOUNT_ERROR;
+    }
+
+    // If no error, return 0 always
+    return handle_response(message);
+}
+
+static ssize_t handle_response(message_t *message)
+{
+    if(message->type != CHT_SEND)
+    {
+        const void *buf;
+        size_t      len;
+
+        /* Handlers only fill res_buf for replies with per-request fields */
+        if(message->response_len > 0)
+        {
+            buf = message->res_buf;
+            len = message->response_len;
+        }
+        else
+        {
+            const response_frame_t *frame = response_lookup(message->type, EC_GOOD);
+
+            buf = frame->buf;
+            len = frame->len;
+        }
+        LOG_DEBUG("response_len: %d", (int)len);
+        if(len > 0)
+        {
+            send_client(message->state, buf, len);
+        }
+    }
+
+    return 0;
+}
+
+/* Counts the connections that have logged in, reading only the dense user id array. */
+static void count_user(void)
+{
+    user_count = 0;
+    for(uint32_t i = conns.base; i < conns.high; i++)
+    {
+        if(conns.user_id[i] != CONN_NO_USER)
+        {
+            user_count++;
+        }
+    }
+    LOG_DEBUG("Current number of users: %d", user_count);
+}
+
+static void handle_sm_diagnostic(char *msg)
+{
+    char    *ptr = msg;
+    uint16_t temp;
+
+    /* Build the 4-byte header for server management */
+    *ptr++ = SVR_DIAGNOSTIC;                /* Packet type, from your sm_type_t enum (0x0A) */
+    *ptr++ = VERSION_NUM;                   /* Protocol version */
+    temp   = htons(DIAGNOSTIC_PAYLOAD_LEN); /* 10 bytes payload */
     memcpy(ptr, &temp, sizeof(temp));
     ptr += sizeof(temp);
 
-    /* Append the diagnostic payload */
-    /* First BER block: user_count */
-    *ptr++ = BER_INT;          /* BER tag (should be 0x02) */
-    *ptr++ = sizeof(uint16_t); /* Length: 2 bytes */
-    temp   = htons(user_count);
-    memcpy(ptr, &temp, sizeof(temp));
-    ptr += sizeof(uint16_t);
+    /* Append the diagnostic payload */
+    /* First BER block: user_count */
+    *ptr++ = BER_INT;          /* BER tag (should be 0x02) */
+    *ptr++ = sizeof(uint16_t); /* Length: 2 bytes */
+    temp   = htons(user_count);
+    memcpy(ptr, &temp, sizeof(temp));
+    ptr += sizeof(uint16_t);
+
+    /* Second BER block: msg_count */
+    *ptr++ = BER_INT;          /* BER tag */
+    *ptr++ = sizeof(uint32_t); /* Length: 4 bytes */
+    {
+        uint32_t temp32 = htonl(msg_count);
+        memcpy(ptr, &temp32, sizeof(temp32));
+    }
+    /* Total bytes written = SM_HEADERLEN (4) + DIAGNOSTIC_PAYLOAD_LEN (10) = 14 bytes */
+}
+
+/* Builds the extended (version 2) diagnostic frame and returns its length.
+   Payload: a 1-byte version, then active connections, msg_count, messages/sec,
+   bytes in, bytes out, p50 and p99 handler latency (us), receive queue bytes,
+   log queue records and connection buffer bytes, each a fixed-width
+   big-endian BER_INT.
+*/
+static size_t handle_sm_diagnostic_ext(uint8_t *msg)
+{
+    metrics_report_t report;
+    uint8_t         *ptr;
+    uint16_t         payload_len;
+
+    metrics_report(&report);
+
+    ptr = msg + SM_HEADERLEN;
+    ptr = put_ber_uint(ptr, DIAG_VERSION_EXTENDED, sizeof(uint8_t));
+    ptr = put_ber_uint(ptr, (uint64_t)report.connections, sizeof(uint32_t));
+    ptr = put_ber_uint(ptr, msg_count, sizeof(uint32_t));
+    ptr = put_ber_uint(ptr, report.msgs_per_sec, sizeof(uint32_t));
+    ptr = put_ber_uint(ptr, report.bytes_in, sizeof(uint64_t));
+    ptr = put_ber_uint(ptr, report.bytes_out, sizeof(uint64_t));
+    ptr = put_ber_uint(ptr, report.p50_us, sizeof(uint32_t));
+    ptr = put_ber_uint(ptr, report.p99_us, sizeof(uint32_t));
+    ptr = put_ber_uint(ptr, (uint64_t)report.rx_queued, sizeof(uint32_t));
+    ptr = put_ber_uint(ptr, report.log_backlog, sizeof(uint32_t));
+    ptr = put_ber_uint(ptr, (uint64_t)report.mem_held, sizeof(uint64_t));
+
+    payload_len = htons((uint16_t)(ptr - msg - SM_HEADERLEN));
+    msg[0]      = SVR_DIAGNOSTIC;
+    msg[1]      = VERSION_NUM;
+    memcpy(msg + 2, &payload_len, sizeof(payload_len));
+
+    LOG_DEBUG("Diagnostics: %d conns, %u msg/s, p50 %lu us, p99 %lu us, %ld buffer bytes", (int)report.connections, report.msgs_per_sec, (unsigned long)report.p50_us, (unsigned long)report.p99_us, (long)report.mem_held);
+    return (size_t)(ptr - msg);
+}
+
+/* Writes value as a BER_INT of exactly width bytes, saturating if it does not fit. */
+static uint8_t *put_ber_uint(uint8_t *ptr, uint64_t value, uint8_t width)
+{
+    if(width < sizeof(uint64_t) && value >= ((uint64_t)1 << (width * 8)))
+    {
+        value = ((uint64_t)1 << (width * 8)) - 1;
+    }
+    *ptr++ = BER_INT;
+    *ptr++ = width;
+    for(int i = width - 1; i >= 0; i--)
+    {
+        *ptr++ = (uint8_t)(value >> (i * 8));
+    }
+    return ptr;
+}
+
+/* Send the diagnostic message to the server manager.
+   Since the server manager protocol uses a 4-byte header,
+   we update the payload fields using SM_HEADERLEN as the starting offset.
+   We no longer attempt to read any response.
+*/
+static void send_sm_response(char *msg)
+{
+    char    *ptr = msg;
+    uint16_t net_uc;
+    uint32_t net_mc;
+
+    /* Update the diagnostic payload values */
+    /* Skip SM_HEADERLEN (4 bytes) and the first BER tag and length (2 bytes)
+       so that we are at offset 6 (4+2) where the user_count value (2 bytes) should be.
+    */
+    ptr += SM_HEADERLEN + 2;
+    net_uc = htons(user_count);
+    memcpy(ptr, &net_uc, sizeof(net_uc));
+
+    /* Skip the user_count value (2 bytes) and the next BER tag and length (2 bytes)
+       to locate the msg_count value (offset 10 in the packet).
+    */
+    ptr += sizeof(uint16_t) + 2;
+    net_mc = htonl(msg_count);
+    memcpy(ptr, &net_mc, sizeof(net_mc));
+
+    LOG_DEBUG("Sending user count to server manager");
+    if(sm_link_send(&sm_link, msg, DIAGNOSTIC_MSG_LEN) < 0)
+    {
+        LOG_ERROR("Failed to queue user count");
+    }
+    /* We do not attempt to read any response because the manager protocol
+       currently does not send an acknowledgment for diagnostic updates.
+    */
+}
+
+ssize_t send_error_response(message_t *message)
+{
+    const response_frame_t *frame;
+
+    METRIC_ADD(errors[message->code], 1);
+    frame = response_lookup(message->type, message->code);
+    if(frame->len > 0)
+    {
+        LOG_DEBUG("sending error response");
+        if(send_client(message->state, frame->buf, frame->len) < 0)
+        {
+            LOG_ERROR("Failed to send error response: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+ssize_t send_client(client_state_t *state, const void *buf, size_t len)
+{
+    size_t    left   = len;
+    int       urgent = packet_class(((const uint8_t *)buf)[0]) != SCHED_CHAT;
+    tx_buf_t *tx;
+
+    // A handler on a worker thread leaves the socket to the loop.
+    if(executor_on_worker())
+    {
+        return reply_post(REPLY_SEND, buf, len);
+    }
+    // The connection closed while its handler waited on storage.
+    if(state->pfd->fd < 0)
+    {
+        return -1;
+    }
+    // With poll() and nothing queued, the frame usually goes straight out without a copy.
+    if(!ring_active && state->tx_head == NULL)
+    {
+        ssize_t nwritten = tx_write_now(state, buf, len);
+
+        if(nwritten < 0 || (size_t)nwritten == len)
+        {
+            return nwritten;
+        }
+        buf = (const uint8_t *)buf + nwritten;
+        left -= (size_t)nwritten;
+    }
+    tx = tx_alloc(buf, left, 1);
+    if(tx == NULL)
+    {
+        return -1;
+    }
+    tx_push(state, tx, urgent);
+    return (ssize_t)len;
+}
+
+void send_broadcast(const void *buf, size_t len)
+{
+    fanout_t *job;
+
+    // The router resolves the recipients and hands them back through route_deliver().
+    // If its queue is full we fan out here, as without it.
+    if(router_active() && router_publish(buf, len) == 0)
+    {
+        return;
+    }
+    if(executor_on_worker())
+    {
+        reply_post(REPLY_BROADCAST, buf, len);
+        return;
+    }
+    // The loop writes it out FANOUT_QUOTA recipients per pass, so a broadcast to every client does not hold
+    // up the passes in between. The job's reference keeps the copy alive until the last recipient.
+    job = (fanout_t *)malloc(sizeof(fanout_t));
+    if(job == NULL)
+    {
+        LOG_ERROR("Failed to allocate broadcast: %s", strerror(errno));
+        return;
+    }
+    job->tx = tx_alloc(buf, len, 1);
+    if(job->tx == NULL)
+    {
+        free(job);
+        return;
+    }
+    METRIC_ADD(tx_allocated, (int_fast64_t)sizeof(fanout_t));
+    job->next      = NULL;
+    job->next_slot = conns.base;
+    job->seq_limit = conn_seq;
+    *fanout_tail   = job;
+    fanout_tail    = &job->next;
+    // Broadcasts arriving faster than the quota writes them out would pile up; the oldest goes out in full.
+    if(++fanout_pending > FANOUT_BACKLOG_MAX)
+    {
+        fanout_step(fanout_head, UINT32_MAX);
+        fanout_pop();
+    }
+}
+
+/* Writes out every queued broadcast, before the connections change hands or close. */
+static void fanout_flush(void)
+{
+    while(fanout_head != NULL)
+    {
+        fanout_run();
+    }
+}
+
+/* Writes the queued broadcasts to up to FANOUT_QUOTA recipients, oldest broadcast first, so each recipient
+   gets them in order. Connections opened after a broadcast was sent do not get it. */
+static void fanout_run(void)
+{
+    uint32_t budget = FANOUT_QUOTA;
+
+    while(fanout_head != NULL && budget > 0)
+    {
+        budget = fanout_step(fanout_head, budget);
+        if(fanout_head->next_slot < conns.high)
+        {
+            return;
+        }
+        fanout_pop();
+    }
+}
+
+/* Writes a broadcast to up to budget more recipients. Returns what is left of the budget. */
+static uint32_t fanout_step(fanout_t *job, uint32_t budget)
+{
+    while(job->next_slot < conns.high && budget > 0)
+    {
+        client_state_t *state = &conns.state[job->next_slot];
+
+        if(conns.pfd[job->next_slot++].fd == -1 || (int32_t)(state->conn_seq - job->seq_limit) > 0)
+        {
+            continue;
+        }
+        budget--;
+        tx_share(state, job->tx);
+    }
+    return budget;
+}
+
+/* Frees the oldest broadcast, which every recipient has been given. */
+static void fanout_pop(void)
+{
+    fanout_t *job = fanout_head;
+
+    fanout_head = job->next;
+    if(fanout_head == NULL)
+    {
+        fanout_tail = &fanout_head;
+    }
+    fanout_pending--;
+    METRIC_SUB(tx_allocated, (int_fast64_t)sizeof(fanout_t));
+    tx_unref(job->tx);
+    free(job);
+}
+
+/* Sets up the ring and arms the multishot accept. Returns -1 (and the caller stays on poll) if io_uring is unusable. */
+static int ring_start(int server_fd)
+{
+    if(uring_init(&ring, URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE) < 0)
+    {
+        LOG_WARN("io_uring unavailable, using poll()");
+        return -1;
+    }
+    accept_armed = 1;
+    if(uring_accept_multishot(&ring, server_fd, UD_ACCEPT) < 0 || uring_submit(&ring) < 0)
+    {
+        uring_destroy(&ring);
+        LOG_WARN("io_uring accept failed, using poll()");
+        return -1;
+    }
+    LOG_INFO("Client I/O on io_uring");
+    return 0;
+}
+
+/* Dispatches every completion waiting in the ring. */
+static void ring_reap(int server_fd)
+{
+    uring_event_t event;
+
+    while(uring_next(&ring, &event))
+    {
+        switch(event.user_data & UD_KIND_MASK)
+        {
+            case UD_ACCEPT:
+                if(event.res >= 0)
+                {
+                    admit_client(event.res);
+                }
+                else if(event.res != -ECANCELED)
+                {
+                    LOG_ERROR("accept error: %s", strerror(-event.res));
+                }
+                // The kernel ends a multishot request on errors and overflow; start another.
+                if(!event.more)
+                {
+                    accept_armed = !draining && !accept_paused && event.res != -EINVAL && uring_accept_multishot(&ring, server_fd, UD_ACCEPT) == 0;
+                }
+                break;
+            case UD_CANCEL:
+                break;
+            case UD_RECV:
+                ring_recv(&event);
+                break;
+            default:
+                tx_complete((tx_op_t *)(uintptr_t)event.user_data, event.res);
+                break;
+        }
+    }
+}
+
+/* Appends received bytes to the connection and serves every frame they complete. */
+static void ring_recv(const uring_event_t *event)
+{
+    uint64_t        slot  = event->user_data >> UD_SLOT_SHIFT;
+    uint32_t        gen   = (uint32_t)(event->user_data >> UD_SEQ_SHIFT);
+    client_state_t *state = &conns.state[slot];
+    int             fd    = conns.pfd[slot].fd;
+
+    // Completions can outlive the connection they were armed for.
+    if(fd == -1 || conns.gen[slot] != gen)
+    {
+        if(event->buffer != URING_NO_BUFFER)
+        {
+            uring_buffer_recycle(&ring, event->buffer);
+        }
+        return;
+    }
+    // Cancelled by ring_drain(): the socket stays open for the successor.
+    if(event->res == -ECANCELED)
+    {
+        state->rx_armed = 0;
+        return;
+    }
+
+    if(event->res > 0)
+    {
+        int ok = rx_reserve(state, state->rx_len + (size_t)event->res) == 0;
+
+        if(ok)
+        {
+            memcpy(state->rx_buf + state->rx_len, uring_buffer(&ring, event->buffer), (size_t)event->res);
+            rx_commit(state, (size_t)event->res);
+        }
+        uring_buffer_recycle(&ring, event->buffer);
+        if(!ok)
+        {
+            close_client(state);
+            return;
+        }
+        serve_client((int)slot);
+    }
+    else if(event->res != -ENOBUFS)
+    {
+        if(event->res < 0)
+        {
+            LOG_ERROR("Fail to read from client: %s", strerror(-event->res));
+        }
+        LOG_INFO("client#%d disconnected.", *state->client_id);
+        close_client(state);
+        return;
+    }
+
+    // Out of provided buffers (or any other reason the kernel stopped): arm again, unless draining for a handoff.
+    if(!event->more && state->pfd->fd == fd && conns.gen[slot] == gen)
+    {
+        state->rx_armed = !draining && uring_recv_multishot(&ring, fd, event->user_data) == 0;
+    }
+}
+
+static uint64_t recv_user_data(int slot)
+{
+    return ((uint64_t)slot << UD_SLOT_SHIFT) | ((uint64_t)conns.gen[slot] << UD_SEQ_SHIFT) | UD_RECV;
+}
+
+/* Cancels the accept and every receive, then runs the ring until they have ended and all queued sends
+   have gone out. Frames that arrive meanwhile are served as usual. Returns -1 on timeout. */
+static int ring_drain(int server_fd)
+{
+    uint64_t deadline = metrics_now_us() + ((uint64_t)HANDOFF_TIMEOUT * US_PER_MS);
+
+    draining = 1;
+    if(accept_armed)
+    {
+        uring_cancel(&ring, UD_ACCEPT, UD_CANCEL);
+    }
+    for(int i = (int)conns.base; i < (int)conns.high; i++)
+    {
+        if(conns.pfd[i].fd != -1 && conns.state[i].rx_armed)
+        {
+            uring_cancel(&ring, recv_user_data(i), UD_CANCEL);
+        }
+    }
+
+    for(;;)
+    {
+        struct pollfd pfd  = {.fd = ring.fd, .events = POLLIN, .revents = 0};
+        int           busy = accept_armed;
+
+        for(uint32_t i = conns.base; i < conns.high; i++)
+        {
+            busy |= conns.pfd[i].fd != -1 && (conns.state[i].rx_armed || conns.state[i].tx_head != NULL);
+        }
+        if(!busy)
+        {
+            return 0;
+        }
+        if(metrics_now_us() > deadline)
+        {
+            return -1;
+        }
+        uring_submit(&ring);
+        if(poll(&pfd, 1, DRAIN_POLL_MS) > 0)
+        {
+            ring_reap(server_fd);
+        }
+    }
+}
+
+/* Undoes ring_drain() after a failed handoff. */
+static void ring_resume(int server_fd)
+{
+    draining = 0;
+    if(!accept_armed && !accept_paused)
+    {
+        accept_armed = uring_accept_multishot(&ring, server_fd, UD_ACCEPT) == 0;
+    }
+    for(int i = (int)conns.base; i < (int)conns.high; i++)
+    {
+        if(conns.pfd[i].fd != -1 && !conns.state[i].rx_armed)
+        {
+            conns.state[i].rx_armed = uring_recv_multishot(&ring, conns.pfd[i].fd, recv_user_data(i)) == 0;
+        }
+    }
+}
+
+static tx_buf_t *tx_alloc(const void *buf, size_t len, uint32_t refs)
+{
+    tx_buf_t *tx;
+
+    if(refs == 0)
+    {
+        return NULL;
+    }
+    tx = (tx_buf_t *)malloc(sizeof(tx_buf_t) + len);
+    if(tx == NULL)
+    {
+        LOG_ERROR("Failed to allocate send buffer: %s", strerror(errno));
+        return NULL;
+    }
+    tx->refs = refs;
+    tx->len  = (uint32_t)len;
+    memcpy(tx->data, buf, len);
+    METRIC_ADD(tx_allocated, (int_fast64_t)(sizeof(tx_buf_t) + len));
+    return tx;
+}
+
+/* Queues buf on the connection, taking over the caller's reference. If nothing else is queued the send starts
+   at once with io_uring; with poll() it waits for the socket to be writable. An urgent send goes behind the
+   one in flight and the urgent ones before it, ahead of any queued chat. A connection that is not reading
+   fast enough to stay under its memory cap gets nothing more and is shed. Returns the queued send, or NULL. */
+static tx_op_t *tx_push(client_state_t *state, tx_buf_t *buf, int urgent)
+{
+    tx_op_t *op;
+
+    if(state->shed)
+    {
+        tx_unref(buf);
+        return NULL;
+    }
+    if(conn_mem(state) + sizeof(tx_op_t) + buf->len > global_args.conn_mem_max)
+    {
+        LOG_WARN("client#%d has %zu bytes of sends queued; shedding it", *state->client_id, state->tx_queued);
+        state->shed  = 1;
+        shed_pending = 1;
+        tx_unref(buf);
+        return NULL;
+    }
+    op = (tx_op_t *)malloc(sizeof(tx_op_t));
+    if(op == NULL)
+    {
+        LOG_ERROR("Failed to allocate send: %s", strerror(errno));
+        tx_unref(buf);
+        return NULL;
+    }
+    op->next  = NULL;
+    op->buf   = buf;
+    op->state = state;
+    op->sent  = 0;
+    state->tx_queued += sizeof(tx_op_t) + buf->len;
+    METRIC_ADD(tx_allocated, (int_fast64_t)sizeof(tx_op_t));
+
+    if(state->tx_tail != NULL)
+    {
+        // The head may be part sent; nothing goes in front of it.
+        tx_op_t *after = urgent ? (state->tx_urgent != NULL ? state->tx_urgent : state->tx_head) : state->tx_tail;
+
+        op->next    = after->next;
+        after->next = op;
+        if(state->tx_tail == after)
+        {
+            state->tx_tail = op;
+        }
+        if(urgent)
+        {
+            state->tx_urgent = op;
+        }
+        return op;
+    }
+    state->tx_head = op;
+    state->tx_tail = op;
+    if(!ring_active)
+    {
+        state->pfd->events |= POLLOUT;
+        return op;
+    }
+    if(tx_start(op) < 0)
+    {
+        tx_drop(state, NULL);
+        return NULL;
+    }
+    return op;
+}
+
+/* Sends a copy several recipients share. With poll() and nothing queued it is written at once, and only what
+   the socket does not take is queued, holding a reference of its own. */
+static void tx_share(client_state_t *state, tx_buf_t *buf)
+{
+    ssize_t  nwritten = 0;
+    tx_op_t *op;
 
-    /* Second BER block: msg_count */
-    *ptr++ = BER_INT;          /* BER tag */
-    *ptr++ = sizeof(uint32_t); /* Length: 4 bytes */
+    if(!ring_active && state->tx_head == NULL)
     {
-        uint32_t temp32 = htonl(msg_count);
-        memcpy(ptr, &temp32, sizeof(temp32));
+        nwritten = tx_write_now(state, buf->data, buf->len);
+        if(nwritten < 0 || (size_t)nwritten == buf->len)
+        {
+            return;
+        }
+    }
+    buf->refs++;
+    op = tx_push(state, buf, 0);
+    if(op != NULL)
+    {
+        op->sent = (uint32_t)nwritten;
     }
-    /* Total bytes written = SM_HEADERLEN (4) + DIAGNOSTIC_PAYLOAD_LEN (10) = 14 bytes */
 }
 
-/* Send the diagnostic message to the server manager.
-   Since the server manager protocol uses a 4-byte header,
-   we update the payload fields using SM_HEADERLEN as the starting offset.
-   We no longer attempt to read any response.
-*/
-static void send_sm_response(char *msg)
+/* Poll mode, nothing queued: writes what the socket takes right now. Returns the bytes written, 0 if it is full,
+   or -1 if the connection has failed, which the loop then sees as a hangup. */
+static ssize_t tx_write_now(client_state_t *state, const void *buf, size_t len)
 {
-    char    *ptr = msg;
-    uint16_t net_uc;
-    uint32_t net_mc;
+    ssize_t nwritten = write(state->pfd->fd, buf, len);
 
-    /* Update the diagnostic payload values */
-    /* Skip SM_HEADERLEN (4 bytes) and the first BER tag and length (2 bytes)
-       so that we are at offset 6 (4+2) where the user_count value (2 bytes) should be.
-    */
-    ptr += SM_HEADERLEN + 2;
-    net_uc = htons(user_count);
-    memcpy(ptr, &net_uc, sizeof(net_uc));
+    if(nwritten < 0)
+    {
+        return would_block(errno) || errno == EINTR ? 0 : -1;
+    }
+    METRIC_ADD(bytes_out, (uint_fast64_t)nwritten);
+    return nwritten;
+}
 
-    /* Skip the user_count value (2 bytes) and the next BER tag and length (2 bytes)
-       to locate the msg_count value (offset 10 in the packet).
-    */
-    ptr += sizeof(uint16_t) + 2;
-    net_mc = htonl(msg_count);
-    memcpy(ptr, &net_mc, sizeof(net_mc));
+/* Poll mode, the socket is writable: writes queued sends, urgent ones first as queued, until it is full again.
+   Stops watching for POLLOUT once the queue is empty. Returns -1 if the connection has failed. */
+static int tx_flush(client_state_t *state)
+{
+    while(state->tx_head != NULL)
+    {
+        tx_op_t *op       = state->tx_head;
+        ssize_t  nwritten = tx_write_now(state, op->buf->data + op->sent, op->buf->len - op->sent);
+
+        if(nwritten < 0)
+        {
+            return -1;
+        }
+        op->sent += (uint32_t)nwritten;
+        if(op->sent < op->buf->len)
+        {
+            return 0;
+        }
+        tx_pop(state);
+    }
+    state->pfd->events &= (short)~POLLOUT;
+    return 0;
+}
+
+/* Poll mode: writes out every queued send before another process takes the sockets, which stop being read.
+   Connections that fail meanwhile are closed. Returns -1 on timeout. */
+static int tx_drain(void)
+{
+    uint64_t deadline = metrics_now_us() + ((uint64_t)HANDOFF_TIMEOUT * US_PER_MS);
 
-    printf("Sending user count to server manager\n");
-    if(write(sm_fd, msg, DIAGNOSTIC_MSG_LEN) < 0)
+    for(uint32_t i = conns.base; i < conns.high; i++)
     {
-        perror("Failed to send user count");
+        conns.pfd[i].events &= (short)~POLLIN;
     }
-    /* We do not attempt to read any response because the manager protocol
-       currently does not send an acknowledgment for diagnostic updates.
-    */
+    for(;;)
+    {
+        int busy = 0;
+
+        for(uint32_t i = conns.base; i < conns.high; i++)
+        {
+            if(conns.pfd[i].fd == -1 || conns.state[i].tx_head == NULL)
+            {
+                continue;
+            }
+            if(tx_flush(&conns.state[i]) < 0)
+            {
+                close_client(&conns.state[i]);
+                continue;
+            }
+            busy |= conns.state[i].tx_head != NULL;
+        }
+        if(!busy)
+        {
+            return 0;
+        }
+        if(metrics_now_us() > deadline)
+        {
+            return -1;
+        }
+        poll(conns.pfd + conns.base, conns.high - conns.base, DRAIN_POLL_MS);
+    }
+}
+
+static int tx_start(tx_op_t *op)
+{
+    return uring_send(&ring, op->state->pfd->fd, op->buf->data + op->sent, op->buf->len - op->sent, (uint64_t)(uintptr_t)op);
+}
+
+/* A send finished: resend the remainder of a short write, otherwise start the next queued frame. */
+static void tx_complete(tx_op_t *op, int32_t res)
+{
+    client_state_t *state = op->state;
+
+    // close_client() detaches the in-flight send; it only needs freeing.
+    if(state->tx_head != op)
+    {
+        tx_free(op);
+        return;
+    }
+
+    if(res > 0)
+    {
+        METRIC_ADD(bytes_out, (uint_fast64_t)res);
+        op->sent += (uint32_t)res;
+        if(op->sent < op->buf->len)
+        {
+            if(tx_start(op) < 0)
+            {
+                tx_drop(state, NULL);
+            }
+            return;
+        }
+    }
+    else
+    {
+        LOG_DEBUG("client#%d send failed: %s", *state->client_id, strerror(-res));
+    }
+
+    tx_pop(state);
+    if(state->tx_head != NULL && tx_start(state->tx_head) < 0)
+    {
+        tx_drop(state, NULL);
+    }
+}
+
+/* Frees the send at the head of the connection's queue, which has been written. */
+static void tx_pop(client_state_t *state)
+{
+    tx_op_t *op = state->tx_head;
+
+    state->tx_head = op->next;
+    if(state->tx_head == NULL)
+    {
+        state->tx_tail = NULL;
+    }
+    if(state->tx_urgent == op)
+    {
+        state->tx_urgent = NULL;
+    }
+    state->tx_queued -= sizeof(tx_op_t) + op->buf->len;
+    tx_free(op);
+}
+
+static void tx_free(tx_op_t *op)
+{
+    tx_unref(op->buf);
+    free(op);
+    METRIC_SUB(tx_allocated, (int_fast64_t)sizeof(tx_op_t));
+}
+
+/* Drops one recipient's reference to a shared send buffer. */
+static void tx_unref(tx_buf_t *buf)
+{
+    if(--buf->refs == 0)
+    {
+        METRIC_SUB(tx_allocated, (int_fast64_t)(sizeof(tx_buf_t) + buf->len));
+        free(buf);
+    }
+}
+
+/* Empties the connection's queue, leaving keep (a send the kernel still owns) to its completion. */
+static void tx_drop(client_state_t *state, const tx_op_t *keep)
+{
+    tx_op_t *op = state->tx_head;
+
+    while(op != NULL)
+    {
+        tx_op_t *next = op->next;
+
+        if(op != keep)
+        {
+            tx_free(op);
+        }
+        op = next;
+    }
+    state->tx_head   = NULL;
+    state->tx_tail   = NULL;
+    state->tx_urgent = NULL;
+    state->tx_queued = 0;
 }
 
-static ssize_t send_error_response(message_t *message)
-{
-    char    *ptr;
-    uint16_t sender_id;
-    uint8_t  msg_len;
-
-    sender_id = SYSID;
-    ptr       = (char *)message->res_buf;
-
-    if(message->type != ACC_LOGOUT)
-    {
-        const char *msg;
-
-        // Build error response header.
-        printf("sending error response\n");
-        *ptr++    = SYS_ERROR;
-        *ptr++    = VERSION_NUM;
-        sender_id = htons(sender_id);
-        memcpy(ptr, &sender_id, sizeof(sender_id));
-        ptr += sizeof(sender_id);
-        msg     = error_code_to_string(&message->code);
-        msg_len = (uint8_t)strlen(msg);
-        // Update response_len to include tag fields and message.
-        message->response_len = (uint16_t)(message->response_len + (sizeof(uint8_t) + sizeof(uint8_t) + msg_len));
-        message->response_len = htons(message->response_len);
-        memcpy(ptr, &message->response_len, sizeof(message->response_len));
-        ptr += sizeof(message->response_len);
-        // Encode error code and error string.
-        *ptr++ = BER_INT;
-        *ptr++ = sizeof(uint8_t);
-        memcpy(ptr, &message->code, sizeof(uint8_t));
-        ptr += sizeof(uint8_t);
-        *ptr++ = BER_STR;
-        memcpy(ptr, &msg_len, sizeof(msg_len));
-        ptr += sizeof(msg_len);
-        memcpy(ptr, msg, msg_len);
-        // Calculate the final response length.
-        message->response_len = (uint16_t)(HEADERLEN + ntohs(message->response_len));
-    }
-
-    if(write(message->client->fd, message->res_buf, message->response_len) < 0)
-    {
-        perror("Failed to send error response");
-        sfree(&message->req_buf);
+/* Names a connection to the router and the workers by its table handle, so a reused slot is not mistaken for it. */
+static uint64_t route_handle(const client_state_t *state)
+{
+    return conn_table_handle(&conns, (uint32_t)(state - conns.state));
+}
+
+/* The connection a handle names, or NULL if it has closed since the handle was taken. */
+static client_state_t *route_target(uint64_t handle)
+{
+    int slot = conn_table_lookup(&conns, handle);
+
+    return slot < 0 ? NULL : &conns.state[slot];
+}
+
+/* Sends each routed frame to the recipients that are still connected. */
+static void route_deliver(void)
+{
+    route_delivery_t batch[ROUTER_TAKE_MAX];
+    size_t           n;
+    size_t           budget = FANOUT_QUOTA;
+
+    // router_take() has cleared the wake-up, so whatever the quota leaves is picked up through route_pending.
+    route_pending = 0;
+    while((n = router_take(ROUTER_IO, batch, ROUTER_TAKE_MAX)) > 0)
+    {
+        route_pending = 1;
+        for(size_t d = 0; d < n; d++)
+        {
+            route_delivery_t      *delivery = &batch[d];
+            const route_members_t *members  = delivery->members;
+            // Every recipient that has to queue the frame shares one copy, as in send_broadcast().
+            tx_buf_t *tx = tx_alloc(delivery->frame->data, delivery->frame->len, 1);
+
+            for(size_t r = 0; tx != NULL && r < members->count; r++)
+            {
+                client_state_t *state = route_target(members->handles[r]);
+
+                if(state != NULL)
+                {
+                    tx_share(state, tx);
+                }
+            }
+            if(tx != NULL)
+            {
+                tx_unref(tx);
+            }
+            budget -= members->count < budget ? members->count : budget;
+            router_done(delivery);
+        }
+        if(budget == 0)
+        {
+            return;
+        }
+    }
+    route_pending = 0;
+}
+
+/* Copies a complete frame into a task for the slot's strand. Returns 0, or -2 if memory ran out. */
+static ssize_t request_submit(client_state_t *state, size_t len, int shed)
+{
+    int             slot = (int)(state - conns.state);
+    request_task_t *req  = (request_task_t *)malloc(sizeof(request_task_t) + len);
+
+    if(req == NULL)
+    {
+        LOG_ERROR("Failed to allocate request: %s", strerror(errno));
+        return -2;
+    }
+    req->task.run       = request_run;
+    req->handle         = route_handle(state);
+    req->client_id      = conns.user_id[slot];
+    req->frame_start_us = state->frame_start_us;
+    req->len            = (uint32_t)len;
+    req->shed           = shed;
+    memcpy(req->frame, state->rx_buf, len);
+    requests_inflight++;
+    executor_submit(&conn_exec[slot].strand, &req->task);
+    return 0;
+}
+
+/* Worker side: runs the handlers on a private message. Everything they send is posted back to the loop. */
+static void request_run(exec_task_t *task)
+{
+    request_task_t *req  = (request_task_t *)task;
+    conn_exec_t    *conn = &conn_exec[req->handle >> CONN_GEN_SHIFT];
+    message_t       message;
+    uint64_t        start;
+
+    // The first request of a new connection on this slot brings its client id.
+    if(conn->gen != (uint32_t)req->handle)
+    {
+        conn->gen       = (uint32_t)req->handle;
+        conn->client_id = req->client_id;
+    }
+    memset(&message, 0, sizeof(message));
+    message.req_buf   = req->frame;
+    message.client_id = &conn->client_id;
+    message.code      = EC_GOOD;
+    message.arena     = &conn->scratch;
+    message.res_buf   = arena_zalloc(&conn->scratch, RESPONSELEN);
+    running_request   = req;
+    if(req->shed)
+    {
+        // send_client() posts it to the loop; this worker has no connection of its own.
+        shed_reply(NULL, req->frame[0]);
+    }
+    else if(message.res_buf == NULL)
+    {
+        LOG_ERROR("Failed to allocate message response buffer: %s", strerror(errno));
+    }
+    else
+    {
+        start = metrics_now_us();
+        handle_package(&message, req->len);
+        hist_record(&metrics.handler_latency, metrics_now_us() - start);
+        METRIC_ADD(msgs_in, 1);
+    }
+    running_request = NULL;
+    arena_reset(&conn->scratch);
+
+    req->client_id = conn->client_id;
+    req->task.run  = request_done;
+    executor_post(&req->task);
+}
+
+/* Loop side: the request's replies are queued ahead of this, so it is answered. */
+static void request_done(exec_task_t *task)
+{
+    request_task_t *req   = (request_task_t *)task;
+    client_state_t *state = route_target(req->handle);
+
+    if(state != NULL)
+    {
+        *state->client_id = req->client_id;
+        metrics_record_frame(req->frame[0], metrics_now_us() - req->frame_start_us);
+    }
+    requests_inflight--;
+    free(req);
+}
+
+/* Hands a frame from the request running on this worker to the loop. Returns len, or -1 if memory ran out. */
+static ssize_t reply_post(reply_kind_t kind, const void *buf, size_t len)
+{
+    reply_task_t *reply = (reply_task_t *)malloc(sizeof(reply_task_t) + len);
+
+    if(reply == NULL)
+    {
+        LOG_ERROR("Failed to allocate reply: %s", strerror(errno));
+        return -1;
+    }
+    reply->task.run = reply_run;
+    reply->kind     = kind;
+    reply->handle   = running_request->handle;
+    reply->len      = (uint32_t)len;
+    memcpy(reply->data, buf, len);
+    executor_post(&reply->task);
+    return (ssize_t)len;
+}
+
+static void reply_run(exec_task_t *task)
+{
+    reply_task_t *reply = (reply_task_t *)task;
+
+    if(reply->kind == REPLY_BROADCAST)
+    {
+        send_broadcast(reply->data, reply->len);
+    }
+    else
+    {
+        client_state_t *state = route_target(reply->handle);
+
+        if(state != NULL)
+        {
+            send_client(state, reply->data, reply->len);
+        }
+    }
+    free(reply);
+}
+
+/* Runs posted replies and resumes handlers until every request handed to the workers or waiting on
+   storage is answered. Returns -1 on timeout. */
+static int requests_settle(int timeout_ms)
+{
+    uint64_t deadline = metrics_now_us() + ((uint64_t)timeout_ms * US_PER_MS);
+
+    while(requests_inflight > 0 || storage_holder != NULL)
+    {
+        struct pollfd pfd[2];
+
+        if(metrics_now_us() >= deadline)
+        {
+            return -1;
+        }
+        pfd[0].fd      = executor_active() ? executor_loop_fd() : -1;
+        pfd[1].fd      = storage_io_active() ? storage_io_fd() : -1;
+        pfd[0].events  = pfd[1].events  = POLLIN;
+        pfd[0].revents = pfd[1].revents = 0;
+        if(poll(pfd, 2, DRAIN_POLL_MS) <= 0)
+        {
+            continue;
+        }
+        if(pfd[0].revents & POLLIN)
+        {
+            executor_loop_run();
+        }
+        if(pfd[1].revents & POLLIN)
+        {
+            storage_io_run(request_resume);
+        }
+    }
+    return 0;
+}
+
+static int uses_storage(uint8_t type)
+{
+    return type == ACC_LOGIN || type == ACC_CREATE || type == ACC_EDIT || type == ACC_LOGOUT;
+}
+
+/* Starts the frame's handler as a coroutine, or queues it while another handler holds storage; one
+   holder at a time keeps the storage lock away from the loop. Returns 0, or -1 to handle it inline. */
+static int request_spawn(const message_t *message, size_t len)
+{
+    client_state_t *state = message->state;
+    coro_request_t *req   = (coro_request_t *)malloc(sizeof(coro_request_t) + len);
+
+    if(req == NULL)
+    {
+        return -1;
+    }
+    req->co = coro_create(request_body, req);
+    if(req->co == NULL)
+    {
+        free(req);
         return -1;
     }
+    req->message              = *message;
+    req->message.req_buf      = req->frame;
+    req->message.res_buf      = NULL;
+    req->message.arena        = NULL;
+    req->message.response_len = 0;
+    req->message.code         = EC_GOOD;
+    req->next           = NULL;
+    req->state          = state;
+    req->frame_start_us = state->frame_start_us;
+    req->len            = len;
+    memcpy(req->frame, state->rx_buf, len);
+    state->request = req;
+    if(!ring_active)
+    {
+        state->pfd->events &= (short)~POLLIN;    // The rest stays in the socket until this request is done
+    }
 
-    printf("Response: %s\n", (char *)message->res_buf);
-    sfree(&message->req_buf);
+    if(storage_holder != NULL)
+    {
+        coro_request_t **tail = &storage_waiting;
 
+        while(*tail != NULL)
+        {
+            tail = &(*tail)->next;
+        }
+        *tail = req;
+        storage_waiters++;
+        return 0;
+    }
+    // Nobody waits while there is no holder, so a request that never yields finishes right here.
+    request_begin(req);
+    if(coro_resume(req->co))
+    {
+        request_finish(req);
+    }
     return 0;
 }
 
-static const char *error_code_to_string(const error_code_t *code)
+/* Makes req the storage holder. Only the holder runs, so it has the holder's arena to itself. */
+static void request_begin(coro_request_t *req)
+{
+    storage_holder       = req;
+    req->start_us        = metrics_now_us();
+    req->message.arena   = &holder_scratch;
+    req->message.res_buf = arena_zalloc(&holder_scratch, RESPONSELEN);
+}
+
+static void request_body(void *arg)
+{
+    coro_request_t *req = (coro_request_t *)arg;
+
+    if(req->message.res_buf == NULL)
+    {
+        LOG_ERROR("Failed to allocate message response buffer: %s", strerror(errno));
+        return;
+    }
+    handle_package(&req->message, req->len);
+}
+
+/* Resumes the storage holder. Each time one finishes, the connection's waiting frames are served and the
+   next queued request takes over storage. */
+static void request_resume(coro_t *co)
+{
+    coro_request_t *req = (coro_request_t *)coro_arg(co);
+
+    while(req != NULL && coro_resume(req->co))
+    {
+        client_state_t *state = request_finish(req);
+
+        req = storage_waiting;
+        if(req != NULL)
+        {
+            storage_waiting = req->next;
+            storage_waiters--;
+            request_begin(req);
+        }
+        if(state != NULL)
+        {
+            serve_client((int)(state - conns.state));
+        }
+    }
+}
+
+/* Releases storage and the request. Returns its connection for serving, or NULL if it has closed. */
+static client_state_t *request_finish(coro_request_t *req)
 {
-    size_t i;
-    for(i = 0; i < sizeof(code_map) / sizeof(code_map[0]); i++)
+    client_state_t *state = req->state;
+    uint64_t        now   = metrics_now_us();
+
+    hist_record(&metrics.handler_latency, now - req->start_us);
+    METRIC_ADD(msgs_in, 1);
+    if(state != NULL)
     {
-        if(code_map[i].code == *code)
+        metrics_record_frame(req->frame[0], now - req->frame_start_us);
+        state->request = NULL;
+        if(!ring_active)
         {
-            return code_map[i].msg;
+            state->pfd->events |= POLLIN;
         }
     }
-    return UNKNOWNTYPE;
+    storage_holder = NULL;
+    coro_destroy(req->co);
+    arena_reset(&holder_scratch);
+    free(req);
+    return state;
+}
+
+/* The connection is closing under a request that has not finished. It runs to the end, talking to nobody. */
+static void request_detach(coro_request_t *req)
+{
+    req->state             = NULL;
+    req->orphan_id         = *req->message.client_id;
+    req->message.client_id = &req->orphan_id;
+    req->message.client    = &detached_pfd;
+    req->message.state     = &detached_state;
 }
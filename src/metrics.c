@@ -0,0 +1,205 @@
+/*******************************************************************************
+ * Server metrics
+ *
+ * The event loop bumps the counters in `metrics` as it reads, handles and
+ * writes frames. metrics_report() turns them into the figures carried by the
+ * diagnostic frames: totals, plus a rate and latency percentiles computed over
+ * the interval since the previous report.
+ *
+ * End-to-end frame latency is kept per packet type in per-thread tables,
+ * registered on first use like the logger's rings, and merged only when a
+ * report or dump asks for it.
+ ******************************************************************************/
+
+#include "../include/metrics.h"
+#include "../include/logger.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define US_PER_SEC (1000000)
+#define NS_PER_US (1000)
+#define P50 (50.0)
+#define P90 (90.0)
+#define P99 (99.0)
+#define P999 (99.9)
+
+typedef struct
+{
+    histogram_t by_type[METRIC_FRAME_TYPES];    // cppcheck-suppress unusedStructMember
+} latency_table_t;
+
+metrics_t metrics;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static hist_snapshot_t last_latency;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static uint64_t        last_msgs;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static uint64_t        last_us;         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static _Atomic(latency_table_t *) tables[METRIC_MAX_THREADS];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_int                 table_count;                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static _Thread_local latency_table_t *local_table;               // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static latency_table_t *table_acquire(void);
+static int              type_slot(uint8_t type);
+
+uint64_t metrics_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * US_PER_SEC) + ((uint64_t)ts.tv_nsec / NS_PER_US);
+}
+
+int64_t metrics_mem_held(void)
+{
+    return atomic_load_explicit(&metrics.rx_allocated, memory_order_relaxed) + atomic_load_explicit(&metrics.tx_allocated, memory_order_relaxed);
+}
+
+void metrics_report(metrics_report_t *report)
+{
+    hist_snapshot_t latency = {0};
+    hist_snapshot_t interval;
+    uint64_t        now;
+
+    now                 = metrics_now_us();
+    report->msgs_in     = atomic_load_explicit(&metrics.msgs_in, memory_order_relaxed);
+    report->bytes_in    = atomic_load_explicit(&metrics.bytes_in, memory_order_relaxed);
+    report->bytes_out   = atomic_load_explicit(&metrics.bytes_out, memory_order_relaxed);
+    report->connections = atomic_load_explicit(&metrics.connections, memory_order_relaxed);
+    report->rx_queued   = atomic_load_explicit(&metrics.rx_queued, memory_order_relaxed);
+    report->mem_held    = metrics_mem_held();
+    report->log_backlog = log_backlog();
+
+    report->msgs_per_sec = 0;
+    if(last_us != 0 && now > last_us)
+    {
+        report->msgs_per_sec = (uint32_t)(((report->msgs_in - last_msgs) * US_PER_SEC) / (now - last_us));
+    }
+
+    // Percentiles over this interval only: diff against the previous reading.
+    hist_accumulate(&latency, &metrics.handler_latency);
+    interval = latency;
+    hist_subtract(&interval, &last_latency);
+    report->p50_us = hist_percentile(&interval, P50);
+    report->p99_us = hist_percentile(&interval, P99);
+
+    last_latency = latency;
+    last_msgs    = report->msgs_in;
+    last_us      = now;
+}
+
+void metrics_record_frame(uint8_t type, uint64_t latency_us)
+{
+    latency_table_t *table = table_acquire();
+
+    if(table != NULL)
+    {
+        hist_record(&table->by_type[type_slot(type)], latency_us);
+    }
+}
+
+void metrics_frame_latency(hist_snapshot_t *snap, uint8_t type)
+{
+    int count = atomic_load(&table_count);
+
+    for(int i = 0; i < count && i < METRIC_MAX_THREADS; i++)
+    {
+        const latency_table_t *table = atomic_load_explicit(&tables[i], memory_order_acquire);
+        if(table != NULL)
+        {
+            hist_accumulate(snap, &table->by_type[type_slot(type)]);
+        }
+    }
+}
+
+const char *metrics_type_name(uint8_t type)
+{
+    switch(type)
+    {
+        case SYS_SUCCESS:
+            return "SYS_SUCCESS";
+        case SYS_ERROR:
+            return "SYS_ERROR";
+        case ACC_LOGIN:
+            return "ACC_LOGIN";
+        case ACC_LOGIN_SUCCESS:
+            return "ACC_LOGIN_SUCCESS";
+        case ACC_LOGOUT:
+            return "ACC_LOGOUT";
+        case ACC_CREATE:
+            return "ACC_CREATE";
+        case ACC_EDIT:
+            return "ACC_EDIT";
+        case CHT_SEND:
+            return "CHT_SEND";
+        case LST_GET:
+            return "LST_GET";
+        case LST_RESPONSE:
+            return "LST_RESPONSE";
+        case GRP_JOIN:
+            return "GRP_JOIN";
+        case GRP_EXIT:
+            return "GRP_EXIT";
+        case GRP_CREATE:
+            return "GRP_CREATE";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+void metrics_dump_latency(void)
+{
+    hist_snapshot_t snap;
+
+    LOG_INFO("Frame latency (us), first byte received to last byte sent:");
+    for(int type = 0; type < METRIC_FRAME_TYPES; type++)
+    {
+        memset(&snap, 0, sizeof(snap));
+        metrics_frame_latency(&snap, (uint8_t)type);
+        if(snap.total == 0)
+        {
+            continue;
+        }
+        LOG_INFO("  %-12s n=%lu p50=%lu p90=%lu p99=%lu p99.9=%lu max=%lu",
+                 metrics_type_name((uint8_t)type),
+                 (unsigned long)snap.total,
+                 (unsigned long)hist_percentile(&snap, P50),
+                 (unsigned long)hist_percentile(&snap, P90),
+                 (unsigned long)hist_percentile(&snap, P99),
+                 (unsigned long)hist_percentile(&snap, P999),
+                 (unsigned long)snap.max);
+    }
+}
+
+/* Returns the calling thread's latency table, registering a new one on first use. */
+static latency_table_t *table_acquire(void)
+{
+    latency_table_t *table;
+    int              slot;
+
+    if(local_table != NULL)
+    {
+        return local_table;
+    }
+
+    slot = atomic_fetch_add(&table_count, 1);
+    if(slot >= METRIC_MAX_THREADS)
+    {
+        atomic_fetch_sub(&table_count, 1);
+        return NULL;
+    }
+
+    table = (latency_table_t *)calloc(1, sizeof(latency_table_t));
+    if(table == NULL)
+    {
+        return NULL;
+    }
+    atomic_store_explicit(&tables[slot], table, memory_order_release);
+    local_table = table;
+    return table;
+}
+
+static int type_slot(uint8_t type)
+{
+    return type < PACKET_TYPE_MAX ? type : PACKET_TYPE_MAX;
+}
@@ -1,5 +1,6 @@
 /* network.c */
 
+#include "../include/logger.h"
 #include "../include/network.h"
 #include "../include/user_db.h"
 #include <arpa/inet.h>
@@ -16,9 +17,10 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+static int  listen_tcp(const char *ip, in_port_t port, int reuseport);
 static void socket_setup(struct sockaddr_storage *addr, socklen_t *addr_len, const char *ip, in_port_t port);
 static int  socket_create(int domain, int type, int protocol);
-static int  socket_set(int sockfd);
+static int  socket_set(int sockfd, int reuseport);
 /* Declare the parameters as pointers to const */
 static int socket_bind(int sockfd, const struct sockaddr_storage *addr, socklen_t addr_len);
 static int socket_listen(int server_fd, int backlog);
@@ -31,7 +33,7 @@ static int socket_connect(int sockfd, const struct sockaddr_storage *addr, sockl
 #define ERR_LISTEN (-4)
 #define ERR_CONNECT (-5)
 
-int sm_fd;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+int sm_fd = SM_WORKER_FD;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
 
 /*
  * Function: server_tcp
@@ -39,6 +41,23 @@ int sm_fd;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warn
  * Returns: The server socket descriptor on success or an error code on failure.
  */
 int server_tcp(const Arguments *args)
+{
+    // Workers under server_starter each bind the port; the kernel spreads connections between them.
+    return listen_tcp(args->ip, args->port, args->workers > 1);
+}
+
+/*
+ * Function: admin_tcp
+ * Description: Sets up the listener for the admin/metrics endpoint.
+ * Returns: The listening socket descriptor on success or an error code on failure.
+ */
+int admin_tcp(const Arguments *args)
+{
+    return listen_tcp(args->admin_ip, args->admin_port, 0);
+}
+
+/* Creates a socket listening on ip:port */
+static int listen_tcp(const char *ip, in_port_t port, int reuseport)
 {
     int                     sockfd;
     struct sockaddr_storage addr;
@@ -48,7 +67,7 @@ int server_tcp(const Arguments *args)
     memset(&addr, 0, sizeof(struct sockaddr_storage));
 
     /* Set up the address structure */
-    socket_setup(&addr, &addr_len, args->ip, args->port);
+    socket_setup(&addr, &addr_len, ip, port);
 
     /* Create the socket */
     sockfd = socket_create(addr.ss_family, SOCK_STREAM, 0);
@@ -59,7 +78,7 @@ int server_tcp(const Arguments *args)
     }
 
     /* Set socket options */
-    if(socket_set(sockfd) < 0)
+    if(socket_set(sockfd, reuseport) < 0)
     {
         perror("Failed to set socket options");
         return ERR_SET_OPTION;
@@ -71,7 +90,7 @@ int server_tcp(const Arguments *args)
         perror("Failed to bind socket");
         return ERR_BIND;
     }
-    printf("Bound to socket: %s:%u\n", args->ip, args->port);
+    LOG_INFO("Bound to socket: %s:%u", ip, port);
     /* Start listening */
     if(socket_listen(sockfd, SOMAXCONN) < 0)
     {
@@ -79,20 +98,22 @@ int server_tcp(const Arguments *args)
         close(sockfd);
         return ERR_LISTEN;
     }
-    printf("Listening on %s:%u\n", args->ip, args->port);
+    LOG_INFO("Listening on %s:%u", ip, port);
 
     return sockfd;
 }
 
 /*
  * Function: server_manager_tcp
- * Description: Connects to the server manager using the provided arguments.
+ * Description: Starts a non-blocking connection to the server manager using the provided arguments.
+ *              The connect may still be in progress on return; wait for POLLOUT and check SO_ERROR.
  * Returns: The server manager socket descriptor on success or an error code on failure.
  */
 int server_manager_tcp(const Arguments *args)
 {
     struct sockaddr_storage addr;
     socklen_t               addr_len;
+    int                     flag;
 
     addr_len = 0;
     memset(&addr, 0, sizeof(struct sockaddr_storage));
@@ -101,27 +122,30 @@ int server_manager_tcp(const Arguments *args)
     socket_setup(&addr, &addr_len, args->sm_ip, args->sm_port);
 
     /* Create the socket */
-    sm_fd = socket_create(addr.ss_family, SOCK_STREAM, 0);
+    sm_fd = socket_create(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if(sm_fd < 0)
     {
         perror("Failed to create socket");
         return ERR_SOCKET;
     }
 
-    /* Set socket options */
-    if(socket_set(sm_fd) < 0)
+    /* Set socket options; the manager link lives in an event loop and must never block it */
+    flag = fcntl(sm_fd, F_GETFL, 0);
+    if(socket_set(sm_fd, 0) < 0 || flag == -1 || fcntl(sm_fd, F_SETFL, flag | O_NONBLOCK) == -1)
     {
         perror("Failed to set socket options");
+        close(sm_fd);
         return ERR_SET_OPTION;
     }
 
     /* Connect to the server manager */
-    if(socket_connect(sm_fd, &addr, addr_len) < 0)
+    if(socket_connect(sm_fd, &addr, addr_len) < 0 && errno != EINPROGRESS)
     {
-        perror("Failed to connect to server manager");
+        LOG_WARN("Failed to connect to server manager at %s:%u: %s", args->sm_ip, args->sm_port, strerror(errno));
+        close(sm_fd);
         return ERR_CONNECT;
     }
-    printf("Connected to server manager at %s:%u\n", args->sm_ip, args->sm_port);
+    LOG_DEBUG("Connecting to server manager at %s:%u", args->sm_ip, args->sm_port);
 
     return sm_fd;
 }
@@ -169,7 +193,7 @@ static int socket_create(int domain, int type, int protocol)
 }
 
 /* Set socket options */
-static int socket_set(int sockfd)
+static int socket_set(int sockfd, int reuseport)
 {
     int flag = fcntl(sockfd, F_GETFL, 0);
     if(flag == -1)
@@ -192,6 +216,11 @@ static int socket_set(int sockfd)
         perror("Failed to set socket options");
         return -1;
     }
+    if(reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
+    {
+        perror("Failed to set SO_REUSEPORT");
+        return -1;
+    }
     return 0;
 }
 
@@ -236,6 +265,15 @@ int socket_accept(int server_fd, struct sockaddr_storage *client_addr, socklen_t
     return client_fd;
 }
 
+int would_block(int err)
+{
+#if EAGAIN != EWOULDBLOCK
+    return err == EAGAIN || err == EWOULDBLOCK;
+#else
+    return err == EAGAIN;
+#endif
+}
+
 /* Convert port from string to in_port_t */
 in_port_t convert_port(const char *binary_name, const char *str)
 {
@@ -0,0 +1,151 @@
+/*******************************************************************************
+ * Pre-encoded response frames
+ *
+ * Every reply whose bytes depend only on the request type and the resulting
+ * error code is encoded once at startup. Handlers then send a reply with a
+ * single write of a static buffer instead of re-encoding it per request.
+ ******************************************************************************/
+
+#include "../include/response.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+#define USER_ID_OFFSET (HEADERLEN + 2)
+
+static uint16_t    encode_header(uint8_t *buf, uint8_t type, uint8_t version, uint16_t payload_len);
+static void        encode_error(response_frame_t *frame, error_code_t code);
+static void        encode_ack(response_frame_t *frame, uint8_t type);
+static const char *error_code_to_string(const error_code_t *code);
+
+/* Error code map */
+static const error_code_map code_map[] = {
+    {EC_GOOD,          ""                      },
+    {EC_INV_USER_ID,   "Invalid User ID"       },
+    {EC_INV_AUTH_INFO, "Invalid Authentication"},
+    {EC_USER_EXISTS,   "User Already Exist"    },
+    {EC_SERVER,        "Server Error"          },
+    {EC_INV_REQ,       "Invalid message"       },
+    {EC_REQ_TIMEOUT,   "message Timeout"       }
+};
+
+static response_frame_t        error_frames[ERROR_CODE_MAX];                     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static response_frame_t        success_frames[PACKET_TYPE_MAX];                  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static response_frame_t        login_template;                                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static const response_frame_t  empty_frame = {0};                                // Nothing to send
+static const response_frame_t *frame_table[PACKET_TYPE_MAX + 1][ERROR_CODE_MAX];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+void response_init(void)
+{
+    size_t type;
+    size_t code;
+
+    for(code = 0; code < ERROR_CODE_MAX; code++)
+    {
+        encode_error(&error_frames[code], (error_code_t)code);
+    }
+
+    /* Plain SYS_SUCCESS acknowledgements carrying the request type */
+    encode_ack(&success_frames[ACC_CREATE], ACC_CREATE);
+    encode_ack(&success_frames[CHT_SEND], CHT_SEND);
+
+    /* ACC_EDIT is acknowledged with an empty SYS_SUCCESS */
+    success_frames[ACC_EDIT].len = encode_header(success_frames[ACC_EDIT].buf, SYS_SUCCESS, VERSION_NUM, 0);
+
+    /* ACC_LOGIN_SUCCESS: the user id at USER_ID_OFFSET is patched in per request */
+    encode_header(login_template.buf, ACC_LOGIN_SUCCESS, SYSID, LOGIN_SUCCESS_LEN - HEADERLEN);
+    login_template.buf[HEADERLEN]     = BER_INT;
+    login_template.buf[HEADERLEN + 1] = sizeof(uint16_t);
+    login_template.len                = LOGIN_SUCCESS_LEN;
+
+    /* Row PACKET_TYPE_MAX is used for every unknown packet type */
+    for(type = 0; type <= PACKET_TYPE_MAX; type++)
+    {
+        frame_table[type][EC_GOOD] = (type < PACKET_TYPE_MAX) ? &success_frames[type] : &empty_frame;
+        for(code = EC_GOOD + 1; code < ERROR_CODE_MAX; code++)
+        {
+            frame_table[type][code] = (type == ACC_LOGOUT) ? &empty_frame : &error_frames[code];
+        }
+    }
+    // success_frames[ACC_LOGIN] stays empty: only response_login_success() makes a login reply, so a login
+    // that never set its user id sends nothing rather than "logged in as 0".
+}
+
+const response_frame_t *response_lookup(uint8_t type, error_code_t code)
+{
+    size_t row;
+
+    row = (type < PACKET_TYPE_MAX) ? type : PACKET_TYPE_MAX;
+    if((size_t)code >= ERROR_CODE_MAX)
+    {
+        return &error_frames[EC_SERVER];
+    }
+    return frame_table[row][code];
+}
+
+uint16_t response_login_success(void *dst, uint16_t user_id)
+{
+    uint16_t uid;
+
+    uid = htons(user_id);
+    memcpy(dst, login_template.buf, LOGIN_SUCCESS_LEN);
+    memcpy((uint8_t *)dst + USER_ID_OFFSET, &uid, sizeof(uid));
+    return LOGIN_SUCCESS_LEN;
+}
+
+static uint16_t encode_header(uint8_t *buf, uint8_t type, uint8_t version, uint16_t payload_len)
+{
+    uint16_t sender_id;
+
+    buf[0]      = type;
+    buf[1]      = version;
+    sender_id   = htons(SYSID);
+    payload_len = htons(payload_len);
+    memcpy(buf + 2, &sender_id, sizeof(sender_id));
+    memcpy(buf + 4, &payload_len, sizeof(payload_len));
+    return HEADERLEN;
+}
+
+static void encode_error(response_frame_t *frame, error_code_t code)
+{
+    const char *msg;
+    uint8_t     msg_len;
+    uint8_t    *ptr;
+
+    msg     = error_code_to_string(&code);
+    msg_len = (uint8_t)strlen(msg);
+    ptr     = frame->buf + encode_header(frame->buf, SYS_ERROR, VERSION_NUM, (uint16_t)(U8ENCODELEN + 2 + msg_len));
+
+    // Encode error code and error string.
+    *ptr++ = BER_INT;
+    *ptr++ = sizeof(uint8_t);
+    *ptr++ = (uint8_t)code;
+    *ptr++ = BER_STR;
+    *ptr++ = msg_len;
+    memcpy(ptr, msg, msg_len);
+    frame->len = (uint16_t)(ptr + msg_len - frame->buf);
+}
+
+static void encode_ack(response_frame_t *frame, uint8_t type)
+{
+    uint8_t *ptr;
+
+    ptr    = frame->buf + encode_header(frame->buf, SYS_SUCCESS, VERSION_NUM, U8ENCODELEN);
+    *ptr++ = BER_ENUM;
+    *ptr++ = sizeof(uint8_t);
+    *ptr++ = type;
+
+    frame->len = (uint16_t)(ptr - frame->buf);
+}
+
+static const char *error_code_to_string(const error_code_t *code)
+{
+    size_t i;
+    for(i = 0; i < sizeof(code_map) / sizeof(code_map[0]); i++)
+    {
+        if(code_map[i].code == *code)
+        {
+            return code_map[i].msg;
+        }
+    }
+    return UNKNOWNTYPE;
+}
@@ -0,0 +1,566 @@
+/*******************************************************************************
+ * Chat router
+ *
+ * Moves fanout off the I/O threads. The ingress queue is a bounded MPSC
+ * array in which every cell carries a sequence number: producers claim a
+ * position with one CAS and publish the cell by advancing its sequence, and
+ * the router, the only consumer, never writes anything a producer spins on.
+ * The router sleeps on an eventfd when the queue is empty; producers only
+ * pay for the wakeup when it is actually asleep.
+ *
+ * Deliveries go out through one single-producer ring per I/O thread. The
+ * router routes everything it can take in one pass, then wakes each I/O
+ * thread that got something once, so a burst of chat costs each I/O thread
+ * one wakeup. A delivery ring that is full drops the delivery rather than
+ * holding up the router and with it every other thread.
+ *
+ * Each I/O thread's members are one packed array of handles, which every
+ * delivery shares by reference. Joins and leaves edit it in place while no
+ * delivery holds it and copy it once otherwise; a slot-indexed map finds a
+ * leaving member without a scan.
+ ******************************************************************************/
+
+#include "../include/router.h"
+#include "../include/logger.h"
+#include "../include/wakeup.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ROUTER_CACHE_LINE (64)
+#define ROUTER_BATCH (256)    // Ingress entries per pass before the I/O threads are woken
+#define ROUTER_QUEUE_MASK (ROUTER_QUEUE_SIZE - 1)
+#define ROUTER_DELIVERY_MASK (ROUTER_DELIVERY_SIZE - 1)
+#define ROUTER_MEMBERS_INIT (64)
+#define ROUTER_NO_MEMBER UINT32_MAX
+
+typedef enum
+{
+    ROUTE_JOIN,
+    ROUTE_LEAVE,
+    ROUTE_PUBLISH,
+} route_kind_t;
+
+typedef struct
+{
+    route_kind_t   kind;      // cppcheck-suppress unusedStructMember
+    size_t         io;        // cppcheck-suppress unusedStructMember
+    uint32_t       slot;      // cppcheck-suppress unusedStructMember
+    uint64_t       handle;    // cppcheck-suppress unusedStructMember
+    route_frame_t *frame;     // cppcheck-suppress unusedStructMember
+} route_msg_t;
+
+typedef struct
+{
+    atomic_size_t seq;    // cppcheck-suppress unusedStructMember
+    route_msg_t   msg;    // cppcheck-suppress unusedStructMember
+} route_cell_t;
+
+/* Router-to-I/O-thread ring, plus the router's record of that thread's connections */
+typedef struct
+{
+    _Alignas(ROUTER_CACHE_LINE) atomic_size_t head;      // Next slot the router fills
+    _Alignas(ROUTER_CACHE_LINE) atomic_size_t tail;      // Next slot the I/O thread takes
+    route_delivery_t deliveries[ROUTER_DELIVERY_SIZE];    // cppcheck-suppress unusedStructMember
+    int              wake[2];                             // cppcheck-suppress unusedStructMember
+    route_members_t *members;                             // Current membership, shared with deliveries
+    uint32_t        *member_slot;                         // Slot of each member, by position in members
+    size_t           member_cap;                          // Handles members and member_slot have room for
+    uint32_t        *slot_member;                         // Position in members of each slot, or ROUTER_NO_MEMBER
+    size_t           slot_cap;                            // cppcheck-suppress unusedStructMember
+} route_io_t;
+
+static route_cell_t  cells[ROUTER_QUEUE_SIZE];                          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static _Alignas(ROUTER_CACHE_LINE) atomic_size_t enqueue_pos;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static _Alignas(ROUTER_CACHE_LINE) size_t        dequeue_pos;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static _Alignas(ROUTER_CACHE_LINE) atomic_bool   sleeping;              // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_bool                               stopping;              // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int                                       running;               // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int                                       router_wake[2];        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static route_io_t                               *io_threads;            // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static size_t                                    io_count;              // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static pthread_t                                 router_thread;         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static int              queue_push(const route_msg_t *msg);
+static int              queue_pop(route_msg_t *msg);
+static int              queue_ready(void);
+static void            *router_loop(void *arg);
+static void             route(const route_msg_t *msg, bool *woken);
+static void             route_frame(route_frame_t *frame, bool *woken);
+static void             member_add(route_io_t *io, uint32_t slot, uint64_t handle);
+static void             member_remove(route_io_t *io, uint32_t slot);
+static route_members_t *members_own(route_io_t *io, size_t need);
+static void             members_release(route_members_t *members);
+static void             frame_release(route_frame_t *frame);
+
+int router_start(size_t threads)
+{
+    if(threads == 0 || threads > ROUTER_IO_MAX)
+    {
+        return -1;
+    }
+    io_threads = (route_io_t *)calloc(threads, sizeof(route_io_t));
+    if(io_threads == NULL)
+    {
+        return -1;
+    }
+    io_count = threads;
+    for(size_t i = 0; i < ROUTER_QUEUE_SIZE; i++)
+    {
+        atomic_init(&cells[i].seq, i);
+    }
+    atomic_store(&enqueue_pos, 0);
+    dequeue_pos = 0;
+    atomic_store(&sleeping, false);
+    atomic_store(&stopping, false);
+
+    router_wake[0] = router_wake[1] = -1;
+    for(size_t i = 0; i < io_count; i++)
+    {
+        io_threads[i].wake[0] = io_threads[i].wake[1] = -1;
+    }
+    if(wakeup_open(router_wake) < 0)
+    {
+        goto fail;
+    }
+    for(size_t i = 0; i < io_count; i++)
+    {
+        if(wakeup_open(io_threads[i].wake) < 0)
+        {
+            goto fail;
+        }
+    }
+    if(pthread_create(&router_thread, NULL, router_loop, NULL) != 0)
+    {
+        goto fail;
+    }
+    running = 1;
+    LOG_INFO("Chat routing on its own thread for %zu I/O thread(s)", io_count);
+    return 0;
+
+fail:
+    LOG_ERROR("router: %s", strerror(errno));
+    wakeup_close(router_wake);
+    for(size_t i = 0; i < io_count; i++)
+    {
+        wakeup_close(io_threads[i].wake);
+    }
+    free(io_threads);
+    io_threads = NULL;
+    io_count   = 0;
+    return -1;
+}
+
+void router_stop(void)
+{
+    route_msg_t msg;
+
+    if(!running)
+    {
+        return;
+    }
+    atomic_store(&stopping, true);
+    wakeup_signal(router_wake, "router");
+    pthread_join(router_thread, NULL);
+    running = 0;
+
+    while(queue_pop(&msg))
+    {
+        if(msg.kind == ROUTE_PUBLISH)
+        {
+            frame_release(msg.frame);
+        }
+    }
+    for(size_t i = 0; i < io_count; i++)
+    {
+        route_delivery_t delivery;
+
+        while(router_take(i, &delivery, 1) > 0)
+        {
+            router_done(&delivery);
+        }
+        members_release(io_threads[i].members);
+        free(io_threads[i].member_slot);
+        free(io_threads[i].slot_member);
+        wakeup_close(io_threads[i].wake);
+    }
+    wakeup_close(router_wake);
+    free(io_threads);
+    io_threads = NULL;
+    io_count   = 0;
+}
+
+int router_active(void)
+{
+    return running;
+}
+
+int router_wake_fd(size_t io)
+{
+    return io < io_count ? io_threads[io].wake[0] : -1;
+}
+
+void router_join(size_t io, uint32_t slot, uint64_t handle)
+{
+    route_msg_t msg = {ROUTE_JOIN, io, slot, handle, NULL};
+
+    // The router never waits on us, so the queue always drains.
+    while(queue_push(&msg) < 0)
+    {
+        sched_yield();
+    }
+}
+
+void router_leave(size_t io, uint32_t slot)
+{
+    route_msg_t msg = {ROUTE_LEAVE, io, slot, 0, NULL};
+
+    while(queue_push(&msg) < 0)
+    {
+        sched_yield();
+    }
+}
+
+int router_publish(const void *frame, size_t len)
+{
+    route_msg_t    msg;
+    route_frame_t *copy;
+
+    copy = (route_frame_t *)malloc(sizeof(route_frame_t) + len);
+    if(copy == NULL)
+    {
+        return -1;
+    }
+    atomic_init(&copy->refs, 1);    // The router's own reference, dropped once it has been routed
+    copy->len = (uint32_t)len;
+    memcpy(copy->data, frame, len);
+
+    msg.kind   = ROUTE_PUBLISH;
+    msg.io     = 0;
+    msg.slot   = 0;
+    msg.handle = 0;
+    msg.frame  = copy;
+    if(queue_push(&msg) < 0)
+    {
+        free(copy);
+        return -1;
+    }
+    return 0;
+}
+
+size_t router_take(size_t io, route_delivery_t *out, size_t max)
+{
+    route_io_t *thread = &io_threads[io];
+    size_t      tail;
+    size_t      head;
+    size_t      n = 0;
+
+    wakeup_clear(thread->wake);
+    tail = atomic_load_explicit(&thread->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&thread->head, memory_order_acquire);
+    while(n < max && tail != head)
+    {
+        out[n++] = thread->deliveries[tail & ROUTER_DELIVERY_MASK];
+        tail++;
+    }
+    atomic_store_explicit(&thread->tail, tail, memory_order_release);
+    return n;
+}
+
+void router_done(route_delivery_t *delivery)
+{
+    frame_release(delivery->frame);
+    members_release(delivery->members);
+    delivery->frame   = NULL;
+    delivery->members = NULL;
+}
+
+/* Claims the next cell and fills it. Returns -1 if the queue is full. */
+static int queue_push(const route_msg_t *msg)
+{
+    size_t        pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    route_cell_t *cell;
+
+    for(;;)
+    {
+        size_t    seq;
+        ptrdiff_t diff;
+
+        cell = &cells[pos & ROUTER_QUEUE_MASK];
+        seq  = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+        if(diff == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            return -1;    // The router has not freed this cell since the last lap
+        }
+        else
+        {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->msg = *msg;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    // Pairs with the fence in router_loop(): either it sees this cell, or we see it asleep.
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&sleeping, memory_order_relaxed) && atomic_exchange(&sleeping, false))
+    {
+        wakeup_signal(router_wake, "router");
+    }
+    return 0;
+}
+
+static int queue_pop(route_msg_t *msg)
+{
+    route_cell_t *cell = &cells[dequeue_pos & ROUTER_QUEUE_MASK];
+
+    if(atomic_load_explicit(&cell->seq, memory_order_acquire) != dequeue_pos + 1)
+    {
+        return 0;
+    }
+    *msg = cell->msg;
+    atomic_store_explicit(&cell->seq, dequeue_pos + ROUTER_QUEUE_SIZE, memory_order_release);
+    dequeue_pos++;
+    return 1;
+}
+
+static int queue_ready(void)
+{
+    return atomic_load_explicit(&cells[dequeue_pos & ROUTER_QUEUE_MASK].seq, memory_order_acquire) == dequeue_pos + 1;
+}
+
+static void *router_loop(void *arg)
+{
+    bool woken[ROUTER_IO_MAX];
+
+    (void)arg;
+    while(!atomic_load(&stopping))
+    {
+        route_msg_t msg;
+        size_t      n = 0;
+
+        memset(woken, 0, sizeof(woken));
+        while(n < ROUTER_BATCH && queue_pop(&msg))
+        {
+            route(&msg, woken);
+            n++;
+        }
+        for(size_t i = 0; i < io_count; i++)
+        {
+            if(woken[i])
+            {
+                wakeup_signal(io_threads[i].wake, "router");
+            }
+        }
+        if(n > 0)
+        {
+            continue;
+        }
+
+        atomic_store(&sleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if(queue_ready() || atomic_load(&stopping))
+        {
+            atomic_store(&sleeping, false);
+            continue;
+        }
+        {
+            struct pollfd pfd = {router_wake[0], POLLIN, 0};
+
+            if(poll(&pfd, 1, -1) > 0)
+            {
+                wakeup_clear(router_wake);
+            }
+        }
+        atomic_store(&sleeping, false);
+    }
+    return NULL;
+}
+
+static void route(const route_msg_t *msg, bool *woken)
+{
+    switch(msg->kind)
+    {
+        case ROUTE_JOIN:
+            member_add(&io_threads[msg->io], msg->slot, msg->handle);
+            break;
+        case ROUTE_LEAVE:
+            member_remove(&io_threads[msg->io], msg->slot);
+            break;
+        case ROUTE_PUBLISH:
+        default:
+            route_frame(msg->frame, woken);
+            break;
+    }
+}
+
+/* Chat frames go to every connection: one delivery for each I/O thread that has any, holding a reference to
+   its current membership. */
+static void route_frame(route_frame_t *frame, bool *woken)
+{
+    for(size_t i = 0; i < io_count; i++)
+    {
+        route_io_t       *thread = &io_threads[i];
+        route_delivery_t *slot;
+        size_t            head;
+
+        if(thread->members == NULL || thread->members->count == 0)
+        {
+            continue;
+        }
+        head = atomic_load_explicit(&thread->head, memory_order_relaxed);
+        if(head - atomic_load_explicit(&thread->tail, memory_order_acquire) >= ROUTER_DELIVERY_SIZE)
+        {
+            LOG_WARN("router: I/O thread %zu is %d deliveries behind, dropping a frame", i, ROUTER_DELIVERY_SIZE);
+            continue;
+        }
+        slot          = &thread->deliveries[head & ROUTER_DELIVERY_MASK];
+        slot->frame   = frame;
+        slot->members = thread->members;
+        atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&thread->members->refs, 1, memory_order_relaxed);
+        atomic_store_explicit(&thread->head, head + 1, memory_order_release);
+        woken[i] = true;
+    }
+    frame_release(frame);
+}
+
+static void member_add(route_io_t *io, uint32_t slot, uint64_t handle)
+{
+    route_members_t *members;
+
+    if(slot >= io->slot_cap)
+    {
+        size_t    cap   = io->slot_cap == 0 ? ROUTER_MEMBERS_INIT : io->slot_cap;
+        uint32_t *grown;
+
+        while(cap <= slot)
+        {
+            cap *= 2;
+        }
+        grown = (uint32_t *)realloc(io->slot_member, cap * sizeof(uint32_t));
+        if(grown == NULL)
+        {
+            LOG_ERROR("router: out of memory, a connection will miss chat");
+            return;
+        }
+        for(size_t i = io->slot_cap; i < cap; i++)
+        {
+            grown[i] = ROUTER_NO_MEMBER;
+        }
+        io->slot_member = grown;
+        io->slot_cap    = cap;
+    }
+    if(io->slot_member[slot] != ROUTER_NO_MEMBER)
+    {
+        member_remove(io, slot);
+    }
+    members = members_own(io, (io->members != NULL ? io->members->count : 0) + 1);
+    if(members == NULL)
+    {
+        LOG_ERROR("router: out of memory, a connection will miss chat");
+        return;
+    }
+    io->member_slot[members->count]    = slot;
+    io->slot_member[slot]              = members->count;
+    members->handles[members->count++] = handle;
+}
+
+/* Moves the last member into the leaving one's place. */
+static void member_remove(route_io_t *io, uint32_t slot)
+{
+    route_members_t *members;
+    uint32_t         pos;
+    uint32_t         last;
+
+    if(slot >= io->slot_cap || io->slot_member[slot] == ROUTER_NO_MEMBER)
+    {
+        return;
+    }
+    members = members_own(io, io->members->count);
+    if(members == NULL)
+    {
+        // The handle stays behind; the I/O thread finds it closed and skips it.
+        LOG_ERROR("router: out of memory, a closed connection stays listed");
+        return;
+    }
+    pos                                   = io->slot_member[slot];
+    last                                  = --members->count;
+    members->handles[pos]                 = members->handles[last];
+    io->member_slot[pos]                  = io->member_slot[last];
+    io->slot_member[io->member_slot[pos]] = pos;
+    io->slot_member[slot]                 = ROUTER_NO_MEMBER;
+}
+
+/* The membership, made the router's alone and with room for need handles: in place if no delivery holds it,
+   or else a copy, which the deliveries' references keep the old one alive beside. Returns NULL if memory ran out. */
+static route_members_t *members_own(route_io_t *io, size_t need)
+{
+    route_members_t *current = io->members;
+    route_members_t *copy;
+    size_t           cap = io->member_cap;
+
+    if(current != NULL && need <= cap && atomic_load_explicit(&current->refs, memory_order_acquire) == 1)
+    {
+        return current;
+    }
+    if(cap < need)
+    {
+        uint32_t *grown;
+
+        cap = cap == 0 ? ROUTER_MEMBERS_INIT : cap;
+        while(cap < need)
+        {
+            cap *= 2;
+        }
+        grown = (uint32_t *)realloc(io->member_slot, cap * sizeof(uint32_t));
+        if(grown == NULL)
+        {
+            return NULL;
+        }
+        io->member_slot = grown;
+    }
+    copy = (route_members_t *)malloc(sizeof(route_members_t) + cap * sizeof(uint64_t));
+    if(copy == NULL)
+    {
+        return NULL;
+    }
+    atomic_init(&copy->refs, 1);    // The router's own reference
+    copy->count = current != NULL ? current->count : 0;
+    if(current != NULL)
+    {
+        memcpy(copy->handles, current->handles, current->count * sizeof(uint64_t));
+    }
+    members_release(current);
+    io->members    = copy;
+    io->member_cap = cap;
+    return copy;
+}
+
+static void members_release(route_members_t *members)
+{
+    if(members != NULL && atomic_fetch_sub_explicit(&members->refs, 1, memory_order_acq_rel) == 1)
+    {
+        free(members);
+    }
+}
+
+static void frame_release(route_frame_t *frame)
+{
+    if(frame != NULL && atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) == 1)
+    {
+        free(frame);
+    }
+}
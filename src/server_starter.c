@@ -2,12 +2,21 @@
 #include "../include/server_starter.h"
 #include "../include/args.h"
 #include "../include/network.h"
+#include "../include/sm_link.h"
+#include <errno.h>
 #include <fcntl.h> /* for fcntl */
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+    #include <sched.h>
+#endif
 
 #define SM_PORT 9000
 #define MSG_LEN 4
@@ -21,144 +30,648 @@
 /* Use the protocol version defined in our message header */
 #define PROTOCOL_VERSION VERSION_NUM
 
+/* Hot upgrade: how long the old server gets to hand over and exit */
+#define UPGRADE_TIMEOUT_MS 15000
+#define UPGRADE_POLL_MS 100
+#define US_PER_MS 1000
+#define NS_PER_MS 1000000
+#define MS_PER_SEC 1000
+
+/* Supervision: how often the loop wakes up, and how crashed workers are restarted */
+#define SUPERVISE_TICK_MS 100
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 10000
+#define STABLE_MS 30000    // A worker that ran this long before dying starts over at BACKOFF_MIN_MS
+#define STOP_FLUSH_MS 1000    // How long SVR_OFFLINE may take to reach the manager before we exit
+
+/* Per-worker arguments appended to our own: -H, -M and -C each with a value */
+#define WORKER_EXTRA_ARGS 6
+#define WORKER_PATH_MAX 108
+#define WORKER_PORT_LEN 12    // Any int, sign and terminator included
+
+/* Diagnostic reports are a 4-byte header and a run of BER integers. The extended layout
+   (handle_sm_diagnostic_ext) leads with its version and carries p50/p99 at these positions. */
+#define DIAG_FIELDS_MAX 16
+#define DIAG_EXT_FIELDS 10
+#define DIAG_EXT_P50 6
+#define DIAG_EXT_P99 7
+#define BYTE_BITS 8
+
+typedef struct
+{
+    pid_t    pid;                                  // cppcheck-suppress unusedStructMember
+    int      diag_fd;                              // cppcheck-suppress unusedStructMember
+    uint64_t started_ms;                           // cppcheck-suppress unusedStructMember
+    uint64_t restart_at_ms;                        // cppcheck-suppress unusedStructMember
+    unsigned backoff_ms;                           // cppcheck-suppress unusedStructMember
+    size_t   diag_len;                             // cppcheck-suppress unusedStructMember
+    uint8_t  diag[DIAG_EXT_MSG_MAX];               // cppcheck-suppress unusedStructMember
+    char   **argv;                                 // cppcheck-suppress unusedStructMember
+    char     handoff_path[WORKER_PATH_MAX];        // cppcheck-suppress unusedStructMember
+    char     capture_path[WORKER_PATH_MAX];        // cppcheck-suppress unusedStructMember
+    char     admin_port[WORKER_PORT_LEN];          // cppcheck-suppress unusedStructMember
+} worker_t;
+
+static volatile sig_atomic_t upgrade_requested = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static worker_t              workers[WORKERS_MAX];     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int                   worker_count;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int                   running;                  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static sm_link_t             manager;                  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+// execv() takes char *const[]; the flags we append live here rather than in string literals
+static char opt_handoff[] = "-H";    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static char opt_admin[]   = "-M";    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static char opt_capture[] = "-C";    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static void     sigusr2_handler(int sig);
+static uint64_t now_ms(void);
+static int      init_workers(int argc, char *argv[]);
+static pid_t    spawn_worker(const worker_t *w, int index, int *diag_fd);
+static int      start_workers(void);
+static void     stop_workers(void);
+static void     reap_workers(void);
+static void     restart_workers(void);
+static void     upgrade_workers(void);
+static void     pin_worker(int index);
+static void     collect_diagnostics(worker_t *w);
+static void     send_diagnostics(void);
+static size_t   parse_diagnostic(const uint8_t *msg, size_t len, uint64_t *values, uint8_t *widths);
+
 int main(int argc, char *argv[])
 {
-    int           sm_socket;
-    int           child_pid = -1;
     unsigned char req[MSG_LEN];
+    uint64_t      next_diag;
 
     parse_args(argc, argv);
     global_args.sm_port = SM_PORT;    // hard coded server manager port
-
-    printf("Connecting to server manager at %s:%d\n", global_args.sm_ip, global_args.sm_port);
-    sm_socket = server_manager_tcp(&global_args);
-    if(sm_socket < 0)
+    if(init_workers(argc, argv) < 0)
     {
-        fprintf(stderr, "Error connecting to server manager\n");
         exit(EXIT_FAILURE);
     }
 
-    /* Clear FD_CLOEXEC so that the socket is inherited by the child */
+    /* The link connects in the background and reconnects whenever the manager goes away.
+       Only we talk to the manager; each worker gets its own diagnostics socket on SM_WORKER_FD. */
+    printf("Connecting to server manager at %s:%d\n", global_args.sm_ip, global_args.sm_port);
+    sm_link_open(&manager, &global_args);
+
+    /* SIGUSR2 starts new server binaries that take over from the running ones (needs --handoff) */
     {
-        int flags = fcntl(sm_socket, F_GETFD, 0);
-        if(flags < 0)
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = sigusr2_handler;
+        sigemptyset(&sa.sa_mask);
+        if(sigaction(SIGUSR2, &sa, NULL) == -1)
         {
-            perror("fcntl F_GETFD");
+            perror("sigaction");
             exit(EXIT_FAILURE);
         }
-        flags &= ~FD_CLOEXEC;
-        if(fcntl(sm_socket, F_SETFD, flags) == -1)
+    }
+
+    /* Main loop: wait for start/stop requests from the server manager while minding the workers */
+    next_diag = now_ms() + DIAGNOSTIC_INTERVAL;
+    while(1)
+    {
+        struct pollfd pfds[1 + WORKERS_MAX];
+        int           timeout = sm_link_timeout(&manager);
+        ssize_t       n;
+
+        sm_link_poll(&manager, &pfds[0]);
+        for(int i = 0; i < worker_count; i++)
+        {
+            pfds[1 + i].fd      = workers[i].diag_fd;
+            pfds[1 + i].events  = POLLIN;
+            pfds[1 + i].revents = 0;
+        }
+        if(timeout < 0 || timeout > SUPERVISE_TICK_MS)
+        {
+            timeout = SUPERVISE_TICK_MS;
+        }
+        if(poll(pfds, (nfds_t)(1 + worker_count), timeout) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+
+        if(upgrade_requested)
+        {
+            upgrade_requested = 0;
+            upgrade_workers();
+        }
+        reap_workers();
+        restart_workers();
+        for(int i = 0; i < worker_count; i++)
         {
-            perror("fcntl F_SETFD");
+            if(workers[i].diag_fd >= 0 && (pfds[1 + i].revents & POLLIN))
+            {
+                collect_diagnostics(&workers[i]);
+            }
+        }
+        if(now_ms() >= next_diag)
+        {
+            send_diagnostics();
+            next_diag = now_ms() + DIAGNOSTIC_INTERVAL;
+        }
+
+        sm_link_handle(&manager, pfds[0].revents);
+        while((n = sm_link_recv(&manager, req, MSG_LEN)) != 0)
+        {
+            if(n < 0)
+            {
+                fprintf(stderr, "Ignoring a request with an unexpected payload\n");
+                continue;
+            }
+            /* Check that the protocol version matches */
+            if(req[1] != PROTOCOL_VERSION)
+            {
+                fprintf(stderr, "Protocol version mismatch: expected %d, got %d\n", PROTOCOL_VERSION, req[1]);
+                continue;
+            }
+            if(req[0] == SVR_START)
+            {
+                const unsigned char online_msg[MSG_LEN] = {SVR_ONLINE, PROTOCOL_VERSION, 0x00, 0x00};
+
+                printf("Received SVR_Start request\n");
+                if(!running && start_workers() < 0)
+                {
+                    continue;
+                }
+                /* Send SVR_ONLINE response (also when the server is already running) */
+                if(sm_link_send(&manager, online_msg, MSG_LEN) < 0)
+                {
+                    fprintf(stderr, "Could not queue SVR_ONLINE\n");
+                }
+            }
+            else if(req[0] == SVR_STOP)
+            {
+                const unsigned char offline_msg[MSG_LEN] = {SVR_OFFLINE, PROTOCOL_VERSION, 0x00, 0x00};
+
+                printf("Received SVR_Stop request\n");
+                stop_workers();
+                sm_link_send(&manager, offline_msg, MSG_LEN);
+                sm_link_flush(&manager, STOP_FLUSH_MS);
+                printf("Shutting down server starter...\n");
+                sm_link_close(&manager);
+                exit(EXIT_SUCCESS);
+            }
+            else
+            {
+                fprintf(stderr, "Received unknown request: 0x%02x\n", req[0]);
+            }
         }
     }
+    stop_workers();
+    sm_link_close(&manager);
+    return 0;
+}
+
+static void sigusr2_handler(int sig)
+{
+    (void)sig;
+    upgrade_requested = 1;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
 
-    /* Duplicate sm_socket to our desired file descriptor sm_fd so that the server process
-       (after execv) gets the connection on a known fd. */
-    if(dup2(sm_socket, sm_fd) == -1)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * MS_PER_SEC) + ((uint64_t)ts.tv_nsec / NS_PER_MS);
+}
+
+/*
+ * Builds each worker's command line: ours, plus per-worker values for the
+ * options that name something only one process may own (the handoff socket,
+ * the admin port and the capture file). A lone worker runs with ours as is.
+ */
+static int init_workers(int argc, char *argv[])
+{
+    worker_count = global_args.workers;
+    for(int i = 0; i < worker_count; i++)
     {
-        perror("dup2");
+        worker_t *w    = &workers[i];
+        int       argn = argc;
+
+        w->pid     = 0;
+        w->diag_fd = -1;
+        w->argv    = (char **)calloc((size_t)argc + WORKER_EXTRA_ARGS + 1, sizeof(char *));
+        if(w->argv == NULL)
+        {
+            perror("calloc");
+            return -1;
+        }
+        memcpy(w->argv, argv, (size_t)argc * sizeof(char *));
+        if(worker_count == 1)
+        {
+            continue;
+        }
+        if(global_args.handoff_path != NULL)
+        {
+            snprintf(w->handoff_path, sizeof(w->handoff_path), "%s.%d", global_args.handoff_path, i);
+            w->argv[argn++] = opt_handoff;
+            w->argv[argn++] = w->handoff_path;
+        }
+        if(global_args.admin_port != 0)
+        {
+            snprintf(w->admin_port, sizeof(w->admin_port), "%d", global_args.admin_port + i);
+            w->argv[argn++] = opt_admin;
+            w->argv[argn++] = w->admin_port;
+        }
+        if(global_args.capture_path != NULL)
+        {
+            snprintf(w->capture_path, sizeof(w->capture_path), "%s.%d", global_args.capture_path, i);
+            w->argv[argn++] = opt_capture;
+            w->argv[argn++] = w->capture_path;
+        }
+    }
+    return 0;
+}
+
+/* Forks and execs a worker with its diagnostics socket on SM_WORKER_FD. Returns the pid (and our end of the socket) or -1. */
+static pid_t spawn_worker(const worker_t *w, int index, int *diag_fd)
+{
+    int   pair[2];
+    pid_t pid;
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0)
+    {
+        perror("socketpair");
+        return -1;
+    }
+    pid = fork();
+    if(pid < 0)
+    {
+        perror("fork");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if(pid == 0)
+    {
+        /* Child process: start the actual server. dup2() clears close-on-exec on the copy. */
+        if(dup2(pair[1], SM_WORKER_FD) == -1)
+        {
+            perror("dup2");
+            exit(EXIT_FAILURE);
+        }
+        if(worker_count > 1)
+        {
+            pin_worker(index);
+        }
+        printf("Starting server process...\n");
+        execv("./build/main", w->argv);
+        perror("execv");
         exit(EXIT_FAILURE);
     }
-    if(sm_socket != sm_fd)
+    close(pair[1]);
+    *diag_fd = pair[0];
+    return pid;
+}
+
+static int start_workers(void)
+{
+    int started = 0;
+
+    running = 1;
+    for(int i = 0; i < worker_count; i++)
+    {
+        workers[i].backoff_ms    = 0;
+        workers[i].restart_at_ms = 0;
+        workers[i].pid           = spawn_worker(&workers[i], i, &workers[i].diag_fd);
+        if(workers[i].pid > 0)
+        {
+            workers[i].started_ms = now_ms();
+            started++;
+        }
+        else
+        {
+            workers[i].pid           = 0;
+            workers[i].restart_at_ms = now_ms() + BACKOFF_MIN_MS;
+        }
+    }
+    if(started == 0)
     {
-        close(sm_socket);
+        running = 0;
+        return -1;
     }
+    return 0;
+}
 
-    printf("Connected to server manager.\n");
+static void stop_workers(void)
+{
+    running = 0;
+    for(int i = 0; i < worker_count; i++)
+    {
+        if(workers[i].pid > 0 && kill(workers[i].pid, SIGINT) != 0)
+        {
+            perror("kill");
+        }
+    }
+    for(int i = 0; i < worker_count; i++)
+    {
+        if(workers[i].pid > 0)
+        {
+            waitpid(workers[i].pid, NULL, 0);
+            workers[i].pid = 0;
+        }
+        if(workers[i].diag_fd >= 0)
+        {
+            close(workers[i].diag_fd);
+            workers[i].diag_fd = -1;
+        }
+    }
+}
 
-    /* Main loop: continuously wait for start/stop requests from the server manager */
-    while(1)
+/* Collects exited workers and schedules their restart, backing off while they keep dying young. */
+static void reap_workers(void)
+{
+    pid_t pid;
+    int   status;
+
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0)
     {
-        ssize_t n = read(sm_fd, req, MSG_LEN);
-        if(n <= 0)
+        for(int i = 0; i < worker_count; i++)
         {
-            perror("read");
-            break;
+            worker_t *w = &workers[i];
+            uint64_t  uptime;
+
+            if(w->pid != pid)
+            {
+                continue;
+            }
+            if(WIFSIGNALED(status))
+            {
+                fprintf(stderr, "Worker %d (pid %d) killed by signal %d\n", i, (int)pid, WTERMSIG(status));
+            }
+            else
+            {
+                fprintf(stderr, "Worker %d (pid %d) exited with status %d\n", i, (int)pid, WEXITSTATUS(status));
+            }
+            close(w->diag_fd);
+            w->diag_fd  = -1;
+            w->diag_len = 0;
+            w->pid      = 0;
+
+            uptime        = now_ms() - w->started_ms;
+            w->backoff_ms = uptime >= STABLE_MS ? BACKOFF_MIN_MS : w->backoff_ms * 2;
+            if(w->backoff_ms < BACKOFF_MIN_MS)
+            {
+                w->backoff_ms = BACKOFF_MIN_MS;
+            }
+            if(w->backoff_ms > BACKOFF_MAX_MS)
+            {
+                w->backoff_ms = BACKOFF_MAX_MS;
+            }
+            w->restart_at_ms = now_ms() + w->backoff_ms;
+            if(running)
+            {
+                printf("Restarting worker %d in %u ms\n", i, w->backoff_ms);
+            }
         }
-        if(n < MSG_LEN)
+    }
+}
+
+static void restart_workers(void)
+{
+    if(!running)
+    {
+        return;
+    }
+    for(int i = 0; i < worker_count; i++)
+    {
+        worker_t *w = &workers[i];
+
+        if(w->pid != 0 || now_ms() < w->restart_at_ms)
+        {
+            continue;
+        }
+        w->pid = spawn_worker(w, i, &w->diag_fd);
+        if(w->pid > 0)
+        {
+            w->started_ms = now_ms();
+        }
+        else
+        {
+            w->pid           = 0;
+            w->restart_at_ms = now_ms() + BACKOFF_MAX_MS;
+        }
+    }
+}
+
+/*
+ * Replaces the workers one at a time. Each new server takes the listener and
+ * the clients from its predecessor over the handoff socket, and the old one
+ * exits. A worker whose replacement dies first keeps running.
+ */
+static void upgrade_workers(void)
+{
+    if(!running || global_args.handoff_path == NULL)
+    {
+        fprintf(stderr, "Hot upgrade needs a running server started with --handoff\n");
+        return;
+    }
+
+    for(int i = 0; i < worker_count; i++)
+    {
+        worker_t *w = &workers[i];
+        pid_t     new_pid;
+        int       diag_fd;
+        int       waited;
+
+        if(w->pid <= 0)
         {
-            /* Incomplete message: wait for the complete message */
             continue;
         }
-        /* Check that the protocol version matches */
-        if(req[1] != PROTOCOL_VERSION)
+        printf("Upgrading server %d...\n", (int)w->pid);
+        new_pid = spawn_worker(w, i, &diag_fd);
+        if(new_pid < 0)
         {
-            fprintf(stderr, "Protocol version mismatch: expected %d, got %d\n", PROTOCOL_VERSION, req[1]);
             continue;
         }
-        if(req[0] == SVR_START)
+
+        for(waited = 0; waited < UPGRADE_TIMEOUT_MS; waited += UPGRADE_POLL_MS)
         {
-            printf("Received SVR_Start request\n");
-            if(child_pid <= 0)
+            if(waitpid(w->pid, NULL, WNOHANG) == w->pid)
             {
-                child_pid = fork();
-                if(child_pid < 0)
-                {
-                    perror("fork");
-                    continue;
-                }
-                if(child_pid == 0)
-                {
-                    /* Child process: start the actual server */
-                    printf("Starting server process...\n");
-                    execv("./build/main", argv);
-                    perror("execv");
-                    exit(EXIT_FAILURE);
-                }
-                else
-                {
-                    /* Parent process: send SVR_ONLINE response */
-                    const unsigned char online_msg[MSG_LEN] = {SVR_ONLINE, PROTOCOL_VERSION, 0x00, 0x00};
-                    if(write(sm_fd, online_msg, MSG_LEN) != MSG_LEN)
-                    {
-                        perror("write SVR_ONLINE");
-                    }
-                }
+                break;
             }
-            else
+            if(waitpid(new_pid, NULL, WNOHANG) == new_pid)
             {
-                /* Server is already running; send online response */
-                const unsigned char online_msg[MSG_LEN] = {SVR_ONLINE, PROTOCOL_VERSION, 0x00, 0x00};
-                if(write(sm_fd, online_msg, MSG_LEN) != MSG_LEN)
-                {
-                    perror("write SVR_ONLINE");
-                }
+                fprintf(stderr, "New server exited during the upgrade, keeping %d\n", (int)w->pid);
+                close(diag_fd);
+                new_pid = -1;
+                break;
+            }
+            usleep(UPGRADE_POLL_MS * US_PER_MS);
+        }
+        if(new_pid < 0)
+        {
+            continue;
+        }
+        if(waited >= UPGRADE_TIMEOUT_MS)
+        {
+            fprintf(stderr, "Old server %d has not exited; tracking the new server %d\n", (int)w->pid, (int)new_pid);
+        }
+        else
+        {
+            printf("Upgrade complete, server is now %d\n", (int)new_pid);
+        }
+        close(w->diag_fd);
+        w->pid        = new_pid;
+        w->diag_fd    = diag_fd;
+        w->diag_len   = 0;
+        w->started_ms = now_ms();
+    }
+}
+
+/* Binds worker index to one of the CPUs we may run on, so workers do not migrate and share caches. */
+static void pin_worker(int index)
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    cpu_set_t one;
+    int       target;
+    int       seen = 0;
+
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return;
+    }
+    target = index % CPU_COUNT(&allowed);
+    for(size_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if(CPU_ISSET(cpu, &allowed) && seen++ == target)
+        {
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            if(sched_setaffinity(0, sizeof(one), &one) != 0)
+            {
+                perror("sched_setaffinity");
             }
+            return;
         }
-        else if(req[0] == SVR_STOP)
+    }
+#else
+    (void)index;
+#endif
+}
+
+/* Keeps the most recent report a worker has sent. */
+static void collect_diagnostics(worker_t *w)
+{
+    uint8_t buf[DIAG_EXT_MSG_MAX];
+    ssize_t n;
+
+    while((n = recv(w->diag_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+    {
+        memcpy(w->diag, buf, (size_t)n);
+        w->diag_len = (size_t)n;
+    }
+}
+
+/* Sends the manager one report for all workers: counters add up, latency percentiles take the slowest worker. */
+static void send_diagnostics(void)
+{
+    uint64_t total[DIAG_FIELDS_MAX];
+    uint8_t  widths[DIAG_FIELDS_MAX];
+    uint8_t  out[DIAG_EXT_MSG_MAX];
+    size_t   fields  = 0;
+    int      reports = 0;
+    uint8_t *ptr;
+    uint16_t payload_len;
+
+    for(int i = 0; i < worker_count; i++)
+    {
+        uint64_t values[DIAG_FIELDS_MAX];
+        uint8_t  w_widths[DIAG_FIELDS_MAX];
+        size_t   n = parse_diagnostic(workers[i].diag, workers[i].diag_len, values, w_widths);
+
+        if(n == 0 || (reports > 0 && n != fields))
+        {
+            continue;
+        }
+        if(reports++ == 0)
         {
-            printf("Received SVR_Stop request\n");
-            if(child_pid > 0)
+            fields = n;
+            memcpy(total, values, n * sizeof(values[0]));
+            memcpy(widths, w_widths, n);
+            continue;
+        }
+        for(size_t f = 0; f < n; f++)
+        {
+            int extended = fields == DIAG_EXT_FIELDS && total[0] == DIAG_VERSION_EXTENDED;
+
+            if(extended && f == 0)
             {
-                const unsigned char offline_msg[MSG_LEN] = {SVR_OFFLINE, PROTOCOL_VERSION, 0x00, 0x00};
-                if(kill(child_pid, SIGINT) != 0)
-                {
-                    perror("kill");
-                }
-                waitpid(child_pid, NULL, 0);
-                if(write(sm_fd, offline_msg, MSG_LEN) != MSG_LEN)
-                {
-                    perror("write SVR_OFFLINE");
-                }
+                continue;    // Layout version
             }
-            else
+            if(extended && (f == DIAG_EXT_P50 || f == DIAG_EXT_P99))
             {
-                const unsigned char offline_msg[MSG_LEN] = {SVR_OFFLINE, PROTOCOL_VERSION, 0x00, 0x00};
-                if(write(sm_fd, offline_msg, MSG_LEN) != MSG_LEN)
-                {
-                    perror("write SVR_OFFLINE");
-                }
+                total[f] = values[f] > total[f] ? values[f] : total[f];
+                continue;
             }
-            printf("Shutting down server starter...\n");
-            close(sm_fd);
-            exit(EXIT_SUCCESS);
+            total[f] += values[f];
         }
-        else
+    }
+    if(reports == 0)
+    {
+        return;
+    }
+
+    ptr = out + SM_HEADERLEN;
+    for(size_t f = 0; f < fields; f++)
+    {
+        uint64_t value = total[f];
+
+        if(widths[f] < sizeof(uint64_t) && value >> (widths[f] * BYTE_BITS) != 0)
+        {
+            value = (UINT64_C(1) << (widths[f] * BYTE_BITS)) - 1;    // Saturate rather than wrap
+        }
+        *ptr++ = BER_INT;
+        *ptr++ = widths[f];
+        for(int b = widths[f] - 1; b >= 0; b--)
         {
-            fprintf(stderr, "Received unknown request: 0x%02x\n", req[0]);
+            *ptr++ = (uint8_t)(value >> (b * BYTE_BITS));
         }
     }
-    close(sm_fd);
-    return 0;
+    payload_len = htons((uint16_t)(ptr - out - SM_HEADERLEN));
+    out[0]      = SVR_DIAGNOSTIC;
+    out[1]      = PROTOCOL_VERSION;
+    memcpy(out + 2, &payload_len, sizeof(payload_len));
+    // Queued while the manager is away; it gets the backlog once the link is back.
+    sm_link_send(&manager, out, (size_t)(ptr - out));
+}
+
+/* Splits a worker's report into its integers. Returns how many there were, or 0 if the report is malformed. */
+static size_t parse_diagnostic(const uint8_t *msg, size_t len, uint64_t *values, uint8_t *widths)
+{
+    size_t pos    = SM_HEADERLEN;
+    size_t fields = 0;
+
+    if(len <= SM_HEADERLEN || msg[0] != SVR_DIAGNOSTIC)
+    {
+        return 0;
+    }
+    while(pos < len)
+    {
+        uint8_t width;
+
+        if(fields == DIAG_FIELDS_MAX || len - pos < 2 || msg[pos] != BER_INT)
+        {
+            return 0;
+        }
+        width = msg[pos + 1];
+        pos += 2;
+        if(width == 0 || width > sizeof(uint64_t) || len - pos < width)
+        {
+            return 0;
+        }
+        values[fields] = 0;
+        for(uint8_t b = 0; b < width; b++)
+        {
+            values[fields] = (values[fields] << BYTE_BITS) | msg[pos++];
+        }
+        widths[fields++] = width;
+    }
+    return fields;
 }
@@ -0,0 +1,383 @@
+/*******************************************************************************
+ * Server manager link
+ *
+ * The manager connection is one more non-blocking socket in the caller's
+ * event loop. A manager that stops reading fills our queue, not our stack:
+ * frames wait in tx until POLLOUT, and when the queue is full the oldest
+ * waiting frame is dropped, so chat traffic never waits on the manager.
+ * A manager that goes away is reconnected with exponential backoff, and
+ * frames sent in the meantime go out once it is back.
+ ******************************************************************************/
+
+#include "../include/sm_link.h"
+#include "../include/logger.h"
+#include "../include/network.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MS_PER_SEC (1000)
+#define NS_PER_MS (1000000)
+#define BYTE_BITS (8)
+
+static uint64_t now_ms(void);
+static size_t   frame_len(const uint8_t *frame);
+static void     link_connect(sm_link_t *link);
+static void     link_down(sm_link_t *link, const char *why);
+static void     link_read(sm_link_t *link);
+static void     link_write(sm_link_t *link);
+static void     drop_oldest(sm_link_t *link);
+
+void sm_link_open(sm_link_t *link, const Arguments *args)
+{
+    link->fd          = -1;
+    link->connecting  = 0;
+    link->args        = args;
+    link->retry_at_ms = 0;
+    link->backoff_ms  = SM_LINK_BACKOFF_MIN;
+    link->rx_len      = 0;
+    link->tx_len      = 0;
+    link->tx_sent     = 0;
+    link_connect(link);
+}
+
+int sm_link_adopt(sm_link_t *link, int fd)
+{
+    struct stat st;
+    int         flag;
+
+    link->fd          = -1;
+    link->connecting  = 0;
+    link->args        = NULL;
+    link->retry_at_ms = 0;
+    link->backoff_ms  = 0;
+    link->rx_len      = 0;
+    link->tx_len      = 0;
+    link->tx_sent     = 0;
+
+    // Started by hand, fd 0 is a terminal or /dev/null rather than a supervisor.
+    if(fstat(fd, &st) != 0 || !S_ISSOCK(st.st_mode))
+    {
+        return -1;
+    }
+    flag = fcntl(fd, F_GETFL, 0);
+    if(flag == -1 || fcntl(fd, F_SETFL, flag | O_NONBLOCK) == -1)
+    {
+        return -1;
+    }
+    link->fd = fd;
+    return 0;
+}
+
+void sm_link_close(sm_link_t *link)
+{
+    if(link->fd >= 0)
+    {
+        close(link->fd);
+    }
+    link->fd         = -1;
+    link->connecting = 0;
+    link->args       = NULL;
+    link->rx_len     = 0;
+    link->tx_len     = 0;
+    link->tx_sent    = 0;
+}
+
+int sm_link_enabled(const sm_link_t *link)
+{
+    return link->fd >= 0 || link->args != NULL;
+}
+
+int sm_link_up(const sm_link_t *link)
+{
+    return link->fd >= 0 && !link->connecting;
+}
+
+void sm_link_poll(const sm_link_t *link, struct pollfd *pfd)
+{
+    pfd->fd      = link->fd;
+    pfd->revents = 0;
+    if(link->connecting)
+    {
+        pfd->events = POLLOUT;
+        return;
+    }
+    pfd->events = (short)(POLLIN | (link->tx_len > 0 ? POLLOUT : 0));
+}
+
+int sm_link_handle(sm_link_t *link, short revents)
+{
+    if(link->fd < 0)
+    {
+        if(link->args != NULL && now_ms() >= link->retry_at_ms)
+        {
+            link_connect(link);
+        }
+        return 0;
+    }
+
+    if(link->connecting)
+    {
+        int       err = 0;
+        socklen_t len = sizeof(err);
+
+        if(!(revents & (POLLOUT | POLLERR | POLLHUP)))
+        {
+            return 0;
+        }
+        if(getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+        {
+            err = errno;
+        }
+        if(err != 0)
+        {
+            link_down(link, strerror(err));
+            return 0;
+        }
+        link->connecting = 0;
+        link->backoff_ms = SM_LINK_BACKOFF_MIN;
+        LOG_INFO("Connected to server manager at %s:%u", link->args->sm_ip, link->args->sm_port);
+        link_write(link);
+        return 1;
+    }
+
+    if(revents & (POLLIN | POLLHUP | POLLERR))
+    {
+        link_read(link);
+    }
+    if(link->fd >= 0 && (revents & POLLOUT))
+    {
+        link_write(link);
+    }
+    return 0;
+}
+
+int sm_link_timeout(const sm_link_t *link)
+{
+    uint64_t now;
+
+    if(link->fd >= 0 || link->args == NULL)
+    {
+        return -1;
+    }
+    now = now_ms();
+    return link->retry_at_ms > now ? (int)(link->retry_at_ms - now) : 0;
+}
+
+ssize_t sm_link_recv(sm_link_t *link, uint8_t *buf, size_t cap)
+{
+    size_t len;
+
+    if(link->rx_len < SM_HEADERLEN)
+    {
+        return 0;
+    }
+    len = frame_len(link->rx);
+    if(link->rx_len < len)
+    {
+        return 0;
+    }
+    if(len <= cap)
+    {
+        memcpy(buf, link->rx, len);
+    }
+    link->rx_len -= len;
+    memmove(link->rx, link->rx + len, link->rx_len);
+    return len <= cap ? (ssize_t)len : -1;
+}
+
+int sm_link_send(sm_link_t *link, const void *frame, size_t len)
+{
+    if(!sm_link_enabled(link) || len < SM_HEADERLEN || len != frame_len((const uint8_t *)frame))
+    {
+        return -1;
+    }
+    while(link->tx_len + len > SM_LINK_TX_MAX)
+    {
+        size_t before = link->tx_len;
+
+        drop_oldest(link);
+        if(link->tx_len == before)
+        {
+            return -1;    // Only the frame being written is left, and it must finish
+        }
+    }
+    memcpy(link->tx + link->tx_len, frame, len);
+    link->tx_len += len;
+    if(sm_link_up(link))
+    {
+        link_write(link);
+    }
+    return 0;
+}
+
+void sm_link_flush(sm_link_t *link, int timeout_ms)
+{
+    uint64_t deadline = now_ms() + (uint64_t)timeout_ms;
+
+    while(sm_link_up(link) && link->tx_len > 0)
+    {
+        struct pollfd pfd;
+        uint64_t      now = now_ms();
+
+        if(now >= deadline)
+        {
+            LOG_WARN("Server manager did not take %zu queued bytes", link->tx_len);
+            return;
+        }
+        pfd.fd      = link->fd;
+        pfd.events  = POLLOUT;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, (int)(deadline - now)) > 0)
+        {
+            link_write(link);
+        }
+    }
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * MS_PER_SEC) + ((uint64_t)ts.tv_nsec / NS_PER_MS);
+}
+
+/* Total length of the frame whose header starts at frame */
+static size_t frame_len(const uint8_t *frame)
+{
+    return SM_HEADERLEN + (((size_t)frame[2] << BYTE_BITS) | frame[3]);
+}
+
+static void link_connect(sm_link_t *link)
+{
+    link->fd = server_manager_tcp(link->args);
+    if(link->fd < 0)
+    {
+        link->fd          = -1;
+        link->retry_at_ms = now_ms() + link->backoff_ms;
+        link->backoff_ms  = link->backoff_ms * 2 > SM_LINK_BACKOFF_MAX ? SM_LINK_BACKOFF_MAX : link->backoff_ms * 2;
+        return;
+    }
+    link->connecting = 1;
+}
+
+/* Drops the connection. Queued frames are kept for the next one; a half-written frame cannot be resumed. */
+static void link_down(sm_link_t *link, const char *why)
+{
+    if(link->connecting)
+    {
+        LOG_WARN("Cannot reach server manager (%s), retrying in %u ms", why, link->backoff_ms);
+    }
+    else if(link->args != NULL)
+    {
+        LOG_WARN("Server manager link lost (%s), retrying in %u ms", why, link->backoff_ms);
+    }
+    else
+    {
+        LOG_WARN("Server manager link lost (%s)", why);
+    }
+    close(link->fd);
+    link->fd         = -1;
+    link->connecting = 0;
+    link->rx_len     = 0;
+    if(link->tx_sent > 0)
+    {
+        size_t len = frame_len(link->tx);
+
+        link->tx_len -= len;
+        memmove(link->tx, link->tx + len, link->tx_len);
+        link->tx_sent = 0;
+    }
+    if(link->args == NULL)
+    {
+        link->tx_len = 0;
+        return;
+    }
+    link->retry_at_ms = now_ms() + link->backoff_ms;
+    link->backoff_ms  = link->backoff_ms * 2 > SM_LINK_BACKOFF_MAX ? SM_LINK_BACKOFF_MAX : link->backoff_ms * 2;
+}
+
+/* Reads whatever has arrived. The buffer holds the largest frame, so it is only full when a frame is waiting. */
+static void link_read(sm_link_t *link)
+{
+    while(link->rx_len < sizeof(link->rx))
+    {
+        ssize_t n = recv(link->fd, link->rx + link->rx_len, sizeof(link->rx) - link->rx_len, MSG_DONTWAIT);
+
+        if(n > 0)
+        {
+            link->rx_len += (size_t)n;
+            continue;
+        }
+        if(n == 0)
+        {
+            link_down(link, "closed by peer");
+            return;
+        }
+        if(errno == EINTR)
+        {
+            continue;
+        }
+        if(!would_block(errno))
+        {
+            link_down(link, strerror(errno));
+        }
+        return;
+    }
+}
+
+/* Writes queued frames one send() each, so a SOCK_SEQPACKET peer sees one frame per message. */
+static void link_write(sm_link_t *link)
+{
+    while(link->tx_len > 0)
+    {
+        size_t  len = frame_len(link->tx);
+        ssize_t n   = send(link->fd, link->tx + link->tx_sent, len - link->tx_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(!would_block(errno))
+            {
+                link_down(link, strerror(errno));
+            }
+            return;
+        }
+        link->tx_sent += (size_t)n;
+        if(link->tx_sent < len)
+        {
+            continue;
+        }
+        link->tx_len -= len;
+        memmove(link->tx, link->tx + len, link->tx_len);
+        link->tx_sent = 0;
+    }
+}
+
+/* Makes room by dropping the oldest frame that has not started going out. */
+static void drop_oldest(sm_link_t *link)
+{
+    size_t start = 0;
+    size_t len;
+
+    if(link->tx_sent > 0)
+    {
+        start = frame_len(link->tx);
+        if(start >= link->tx_len)
+        {
+            return;
+        }
+    }
+    len = frame_len(link->tx + start);
+    LOG_WARN("Server manager queue full, dropped a 0x%02x frame", link->tx[start]);
+    link->tx_len -= len;
+    memmove(link->tx + start, link->tx + start + len, link->tx_len - start);
+}
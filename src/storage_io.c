@@ -0,0 +1,261 @@
+/*******************************************************************************
+ * Storage I/O thread
+ *
+ * A waiting call lives on the stack of the coroutine that made it, which
+ * stays put while the coroutine is suspended, so queueing a call allocates
+ * nothing; a submitted call is allocated, since nobody waits for it. The
+ * storage thread takes everything queued in one go, runs it in order and
+ * hands the finished batch to the done list under a single lock. The loop
+ * is woken only when the done list goes from empty to non-empty, because
+ * it takes the whole list at once.
+ ******************************************************************************/
+
+#include "../include/storage_io.h"
+#include "../include/logger.h"
+#include "../include/wakeup.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+typedef struct storage_call
+{
+    struct storage_call *next;    // cppcheck-suppress unusedStructMember
+    storage_fn_t         fn;      // cppcheck-suppress unusedStructMember
+    storage_fn_t         done;    // Submitted calls: runs on the loop afterwards
+    void                *arg;     // cppcheck-suppress unusedStructMember
+    coro_t              *co;      // Awaited calls: resumed on the loop afterwards
+} storage_call_t;
+
+typedef struct
+{
+    storage_call_t *head;    // cppcheck-suppress unusedStructMember
+    storage_call_t *tail;    // cppcheck-suppress unusedStructMember
+} call_list_t;
+
+static pthread_mutex_t lock  = PTHREAD_MUTEX_INITIALIZER;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static pthread_cond_t  ready = PTHREAD_COND_INITIALIZER;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static call_list_t     queued;                               // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static call_list_t     done;                                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_size_t   backlog;                              // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static bool            stopping;                             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int             running;                              // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int             wake[2] = {-1, -1};                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static pthread_t       storage_thread;                       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static void           *storage_loop(void *arg);
+static void            queue_call(storage_call_t *call);
+static void            list_append(call_list_t *list, storage_call_t *call);
+static storage_call_t *list_take(call_list_t *list);
+static void            run_finished(storage_call_t *call, void (*resume)(coro_t *co));
+
+int storage_io_start(void)
+{
+    if(wakeup_open(wake) < 0)
+    {
+        LOG_ERROR("storage thread: %s", strerror(errno));
+        return -1;
+    }
+    stopping = false;
+    if(pthread_create(&storage_thread, NULL, storage_loop, NULL) != 0)
+    {
+        LOG_ERROR("storage thread: cannot start");
+        wakeup_close(wake);
+        return -1;
+    }
+    running = 1;
+    LOG_INFO("Storage calls run on their own thread");
+    return 0;
+}
+
+void storage_io_stop(void (*resume)(coro_t *co))
+{
+    if(!running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+    pthread_join(storage_thread, NULL);
+    running = 0;
+    // Every queued call has run. With the thread gone, the handlers resumed here make the rest of their
+    // calls directly, so each runs to the end before this returns.
+    run_finished(list_take(&done), resume);
+    wakeup_close(wake);
+}
+
+int storage_io_active(void)
+{
+    return running;
+}
+
+int storage_io_fd(void)
+{
+    return wake[0];
+}
+
+size_t storage_io_backlog(void)
+{
+    return atomic_load_explicit(&backlog, memory_order_relaxed);
+}
+
+void storage_io_run(void (*resume)(coro_t *co))
+{
+    storage_call_t *call;
+
+    wakeup_clear(wake);
+    pthread_mutex_lock(&lock);
+    call = list_take(&done);
+    pthread_mutex_unlock(&lock);
+    run_finished(call, resume);
+}
+
+void storage_await(storage_fn_t fn, void *arg)
+{
+    storage_call_t call;
+
+    call.co = coro_current();
+    if(!running || call.co == NULL)
+    {
+        fn(arg);
+        return;
+    }
+    call.fn   = fn;
+    call.done = NULL;
+    call.arg  = arg;
+    queue_call(&call);
+    coro_yield();
+}
+
+int storage_submit(storage_fn_t fn, storage_fn_t complete, void *arg)
+{
+    storage_call_t *call;
+
+    if(!running)
+    {
+        fn(arg);
+        complete(arg);
+        return 0;
+    }
+    call = (storage_call_t *)malloc(sizeof(storage_call_t));
+    if(call == NULL)
+    {
+        return -1;
+    }
+    call->fn   = fn;
+    call->done = complete;
+    call->arg  = arg;
+    call->co   = NULL;
+    queue_call(call);
+    return 0;
+}
+
+static void *storage_loop(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for(;;)
+    {
+        storage_call_t *batch = list_take(&queued);
+        storage_call_t *last  = NULL;
+        bool            was_empty;
+
+        if(batch == NULL)
+        {
+            if(stopping)
+            {
+                break;
+            }
+            pthread_cond_wait(&ready, &lock);
+            continue;
+        }
+        pthread_mutex_unlock(&lock);
+
+        // A call's next link is its place in the batch; the links are kept as they go onto the done list.
+        for(storage_call_t *call = batch; call != NULL; call = call->next)
+        {
+            call->fn(call->arg);
+            atomic_fetch_sub_explicit(&backlog, 1, memory_order_relaxed);
+            last = call;
+        }
+
+        pthread_mutex_lock(&lock);
+        was_empty = done.head == NULL;
+        if(done.tail != NULL)
+        {
+            done.tail->next = batch;
+        }
+        else
+        {
+            done.head = batch;
+        }
+        done.tail = last;
+        if(was_empty)
+        {
+            wakeup_signal(wake, "storage");
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void queue_call(storage_call_t *call)
+{
+    atomic_fetch_add_explicit(&backlog, 1, memory_order_relaxed);
+    pthread_mutex_lock(&lock);
+    list_append(&queued, call);
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+}
+
+static void list_append(call_list_t *list, storage_call_t *call)
+{
+    call->next = NULL;
+    if(list->tail != NULL)
+    {
+        list->tail->next = call;
+    }
+    else
+    {
+        list->head = call;
+    }
+    list->tail = call;
+}
+
+/* Empties the list, returning its calls in order. */
+static storage_call_t *list_take(call_list_t *list)
+{
+    storage_call_t *head = list->head;
+
+    list->head = NULL;
+    list->tail = NULL;
+    return head;
+}
+
+/* Resumes the coroutines of the awaited calls in a finished list and runs the completions of the submitted ones. */
+static void run_finished(storage_call_t *call, void (*resume)(coro_t *co))
+{
+    while(call != NULL)
+    {
+        // An awaited call lives on the coroutine's stack and is gone once it resumes.
+        storage_call_t *next = call->next;
+
+        if(call->co != NULL)
+        {
+            resume(call->co);
+        }
+        else
+        {
+            call->done(call->arg);
+            free(call);
+        }
+        call = next;
+    }
+}
@@ -0,0 +1,251 @@
+/*******************************************************************************
+ * Hierarchical timing wheel
+ *
+ * Timers live in intrusive doubly linked lists hanging off the wheel slots, so
+ * scheduling and cancelling are O(1). Level 0 holds timers due within
+ * TIMER_SLOTS ticks; timers further out sit in coarser levels and are cascaded
+ * down whenever the level below wraps around.
+ ******************************************************************************/
+
+#include "../include/timer.h"
+#include <time.h>
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_MAX_TICKS ((uint64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+#define MS_PER_SEC (1000)
+#define NS_PER_MS (1000000)
+
+static void     list_init(tw_timer_t *head);
+static void     list_append(tw_timer_t *head, tw_timer_t *timer);
+static void     list_unlink(tw_timer_t *timer);
+static void     place(timer_wheel_t *wheel, tw_timer_t *timer);
+static void     cascade(timer_wheel_t *wheel, int level);
+static uint64_t current_tick(const timer_wheel_t *wheel);
+
+uint64_t timer_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * MS_PER_SEC) + ((uint64_t)ts.tv_nsec / NS_PER_MS);
+}
+
+void timer_wheel_init(timer_wheel_t *wheel)
+{
+    int level;
+    int slot;
+
+    wheel->now      = 0;
+    wheel->count    = 0;
+    wheel->start_ms = timer_now_ms();
+    for(level = 0; level < TIMER_LEVELS; level++)
+    {
+        for(slot = 0; slot < TIMER_SLOTS; slot++)
+        {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+void timer_init(tw_timer_t *timer, timer_cb cb, void *arg)
+{
+    timer->next    = NULL;
+    timer->prev    = NULL;
+    timer->expires = 0;
+    timer->cb      = cb;
+    timer->arg     = arg;
+}
+
+void timer_schedule(timer_wheel_t *wheel, tw_timer_t *timer, uint32_t delay_ms)
+{
+    uint64_t ticks;
+
+    timer_cancel(wheel, timer);
+
+    /* Round up so a timer never fires early; always at least one tick away */
+    ticks = ((uint64_t)delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if(ticks == 0)
+    {
+        ticks = 1;
+    }
+    if(ticks >= TIMER_MAX_TICKS)
+    {
+        ticks = TIMER_MAX_TICKS - 1;
+    }
+
+    /* Count from the real current tick so a late timer_advance() does not stretch delays */
+    timer->expires = current_tick(wheel) + ticks;
+    if(timer->expires <= wheel->now)
+    {
+        timer->expires = wheel->now + 1;
+    }
+    place(wheel, timer);
+    wheel->count++;
+}
+
+void timer_cancel(timer_wheel_t *wheel, tw_timer_t *timer)
+{
+    if(timer_pending(timer))
+    {
+        list_unlink(timer);
+        wheel->count--;
+    }
+}
+
+int timer_pending(const tw_timer_t *timer)
+{
+    return timer->next != NULL;
+}
+
+size_t timer_advance(timer_wheel_t *wheel)
+{
+    uint64_t target;
+    size_t   fired = 0;
+
+    target = current_tick(wheel);
+    if(wheel->count == 0)
+    {
+        wheel->now = target;
+        return 0;
+    }
+
+    while(wheel->now < target)
+    {
+        tw_timer_t expired;
+        int        index;
+
+        wheel->now++;
+        index = (int)(wheel->now & TIMER_MASK);
+        if(index == 0)
+        {
+            cascade(wheel, 1);
+        }
+
+        /* Detach the slot first: callbacks may schedule or cancel timers */
+        list_init(&expired);
+        if(wheel->slots[0][index].next != &wheel->slots[0][index])
+        {
+            expired.next       = wheel->slots[0][index].next;
+            expired.prev       = wheel->slots[0][index].prev;
+            expired.next->prev = &expired;
+            expired.prev->next = &expired;
+            list_init(&wheel->slots[0][index]);
+        }
+
+        while(expired.next != &expired)
+        {
+            tw_timer_t *timer = expired.next;
+
+            list_unlink(timer);
+            wheel->count--;
+            timer->cb(timer->arg);
+            fired++;
+        }
+    }
+    return fired;
+}
+
+int timer_next_timeout(const timer_wheel_t *wheel)
+{
+    uint64_t now;
+    uint64_t ticks;
+    uint64_t elapsed;
+
+    if(wheel->count == 0)
+    {
+        return -1;
+    }
+
+    /* Nearest non-empty level 0 slot; otherwise wake up for the next cascade */
+    for(ticks = 1; ticks < TIMER_SLOTS; ticks++)
+    {
+        const tw_timer_t *head = &wheel->slots[0][(wheel->now + ticks) & TIMER_MASK];
+        if(head->next != head)
+        {
+            break;
+        }
+    }
+    if(ticks == TIMER_SLOTS)
+    {
+        ticks = TIMER_SLOTS - (wheel->now & TIMER_MASK);
+    }
+
+    now     = timer_now_ms();
+    elapsed = (now - wheel->start_ms) - (wheel->now * TIMER_TICK_MS);
+    if(elapsed >= ticks * TIMER_TICK_MS)
+    {
+        return 0;
+    }
+    return (int)((ticks * TIMER_TICK_MS) - elapsed);
+}
+
+static void list_init(tw_timer_t *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(tw_timer_t *head, tw_timer_t *timer)
+{
+    timer->prev      = head->prev;
+    timer->next      = head;
+    head->prev->next = timer;
+    head->prev       = timer;
+}
+
+static void list_unlink(tw_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next       = NULL;
+    timer->prev       = NULL;
+}
+
+/* Puts a timer into the finest level whose range covers its expiry. */
+static void place(timer_wheel_t *wheel, tw_timer_t *timer)
+{
+    uint64_t delta;
+    int      level;
+
+    delta = timer->expires - wheel->now;
+    for(level = 0; level < TIMER_LEVELS - 1; level++)
+    {
+        if(delta < ((uint64_t)1 << (TIMER_LEVEL_BITS * (level + 1))))
+        {
+            break;
+        }
+    }
+    list_append(&wheel->slots[level][(timer->expires >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK], timer);
+}
+
+/* Re-places the current slot of a level into finer levels, recursing upwards on wrap. */
+static void cascade(timer_wheel_t *wheel, int level)
+{
+    tw_timer_t *head;
+    int         index;
+
+    if(level >= TIMER_LEVELS)
+    {
+        return;
+    }
+
+    index = (int)((wheel->now >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK);
+    if(index == 0)
+    {
+        cascade(wheel, level + 1);
+    }
+
+    head = &wheel->slots[level][index];
+    while(head->next != head)
+    {
+        tw_timer_t *timer = head->next;
+
+        list_unlink(timer);
+        place(wheel, timer);
+    }
+}
+
+static uint64_t current_tick(const timer_wheel_t *wheel)
+{
+    return (timer_now_ms() - wheel->start_ms) / TIMER_TICK_MS;
+}
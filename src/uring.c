@@ -0,0 +1,390 @@
+/*******************************************************************************
+ * io_uring on raw system calls
+ *
+ * liburing is not a dependency of this project, so the rings are mapped and
+ * driven here directly. Only the single-threaded event loop touches a ring,
+ * so the shared indices need acquire/release ordering against the kernel
+ * and nothing else.
+ ******************************************************************************/
+
+#include "../include/uring.h"
+
+#ifdef __linux__
+
+    #include "../include/logger.h"
+    #include <errno.h>
+    #include <linux/io_uring.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/syscall.h>
+    #include <sys/utsname.h>
+    #include <unistd.h>
+
+    #define MIN_KERNEL_MAJOR 6    // Multishot receive arrived in 6.0
+    #define BUFFER_GROUP 0
+    #define BASE_TEN 10
+
+static int  kernel_supported(void);
+static void unmap(uring_t *ring);
+
+static struct io_uring_sqe *get_sqe(uring_t *ring);
+
+int uring_init(uring_t *ring, unsigned entries, unsigned buf_count, unsigned buf_size)
+{
+    struct io_uring_params  params;
+    struct io_uring_buf_reg reg;
+    struct io_uring_buf    *bufs;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = -1;
+
+    if(!kernel_supported())
+    {
+        LOG_WARN("io_uring needs Linux %d.0 or later", MIN_KERNEL_MAJOR);
+        return -1;
+    }
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0)
+    {
+        LOG_WARN("io_uring_setup: %s", strerror(errno));
+        return -1;
+    }
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        LOG_WARN("io_uring: kernel lacks IORING_FEAT_SINGLE_MMAP");
+        goto fail;
+    }
+
+    // The SQ and CQ rings share one mapping; the SQE array has its own.
+    ring->sq_ring_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+    ring->cq_ring_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    if(ring->cq_ring_size > ring->sq_ring_size)
+    {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+    ring->cq_ring   = ring->sq_ring;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes      = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head    = (unsigned *)(void *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail    = (unsigned *)(void *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask    = (unsigned *)(void *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array   = (unsigned *)(void *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head    = (unsigned *)(void *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail    = (unsigned *)(void *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask    = (unsigned *)(void *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes       = (uint8_t *)ring->cq_ring + params.cq_off.cqes;
+
+    // Provided buffers: the ring of descriptors, then the buffers themselves, in one anonymous mapping.
+    ring->buf_count     = buf_count;
+    ring->buf_size      = buf_size;
+    ring->buf_ring_size = (buf_count * sizeof(struct io_uring_buf)) + ((size_t)buf_count * buf_size);
+    ring->buf_ring      = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buf_ring == MAP_FAILED)
+    {
+        ring->buf_ring = NULL;
+        goto fail;
+    }
+    ring->buf_base = (uint8_t *)ring->buf_ring + (buf_count * sizeof(struct io_uring_buf));
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid         = BUFFER_GROUP;
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        LOG_WARN("io_uring: provided buffer rings unsupported: %s", strerror(errno));
+        goto fail;
+    }
+
+    bufs = (struct io_uring_buf *)ring->buf_ring;
+    for(unsigned b = 0; b < buf_count; b++)
+    {
+        bufs[b].addr = (uint64_t)(uintptr_t)(ring->buf_base + ((size_t)b * buf_size));
+        bufs[b].len  = buf_size;
+        bufs[b].bid  = (uint16_t)b;
+    }
+    ring->buf_tail = (uint16_t)buf_count;
+    __atomic_store_n(&((struct io_uring_buf_ring *)ring->buf_ring)->tail, ring->buf_tail, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    unmap(ring);
+    return -1;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    unmap(ring);
+}
+
+int uring_accept_multishot(uring_t *ring, int listen_fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode    = IORING_OP_ACCEPT;
+    sqe->fd        = listen_fd;
+    sqe->ioprio    = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_recv_multishot(uring_t *ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = fd;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_send(uring_t *ring, int fd, const void *buf, size_t len, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t)(uintptr_t)buf;
+    sqe->len       = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_cancel(uring_t *ring, uint64_t target, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = target;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_submit(uring_t *ring)
+{
+    long submitted;
+
+    if(ring->sq_pending == 0)
+    {
+        return 0;
+    }
+    do
+    {
+        submitted = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, 0, 0, NULL, 0);
+    } while(submitted < 0 && errno == EINTR);
+    if(submitted < 0)
+    {
+        LOG_ERROR("io_uring_enter: %s", strerror(errno));
+        return -1;
+    }
+    ring->sq_pending -= (unsigned)submitted;
+    return (int)submitted;
+}
+
+bool uring_next(uring_t *ring, uring_event_t *event)
+{
+    unsigned                   head = *ring->cq_head;
+    const struct io_uring_cqe *cqe;
+
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+    cqe              = (const struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+    event->user_data = cqe->user_data;
+    event->res       = cqe->res;
+    event->more      = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    event->buffer    = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : URING_NO_BUFFER;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+const uint8_t *uring_buffer(const uring_t *ring, int buffer)
+{
+    return ring->buf_base + ((size_t)buffer * ring->buf_size);
+}
+
+void uring_buffer_recycle(uring_t *ring, int buffer)
+{
+    struct io_uring_buf *bufs = (struct io_uring_buf *)ring->buf_ring;
+    struct io_uring_buf *buf  = &bufs[ring->buf_tail & (ring->buf_count - 1)];
+    const uint8_t       *base = uring_buffer(ring, buffer);
+    uintptr_t            addr = (uintptr_t)base;
+
+    buf->addr = (uint64_t)addr;
+    buf->len  = ring->buf_size;
+    buf->bid  = (uint16_t)buffer;
+    ring->buf_tail++;
+    __atomic_store_n(&((struct io_uring_buf_ring *)ring->buf_ring)->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Returns a zeroed SQE, submitting first when the queue is full. */
+static struct io_uring_sqe *get_sqe(uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned             tail = *ring->sq_tail;
+
+    if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        if(uring_submit(ring) < 0 || tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        {
+            return NULL;
+        }
+    }
+    sqe = (struct io_uring_sqe *)ring->sqes + (tail & *ring->sq_mask);
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    // The kernel only reads the tail in io_uring_enter(), so the SQE is not live until the next submit.
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+static int kernel_supported(void)
+{
+    struct utsname name;
+
+    if(uname(&name) < 0)
+    {
+        return 0;
+    }
+    return strtol(name.release, NULL, BASE_TEN) >= MIN_KERNEL_MAJOR;
+}
+
+static void unmap(uring_t *ring)
+{
+    if(ring->buf_ring != NULL)
+    {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    if(ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if(ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if(ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+#else
+
+int uring_init(uring_t *ring, unsigned entries, unsigned buf_count, unsigned buf_size)
+{
+    (void)entries;
+    (void)buf_count;
+    (void)buf_size;
+    ring->fd = -1;
+    return -1;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    ring->fd = -1;
+}
+
+int uring_accept_multishot(uring_t *ring, int listen_fd, uint64_t user_data)
+{
+    (void)ring;
+    (void)listen_fd;
+    (void)user_data;
+    return -1;
+}
+
+int uring_recv_multishot(uring_t *ring, int fd, uint64_t user_data)
+{
+    (void)ring;
+    (void)fd;
+    (void)user_data;
+    return -1;
+}
+
+int uring_send(uring_t *ring, int fd, const void *buf, size_t len, uint64_t user_data)
+{
+    (void)ring;
+    (void)fd;
+    (void)buf;
+    (void)len;
+    (void)user_data;
+    return -1;
+}
+
+int uring_cancel(uring_t *ring, uint64_t target, uint64_t user_data)
+{
+    (void)ring;
+    (void)target;
+    (void)user_data;
+    return -1;
+}
+
+int uring_submit(uring_t *ring)
+{
+    (void)ring;
+    return -1;
+}
+
+bool uring_next(uring_t *ring, uring_event_t *event)
+{
+    (void)ring;
+    (void)event;
+    return false;
+}
+
+const uint8_t *uring_buffer(const uring_t *ring, int buffer)
+{
+    (void)ring;
+    (void)buffer;
+    return NULL;
+}
+
+void uring_buffer_recycle(uring_t *ring, int buffer)
+{
+    (void)ring;
+    (void)buffer;
+}
+
+#endif
@@ -5,26 +5,95 @@
  * DBM (Database Manager) for data storage. It supports both account credential
  * operations (for login/creation) and user list management. All user data is
  * stored persistently via DBM, so no in-memory global array is needed.
+ *
+ * Every DBM call goes through storage_await(): a handler running as a
+ * coroutine waits for it on the storage thread, anyone else makes it inline.
+ * The storage lock goes the same way, so while such a handler holds it, it
+ * is held by the storage thread and never by the loop.
+ *
+ * Writes nobody waits for are queued with store_byte_async(). Queued writes
+ * are applied together, under one storage lock, by a single flush on the
+ * storage thread; a write to a key that is still queued replaces the
+ * earlier one instead of queueing behind it.
  ******************************************************************************/
 
 #include "../include/user_db.h"
 #include "../include/message.h"
+#include "../include/metrics.h"
+#include "../include/storage_io.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #pragma GCC diagnostic ignored "-Waggregate-return"
 
+/* A queued write. Key and value are copied in behind the struct. */
+typedef struct pending_write
+{
+    struct pending_write *next;        // cppcheck-suppress unusedStructMember
+    struct pending_write *replaced;    // An older write to the same key, dropped for this one
+    DBM                  *db;          // cppcheck-suppress unusedStructMember
+    store_done_t          done;        // cppcheck-suppress unusedStructMember
+    void                 *ctx;         // cppcheck-suppress unusedStructMember
+    size_t                k_size;      // cppcheck-suppress unusedStructMember
+    size_t                v_size;      // cppcheck-suppress unusedStructMember
+    int                   result;      // cppcheck-suppress unusedStructMember
+    char                  data[];      // cppcheck-suppress unusedStructMember
+} pending_write_t;
+
+/* What one flush took off the queue, kept until its completion on the loop */
+typedef struct
+{
+    pending_write_t *writes;    // cppcheck-suppress unusedStructMember
+} write_batch_t;
+
+static int                   lock_fd     = -1;                           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static pthread_mutex_t       thread_lock = PTHREAD_MUTEX_INITIALIZER;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static _Thread_local int     lock_depth;                                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static pthread_mutex_t       write_lock  = PTHREAD_MUTEX_INITIALIZER;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static pending_write_t      *writes;                                     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int                   flush_queued;                               // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+/* One DBM call and its result, made wherever storage_await() runs it */
+typedef struct
+{
+    char       *name;      // cppcheck-suppress unusedStructMember
+    const char *pk_name;   // cppcheck-suppress unusedStructMember
+    DBM        *db;        // cppcheck-suppress unusedStructMember
+    datum       key;       // cppcheck-suppress unusedStructMember
+    datum       value;     // cppcheck-suppress unusedStructMember
+    int         result;    // cppcheck-suppress unusedStructMember
+} dbm_call_t;
+
+static int   timed_store(DBM *db, datum key, datum value);
+static datum timed_fetch(DBM *db, datum key);
+static void  call_open(void *arg);
+static void  call_close(void *arg);
+static void  call_store(void *arg);
+static void  call_fetch(void *arg);
+static void  call_pk_next(void *arg);
+static void  call_lock(void *arg);
+static void  call_unlock(void *arg);
+static void  flush_writes(void *arg);
+static void  writes_done(void *arg);
+
 /* --- Functions for account credential storage --- */
 
 /* Opens the DBM database specified by dbo->name.
    Returns 0 on success, -1 on error. */
 ssize_t database_open(DBO *dbo)
 {
-    dbo->db = dbm_open(dbo->name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    dbm_call_t call;
+
+    call.name = dbo->name;
+    storage_await(call_open, &call);
+    dbo->db = call.db;
     if(!dbo->db)
     {
         perror("dbm_open failed");
@@ -33,6 +102,19 @@ ssize_t database_open(DBO *dbo)
     return 0;
 }
 
+void database_close(DBO *dbo)
+{
+    dbm_call_t call;
+
+    if(dbo->db == NULL)
+    {
+        return;
+    }
+    call.db = dbo->db;
+    storage_await(call_close, &call);
+    dbo->db = NULL;
+}
+
 /* Stores the string value under the given key in the database.
    Returns 0 on success, -1 on failure. */
 int store_string(DBM *db, const char *key, const char *value)
@@ -40,29 +122,16 @@ int store_string(DBM *db, const char *key, const char *value)
     const_datum key_datum   = MAKE_CONST_DATUM(key);
     const_datum value_datum = MAKE_CONST_DATUM(value);
 
-    return dbm_store(db, *(datum *)&key_datum, *(datum *)&value_datum, DBM_REPLACE);
+    return timed_store(db, *(datum *)&key_datum, *(datum *)&value_datum);
 }
 
 int store_int(DBM *db, const char *key, int value)
 {
-    const_datum key_datum = MAKE_CONST_DATUM(key);
-    datum       value_datum;
-    int         result;
-
-    value_datum.dptr = (char *)malloc(TO_SIZE_T(sizeof(int)));
-
-    if(value_datum.dptr == NULL)
-    {
-        return -1;
-    }
-
-    memcpy(value_datum.dptr, &value, sizeof(int));
-    value_datum.dsize = sizeof(int);
-
-    result = dbm_store(db, *(datum *)&key_datum, value_datum, DBM_REPLACE);
+    // dbm_store() copies the value, so it can come straight off the stack.
+    const_datum key_datum   = MAKE_CONST_DATUM(key);
+    const_datum value_datum = MAKE_CONST_DATUM_BYTE(&value, sizeof(int));
 
-    free(value_datum.dptr);
-    return result;
+    return timed_store(db, *(datum *)&key_datum, *(datum *)&value_datum);
 }
 
 int store_byte(DBM *db, const void *key, size_t k_size, const void *value, size_t v_size)
@@ -70,12 +139,12 @@ int store_byte(DBM *db, const void *key, size_t k_size, const void *value, size_
     const_datum key_datum   = MAKE_CONST_DATUM_BYTE(key, k_size);
     const_datum value_datum = MAKE_CONST_DATUM_BYTE(value, v_size);
 
-    return dbm_store(db, *(datum *)&key_datum, *(datum *)&value_datum, DBM_REPLACE);
+    return timed_store(db, *(datum *)&key_datum, *(datum *)&value_datum);
 }
 
 /* Retrieves a stored string value for the given key from the database.
-   Returns a newly allocated copy of the string on success, or NULL if not found. */
-char *retrieve_string(DBM *db, const char *key)
+   Returns a copy of the string from arena on success, or NULL if not found. */
+char *retrieve_string(DBM *db, const char *key, arena_t *arena)
 {
     const_datum key_datum;
     datum       result;
@@ -83,14 +152,14 @@ char *retrieve_string(DBM *db, const char *key)
 
     key_datum = MAKE_CONST_DATUM(key);
 
-    result = dbm_fetch(db, *(datum *)&key_datum);
+    result = timed_fetch(db, *(datum *)&key_datum);
 
     if(result.dptr == NULL)
     {
         return NULL;
     }
 
-    retrieved_str = (char *)malloc(TO_SIZE_T(result.dsize));
+    retrieved_str = (char *)arena_alloc(arena, TO_SIZE_T(result.dsize));
 
     if(!retrieved_str)
     {
@@ -107,7 +176,7 @@ int retrieve_int(DBM *db, const char *key, int *result)
     datum       fetched;
     const_datum key_datum = MAKE_CONST_DATUM(key);
 
-    fetched = dbm_fetch(db, *(datum *)&key_datum);
+    fetched = timed_fetch(db, *(datum *)&key_datum);
 
     if(fetched.dptr == NULL || fetched.dsize != sizeof(int))
     {
@@ -119,7 +188,7 @@ int retrieve_int(DBM *db, const char *key, int *result)
     return 0;
 }
 
-void *retrieve_byte(DBM *db, const void *key, size_t size)
+void *retrieve_byte(DBM *db, const void *key, size_t size, arena_t *arena)
 {
     const_datum key_datum;
     datum       result;
@@ -127,14 +196,14 @@ void *retrieve_byte(DBM *db, const void *key, size_t size)
 
     key_datum = MAKE_CONST_DATUM_BYTE(key, size);
 
-    result = dbm_fetch(db, *(datum *)&key_datum);
+    result = timed_fetch(db, *(datum *)&key_datum);
 
     if(result.dptr == NULL)
     {
         return NULL;
     }
 
-    retrieved_str = (char *)malloc(TO_SIZE_T(result.dsize));
+    retrieved_str = (char *)arena_alloc(arena, TO_SIZE_T(result.dsize));
 
     if(!retrieved_str)
     {
@@ -148,22 +217,297 @@ void *retrieve_byte(DBM *db, const void *key, size_t size)
 
 ssize_t init_pk(DBO *dbo, const char *pk_name)
 {
+    int value;
+
     if(database_open(dbo) < 0)
     {
         perror("database error");
         return -1;
     }
 
-    if(retrieve_int(dbo->db, pk_name, &user_index) < 0)
+    if(retrieve_int(dbo->db, pk_name, &value) < 0)
     {
-        if(store_int(dbo->db, pk_name, user_index) != 0)
+        value = user_index;
+        if(store_int(dbo->db, pk_name, value) != 0)
         {
             return -1;
         }
     }
+    user_index = value;
 
-    printf("Retrieved user_count: %d\n", user_index);
+    printf("Retrieved user_count: %d\n", value);
 
     dbm_close(dbo->db);
     return 0;
 }
+
+int storage_share(void)
+{
+    lock_fd = open(STORAGE_LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(lock_fd < 0)
+    {
+        perror("open storage lock");
+        return -1;
+    }
+    return 0;
+}
+
+int storage_shared(void)
+{
+    return lock_fd >= 0;
+}
+
+void storage_lock(void)
+{
+    storage_await(call_lock, NULL);
+}
+
+void storage_unlock(void)
+{
+    storage_await(call_unlock, NULL);
+}
+
+int store_byte_async(DBM *db, const void *key, size_t k_size, const void *value, size_t v_size, store_done_t done, void *ctx)
+{
+    pending_write_t  *write = (pending_write_t *)malloc(sizeof(pending_write_t) + k_size + v_size);
+    pending_write_t **link;
+    write_batch_t    *batch = NULL;
+
+    if(write == NULL)
+    {
+        return -1;
+    }
+    write->db       = db;
+    write->done     = done;
+    write->ctx      = ctx;
+    write->replaced = NULL;
+    write->k_size   = k_size;
+    write->v_size   = v_size;
+    write->result   = 0;
+    memcpy(write->data, key, k_size);
+    memcpy(write->data + k_size, value, v_size);
+
+    pthread_mutex_lock(&write_lock);
+    for(link = &writes; *link != NULL; link = &(*link)->next)
+    {
+        if((*link)->db == db && (*link)->k_size == k_size && memcmp((*link)->data, key, k_size) == 0)
+        {
+            break;
+        }
+    }
+    if(*link != NULL)
+    {
+        // Only the newest value would survive the flush anyway; the write it replaces completes with it.
+        write->replaced = *link;
+        write->next     = (*link)->next;
+    }
+    else
+    {
+        write->next = NULL;
+    }
+    *link = write;
+    if(!flush_queued)
+    {
+        batch        = (write_batch_t *)malloc(sizeof(write_batch_t));
+        flush_queued = batch != NULL;
+    }
+    pthread_mutex_unlock(&write_lock);
+
+    // One flush takes everything queued by the time it runs. Without one the writes wait for the next.
+    if(batch != NULL && storage_submit(flush_writes, writes_done, batch) < 0)
+    {
+        pthread_mutex_lock(&write_lock);
+        flush_queued = 0;
+        pthread_mutex_unlock(&write_lock);
+        free(batch);
+    }
+    return 0;
+}
+
+int store_int_async(DBM *db, const char *key, int value, store_done_t done, void *ctx)
+{
+    return store_byte_async(db, key, strlen(key) + 1, &value, sizeof(int), done, ctx);
+}
+
+int pk_next(char *db_name, const char *pk_name)
+{
+    dbm_call_t call;
+
+    // Read, increment and write in one trip to the storage thread.
+    call.name    = db_name;
+    call.pk_name = pk_name;
+    storage_await(call_pk_next, &call);
+    return call.result;
+}
+
+/* dbm_store() and dbm_fetch() with their duration recorded in the DB latency metrics. */
+static int timed_store(DBM *db, datum key, datum value)
+{
+    dbm_call_t call;
+
+    call.db    = db;
+    call.key   = key;
+    call.value = value;
+    storage_await(call_store, &call);
+    return call.result;
+}
+
+static datum timed_fetch(DBM *db, datum key)
+{
+    dbm_call_t call;
+
+    call.db  = db;
+    call.key = key;
+    storage_await(call_fetch, &call);
+    return call.value;
+}
+
+/* The calls themselves. Each records its own duration, so the DB latency metrics leave out time spent queued. */
+static void call_open(void *arg)
+{
+    dbm_call_t *call  = (dbm_call_t *)arg;
+    uint64_t    start = metrics_now_us();
+
+    call->db = dbm_open(call->name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    hist_record(&metrics.db_latency, metrics_now_us() - start);
+}
+
+static void call_close(void *arg)
+{
+    const dbm_call_t *call = (const dbm_call_t *)arg;
+
+    dbm_close(call->db);
+}
+
+static void call_store(void *arg)
+{
+    dbm_call_t *call  = (dbm_call_t *)arg;
+    uint64_t    start = metrics_now_us();
+
+    call->result = dbm_store(call->db, call->key, call->value, DBM_REPLACE);
+    hist_record(&metrics.db_latency, metrics_now_us() - start);
+}
+
+static void call_fetch(void *arg)
+{
+    dbm_call_t *call  = (dbm_call_t *)arg;
+    uint64_t    start = metrics_now_us();
+
+    call->value = dbm_fetch(call->db, call->key);
+    hist_record(&metrics.db_latency, metrics_now_us() - start);
+}
+
+static void call_pk_next(void *arg)
+{
+    dbm_call_t *call  = (dbm_call_t *)arg;
+    int         value = 0;
+
+    call->result = -1;
+    call->db     = dbm_open(call->name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if(call->db == NULL)
+    {
+        return;
+    }
+    // A missing key just means no id has been handed out yet; store_int() and retrieve_int() run inline here.
+    retrieve_int(call->db, call->pk_name, &value);
+    value++;
+    if(store_int(call->db, call->pk_name, value) == 0)
+    {
+        call->result = value;
+    }
+    dbm_close(call->db);
+}
+
+/* The storage lock itself. DBM files carry no locking of their own; without it, two writers corrupt them.
+   flock() is held per open file, so threads of one process exclude each other with the mutex. */
+static void call_lock(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&thread_lock);
+    while(lock_fd >= 0 && flock(lock_fd, LOCK_EX) < 0 && errno == EINTR)
+    {
+    }
+    lock_depth++;
+}
+
+static void call_unlock(void *arg)
+{
+    (void)arg;
+    lock_depth--;
+    if(lock_fd >= 0)
+    {
+        flock(lock_fd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&thread_lock);
+}
+
+/* Applies every write queued so far on one storage lock, keeping them for writes_done(). */
+static void flush_writes(void *arg)
+{
+    write_batch_t *batch = (write_batch_t *)arg;
+    int            own_lock;
+
+    pthread_mutex_lock(&write_lock);
+    batch->writes = writes;
+    writes        = NULL;
+    flush_queued  = 0;
+    pthread_mutex_unlock(&write_lock);
+
+    // Between the storage calls of a handler holding the lock, the storage thread already has it.
+    own_lock = lock_depth == 0;
+    if(own_lock)
+    {
+        call_lock(NULL);
+    }
+    for(pending_write_t *write = batch->writes; write != NULL; write = write->next)
+    {
+        const_datum key   = MAKE_CONST_DATUM_BYTE(write->data, write->k_size);
+        const_datum value = MAKE_CONST_DATUM_BYTE(write->data + write->k_size, write->v_size);
+        uint64_t    start = metrics_now_us();
+
+        write->result = dbm_store(write->db, *(datum *)&key, *(datum *)&value, DBM_REPLACE);
+        hist_record(&metrics.db_latency, metrics_now_us() - start);
+    }
+    if(own_lock)
+    {
+        call_unlock(NULL);
+    }
+}
+
+/* Reports each flushed write, and every write it replaced, to its caller, oldest first. */
+static void writes_done(void *arg)
+{
+    write_batch_t   *batch = (write_batch_t *)arg;
+    pending_write_t *write = batch->writes;
+
+    while(write != NULL)
+    {
+        pending_write_t *next   = write->next;
+        pending_write_t *oldest = NULL;
+        int              result = write->result;
+
+        // Reverse the replaced chain so the callbacks run in the order the writes were queued.
+        while(write != NULL)
+        {
+            pending_write_t *older = write->replaced;
+
+            write->replaced = oldest;
+            oldest          = write;
+            write           = older;
+        }
+        write = oldest;
+        while(write != NULL)
+        {
+            pending_write_t *newer = write->replaced;
+
+            if(write->done != NULL)
+            {
+                write->done(result, write->ctx);
+            }
+            free(write);
+            write = newer;
+        }
+        write = next;
+    }
+    free(batch);
+}
@@ -10,9 +10,11 @@ _Pragma("clang diagnostic ignored \"-Wdisabled-macro-expansion\"")
 
 #define SIG_SIZE 64
 
-    volatile sig_atomic_t server_running = 1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+    volatile sig_atomic_t server_running = 1;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+volatile sig_atomic_t stats_requested    = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
 
 static void sigint_handler(int sig);
+static void sigusr1_handler(int sig);
 
 void sfree(void **ptr)
 {
@@ -44,6 +46,36 @@ void setup_signal_handler(void)
         perror("sigaction");
         exit(EXIT_FAILURE);
     }
+
+    // SIGUSR1 dumps the latency histograms from the event loop
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = sigusr1_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    if(sigaction(SIGUSR1, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+    // A client that vanishes mid-write must cost an EPIPE, not the server
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = SIG_IGN;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    if(sigaction(SIGPIPE, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
 }
 
 #pragma GCC diagnostic push
@@ -64,4 +96,9 @@ static void sigint_handler(int sig)
     write(STDOUT_FILENO, message, strlen(message));
 }
 
+static void sigusr1_handler(int sig)
+{
+    stats_requested = 1;
+}
+
 #pragma GCC diagnostic pop
@@ -0,0 +1,71 @@
+/*******************************************************************************
+ * Thread wakeups
+ *
+ * An eventfd counter, or the bytes in a pipe, is the "wake up" flag itself:
+ * signalling adds to it and clearing drains it. A signal that finds the
+ * counter or pipe full is dropped, since the sleeper is due to wake anyway.
+ ******************************************************************************/
+
+#include "../include/wakeup.h"
+#include "../include/logger.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+    #include <sys/eventfd.h>
+#endif
+
+#define WAKEUP_READ (16)    // Counter reads per read() while clearing a pipe
+
+int wakeup_open(int *fds)
+{
+#ifdef __linux__
+    fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return fds[0] < 0 ? -1 : 0;
+#else
+    if(pipe(fds) < 0)
+    {
+        return -1;
+    }
+    for(int i = 0; i < 2; i++)
+    {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+#endif
+}
+
+void wakeup_close(int *fds)
+{
+    if(fds[0] >= 0)
+    {
+        close(fds[0]);
+    }
+    if(fds[1] >= 0 && fds[1] != fds[0])
+    {
+        close(fds[1]);
+    }
+    fds[0] = fds[1] = -1;
+}
+
+void wakeup_signal(const int *fds, const char *name)
+{
+    uint64_t one = 1;
+
+    if(write(fds[1], &one, sizeof(one)) < 0 && errno != EAGAIN && name != NULL)
+    {
+        LOG_ERROR("%s wakeup: %s", name, strerror(errno));
+    }
+}
+
+void wakeup_clear(const int *fds)
+{
+    uint64_t buf[WAKEUP_READ];
+
+    while(read(fds[0], buf, sizeof(buf)) > 0)
+    {
+    }
+}
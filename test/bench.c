@@ -0,0 +1,452 @@
+/*******************************************************************************
+ * Microbenchmarks
+ *
+ * Links the server sources (everything except main.c) and times the hot
+ * per-request paths in isolation:
+ *   - header decoding (handle_header)
+ *   - account payload parsing (account_credentials)
+ *   - error reply encoding and write (send_error_response into /dev/null)
+ *   - store_byte / retrieve_byte / retrieve_int against the DBM backend
+ *   - a whole ACC_LOGIN through account_handler
+ * Every result is one JSON object per line on stdout (or -o file), preceded
+ * by a "meta" line describing the build, so runs of two builds can be diffed.
+ ******************************************************************************/
+
+#include "../include/account.h"
+#include "../include/histogram.h"
+#include "../include/logger.h"
+#include "../include/message.h"
+#include "../include/response.h"
+#include "../include/user_db.h"
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UNKNOWN_OPTION_MESSAGE_LEN 24
+#define BASE_TEN 10
+#define DEFAULT_ITERATIONS 200000
+#define STORAGE_DIVISOR 20    // DBM calls are ~100x slower; run fewer of them
+#define WARMUP_DIVISOR 10
+#define BATCH 64              // Fast operations are timed in batches to stay above clock resolution
+#define KEY_COUNT 1024
+#define KEY_LEN 16
+#define FRAME_LEN 64
+#define NS_PER_SEC 1000000000
+#define P50 50.0
+#define P99 99.0
+#define TEMPLATE "/tmp/chat-bench-XXXXXX"
+#define USERNAME "bench"
+#define PASSWORD "password"
+
+#if defined(__APPLE__)
+    #define STORAGE_BACKEND "ndbm"
+#elif defined(__FreeBSD__)
+    #define STORAGE_BACKEND "gdbm"
+#else
+    #define STORAGE_BACKEND "gdbm_compat"
+#endif
+
+typedef struct
+{
+    message_t     message;                   // cppcheck-suppress unusedStructMember
+    struct pollfd client;                    // cppcheck-suppress unusedStructMember
+    client_state_t state;                    // cppcheck-suppress unusedStructMember
+    int           client_id;                 // cppcheck-suppress unusedStructMember
+    uint8_t       chat[FRAME_LEN];           // cppcheck-suppress unusedStructMember
+    uint8_t       login[FRAME_LEN];          // cppcheck-suppress unusedStructMember
+    uint8_t       response[RESPONSELEN];     // cppcheck-suppress unusedStructMember
+    arena_t       scratch;                   // cppcheck-suppress unusedStructMember
+    size_t        chat_len;                  // cppcheck-suppress unusedStructMember
+    DBO           db;                        // cppcheck-suppress unusedStructMember
+    char          keys[KEY_COUNT][KEY_LEN];  // cppcheck-suppress unusedStructMember
+    size_t        next;                      // cppcheck-suppress unusedStructMember
+    uint64_t      sink;                      // cppcheck-suppress unusedStructMember
+} bench_ctx_t;
+
+typedef struct
+{
+    const char *name;                        // cppcheck-suppress unusedStructMember
+    void (*op)(bench_ctx_t *ctx);            // cppcheck-suppress unusedStructMember
+    int         batch;                       // cppcheck-suppress unusedStructMember
+    int         divisor;                     // cppcheck-suppress unusedStructMember
+} bench_t;
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+static void           parse_arguments(int argc, char *argv[], long *iterations, const char **output, const char **filter);
+static void           setup(bench_ctx_t *ctx, const char *dir);
+static void           run(FILE *out, bench_ctx_t *ctx, const bench_t *bench, long iterations);
+static size_t         put_frame(uint8_t *buf, uint8_t type, const char *first, const char *second, const char *third);
+static uint64_t       now_ns(void);
+static void           remove_dir(const char *dir);
+static void           op_handle_header(bench_ctx_t *ctx);
+static void           op_account_credentials(bench_ctx_t *ctx);
+static void           op_send_error_response(bench_ctx_t *ctx);
+static void           op_store_byte(bench_ctx_t *ctx);
+static void           op_retrieve_byte(bench_ctx_t *ctx);
+static void           op_retrieve_int(bench_ctx_t *ctx);
+static void           op_account_login(bench_ctx_t *ctx);
+
+static const bench_t benches[] = {
+    {"handle_header",        op_handle_header,       BATCH, 1              },
+    {"account_credentials",  op_account_credentials, BATCH, 1              },
+    {"send_error_response",  op_send_error_response, BATCH, 1              },
+    {"store_byte",           op_store_byte,          1,     STORAGE_DIVISOR},
+    {"retrieve_byte",        op_retrieve_byte,       1,     STORAGE_DIVISOR},
+    {"retrieve_int",         op_retrieve_int,        1,     STORAGE_DIVISOR},
+    {"account_handler_login", op_account_login,      1,     STORAGE_DIVISOR},
+};
+
+int main(int argc, char *argv[])
+{
+    static bench_ctx_t ctx;
+    long               iterations;
+    const char        *output;
+    const char        *filter;
+    FILE              *out = stdout;
+    char               dir[] = TEMPLATE;
+    time_t             now   = time(NULL);
+
+    parse_arguments(argc, argv, &iterations, &output, &filter);
+    if(output != NULL)
+    {
+        out = fopen(output, "we");
+        if(out == NULL)
+        {
+            perror("fopen");
+            return EXIT_FAILURE;
+        }
+    }
+    if(mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    // Debug logging would dominate every number.
+    atomic_store(&log_level, LOG_LEVEL_OFF);
+    response_init();
+    setup(&ctx, dir);
+
+    fprintf(out,
+            "{\"type\":\"meta\",\"compiler\":\"%s\",\"optimized\":%s,\"log_compile_level\":%d,\"storage\":\"%s\",\"iterations\":%ld,\"time\":%" PRId64 "}\n",
+            __VERSION__,
+#ifdef __OPTIMIZE__
+            "true",
+#else
+            "false",
+#endif
+            LOG_COMPILE_LEVEL,
+            STORAGE_BACKEND,
+            iterations,
+            (int64_t)now);
+
+    for(size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        if(filter == NULL || strstr(benches[i].name, filter) != NULL)
+        {
+            run(out, &ctx, &benches[i], iterations);
+        }
+    }
+
+    dbm_close(ctx.db.db);
+    close(ctx.client.fd);
+    remove_dir(dir);
+    if(out != stdout)
+    {
+        fclose(out);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Times iterations operations after a short warm-up and prints one result line. */
+static void run(FILE *out, bench_ctx_t *ctx, const bench_t *bench, long iterations)
+{
+    static histogram_t hist;
+    hist_snapshot_t    snap;
+    long               count   = iterations / bench->divisor;
+    long               batches = (count + bench->batch - 1) / bench->batch;
+    uint64_t           total   = 0;
+
+    for(long i = 0; i < count / WARMUP_DIVISOR; i++)
+    {
+        bench->op(ctx);
+    }
+
+    memset(&hist, 0, sizeof(hist));
+    for(long b = 0; b < batches; b++)
+    {
+        uint64_t start = now_ns();
+        uint64_t elapsed;
+
+        for(int i = 0; i < bench->batch; i++)
+        {
+            bench->op(ctx);
+        }
+        elapsed = now_ns() - start;
+        total += elapsed;
+        hist_record(&hist, elapsed / (uint64_t)bench->batch);
+    }
+
+    memset(&snap, 0, sizeof(snap));
+    hist_accumulate(&snap, &hist);
+    fprintf(out,
+            "{\"type\":\"result\",\"name\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.1f,\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+            bench->name,
+            batches * bench->batch,
+            (double)total / (double)(batches * bench->batch),
+            hist_percentile(&snap, P50),
+            hist_percentile(&snap, P99),
+            snap.max);
+    fflush(out);
+}
+
+static void setup(bench_ctx_t *ctx, const char *dir)
+{
+    static char db_name[]   = "bench_db";    // Held by ctx->db for the whole run
+    char        timestamp[] = "20250101000000Z";
+
+    // account_handler opens user_db and index_db relative to the working directory.
+    if(chdir(dir) == -1)
+    {
+        perror("chdir");
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->client.fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if(ctx->client.fd == -1)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    ctx->client_id                = -1;
+    ctx->state.pfd                = &ctx->client;
+    ctx->message.client           = &ctx->client;
+    ctx->message.state            = &ctx->state;
+    ctx->message.client_id        = &ctx->client_id;
+    ctx->message.res_buf          = ctx->response;
+    ctx->message.arena            = &ctx->scratch;
+    ctx->chat_len                 = put_frame(ctx->chat, CHT_SEND, timestamp, "hello, world", USERNAME);
+    put_frame(ctx->login, ACC_LOGIN, USERNAME, PASSWORD, NULL);
+    arena_init(&ctx->scratch, SCRATCH_SIZE);
+
+    ctx->db.name = db_name;
+    if(database_open(&ctx->db) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    for(int k = 0; k < KEY_COUNT; k++)
+    {
+        snprintf(ctx->keys[k], KEY_LEN, "user%04d", k);
+        store_byte(ctx->db.db, ctx->keys[k], strlen(ctx->keys[k]), PASSWORD, strlen(PASSWORD));
+        store_int(ctx->db.db, ctx->keys[k], k);
+    }
+
+    // The account the login benchmark signs in to
+    {
+        char users_name[] = "user_db";
+        char index_name[] = "index_db";
+        DBO  users        = {users_name, NULL};
+        DBO  index        = {index_name, NULL};
+
+        if(database_open(&users) < 0 || database_open(&index) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        store_byte(users.db, USERNAME, strlen(USERNAME), PASSWORD, strlen(PASSWORD));
+        store_int(index.db, USERNAME, 1);
+        dbm_close(users.db);
+        dbm_close(index.db);
+    }
+}
+
+/* Builds a frame of up to three UTF8String fields; CHT_SEND tags its first field as GeneralizedTime. */
+static size_t put_frame(uint8_t *buf, uint8_t type, const char *first, const char *second, const char *third)
+{
+    const char *fields[] = {first, second, third};
+    size_t      offset   = HEADERLEN;
+    uint16_t    payload_len;
+
+    buf[0] = type;
+    buf[1] = VERSION_NUM;
+    memset(buf + 2, 0, sizeof(uint16_t));
+    for(int f = 0; f < 3 && fields[f] != NULL; f++)
+    {
+        size_t len = strlen(fields[f]);
+
+        buf[offset++] = (type == CHT_SEND && f == 0) ? BER_TIME : BER_STR;
+        buf[offset++] = (uint8_t)len;
+        memcpy(buf + offset, fields[f], len);
+        offset += len;
+    }
+    payload_len = htons((uint16_t)(offset - HEADERLEN));
+    memcpy(buf + HEADERLEN - sizeof(payload_len), &payload_len, sizeof(payload_len));
+    return offset;
+}
+
+static void op_handle_header(bench_ctx_t *ctx)
+{
+    ctx->message.req_buf = ctx->chat;
+    handle_header(&ctx->message, (ssize_t)ctx->chat_len);
+    ctx->sink += ctx->message.payload_len;
+}
+
+static void op_account_credentials(bench_ctx_t *ctx)
+{
+    credentials_t cred;
+
+    ctx->message.req_buf = ctx->login;
+    account_credentials(&ctx->message, &cred);
+    ctx->sink += (uint64_t)cred.user_len + cred.pass_len;
+}
+
+static void op_send_error_response(bench_ctx_t *ctx)
+{
+    ctx->message.type = ACC_LOGIN;
+    ctx->message.code = EC_INV_AUTH_INFO;
+    send_error_response(&ctx->message);
+}
+
+static void op_store_byte(bench_ctx_t *ctx)
+{
+    const char *key = ctx->keys[ctx->next++ % KEY_COUNT];
+
+    store_byte(ctx->db.db, key, strlen(key), PASSWORD, strlen(PASSWORD));
+}
+
+static void op_retrieve_byte(bench_ctx_t *ctx)
+{
+    const char *key = ctx->keys[ctx->next++ % KEY_COUNT];
+    void       *value;
+
+    value = retrieve_byte(ctx->db.db, key, strlen(key), &ctx->scratch);
+    ctx->sink += (value != NULL);
+    arena_reset(&ctx->scratch);
+}
+
+static void op_retrieve_int(bench_ctx_t *ctx)
+{
+    int value = 0;
+
+    retrieve_int(ctx->db.db, ctx->keys[ctx->next++ % KEY_COUNT], &value);
+    ctx->sink += (uint64_t)value;
+}
+
+static void op_account_login(bench_ctx_t *ctx)
+{
+    ctx->message.type    = ACC_LOGIN;
+    ctx->message.req_buf = ctx->login;
+    ctx->sink += (uint64_t)account_handler(&ctx->message);
+    arena_reset(&ctx->scratch);
+}
+
+static void parse_arguments(int argc, char *argv[], long *iterations, const char **output, const char **filter)
+{
+    int opt;
+
+    opterr      = 0;
+    *iterations = DEFAULT_ITERATIONS;
+    *output     = NULL;
+    *filter     = NULL;
+
+    while((opt = getopt(argc, argv, "hi:o:f:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'h':
+            {
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            }
+            case 'i':
+            {
+                char *endptr;
+
+                errno       = 0;
+                *iterations = strtol(optarg, &endptr, BASE_TEN);
+                if(errno != 0 || *endptr != '\0' || *iterations < STORAGE_DIVISOR * BATCH)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Invalid iteration count.");
+                }
+                break;
+            }
+            case 'o':
+            {
+                *output = optarg;
+                break;
+            }
+            case 'f':
+            {
+                *filter = optarg;
+                break;
+            }
+            case '?':
+            {
+                char message[UNKNOWN_OPTION_MESSAGE_LEN];
+
+                snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
+                usage(argv[0], EXIT_FAILURE, message);
+            }
+            default:
+            {
+                usage(argv[0], EXIT_FAILURE, NULL);
+            }
+        }
+    }
+
+    if(optind < argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too many arguments.");
+    }
+}
+
+/* The DBM backends add their own suffixes (.dir/.pag, .db), so remove whatever is there. */
+static void remove_dir(const char *dir)
+{
+    DIR                 *handle;
+    const struct dirent *entry;
+
+    handle = opendir(dir);
+    if(handle == NULL)
+    {
+        return;
+    }
+    while((entry = readdir(handle)) != NULL)
+    {
+        if(entry->d_name[0] != '.')
+        {
+            unlinkat(dirfd(handle), entry->d_name, 0);
+        }
+    }
+    closedir(handle);
+    rmdir(dir);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * NS_PER_SEC) + (uint64_t)ts.tv_nsec;
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-i iterations] [-o file] [-f filter]\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h          Display this help message\n", stderr);
+    fputs("  -i <n>      Iterations of each in-memory benchmark (default 200000, storage runs 1/20th)\n", stderr);
+    fputs("  -o <file>   Write the JSON lines to file instead of stdout\n", stderr);
+    fputs("  -f <name>   Only run benchmarks whose name contains this\n", stderr);
+    exit(exit_code);
+}
@@ -1,3 +1,4 @@
+#include "protocol.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -29,9 +30,6 @@ static void           print_response(const uint8_t *response, int length);
 // values being sent
 #define BUFFER_SIZE 1024
 #define DEFAULT_SENDER_ID 0x0000
-#define USERNAME_LEN 0x07
-#define PASSWORD_LEN 0x0B
-#define LOGIN_LENGTH 22
 
 // response packet lengths
 #define LOGIN_FAILURE_LEN 45
@@ -39,13 +37,6 @@ static void           print_response(const uint8_t *response, int length);
 #define ACC_CREATE_FAILURE_LEN 24
 #define LOGIN_SUCCESS_LEN 10
 
-// packet type codes
-#define ACC_LOGIN 0x0A
-#define ACC_CREATE 0x0D
-
-// data type codes
-#define UTF8_STR 0x0C
-
 int main(int argc, char *argv[])
 {
     char                   *address;
@@ -179,44 +170,7 @@ static void print_response(const uint8_t *response, int length)
 
 static void construct_acc_message(uint8_t *packet, size_t *length, uint8_t packet_type)
 {
-    size_t   offset = 0;
-    uint16_t payload_length;
-    uint16_t sender_id;
-
-    // Packet type (1 byte)
-    packet[offset++] = packet_type;
-
-    // Version (1 byte)
-    packet[offset++] = 0x01;    // Version: 1
-
-    // Sender ID (2 bytes) - Using htons() for network byte order
-    sender_id = htons(DEFAULT_SENDER_ID);
-    memcpy(&packet[offset], &sender_id, sizeof(sender_id));
-    offset += 2;
-
-    // Payload Length (2 bytes) - Calculated dynamically
-    payload_length = htons(LOGIN_LENGTH);
-    memcpy(&packet[offset], &payload_length, sizeof(payload_length));
-    offset += sizeof(payload_length);
-
-    // Username
-    packet[offset++] = UTF8_STR;        // UTF8 String type
-    packet[offset++] = USERNAME_LEN;    // length 7
-    for(int i = 0; i < USERNAME_LEN; i++)
-    {
-        packet[offset++] = (uint8_t)USERNAME[i];
-    }
-
-    // Password
-    packet[offset++] = UTF8_STR;        // UTF8 String type
-    packet[offset++] = PASSWORD_LEN;    // length 11
-    for(int i = 0; i < PASSWORD_LEN; i++)
-    {
-        packet[offset++] = (uint8_t)PASSWORD[i];
-    }
-
-    // Final packet size
-    *length = offset;
+    *length = proto_account(packet, packet_type, DEFAULT_SENDER_ID, USERNAME, PASSWORD);
 
     printf("Constructed packet (%zu bytes):\n", *length);
     for(size_t i = 0; i < *length; i++)
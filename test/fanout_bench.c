@@ -0,0 +1,597 @@
+/*******************************************************************************
+ * Fanout latency benchmark
+ *
+ * For each receiver count N, opens N receiving connections and M sending
+ * connections. Each sender relays -m CHT_SEND messages at -r messages/s,
+ * and every message carries its send time in the chat content. Receivers
+ * time each copy they get. The report covers:
+ *   - delivery latency over every (message, recipient) pair
+ *   - "last recipient" latency per message: send until the slowest receiver
+ *     has it, which is the broadcast SLO
+ *   - delivered messages/s
+ * Sender and receivers share the host clock, so run this against a local server.
+ ******************************************************************************/
+
+#include "../include/histogram.h"
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UNKNOWN_OPTION_MESSAGE_LEN 24
+#define BASE_TEN 10
+#define DEFAULT_RECEIVERS "10,100,1000,10000"
+#define DEFAULT_SENDERS 1
+#define DEFAULT_MESSAGES 200
+#define DEFAULT_RATE 100
+#define DEFAULT_THREADS 4
+#define MAX_RUNS 16
+#define USERNAME "fanout"
+#define PROBE_MAGIC 0x46424E43    // "FBNC"
+#define RX_BUF_SIZE 4096
+#define TX_BUF_SIZE 256
+#define POLL_MS 10
+#define SETTLE_US 200000
+#define DRAIN_US 2000000
+#define NS_PER_US 1000
+#define US_PER_SEC 1000000
+#define P50 50.0
+#define P99 99.0
+#define P999 99.9
+
+/* Chat content: who sent it, which message, and when */
+typedef struct
+{
+    uint32_t magic;     // cppcheck-suppress unusedStructMember
+    uint32_t sender;    // cppcheck-suppress unusedStructMember
+    uint32_t seq;       // cppcheck-suppress unusedStructMember
+    uint64_t sent_us;   // cppcheck-suppress unusedStructMember
+} probe_t;
+
+typedef struct
+{
+    int     fd;                 // cppcheck-suppress unusedStructMember
+    uint8_t rx[RX_BUF_SIZE];    // cppcheck-suppress unusedStructMember
+    size_t  rx_len;             // cppcheck-suppress unusedStructMember
+} conn_t;
+
+typedef struct
+{
+    pthread_t   thread;          // cppcheck-suppress unusedStructMember
+    conn_t     *conns;           // cppcheck-suppress unusedStructMember
+    int         nconns;          // cppcheck-suppress unusedStructMember
+    int         sender;          // cppcheck-suppress unusedStructMember
+    histogram_t delivery;        // cppcheck-suppress unusedStructMember
+    uint64_t    delivered;       // cppcheck-suppress unusedStructMember
+    uint64_t    last_rx_us;      // cppcheck-suppress unusedStructMember
+    uint64_t    disconnects;     // cppcheck-suppress unusedStructMember
+} worker_t;
+
+typedef struct
+{
+    struct sockaddr_storage addr;                  // cppcheck-suppress unusedStructMember
+    socklen_t               addr_len;              // cppcheck-suppress unusedStructMember
+    int                     runs[MAX_RUNS];        // cppcheck-suppress unusedStructMember
+    int                     nruns;                 // cppcheck-suppress unusedStructMember
+    int                     senders;               // cppcheck-suppress unusedStructMember
+    int                     messages;              // cppcheck-suppress unusedStructMember
+    int                     rate;                  // cppcheck-suppress unusedStructMember
+    int                     threads;               // cppcheck-suppress unusedStructMember
+} config_t;
+
+static config_t              config;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_bool           receiving;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_uint_fast64_t *last_seen;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+static void           parse_arguments(int argc, char *argv[]);
+static long           parse_number(const char *binary_name, const char *str, long min, long max);
+static void           convert_address(const char *address, in_port_t port);
+static void           raise_fd_limit(void);
+static void           run(int receivers);
+static int            open_conn(void);
+static void          *receiver_run(void *arg);
+static void          *sender_run(void *arg);
+static void           drain(worker_t *worker, conn_t *conn, bool record);
+static void           record_frame(worker_t *worker, const uint8_t *frame, size_t length);
+static uint64_t       now_us(void);
+
+int main(int argc, char *argv[])
+{
+    parse_arguments(argc, argv);
+    raise_fd_limit();
+
+    printf("%d sender(s), %d messages each at %d msg/s, %d receiver threads\n", config.senders, config.messages, config.rate, config.threads);
+    printf("\n%8s %8s %10s %10s | %9s %9s %9s %9s | %9s %9s %9s | %10s\n", "N", "live", "delivered", "expected", "p50", "p99", "p99.9", "max", "last p50", "last p99", "last max", "msgs/s");
+    for(int i = 0; i < config.nruns; i++)
+    {
+        run(config.runs[i]);
+    }
+    printf("\nlatencies in microseconds; \"last\" is send until the slowest receiver got the message\n");
+    return EXIT_SUCCESS;
+}
+
+static void run(int receivers)
+{
+    worker_t       *workers;
+    worker_t       *senders;
+    conn_t         *conns;
+    hist_snapshot_t delivery;
+    hist_snapshot_t last;
+    uint64_t        delivered = 0;
+    uint64_t        expected;
+    uint64_t        first_send;
+    uint64_t        last_rx = 0;
+    size_t          total_msgs;
+    int             live = 0;
+    int             per_thread;
+    int             threads = config.threads < receivers ? config.threads : receivers;
+
+    total_msgs = (size_t)config.senders * (size_t)config.messages;
+    workers    = (worker_t *)calloc((size_t)threads, sizeof(worker_t));
+    senders    = (worker_t *)calloc((size_t)config.senders, sizeof(worker_t));
+    conns      = (conn_t *)calloc((size_t)(receivers + config.senders), sizeof(conn_t));
+    last_seen  = (atomic_uint_fast64_t *)calloc(total_msgs, sizeof(atomic_uint_fast64_t));
+    if(workers == NULL || senders == NULL || conns == NULL || last_seen == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // Senders connect first so a server with few slots still has someone talking.
+    for(int c = receivers + config.senders - 1; c >= 0; c--)
+    {
+        conns[c].fd = open_conn();
+    }
+
+    // Give the server time to accept (or reject) everyone before the clock starts.
+    usleep(SETTLE_US);
+    atomic_store(&receiving, true);
+    per_thread = receivers / threads;
+    for(int i = 0; i < threads; i++)
+    {
+        workers[i].conns  = conns + (i * per_thread);
+        workers[i].nconns = i == threads - 1 ? receivers - (i * per_thread) : per_thread;
+        pthread_create(&workers[i].thread, NULL, receiver_run, &workers[i]);
+    }
+
+    first_send = now_us();
+    for(int s = 0; s < config.senders; s++)
+    {
+        senders[s].conns  = conns + receivers + s;
+        senders[s].nconns = 1;
+        senders[s].sender = s;
+        pthread_create(&senders[s].thread, NULL, sender_run, &senders[s]);
+    }
+    for(int s = 0; s < config.senders; s++)
+    {
+        pthread_join(senders[s].thread, NULL);
+    }
+
+    // Let the tail of the fanout arrive, then stop the receivers.
+    usleep(DRAIN_US);
+    atomic_store(&receiving, false);
+    memset(&delivery, 0, sizeof(delivery));
+    for(int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        hist_accumulate(&delivery, &workers[i].delivery);
+        delivered += workers[i].delivered;
+        if(workers[i].last_rx_us > last_rx)
+        {
+            last_rx = workers[i].last_rx_us;
+        }
+    }
+    for(int c = 0; c < receivers; c++)
+    {
+        if(conns[c].fd >= 0)
+        {
+            live++;
+        }
+    }
+
+    // Each message's slowest delivery
+    {
+        histogram_t *per_message = (histogram_t *)calloc(1, sizeof(histogram_t));
+
+        if(per_message == NULL)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for(size_t m = 0; m < total_msgs; m++)
+        {
+            uint64_t latency = atomic_load(&last_seen[m]);
+            if(latency > 0)
+            {
+                hist_record(per_message, latency);
+            }
+        }
+        memset(&last, 0, sizeof(last));
+        hist_accumulate(&last, per_message);
+        free(per_message);
+    }
+
+    expected = (uint64_t)live * total_msgs;
+    printf("%8d %8d %10" PRIu64 " %10" PRIu64 " | %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " | %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " | %10.0f\n",
+           receivers,
+           live,
+           delivered,
+           expected,
+           hist_percentile(&delivery, P50),
+           hist_percentile(&delivery, P99),
+           hist_percentile(&delivery, P999),
+           delivery.max,
+           hist_percentile(&last, P50),
+           hist_percentile(&last, P99),
+           last.max,
+           last_rx > first_send ? (double)delivered * US_PER_SEC / (double)(last_rx - first_send) : 0.0);
+    fflush(stdout);
+
+    for(int c = 0; c < receivers + config.senders; c++)
+    {
+        if(conns[c].fd >= 0)
+        {
+            close(conns[c].fd);
+        }
+    }
+    // Let the server reap these before the next run connects.
+    usleep(SETTLE_US);
+    free(last_seen);
+    free(conns);
+    free(senders);
+    free(workers);
+}
+
+static int open_conn(void)
+{
+    int fd;
+
+    fd = socket(config.addr.ss_family, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr *)&config.addr, config.addr_len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    return fd;
+}
+
+static void *receiver_run(void *arg)
+{
+    worker_t      *worker = (worker_t *)arg;
+    struct pollfd *pfds;
+
+    pfds = (struct pollfd *)calloc((size_t)worker->nconns, sizeof(struct pollfd));
+    if(pfds == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    while(atomic_load(&receiving))
+    {
+        int ready;
+
+        for(int c = 0; c < worker->nconns; c++)
+        {
+            pfds[c].fd     = worker->conns[c].fd;
+            pfds[c].events = POLLIN;
+        }
+        ready = poll(pfds, (nfds_t)worker->nconns, POLL_MS);
+        for(int c = 0; c < worker->nconns && ready > 0; c++)
+        {
+            if(pfds[c].revents != 0)
+            {
+                drain(worker, &worker->conns[c], true);
+            }
+        }
+    }
+    free(pfds);
+    return NULL;
+}
+
+static void *sender_run(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    conn_t   *conn   = worker->conns;
+    uint64_t  interval;
+    uint64_t  next;
+
+    interval = (uint64_t)US_PER_SEC / (uint64_t)config.rate;
+    next     = now_us();
+    for(int seq = 0; seq < config.messages && conn->fd >= 0; seq++)
+    {
+        uint8_t packet[TX_BUF_SIZE];
+        char    timestamp[PROTO_TIME_LEN + 1];
+        probe_t probe;
+        size_t  length;
+        int64_t wait;
+
+        wait = (int64_t)(next - now_us());
+        if(wait > 0)
+        {
+            usleep((useconds_t)wait);
+        }
+        next += interval;
+
+        probe.magic   = PROBE_MAGIC;
+        probe.sender  = (uint32_t)worker->sender;
+        probe.seq     = (uint32_t)seq;
+        probe.sent_us = now_us();
+        proto_timestamp(timestamp);
+        length = proto_chat(packet, 0, timestamp, &probe, (uint8_t)sizeof(probe), USERNAME);
+        if(send(conn->fd, packet, length, MSG_NOSIGNAL) != (ssize_t)length)
+        {
+            break;
+        }
+        // Throw away our ACKs and our own copies so the server never blocks on us.
+        drain(worker, conn, false);
+    }
+    return NULL;
+}
+
+static void drain(worker_t *worker, conn_t *conn, bool record)
+{
+    for(;;)
+    {
+        ssize_t nread;
+        size_t  offset = 0;
+        size_t  length;
+
+        nread = recv(conn->fd, conn->rx + conn->rx_len, sizeof(conn->rx) - conn->rx_len, MSG_DONTWAIT);
+        if(nread < 0 && (proto_would_block(errno) || errno == EINTR))
+        {
+            return;
+        }
+        if(nread <= 0)
+        {
+            worker->disconnects++;
+            close(conn->fd);
+            conn->fd = -1;
+            return;
+        }
+        conn->rx_len += (size_t)nread;
+
+        while((length = proto_frame_length(conn->rx + offset, conn->rx_len - offset)) > 0)
+        {
+            if(record)
+            {
+                record_frame(worker, conn->rx + offset, length);
+            }
+            offset += length;
+        }
+        conn->rx_len -= offset;
+        memmove(conn->rx, conn->rx + offset, conn->rx_len);
+    }
+}
+
+/* Pulls the probe out of a relayed CHT_SEND: header, timestamp TLV, then the content TLV. */
+static void record_frame(worker_t *worker, const uint8_t *frame, size_t length)
+{
+    const uint8_t *ptr = frame + PROTO_HEADERLEN;
+    probe_t        probe;
+    uint64_t       now;
+    uint64_t       latency;
+    size_t         index;
+    uint_fast64_t  seen;
+
+    if(frame[0] != CHT_SEND || length < PROTO_HEADERLEN + 2)
+    {
+        return;
+    }
+    ptr += 2 + ptr[1];    // Skip the timestamp
+    if((size_t)(ptr + 2 + sizeof(probe) - frame) > length || ptr[1] != sizeof(probe))
+    {
+        return;
+    }
+    memcpy(&probe, ptr + 2, sizeof(probe));
+    if(probe.magic != PROBE_MAGIC || probe.sender >= (uint32_t)config.senders || probe.seq >= (uint32_t)config.messages)
+    {
+        return;
+    }
+
+    now     = now_us();
+    latency = now > probe.sent_us ? now - probe.sent_us : 0;
+    hist_record(&worker->delivery, latency);
+    worker->delivered++;
+    worker->last_rx_us = now;
+
+    // Keep the slowest delivery of each message
+    index = ((size_t)probe.sender * (size_t)config.messages) + probe.seq;
+    seen  = atomic_load(&last_seen[index]);
+    while(latency > seen && !atomic_compare_exchange_weak(&last_seen[index], &seen, latency))
+    {
+    }
+}
+
+static void parse_arguments(int argc, char *argv[])
+{
+    int         opt;
+    const char *receivers = DEFAULT_RECEIVERS;
+    in_port_t   port;
+    char       *list;
+    char       *token;
+    char       *save;
+
+    opterr          = 0;
+    config.senders  = DEFAULT_SENDERS;
+    config.messages = DEFAULT_MESSAGES;
+    config.rate     = DEFAULT_RATE;
+    config.threads  = DEFAULT_THREADS;
+
+    while((opt = getopt(argc, argv, "hn:s:m:r:t:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'h':
+            {
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            }
+            case 'n':
+            {
+                receivers = optarg;
+                break;
+            }
+            case 's':
+            {
+                config.senders = (int)parse_number(argv[0], optarg, 1, INT16_MAX);
+                break;
+            }
+            case 'm':
+            {
+                config.messages = (int)parse_number(argv[0], optarg, 1, INT32_MAX);
+                break;
+            }
+            case 'r':
+            {
+                config.rate = (int)parse_number(argv[0], optarg, 1, US_PER_SEC);
+                break;
+            }
+            case 't':
+            {
+                config.threads = (int)parse_number(argv[0], optarg, 1, INT16_MAX);
+                break;
+            }
+            case '?':
+            {
+                char message[UNKNOWN_OPTION_MESSAGE_LEN];
+
+                snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
+                usage(argv[0], EXIT_FAILURE, message);
+            }
+            default:
+            {
+                usage(argv[0], EXIT_FAILURE, NULL);
+            }
+        }
+    }
+
+    if(optind + 1 >= argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too few arguments.");
+    }
+    if(optind < argc - 2)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too many arguments.");
+    }
+
+    list = strdup(receivers);
+    if(list == NULL)
+    {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    for(token = strtok_r(list, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+        if(config.nruns == MAX_RUNS)
+        {
+            usage(argv[0], EXIT_FAILURE, "Too many receiver counts.");
+        }
+        config.runs[config.nruns++] = (int)parse_number(argv[0], token, 1, INT32_MAX);
+    }
+    free(list);
+    if(config.nruns == 0)
+    {
+        usage(argv[0], EXIT_FAILURE, "No receiver counts.");
+    }
+
+    port = (in_port_t)parse_number(argv[0], argv[optind + 1], 1, UINT16_MAX);
+    convert_address(argv[optind], port);
+}
+
+static long parse_number(const char *binary_name, const char *str, long min, long max)
+{
+    char *endptr;
+    long  value;
+
+    errno = 0;
+    value = strtol(str, &endptr, BASE_TEN);
+    if(errno != 0 || *endptr != '\0' || endptr == str)
+    {
+        usage(binary_name, EXIT_FAILURE, "Invalid number.");
+    }
+    if(value < min || value > max)
+    {
+        usage(binary_name, EXIT_FAILURE, "Number out of range.");
+    }
+    return value;
+}
+
+static void convert_address(const char *address, in_port_t port)
+{
+    memset(&config.addr, 0, sizeof(config.addr));
+
+    if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)&config.addr)->sin_addr)) == 1)
+    {
+        ((struct sockaddr_in *)&config.addr)->sin_family = AF_INET;
+        ((struct sockaddr_in *)&config.addr)->sin_port   = htons(port);
+        config.addr_len                                  = sizeof(struct sockaddr_in);
+    }
+    else if(inet_pton(AF_INET6, address, &(((struct sockaddr_in6 *)&config.addr)->sin6_addr)) == 1)
+    {
+        ((struct sockaddr_in6 *)&config.addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)&config.addr)->sin6_port   = htons(port);
+        config.addr_len                                    = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        fprintf(stderr, "%s is not an IPv4 or an IPv6 address\n", address);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* 10k receivers need more descriptors than the usual soft limit. */
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * US_PER_SEC) + ((uint64_t)ts.tv_nsec / NS_PER_US);
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-n receivers] [-s senders] [-m messages] [-r rate] [-t threads] <ip address> <port>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h          Display this help message\n", stderr);
+    fputs("  -n <list>   Receiver counts to run, comma separated (default 10,100,1000,10000)\n", stderr);
+    fputs("  -s <n>      Sending connections (default 1)\n", stderr);
+    fputs("  -m <n>      Messages per sender (default 200)\n", stderr);
+    fputs("  -r <n>      Messages per second per sender (default 100)\n", stderr);
+    fputs("  -t <n>      Receiver threads (default 4)\n", stderr);
+    exit(exit_code);
+}
@@ -0,0 +1,732 @@
+/*******************************************************************************
+ * Load generator
+ *
+ * Opens many connections spread over worker threads and drives a weighted mix
+ * of ACC_CREATE / ACC_LOGIN / CHT_SEND / ACC_LOGOUT requests at the server.
+ *
+ * Closed loop (default): every connection keeps one request in flight and
+ * sends the next as soon as the reply arrives.
+ * Open loop (-r): each thread sends on a fixed schedule regardless of replies,
+ * and latency is measured from the scheduled send time so a stalled server
+ * shows up in the percentiles instead of silently lowering the offered rate.
+ *
+ * Replies are matched to requests in order per connection. CHT_SEND frames
+ * are broadcasts and are counted separately; ACC_LOGOUT has no reply.
+ ******************************************************************************/
+
+#include "../include/histogram.h"
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UNKNOWN_OPTION_MESSAGE_LEN 24
+#define BASE_TEN 10
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_THREADS 4
+#define DEFAULT_DURATION 10
+#define DEFAULT_MIX "1:2:6:1"
+#define PASSWORD "Password123"
+#define CHAT_CONTENT "load generator message"
+#define NAME_LEN 32
+#define RX_BUF_SIZE 8192
+#define TX_BUF_SIZE 256
+#define MAX_INFLIGHT 64
+#define POLL_MS 10
+#define SEND_TIMEOUT_SEC 1
+#define NS_PER_US 1000
+#define US_PER_MS 1000
+#define US_PER_SEC 1000000
+#define P50 50.0
+#define P99 99.0
+#define P999 99.9
+
+typedef enum
+{
+    OP_CREATE,
+    OP_LOGIN,
+    OP_CHAT,
+    OP_LOGOUT,
+    OP_COUNT
+} op_t;
+
+static const char *const op_names[OP_COUNT] = {"create", "login", "chat", "logout"};
+
+typedef struct
+{
+    int      fd;                            // cppcheck-suppress unusedStructMember
+    int      id;                            // cppcheck-suppress unusedStructMember
+    uint64_t fresh;                         // cppcheck-suppress unusedStructMember
+    char     username[NAME_LEN];            // cppcheck-suppress unusedStructMember
+    uint8_t  rx[RX_BUF_SIZE];               // cppcheck-suppress unusedStructMember
+    size_t   rx_len;                        // cppcheck-suppress unusedStructMember
+    uint64_t sent_at[MAX_INFLIGHT];         // cppcheck-suppress unusedStructMember
+    uint8_t  sent_op[MAX_INFLIGHT];         // cppcheck-suppress unusedStructMember
+    size_t   head;                          // cppcheck-suppress unusedStructMember
+    size_t   inflight;                      // cppcheck-suppress unusedStructMember
+} conn_t;
+
+typedef struct
+{
+    pthread_t    thread;                  // cppcheck-suppress unusedStructMember
+    int          index;                   // cppcheck-suppress unusedStructMember
+    conn_t      *conns;                   // cppcheck-suppress unusedStructMember
+    int          nconns;                  // cppcheck-suppress unusedStructMember
+    unsigned int seed;                    // cppcheck-suppress unusedStructMember
+    histogram_t  latency[OP_COUNT];       // cppcheck-suppress unusedStructMember
+    uint64_t     sent[OP_COUNT];          // cppcheck-suppress unusedStructMember
+    uint64_t     ok[OP_COUNT];            // cppcheck-suppress unusedStructMember
+    uint64_t     errors[OP_COUNT];        // cppcheck-suppress unusedStructMember
+    uint64_t     broadcasts;              // cppcheck-suppress unusedStructMember
+    uint64_t     disconnects;             // cppcheck-suppress unusedStructMember
+    uint64_t     connect_errors;          // cppcheck-suppress unusedStructMember
+    uint64_t     dropped;                 // cppcheck-suppress unusedStructMember
+} worker_t;
+
+typedef struct
+{
+    struct sockaddr_storage addr;                 // cppcheck-suppress unusedStructMember
+    socklen_t               addr_len;             // cppcheck-suppress unusedStructMember
+    int                     connections;          // cppcheck-suppress unusedStructMember
+    int                     threads;              // cppcheck-suppress unusedStructMember
+    int                     duration;             // cppcheck-suppress unusedStructMember
+    long                    rate;                 // cppcheck-suppress unusedStructMember
+    unsigned int            weights[OP_COUNT];    // cppcheck-suppress unusedStructMember
+    unsigned int            weight_total;         // cppcheck-suppress unusedStructMember
+} config_t;
+
+static config_t    config;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static atomic_bool running;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static int         run_id;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+static void           parse_arguments(int argc, char *argv[]);
+static long           parse_number(const char *binary_name, const char *str, long min, long max);
+static void           parse_mix(const char *binary_name, const char *mix);
+static void           convert_address(const char *address, in_port_t port);
+static void           raise_fd_limit(void);
+static void          *worker_run(void *arg);
+static void           connect_all(worker_t *worker);
+static op_t           pick_op(worker_t *worker);
+static void           send_op(worker_t *worker, conn_t *conn, op_t op, uint64_t scheduled);
+static void           read_conn(worker_t *worker, conn_t *conn);
+static void           close_conn(worker_t *worker, conn_t *conn);
+static void           report(worker_t *workers, double elapsed);
+static uint64_t       now_us(void);
+
+int main(int argc, char *argv[])
+{
+    worker_t *workers;
+    conn_t   *conns;
+    uint64_t  start;
+    int       per_thread;
+    int       extra;
+    int       next;
+
+    parse_arguments(argc, argv);
+    raise_fd_limit();
+    run_id = (int)getpid();
+
+    workers = (worker_t *)calloc((size_t)config.threads, sizeof(worker_t));
+    conns   = (conn_t *)calloc((size_t)config.connections, sizeof(conn_t));
+    if(workers == NULL || conns == NULL)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("%d connections, %d threads, %d s, %s", config.connections, config.threads, config.duration, config.rate > 0 ? "open loop" : "closed loop");
+    if(config.rate > 0)
+    {
+        printf(" at %ld req/s", config.rate);
+    }
+    printf(", mix create:login:chat:logout = %u:%u:%u:%u\n", config.weights[OP_CREATE], config.weights[OP_LOGIN], config.weights[OP_CHAT], config.weights[OP_LOGOUT]);
+
+    // Spread connections as evenly as possible over the threads
+    per_thread = config.connections / config.threads;
+    extra      = config.connections % config.threads;
+    next       = 0;
+    atomic_store(&running, true);
+    start = now_us();
+    for(int i = 0; i < config.threads; i++)
+    {
+        workers[i].index  = i;
+        workers[i].conns  = conns + next;
+        workers[i].nconns = per_thread + (i < extra ? 1 : 0);
+        workers[i].seed   = (unsigned int)(start ^ (uint64_t)i);
+        for(int c = 0; c < workers[i].nconns; c++)
+        {
+            workers[i].conns[c].id = next + c;
+        }
+        next += workers[i].nconns;
+        if(pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    sleep((unsigned int)config.duration);
+    atomic_store(&running, false);
+    for(int i = 0; i < config.threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    report(workers, (double)(now_us() - start) / US_PER_SEC);
+
+    free(conns);
+    free(workers);
+    return EXIT_SUCCESS;
+}
+
+static void *worker_run(void *arg)
+{
+    worker_t      *worker = (worker_t *)arg;
+    struct pollfd *pfds;
+    uint64_t       interval = 0;
+    uint64_t       next_send;
+    int            rr = 0;
+
+    pfds = (struct pollfd *)calloc((size_t)worker->nconns, sizeof(struct pollfd));
+    if(pfds == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    connect_all(worker);
+
+    // Register each connection's own account first, so later logins can succeed.
+    for(int c = 0; c < worker->nconns; c++)
+    {
+        send_op(worker, &worker->conns[c], OP_CREATE, now_us());
+    }
+
+    if(config.rate > 0)
+    {
+        interval = ((uint64_t)config.threads * US_PER_SEC) / (uint64_t)config.rate;
+        if(interval == 0)
+        {
+            interval = 1;
+        }
+    }
+    next_send = now_us();
+
+    while(atomic_load(&running))
+    {
+        int      timeout = POLL_MS;
+        uint64_t now     = now_us();
+        int      ready;
+
+        if(config.rate > 0)
+        {
+            // Open loop: send everything that is due, whatever is still outstanding.
+            while(next_send <= now)
+            {
+                int tries;
+
+                for(tries = 0; tries < worker->nconns && worker->conns[rr].fd < 0; tries++)
+                {
+                    rr = (rr + 1) % worker->nconns;
+                }
+                if(tries == worker->nconns)
+                {
+                    break;    // Every connection is gone
+                }
+                if(worker->conns[rr].inflight < MAX_INFLIGHT)
+                {
+                    send_op(worker, &worker->conns[rr], pick_op(worker), next_send);
+                }
+                else
+                {
+                    worker->dropped++;
+                }
+                rr = (rr + 1) % worker->nconns;
+                next_send += interval;
+            }
+            timeout = 0;
+            if(next_send > now)
+            {
+                timeout = (int)((next_send - now) / US_PER_MS);
+            }
+            if(timeout > POLL_MS)
+            {
+                timeout = POLL_MS;
+            }
+        }
+        else
+        {
+            // Closed loop: one request in flight per connection.
+            for(int c = 0; c < worker->nconns; c++)
+            {
+                if(worker->conns[c].fd >= 0 && worker->conns[c].inflight == 0)
+                {
+                    send_op(worker, &worker->conns[c], pick_op(worker), now);
+                }
+            }
+        }
+
+        for(int c = 0; c < worker->nconns; c++)
+        {
+            pfds[c].fd     = worker->conns[c].fd;
+            pfds[c].events = POLLIN;
+        }
+        ready = poll(pfds, (nfds_t)worker->nconns, timeout);
+        if(ready < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        for(int c = 0; c < worker->nconns && ready > 0; c++)
+        {
+            if(pfds[c].revents != 0)
+            {
+                read_conn(worker, &worker->conns[c]);
+            }
+        }
+    }
+
+    for(int c = 0; c < worker->nconns; c++)
+    {
+        if(worker->conns[c].fd >= 0)
+        {
+            close(worker->conns[c].fd);
+            worker->conns[c].fd = -1;
+        }
+    }
+    free(pfds);
+    return NULL;
+}
+
+static void connect_all(worker_t *worker)
+{
+    struct timeval send_timeout = {SEND_TIMEOUT_SEC, 0};
+
+    for(int c = 0; c < worker->nconns; c++)
+    {
+        conn_t *conn = &worker->conns[c];
+
+        snprintf(conn->username, sizeof(conn->username), "lg%x_%d", (unsigned int)run_id, conn->id);
+        conn->fd = socket(config.addr.ss_family, SOCK_STREAM, 0);
+        if(conn->fd < 0)
+        {
+            worker->connect_errors++;
+            continue;
+        }
+        if(connect(conn->fd, (struct sockaddr *)&config.addr, config.addr_len) == -1)
+        {
+            worker->connect_errors++;
+            close(conn->fd);
+            conn->fd = -1;
+            continue;
+        }
+        // Writes block, but never for long: a wedged server shows up as errors, not a hang.
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+        // Small back-to-back requests must not wait on Nagle, or we measure our own delay.
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    }
+}
+
+static op_t pick_op(worker_t *worker)
+{
+    unsigned int roll = (unsigned int)rand_r(&worker->seed) % config.weight_total;
+
+    for(int op = 0; op < OP_COUNT; op++)
+    {
+        if(roll < config.weights[op])
+        {
+            return (op_t)op;
+        }
+        roll -= config.weights[op];
+    }
+    return OP_CHAT;
+}
+
+static void send_op(worker_t *worker, conn_t *conn, op_t op, uint64_t scheduled)
+{
+    uint8_t packet[TX_BUF_SIZE];
+    char    name[NAME_LEN * 2];
+    char    timestamp[PROTO_TIME_LEN + 1];
+    size_t  length;
+
+    if(conn->fd < 0)
+    {
+        return;
+    }
+
+    switch(op)
+    {
+        case OP_CREATE:
+            // The first create registers the connection's account; later ones use fresh names.
+            if(conn->fresh++ == 0)
+            {
+                length = proto_account(packet, ACC_CREATE, 0, conn->username, PASSWORD);
+            }
+            else
+            {
+                snprintf(name, sizeof(name), "%s_%" PRIu64, conn->username, conn->fresh);
+                length = proto_account(packet, ACC_CREATE, 0, name, PASSWORD);
+            }
+            break;
+        case OP_LOGIN:
+            length = proto_account(packet, ACC_LOGIN, 0, conn->username, PASSWORD);
+            break;
+        case OP_CHAT:
+            proto_timestamp(timestamp);
+            length = proto_chat(packet, 0, timestamp, CHAT_CONTENT, (uint8_t)strlen(CHAT_CONTENT), conn->username);
+            break;
+        case OP_LOGOUT:
+        case OP_COUNT:
+        default:
+            length = proto_logout(packet, 0);
+            break;
+    }
+
+    if(send(conn->fd, packet, length, MSG_NOSIGNAL) != (ssize_t)length)
+    {
+        worker->errors[op]++;
+        close_conn(worker, conn);
+        return;
+    }
+    worker->sent[op]++;
+
+    if(op == OP_LOGOUT)
+    {
+        worker->ok[op]++;    // No reply to wait for
+        return;
+    }
+    conn->sent_at[(conn->head + conn->inflight) % MAX_INFLIGHT] = scheduled;
+    conn->sent_op[(conn->head + conn->inflight) % MAX_INFLIGHT] = (uint8_t)op;
+    conn->inflight++;
+}
+
+static void read_conn(worker_t *worker, conn_t *conn)
+{
+    ssize_t  nread;
+    size_t   offset = 0;
+    size_t   length;
+    uint64_t now;
+
+    nread = recv(conn->fd, conn->rx + conn->rx_len, sizeof(conn->rx) - conn->rx_len, MSG_DONTWAIT);
+    if(nread < 0 && (proto_would_block(errno) || errno == EINTR))
+    {
+        return;
+    }
+    if(nread <= 0)
+    {
+        worker->disconnects++;
+        close_conn(worker, conn);
+        return;
+    }
+    conn->rx_len += (size_t)nread;
+    now = now_us();
+
+    while((length = proto_frame_length(conn->rx + offset, conn->rx_len - offset)) > 0)
+    {
+        uint8_t type = conn->rx[offset];
+
+        offset += length;
+        if(type == CHT_SEND)
+        {
+            worker->broadcasts++;
+            continue;
+        }
+        if(conn->inflight == 0)
+        {
+            continue;    // Unsolicited reply, e.g. a timeout notice
+        }
+
+        {
+            op_t     op   = (op_t)conn->sent_op[conn->head];
+            uint64_t sent = conn->sent_at[conn->head];
+
+            conn->head = (conn->head + 1) % MAX_INFLIGHT;
+            conn->inflight--;
+            hist_record(&worker->latency[op], now > sent ? now - sent : 0);
+            if(type == SYS_ERROR)
+            {
+                worker->errors[op]++;
+            }
+            else
+            {
+                worker->ok[op]++;
+            }
+        }
+    }
+
+    conn->rx_len -= offset;
+    if(conn->rx_len > 0)
+    {
+        memmove(conn->rx, conn->rx + offset, conn->rx_len);
+    }
+    if(conn->rx_len == sizeof(conn->rx))
+    {
+        worker->disconnects++;    // Frame larger than we can buffer
+        close_conn(worker, conn);
+    }
+}
+
+static void close_conn(worker_t *worker, conn_t *conn)
+{
+    // Whatever was still in flight will never be answered.
+    while(conn->inflight > 0)
+    {
+        worker->errors[conn->sent_op[conn->head]]++;
+        conn->head = (conn->head + 1) % MAX_INFLIGHT;
+        conn->inflight--;
+    }
+    close(conn->fd);
+    conn->fd     = -1;
+    conn->rx_len = 0;
+}
+
+static void report(worker_t *workers, double elapsed)
+{
+    uint64_t total_ok     = 0;
+    uint64_t total_errors = 0;
+    uint64_t broadcasts   = 0;
+    uint64_t disconnects  = 0;
+    uint64_t connect_errs = 0;
+    uint64_t dropped      = 0;
+
+    printf("\n%-8s %10s %10s %10s %10s %10s %10s\n", "op", "sent", "ok", "errors", "p50(us)", "p99(us)", "p99.9(us)");
+    for(int op = 0; op < OP_COUNT; op++)
+    {
+        hist_snapshot_t snap;
+        uint64_t        sent   = 0;
+        uint64_t        ok     = 0;
+        uint64_t        errors = 0;
+
+        memset(&snap, 0, sizeof(snap));
+        for(int i = 0; i < config.threads; i++)
+        {
+            hist_accumulate(&snap, &workers[i].latency[op]);
+            sent += workers[i].sent[op];
+            ok += workers[i].ok[op];
+            errors += workers[i].errors[op];
+        }
+        total_ok += ok;
+        total_errors += errors;
+        printf("%-8s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", op_names[op], sent, ok, errors, hist_percentile(&snap, P50), hist_percentile(&snap, P99), hist_percentile(&snap, P999));
+    }
+    for(int i = 0; i < config.threads; i++)
+    {
+        broadcasts += workers[i].broadcasts;
+        disconnects += workers[i].disconnects;
+        connect_errs += workers[i].connect_errors;
+        dropped += workers[i].dropped;
+    }
+
+    printf("\nthroughput: %.1f ok/s over %.1f s, %" PRIu64 " errors\n", (double)total_ok / elapsed, elapsed, total_errors);
+    printf("broadcasts received: %" PRIu64 ", disconnects: %" PRIu64 ", connect errors: %" PRIu64, broadcasts, disconnects, connect_errs);
+    if(config.rate > 0)
+    {
+        printf(", sends skipped (too many in flight): %" PRIu64, dropped);
+    }
+    printf("\n");
+}
+
+static void parse_arguments(int argc, char *argv[])
+{
+    int       opt;
+    in_port_t port;
+
+    opterr             = 0;
+    config.connections = DEFAULT_CONNECTIONS;
+    config.threads     = DEFAULT_THREADS;
+    config.duration    = DEFAULT_DURATION;
+    config.rate        = 0;
+    parse_mix(argv[0], DEFAULT_MIX);
+
+    while((opt = getopt(argc, argv, "hc:t:d:r:m:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'h':
+            {
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            }
+            case 'c':
+            {
+                config.connections = (int)parse_number(argv[0], optarg, 1, INT32_MAX);
+                break;
+            }
+            case 't':
+            {
+                config.threads = (int)parse_number(argv[0], optarg, 1, INT32_MAX);
+                break;
+            }
+            case 'd':
+            {
+                config.duration = (int)parse_number(argv[0], optarg, 1, INT32_MAX);
+                break;
+            }
+            case 'r':
+            {
+                config.rate = parse_number(argv[0], optarg, 0, INT32_MAX);
+                break;
+            }
+            case 'm':
+            {
+                parse_mix(argv[0], optarg);
+                break;
+            }
+            case '?':
+            {
+                char message[UNKNOWN_OPTION_MESSAGE_LEN];
+
+                snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
+                usage(argv[0], EXIT_FAILURE, message);
+            }
+            default:
+            {
+                usage(argv[0], EXIT_FAILURE, NULL);
+            }
+        }
+    }
+
+    if(optind + 1 >= argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too few arguments.");
+    }
+    if(optind < argc - 2)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too many arguments.");
+    }
+    if(config.threads > config.connections)
+    {
+        config.threads = config.connections;
+    }
+
+    port = (in_port_t)parse_number(argv[0], argv[optind + 1], 1, UINT16_MAX);
+    convert_address(argv[optind], port);
+}
+
+static long parse_number(const char *binary_name, const char *str, long min, long max)
+{
+    char *endptr;
+    long  value;
+
+    errno = 0;
+    value = strtol(str, &endptr, BASE_TEN);
+    if(errno != 0 || *endptr != '\0' || endptr == str)
+    {
+        usage(binary_name, EXIT_FAILURE, "Invalid number.");
+    }
+    if(value < min || value > max)
+    {
+        usage(binary_name, EXIT_FAILURE, "Number out of range.");
+    }
+    return value;
+}
+
+/* Parses "create:login:chat:logout" weights, e.g. "1:2:6:1". */
+static void parse_mix(const char *binary_name, const char *mix)
+{
+    const char *ptr = mix;
+
+    config.weight_total = 0;
+    for(int op = 0; op < OP_COUNT; op++)
+    {
+        char *endptr;
+        long  weight;
+
+        errno  = 0;
+        weight = strtol(ptr, &endptr, BASE_TEN);
+        if(errno != 0 || endptr == ptr || weight < 0 || weight > UINT16_MAX)
+        {
+            usage(binary_name, EXIT_FAILURE, "Invalid mix.");
+        }
+        config.weights[op] = (unsigned int)weight;
+        config.weight_total += (unsigned int)weight;
+        ptr = endptr;
+        if(op < OP_COUNT - 1)
+        {
+            if(*ptr != ':')
+            {
+                usage(binary_name, EXIT_FAILURE, "Invalid mix.");
+            }
+            ptr++;
+        }
+    }
+    if(*ptr != '\0' || config.weight_total == 0)
+    {
+        usage(binary_name, EXIT_FAILURE, "Invalid mix.");
+    }
+}
+
+static void convert_address(const char *address, in_port_t port)
+{
+    memset(&config.addr, 0, sizeof(config.addr));
+
+    if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)&config.addr)->sin_addr)) == 1)
+    {
+        ((struct sockaddr_in *)&config.addr)->sin_family = AF_INET;
+        ((struct sockaddr_in *)&config.addr)->sin_port   = htons(port);
+        config.addr_len                                  = sizeof(struct sockaddr_in);
+    }
+    else if(inet_pton(AF_INET6, address, &(((struct sockaddr_in6 *)&config.addr)->sin6_addr)) == 1)
+    {
+        ((struct sockaddr_in6 *)&config.addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)&config.addr)->sin6_port   = htons(port);
+        config.addr_len                                    = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        fprintf(stderr, "%s is not an IPv4 or an IPv6 address\n", address);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Thousands of connections need more descriptors than the usual soft limit. */
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * US_PER_SEC) + ((uint64_t)ts.tv_nsec / NS_PER_US);
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-c connections] [-t threads] [-d seconds] [-r rate] [-m mix] <ip address> <port>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h          Display this help message\n", stderr);
+    fputs("  -c <n>      Connections to open (default 100)\n", stderr);
+    fputs("  -t <n>      Worker threads (default 4)\n", stderr);
+    fputs("  -d <s>      Test duration in seconds (default 10)\n", stderr);
+    fputs("  -r <n>      Open loop at <n> requests/s in total (default: closed loop)\n", stderr);
+    fputs("  -m <mix>    Weights create:login:chat:logout (default 1:2:6:1)\n", stderr);
+    exit(exit_code);
+}
@@ -0,0 +1,116 @@
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+static size_t put_header(uint8_t *packet, uint8_t packet_type, uint16_t sender_id);
+static size_t put_string(uint8_t *packet, uint8_t tag, const void *value, uint8_t len);
+static void   set_payload_length(uint8_t *packet, size_t length);
+
+size_t proto_account(uint8_t *packet, uint8_t packet_type, uint16_t sender_id, const char *username, const char *password)
+{
+    size_t offset;
+
+    offset = put_header(packet, packet_type, sender_id);
+
+    // Username
+    offset += put_string(packet + offset, UTF8_STR, username, (uint8_t)strlen(username));
+
+    // Password
+    offset += put_string(packet + offset, UTF8_STR, password, (uint8_t)strlen(password));
+
+    set_payload_length(packet, offset);
+    return offset;
+}
+
+size_t proto_logout(uint8_t *packet, uint16_t sender_id)
+{
+    size_t offset;
+
+    offset = put_header(packet, ACC_LOGOUT, sender_id);
+    set_payload_length(packet, offset);
+    return offset;
+}
+
+size_t proto_chat(uint8_t *packet, uint16_t sender_id, const char *timestamp, const void *content, uint8_t content_len, const char *username)
+{
+    size_t offset;
+
+    offset = put_header(packet, CHT_SEND, sender_id);
+    offset += put_string(packet + offset, GENERALIZED_TIME, timestamp, (uint8_t)strlen(timestamp));
+    offset += put_string(packet + offset, UTF8_STR, content, content_len);
+    offset += put_string(packet + offset, UTF8_STR, username, (uint8_t)strlen(username));
+
+    set_payload_length(packet, offset);
+    return offset;
+}
+
+void proto_timestamp(char *dst)
+{
+    time_t    now = time(NULL);
+    struct tm utc;
+
+    gmtime_r(&now, &utc);
+    strftime(dst, PROTO_TIME_LEN + 1, "%Y%m%d%H%M%SZ", &utc);
+}
+
+size_t proto_frame_length(const uint8_t *buf, size_t len)
+{
+    uint16_t payload_length;
+    size_t   frame_length;
+
+    if(len < PROTO_HEADERLEN)
+    {
+        return 0;
+    }
+    memcpy(&payload_length, buf + PROTO_HEADERLEN - sizeof(payload_length), sizeof(payload_length));
+    frame_length = PROTO_HEADERLEN + (size_t)ntohs(payload_length);
+    return len >= frame_length ? frame_length : 0;
+}
+
+int proto_would_block(int err)
+{
+#if EAGAIN != EWOULDBLOCK
+    return err == EAGAIN || err == EWOULDBLOCK;
+#else
+    return err == EAGAIN;
+#endif
+}
+
+static size_t put_header(uint8_t *packet, uint8_t packet_type, uint16_t sender_id)
+{
+    size_t offset = 0;
+
+    // Packet type (1 byte)
+    packet[offset++] = packet_type;
+
+    // Version (1 byte)
+    packet[offset++] = PROTO_VERSION;
+
+    // Sender ID (2 bytes) - Using htons() for network byte order
+    sender_id = htons(sender_id);
+    memcpy(&packet[offset], &sender_id, sizeof(sender_id));
+    offset += sizeof(sender_id);
+
+    // Payload Length (2 bytes) - filled in by set_payload_length()
+    memset(&packet[offset], 0, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+
+    return offset;
+}
+
+static size_t put_string(uint8_t *packet, uint8_t tag, const void *value, uint8_t len)
+{
+    packet[0] = tag;
+    packet[1] = len;
+    memcpy(packet + 2, value, len);
+    return (size_t)len + 2;
+}
+
+static void set_payload_length(uint8_t *packet, size_t length)
+{
+    uint16_t payload_length = htons((uint16_t)(length - PROTO_HEADERLEN));
+
+    memcpy(packet + PROTO_HEADERLEN - sizeof(payload_length), &payload_length, sizeof(payload_length));
+}
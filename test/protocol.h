@@ -0,0 +1,52 @@
+#ifndef TEST_PROTOCOL_H
+#define TEST_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTO_HEADERLEN (6)
+#define PROTO_VERSION (0x03)
+#define PROTO_FRAME_MAX (PROTO_HEADERLEN + UINT16_MAX)
+#define PROTO_TIME_LEN (15)    // GeneralizedTime "YYYYMMDDhhmmssZ"
+
+// packet type codes
+#define SYS_SUCCESS 0x00
+#define SYS_ERROR 0x01
+#define ACC_LOGIN 0x0A
+#define ACC_LOGIN_SUCCESS 0x0B
+#define ACC_LOGOUT 0x0C
+#define ACC_CREATE 0x0D
+#define CHT_SEND 0x14
+
+// data type codes
+#define BER_INT 0x02
+#define UTF8_STR 0x0C
+#define GENERALIZED_TIME 0x18
+
+// server manager protocol: type, version and a 2-byte payload length
+#define PROTO_SM_HEADERLEN (4)
+#define SVR_DIAGNOSTIC 0x0A
+#define SVR_ONLINE 0x0C
+#define SVR_OFFLINE 0x0D
+#define SVR_START 0x14
+#define SVR_STOP 0x15
+
+/* Encodes an ACC_LOGIN, ACC_CREATE or ACC_EDIT request into packet. Returns the frame length. */
+size_t proto_account(uint8_t *packet, uint8_t packet_type, uint16_t sender_id, const char *username, const char *password);
+
+/* Encodes an ACC_LOGOUT request. Returns the frame length. */
+size_t proto_logout(uint8_t *packet, uint16_t sender_id);
+
+/* Encodes a CHT_SEND request. content may hold arbitrary bytes. Returns the frame length. */
+size_t proto_chat(uint8_t *packet, uint16_t sender_id, const char *timestamp, const void *content, uint8_t content_len, const char *username);
+
+/* Writes the current UTC time as GeneralizedTime; dst must hold PROTO_TIME_LEN + 1 bytes. */
+void proto_timestamp(char *dst);
+
+/* Length of the complete frame at the front of buf, or 0 if more bytes are needed. */
+size_t proto_frame_length(const uint8_t *buf, size_t len) __attribute__((pure));
+
+/* Non-zero if err says a non-blocking socket had nothing to give or no room to take. */
+int proto_would_block(int err) __attribute__((const));
+
+#endif    // TEST_PROTOCOL_H
@@ -0,0 +1,441 @@
+/*******************************************************************************
+ * Capture replay
+ *
+ * Re-drives a file written by the server's --capture option against a server.
+ * Each captured connection gets its own socket, opened, written to and closed
+ * at the captured offsets divided by -s, so the original concurrency and
+ * inter-arrival gaps hold at 1x or faster. Replies are read and discarded.
+ * The report shows how far behind schedule each event ran.
+ *
+ * Frames are sent byte-for-byte. Logins only succeed if the accounts exist,
+ * so either replay a capture that started with an empty database against an
+ * empty database, or replay against a copy of the captured server's data.
+ ******************************************************************************/
+
+#include "../include/capture.h"
+#include "../include/histogram.h"
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UNKNOWN_OPTION_MESSAGE_LEN 24
+#define BASE_TEN 10
+#define DEFAULT_SPEED 1.0
+#define DEFAULT_LINGER_MS 500
+#define RX_BUF_SIZE 65536
+#define NS_PER_US 1000
+#define US_PER_MS 1000
+#define US_PER_SEC 1000000
+#define P50 50.0
+#define P99 99.0
+
+typedef struct
+{
+    struct sockaddr_storage addr;         // cppcheck-suppress unusedStructMember
+    socklen_t               addr_len;     // cppcheck-suppress unusedStructMember
+    const char             *path;         // cppcheck-suppress unusedStructMember
+    double                  speed;        // cppcheck-suppress unusedStructMember
+    int                     linger_ms;    // cppcheck-suppress unusedStructMember
+} config_t;
+
+typedef struct
+{
+    uint64_t connections;        // cppcheck-suppress unusedStructMember
+    uint64_t connect_errors;     // cppcheck-suppress unusedStructMember
+    uint64_t frames;             // cppcheck-suppress unusedStructMember
+    uint64_t skipped;            // cppcheck-suppress unusedStructMember
+    uint64_t bytes_out;          // cppcheck-suppress unusedStructMember
+    uint64_t bytes_in;           // cppcheck-suppress unusedStructMember
+    uint64_t server_closed;      // cppcheck-suppress unusedStructMember
+    int      open;               // cppcheck-suppress unusedStructMember
+    int      peak;               // cppcheck-suppress unusedStructMember
+} stats_t;
+
+static config_t config;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+static void           parse_arguments(int argc, char *argv[]);
+static void           convert_address(const char *address, in_port_t port);
+static uint8_t       *load(const char *path, size_t *len);
+static uint32_t       max_conn(const uint8_t *buf, size_t len);
+static int            open_conn(void);
+static void           pump(struct pollfd *pfds, uint32_t nconns, stats_t *stats, uint64_t until);
+static void           close_conn(struct pollfd *pfd, stats_t *stats);
+static uint64_t       now_us(void);
+
+int main(int argc, char *argv[])
+{
+    static histogram_t lag;
+    hist_snapshot_t    snap;
+    stats_t            stats;
+    struct pollfd     *pfds;
+    uint8_t           *file;
+    size_t             file_len;
+    size_t             offset;
+    uint32_t           nconns;
+    uint64_t           start;
+    uint64_t           captured_us = 0;
+    uint64_t           elapsed;
+
+    parse_arguments(argc, argv);
+    file = load(config.path, &file_len);
+    if(file_len < CAPTURE_MAGIC_LEN || memcmp(file, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "%s is not a capture file\n", config.path);
+        return EXIT_FAILURE;
+    }
+
+    // Connection numbers are dense from 1, so they index the poll set directly.
+    nconns = max_conn(file + CAPTURE_MAGIC_LEN, file_len - CAPTURE_MAGIC_LEN) + 1;
+    pfds   = (struct pollfd *)calloc(nconns, sizeof(struct pollfd));
+    if(pfds == NULL)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for(uint32_t c = 0; c < nconns; c++)
+    {
+        pfds[c].fd     = -1;
+        pfds[c].events = POLLIN;
+    }
+    memset(&stats, 0, sizeof(stats));
+
+    start  = now_us();
+    offset = CAPTURE_MAGIC_LEN;
+    for(;;)
+    {
+        capture_record_t rec;
+        size_t           rec_len;
+        uint64_t         due;
+        uint64_t         now;
+
+        rec_len = capture_decode(file + offset, file_len - offset, &rec);
+        if(rec_len == 0)
+        {
+            break;
+        }
+        offset += rec_len;
+        captured_us = rec.ts_us;
+
+        // Serve replies while waiting for the event's turn.
+        due = start + (uint64_t)((double)rec.ts_us / config.speed);
+        pump(pfds, nconns, &stats, due);
+        now = now_us();
+        hist_record(&lag, now > due ? now - due : 0);
+
+        switch(rec.kind)
+        {
+            case CAPTURE_OPEN:
+                pfds[rec.conn].fd = open_conn();
+                if(pfds[rec.conn].fd < 0)
+                {
+                    stats.connect_errors++;
+                    break;
+                }
+                stats.connections++;
+                stats.open++;
+                if(stats.open > stats.peak)
+                {
+                    stats.peak = stats.open;
+                }
+                break;
+            case CAPTURE_FRAME:
+                if(pfds[rec.conn].fd < 0 || send(pfds[rec.conn].fd, rec.data, rec.len, MSG_NOSIGNAL) != (ssize_t)rec.len)
+                {
+                    stats.skipped++;
+                    break;
+                }
+                stats.frames++;
+                stats.bytes_out += rec.len;
+                break;
+            case CAPTURE_CLOSE:
+                if(pfds[rec.conn].fd >= 0)
+                {
+                    close(pfds[rec.conn].fd);
+                    pfds[rec.conn].fd = -1;
+                    stats.open--;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    if(offset != file_len)
+    {
+        fprintf(stderr, "warning: %zu trailing bytes (truncated capture?)\n", file_len - offset);
+    }
+
+    elapsed = now_us() - start;
+    // Collect the last replies before hanging up.
+    pump(pfds, nconns, &stats, now_us() + ((uint64_t)config.linger_ms * US_PER_MS));
+    for(uint32_t c = 0; c < nconns; c++)
+    {
+        if(pfds[c].fd >= 0)
+        {
+            close(pfds[c].fd);
+        }
+    }
+
+    memset(&snap, 0, sizeof(snap));
+    hist_accumulate(&snap, &lag);
+    printf("capture %s: %.3f s, replayed in %.3f s at %gx\n", config.path, (double)captured_us / US_PER_SEC, (double)elapsed / US_PER_SEC, config.speed);
+    printf("connections: %" PRIu64 " (peak %d concurrent), connect errors: %" PRIu64 ", closed by server: %" PRIu64 "\n", stats.connections, stats.peak, stats.connect_errors, stats.server_closed);
+    printf("frames sent: %" PRIu64 " (%" PRIu64 " bytes), skipped: %" PRIu64 ", bytes received: %" PRIu64 "\n", stats.frames, stats.bytes_out, stats.skipped, stats.bytes_in);
+    printf("schedule lag (us): p50 %" PRIu64 " p99 %" PRIu64 " max %" PRIu64 "\n", hist_percentile(&snap, P50), hist_percentile(&snap, P99), snap.max);
+
+    free(pfds);
+    free(file);
+    return EXIT_SUCCESS;
+}
+
+/* Reads and discards replies until the until timestamp. */
+static void pump(struct pollfd *pfds, uint32_t nconns, stats_t *stats, uint64_t until)
+{
+    for(;;)
+    {
+        uint64_t now = now_us();
+        int      ready;
+
+        if(now >= until)
+        {
+            // Still pick up anything already waiting, without blocking.
+            ready = poll(pfds, nconns, 0);
+        }
+        else
+        {
+            ready = poll(pfds, nconns, (int)((until - now + US_PER_MS - 1) / US_PER_MS));
+        }
+        if(ready <= 0)
+        {
+            if(now_us() >= until)
+            {
+                return;
+            }
+            continue;
+        }
+        for(uint32_t c = 0; c < nconns && ready > 0; c++)
+        {
+            if(pfds[c].fd >= 0 && pfds[c].revents != 0)
+            {
+                static uint8_t rx[RX_BUF_SIZE];
+                ssize_t        nread;
+
+                ready--;
+                nread = recv(pfds[c].fd, rx, sizeof(rx), MSG_DONTWAIT);
+                if(nread > 0)
+                {
+                    stats->bytes_in += (uint64_t)nread;
+                }
+                else if(nread == 0 || (!proto_would_block(errno) && errno != EINTR))
+                {
+                    close_conn(&pfds[c], stats);
+                }
+            }
+        }
+        if(now >= until)
+        {
+            return;
+        }
+    }
+}
+
+static void close_conn(struct pollfd *pfd, stats_t *stats)
+{
+    close(pfd->fd);
+    pfd->fd = -1;
+    stats->server_closed++;
+    stats->open--;
+}
+
+static int open_conn(void)
+{
+    struct timeval timeout = {1, 0};
+    int            fd;
+
+    fd = socket(config.addr.ss_family, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr *)&config.addr, config.addr_len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+static uint32_t max_conn(const uint8_t *buf, size_t len)
+{
+    capture_record_t rec;
+    size_t           rec_len;
+    uint32_t         highest = 0;
+
+    while((rec_len = capture_decode(buf, len, &rec)) > 0)
+    {
+        if(rec.conn > highest)
+        {
+            highest = rec.conn;
+        }
+        buf += rec_len;
+        len -= rec_len;
+    }
+    return highest;
+}
+
+static uint8_t *load(const char *path, size_t *len)
+{
+    struct stat st;
+    uint8_t    *buf;
+    FILE       *file;
+
+    file = fopen(path, "rbe");
+    if(file == NULL || fstat(fileno(file), &st) == -1)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    buf = (uint8_t *)malloc((size_t)st.st_size + 1);
+    if(buf == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    *len = fread(buf, 1, (size_t)st.st_size, file);
+    fclose(file);
+    return buf;
+}
+
+static void parse_arguments(int argc, char *argv[])
+{
+    int       opt;
+    in_port_t port;
+    char     *endptr;
+    long      value;
+
+    opterr           = 0;
+    config.speed     = DEFAULT_SPEED;
+    config.linger_ms = DEFAULT_LINGER_MS;
+
+    while((opt = getopt(argc, argv, "hs:w:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'h':
+            {
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            }
+            case 's':
+            {
+                errno        = 0;
+                config.speed = strtod(optarg, &endptr);
+                if(errno != 0 || *endptr != '\0' || !(config.speed > 0))
+                {
+                    usage(argv[0], EXIT_FAILURE, "Invalid speed.");
+                }
+                break;
+            }
+            case 'w':
+            {
+                errno = 0;
+                value = strtol(optarg, &endptr, BASE_TEN);
+                if(errno != 0 || *endptr != '\0' || value < 0 || value > INT32_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Invalid linger time.");
+                }
+                config.linger_ms = (int)value;
+                break;
+            }
+            case '?':
+            {
+                char message[UNKNOWN_OPTION_MESSAGE_LEN];
+
+                snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
+                usage(argv[0], EXIT_FAILURE, message);
+            }
+            default:
+            {
+                usage(argv[0], EXIT_FAILURE, NULL);
+            }
+        }
+    }
+
+    if(optind + 2 >= argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too few arguments.");
+    }
+    if(optind < argc - 3)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too many arguments.");
+    }
+
+    config.path = argv[optind];
+    errno       = 0;
+    value       = strtol(argv[optind + 2], &endptr, BASE_TEN);
+    if(errno != 0 || *endptr != '\0' || value < 1 || value > UINT16_MAX)
+    {
+        usage(argv[0], EXIT_FAILURE, "Invalid port.");
+    }
+    port = (in_port_t)value;
+    convert_address(argv[optind + 1], port);
+}
+
+static void convert_address(const char *address, in_port_t port)
+{
+    memset(&config.addr, 0, sizeof(config.addr));
+
+    if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)&config.addr)->sin_addr)) == 1)
+    {
+        ((struct sockaddr_in *)&config.addr)->sin_family = AF_INET;
+        ((struct sockaddr_in *)&config.addr)->sin_port   = htons(port);
+        config.addr_len                                  = sizeof(struct sockaddr_in);
+    }
+    else if(inet_pton(AF_INET6, address, &(((struct sockaddr_in6 *)&config.addr)->sin6_addr)) == 1)
+    {
+        ((struct sockaddr_in6 *)&config.addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)&config.addr)->sin6_port   = htons(port);
+        config.addr_len                                    = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        fprintf(stderr, "%s is not an IPv4 or an IPv6 address\n", address);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * US_PER_SEC) + ((uint64_t)ts.tv_nsec / NS_PER_US);
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-s speed] [-w ms] <capture file> <ip address> <port>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h          Display this help message\n", stderr);
+    fputs("  -s <x>      Speed-up factor: 1 keeps the captured timing, 10 runs ten times faster (default 1)\n", stderr);
+    fputs("  -w <ms>     Keep reading replies this long after the last event (default 500)\n", stderr);
+    exit(exit_code);
+}
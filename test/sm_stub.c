@@ -0,0 +1,633 @@
+/*******************************************************************************
+ * Stand-in server manager
+ *
+ * Plays the server manager on a local address so server_starter and the
+ * SVR_DIAGNOSTIC path can be exercised without the real one. It accepts the
+ * starter, sends SVR_START and waits for SVR_ONLINE, records every diagnostic
+ * report while the load runs, then sends SVR_STOP and waits for SVR_OFFLINE.
+ *
+ * With -s it launches the starter itself and with -l it runs the load once
+ * the server is online, which makes a whole run one command:
+ *
+ *   sm_stub -s "./build/server_starter -A 127.0.0.1 -p 8080 -w 2" \
+ *           -l "./build/loadgen -c 8 -d 5 127.0.0.1 8080" -u 1 -m 1000 127.0.0.1 9000
+ *
+ * Every report must parse (the original two-field layout or the extended
+ * one), message counts must never go backwards, and reports must arrive every
+ * DIAG_INTERVAL_MS within -j. -u and -m set the least peak user count and
+ * final message count the reports must show. The exit status is 0 only if
+ * every check passed.
+ ******************************************************************************/
+
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UNKNOWN_OPTION_MESSAGE_LEN 24
+#define BASE_TEN 10
+#define DEFAULT_DURATION 10
+#define DEFAULT_JITTER_MS 250
+#define DIAG_INTERVAL_MS 1000    // DIAGNOSTIC_INTERVAL in include/message.h
+#define DIAG_VERSION_EXTENDED 2
+#define DIAG_FIELDS_MAX 16
+#define DIAG_EXT_FIELDS 11
+#define DIAG_EXT_CONNECTIONS 1
+#define DIAG_EXT_MSG_COUNT 2
+#define REPLY_TIMEOUT_MS 10000    // For the starter to connect and to answer SVR_START and SVR_STOP
+#define EXIT_TIMEOUT_MS 5000
+#define SETTLE_MS (2 * DIAG_INTERVAL_MS)    // Reports to wait for after the load, so its last messages are counted
+#define RX_BUF_SIZE (PROTO_SM_HEADERLEN + UINT16_MAX)
+#define POLL_MS 50
+#define NS_PER_MS 1000000
+#define MS_PER_SEC 1000
+#define US_PER_MS 1000
+#define BYTE_BITS 8
+
+typedef struct
+{
+    struct sockaddr_storage addr;            // cppcheck-suppress unusedStructMember
+    socklen_t               addr_len;        // cppcheck-suppress unusedStructMember
+    int                     duration;        // cppcheck-suppress unusedStructMember
+    const char             *starter_cmd;     // cppcheck-suppress unusedStructMember
+    const char             *load_cmd;        // cppcheck-suppress unusedStructMember
+    long                    min_users;       // cppcheck-suppress unusedStructMember
+    long                    min_messages;    // cppcheck-suppress unusedStructMember
+    long                    jitter_ms;       // cppcheck-suppress unusedStructMember
+} config_t;
+
+typedef struct
+{
+    int      fd;                 // cppcheck-suppress unusedStructMember
+    size_t   rx_len;             // cppcheck-suppress unusedStructMember
+    uint8_t  rx[RX_BUF_SIZE];    // cppcheck-suppress unusedStructMember
+    uint64_t reports;            // cppcheck-suppress unusedStructMember
+    uint64_t malformed;          // cppcheck-suppress unusedStructMember
+    uint64_t regressions;        // cppcheck-suppress unusedStructMember
+    uint64_t off_cadence;        // cppcheck-suppress unusedStructMember
+    uint64_t last_at;            // cppcheck-suppress unusedStructMember
+    uint64_t gap_min;            // cppcheck-suppress unusedStructMember
+    uint64_t gap_max;            // cppcheck-suppress unusedStructMember
+    uint64_t gap_total;          // cppcheck-suppress unusedStructMember
+    uint64_t peak_users;         // cppcheck-suppress unusedStructMember
+    uint64_t messages;           // cppcheck-suppress unusedStructMember
+    int      layout;             // cppcheck-suppress unusedStructMember
+} manager_t;
+
+static config_t  config;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static manager_t manager;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+static void           parse_arguments(int argc, char *argv[]);
+static long           parse_number(const char *binary_name, const char *str, long min, long max);
+static void           convert_address(const char *address, in_port_t port);
+static int            listen_manager(void);
+static int            accept_starter(int listen_fd, pid_t starter);
+static pid_t          run_command(const char *cmd);
+static void           stop_command(pid_t pid);
+static int            send_control(uint8_t type);
+static int            pump(int timeout_ms, uint8_t want);
+static void           record_diagnostic(const uint8_t *payload, size_t len);
+static int            report(void);
+static uint64_t       now_ms(void);
+
+int main(int argc, char *argv[])
+{
+    int      listen_fd;
+    pid_t    starter = -1;
+    pid_t    load    = -1;
+    int      status  = EXIT_FAILURE;
+    uint64_t end;
+
+    parse_arguments(argc, argv);
+    manager.fd      = -1;
+    manager.gap_min = UINT64_MAX;
+
+    listen_fd = listen_manager();
+    if(listen_fd < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if(config.starter_cmd != NULL && (starter = run_command(config.starter_cmd)) < 0)
+    {
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+
+    manager.fd = accept_starter(listen_fd, starter);
+    close(listen_fd);
+    if(manager.fd < 0)
+    {
+        goto done;
+    }
+    printf("starter connected, sending SVR_START\n");
+    if(send_control(SVR_START) < 0 || pump(REPLY_TIMEOUT_MS, SVR_ONLINE) <= 0)
+    {
+        fprintf(stderr, "FAIL: no SVR_ONLINE after SVR_START\n");
+        goto done;
+    }
+    printf("server online\n");
+
+    // Run the load (or just watch for -d seconds), then a little longer so the last counts are reported.
+    if(config.load_cmd != NULL)
+    {
+        load = run_command(config.load_cmd);
+        if(load < 0)
+        {
+            goto done;
+        }
+        while(waitpid(load, NULL, WNOHANG) == 0)
+        {
+            if(pump(POLL_MS, 0) < 0)
+            {
+                fprintf(stderr, "FAIL: starter disconnected during the load\n");
+                goto done;
+            }
+        }
+        load = -1;
+        end  = now_ms() + SETTLE_MS;
+    }
+    else
+    {
+        end = now_ms() + ((uint64_t)config.duration * MS_PER_SEC);
+    }
+    while(now_ms() < end)
+    {
+        if(pump((int)(end - now_ms()), 0) < 0)
+        {
+            fprintf(stderr, "FAIL: starter disconnected\n");
+            goto done;
+        }
+    }
+
+    printf("sending SVR_STOP\n");
+    if(send_control(SVR_STOP) < 0 || pump(REPLY_TIMEOUT_MS, SVR_OFFLINE) <= 0)
+    {
+        fprintf(stderr, "FAIL: no SVR_OFFLINE after SVR_STOP\n");
+        goto done;
+    }
+    status = report();
+
+done:
+    if(load > 0)
+    {
+        stop_command(load);
+    }
+    if(starter > 0)
+    {
+        stop_command(starter);
+    }
+    if(manager.fd >= 0)
+    {
+        close(manager.fd);
+    }
+    return status;
+}
+
+static int listen_manager(void)
+{
+    int fd = socket(config.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if(bind(fd, (struct sockaddr *)&config.addr, config.addr_len) < 0 || listen(fd, 1) < 0)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Waits for the starter to connect, giving up if it exits first or takes longer than REPLY_TIMEOUT_MS. */
+static int accept_starter(int listen_fd, pid_t starter)
+{
+    uint64_t deadline = now_ms() + REPLY_TIMEOUT_MS;
+
+    while(now_ms() < deadline)
+    {
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+
+        if(starter > 0 && waitpid(starter, NULL, WNOHANG) == starter)
+        {
+            fprintf(stderr, "FAIL: starter exited before connecting\n");
+            return -1;
+        }
+        if(poll(&pfd, 1, POLL_MS) > 0)
+        {
+            int fd = accept(listen_fd, NULL, NULL);
+
+            if(fd < 0)
+            {
+                perror("accept");
+                return -1;
+            }
+            return fd;
+        }
+    }
+    fprintf(stderr, "FAIL: starter did not connect within %d ms\n", REPLY_TIMEOUT_MS);
+    return -1;
+}
+
+/* Runs cmd through the shell in its own process group, so stopping it reaches everything it started. */
+static pid_t run_command(const char *cmd)
+{
+    pid_t pid = fork();
+
+    if(pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+    if(pid == 0)
+    {
+        setpgid(0, 0);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        perror("execl");
+        _exit(EXIT_FAILURE);
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+/* Reaps pid, interrupting its process group if it is still running and killing it if that is not enough. */
+static void stop_command(pid_t pid)
+{
+    uint64_t deadline = now_ms() + EXIT_TIMEOUT_MS;
+
+    if(waitpid(pid, NULL, WNOHANG) == pid)
+    {
+        return;
+    }
+    kill(-pid, SIGINT);
+    while(now_ms() < deadline)
+    {
+        if(waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            return;
+        }
+        usleep(POLL_MS * US_PER_MS);
+    }
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+static int send_control(uint8_t type)
+{
+    const uint8_t msg[PROTO_SM_HEADERLEN] = {type, PROTO_VERSION, 0x00, 0x00};
+
+    if(send(manager.fd, msg, sizeof(msg), MSG_NOSIGNAL) != (ssize_t)sizeof(msg))
+    {
+        perror("send");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads frames for up to timeout_ms, recording diagnostics. With want set,
+ * returns 1 as soon as a frame of that type arrives and 0 on timeout;
+ * otherwise returns 0 after timeout_ms. Returns -1 if the starter hangs up.
+ */
+static int pump(int timeout_ms, uint8_t want)
+{
+    uint64_t deadline = now_ms() + (uint64_t)timeout_ms;
+
+    for(;;)
+    {
+        struct pollfd pfd = {manager.fd, POLLIN, 0};
+        uint64_t      now = now_ms();
+        ssize_t       nread;
+        size_t        offset = 0;
+        int           found  = 0;
+
+        if(now >= deadline)
+        {
+            return 0;
+        }
+        if(poll(&pfd, 1, (int)(deadline - now)) <= 0)
+        {
+            continue;
+        }
+        nread = recv(manager.fd, manager.rx + manager.rx_len, sizeof(manager.rx) - manager.rx_len, 0);
+        if(nread < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nread <= 0)
+        {
+            return -1;
+        }
+        manager.rx_len += (size_t)nread;
+
+        while(manager.rx_len - offset >= PROTO_SM_HEADERLEN)
+        {
+            const uint8_t *frame = manager.rx + offset;
+            size_t         len   = ((size_t)frame[2] << BYTE_BITS) | frame[3];
+
+            if(manager.rx_len - offset < PROTO_SM_HEADERLEN + len)
+            {
+                break;
+            }
+            offset += PROTO_SM_HEADERLEN + len;
+            if(frame[1] != PROTO_VERSION)
+            {
+                fprintf(stderr, "unexpected protocol version %u\n", frame[1]);
+            }
+            if(frame[0] == SVR_DIAGNOSTIC)
+            {
+                record_diagnostic(frame + PROTO_SM_HEADERLEN, len);
+            }
+            else if(frame[0] != SVR_ONLINE && frame[0] != SVR_OFFLINE)
+            {
+                fprintf(stderr, "unexpected frame type 0x%02x\n", frame[0]);
+            }
+            if(want != 0 && frame[0] == want)
+            {
+                found = 1;
+            }
+        }
+        manager.rx_len -= offset;
+        memmove(manager.rx, manager.rx + offset, manager.rx_len);
+        if(found)
+        {
+            return 1;
+        }
+    }
+}
+
+/* Checks one report's layout, timing and counts. */
+static void record_diagnostic(const uint8_t *payload, size_t len)
+{
+    uint64_t values[DIAG_FIELDS_MAX];
+    size_t   fields = 0;
+    size_t   pos    = 0;
+    uint64_t users;
+    uint64_t messages;
+    uint64_t now = now_ms();
+
+    while(pos < len)
+    {
+        uint8_t width;
+
+        if(fields == DIAG_FIELDS_MAX || len - pos < 2 || payload[pos] != BER_INT)
+        {
+            manager.malformed++;
+            return;
+        }
+        width = payload[pos + 1];
+        pos += 2;
+        if(width == 0 || width > sizeof(uint64_t) || len - pos < width)
+        {
+            manager.malformed++;
+            return;
+        }
+        values[fields] = 0;
+        for(uint8_t b = 0; b < width; b++)
+        {
+            values[fields] = (values[fields] << BYTE_BITS) | payload[pos++];
+        }
+        fields++;
+    }
+
+    // Original layout: user_count, msg_count. Extended: version first, then connections and msg_count.
+    if(fields == 2)
+    {
+        users    = values[0];
+        messages = values[1];
+    }
+    else if(fields == DIAG_EXT_FIELDS && values[0] == DIAG_VERSION_EXTENDED)
+    {
+        users    = values[DIAG_EXT_CONNECTIONS];
+        messages = values[DIAG_EXT_MSG_COUNT];
+    }
+    else
+    {
+        manager.malformed++;
+        return;
+    }
+
+    if(manager.reports > 0)
+    {
+        uint64_t gap = now - manager.last_at;
+
+        manager.gap_min = gap < manager.gap_min ? gap : manager.gap_min;
+        manager.gap_max = gap > manager.gap_max ? gap : manager.gap_max;
+        manager.gap_total += gap;
+        if(gap + (uint64_t)config.jitter_ms < DIAG_INTERVAL_MS || gap > DIAG_INTERVAL_MS + (uint64_t)config.jitter_ms)
+        {
+            manager.off_cadence++;
+        }
+        if(messages < manager.messages)
+        {
+            manager.regressions++;
+        }
+    }
+    manager.reports++;
+    manager.last_at    = now;
+    manager.layout     = (int)fields;
+    manager.messages   = messages;
+    manager.peak_users = users > manager.peak_users ? users : manager.peak_users;
+}
+
+/* Prints what the reports showed and checks it. Returns the exit status. */
+static int report(void)
+{
+    int failed = 0;
+
+    printf("\nreports: %" PRIu64 " (%s layout), malformed: %" PRIu64 "\n", manager.reports, manager.layout == DIAG_EXT_FIELDS ? "extended" : "original", manager.malformed);
+    if(manager.reports > 1)
+    {
+        printf("interval ms: min %" PRIu64 ", mean %" PRIu64 ", max %" PRIu64 ", off cadence: %" PRIu64 "\n", manager.gap_min, manager.gap_total / (manager.reports - 1), manager.gap_max, manager.off_cadence);
+    }
+    printf("peak users: %" PRIu64 ", messages: %" PRIu64 "\n\n", manager.peak_users, manager.messages);
+
+    if(manager.reports < 2)
+    {
+        fprintf(stderr, "FAIL: %" PRIu64 " diagnostic report(s)\n", manager.reports);
+        failed = 1;
+    }
+    if(manager.malformed > 0)
+    {
+        fprintf(stderr, "FAIL: %" PRIu64 " malformed report(s)\n", manager.malformed);
+        failed = 1;
+    }
+    if(manager.regressions > 0)
+    {
+        fprintf(stderr, "FAIL: message count went backwards %" PRIu64 " time(s)\n", manager.regressions);
+        failed = 1;
+    }
+    if(manager.off_cadence > 0)
+    {
+        fprintf(stderr, "FAIL: %" PRIu64 " report(s) more than %ld ms off the %d ms interval\n", manager.off_cadence, config.jitter_ms, DIAG_INTERVAL_MS);
+        failed = 1;
+    }
+    if(manager.peak_users < (uint64_t)config.min_users)
+    {
+        fprintf(stderr, "FAIL: peak users %" PRIu64 " < %ld\n", manager.peak_users, config.min_users);
+        failed = 1;
+    }
+    if(manager.messages < (uint64_t)config.min_messages)
+    {
+        fprintf(stderr, "FAIL: messages %" PRIu64 " < %ld\n", manager.messages, config.min_messages);
+        failed = 1;
+    }
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void parse_arguments(int argc, char *argv[])
+{
+    int       opt;
+    in_port_t port;
+
+    opterr           = 0;
+    config.duration  = DEFAULT_DURATION;
+    config.jitter_ms = DEFAULT_JITTER_MS;
+
+    while((opt = getopt(argc, argv, "hd:s:l:u:m:j:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'h':
+            {
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            }
+            case 'd':
+            {
+                config.duration = (int)parse_number(argv[0], optarg, 1, INT32_MAX);
+                break;
+            }
+            case 's':
+            {
+                config.starter_cmd = optarg;
+                break;
+            }
+            case 'l':
+            {
+                config.load_cmd = optarg;
+                break;
+            }
+            case 'u':
+            {
+                config.min_users = parse_number(argv[0], optarg, 0, INT32_MAX);
+                break;
+            }
+            case 'm':
+            {
+                config.min_messages = parse_number(argv[0], optarg, 0, INT32_MAX);
+                break;
+            }
+            case 'j':
+            {
+                config.jitter_ms = parse_number(argv[0], optarg, 0, DIAG_INTERVAL_MS);
+                break;
+            }
+            case '?':
+            {
+                char message[UNKNOWN_OPTION_MESSAGE_LEN];
+
+                snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
+                usage(argv[0], EXIT_FAILURE, message);
+            }
+            default:
+            {
+                usage(argv[0], EXIT_FAILURE, NULL);
+            }
+        }
+    }
+
+    if(optind + 1 >= argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too few arguments.");
+    }
+    if(optind < argc - 2)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too many arguments.");
+    }
+
+    port = (in_port_t)parse_number(argv[0], argv[optind + 1], 1, UINT16_MAX);
+    convert_address(argv[optind], port);
+}
+
+static long parse_number(const char *binary_name, const char *str, long min, long max)
+{
+    char *endptr;
+    long  value;
+
+    errno = 0;
+    value = strtol(str, &endptr, BASE_TEN);
+    if(errno != 0 || *endptr != '\0' || endptr == str)
+    {
+        usage(binary_name, EXIT_FAILURE, "Invalid number.");
+    }
+    if(value < min || value > max)
+    {
+        usage(binary_name, EXIT_FAILURE, "Number out of range.");
+    }
+    return value;
+}
+
+static void convert_address(const char *address, in_port_t port)
+{
+    memset(&config.addr, 0, sizeof(config.addr));
+
+    if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)&config.addr)->sin_addr)) == 1)
+    {
+        ((struct sockaddr_in *)&config.addr)->sin_family = AF_INET;
+        ((struct sockaddr_in *)&config.addr)->sin_port   = htons(port);
+        config.addr_len                                  = sizeof(struct sockaddr_in);
+    }
+    else if(inet_pton(AF_INET6, address, &(((struct sockaddr_in6 *)&config.addr)->sin6_addr)) == 1)
+    {
+        ((struct sockaddr_in6 *)&config.addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)&config.addr)->sin6_port   = htons(port);
+        config.addr_len                                    = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        fprintf(stderr, "%s is not an IPv4 or an IPv6 address\n", address);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * MS_PER_SEC) + ((uint64_t)ts.tv_nsec / NS_PER_MS);
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-d seconds] [-s starter] [-l load] [-u users] [-m messages] [-j ms] <ip address> <port>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h          Display this help message\n", stderr);
+    fputs("  -d <s>      Watch the diagnostics this long when there is no -l (default 10)\n", stderr);
+    fputs("  -s <cmd>    Launch the server starter with this shell command\n", stderr);
+    fputs("  -l <cmd>    Run this shell command as the load once the server is online\n", stderr);
+    fputs("  -u <n>      Fail unless some report shows at least <n> users (default 0)\n", stderr);
+    fputs("  -m <n>      Fail unless the last report counts at least <n> messages (default 0)\n", stderr);
+    fputs("  -j <ms>     Allowed deviation from the 1000 ms report interval (default 250)\n", stderr);
+    exit(exit_code);
+}